@@ -0,0 +1,536 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "lockstep.h"
+#include "rewind.h"
+#include "record.h"
+#include "acia.h"
+#include "kernels.h"
+
+#if defined(ENGINE_TABLE)
+#define ENGINE_NAME "table"
+#elif defined(ENGINE_THREADED)
+#define ENGINE_NAME "threaded"
+#elif defined(ENGINE_PREDECODE)
+#define ENGINE_NAME "predecode"
+#elif defined(ENGINE_JIT)
+#define ENGINE_NAME "jit"
+#else
+#define ENGINE_NAME "switch"
+#endif
+
+/* Timed trials per kernel; the fastest one is reported. */
+#define TRIALS 3
+/* Snapshots taken and restored to time them. */
+#define SNAPSHOTS 10000
+/* Cycles between rewind checkpoints, and checkpoints kept. */
+#define REWIND_PERIOD 100000
+#define REWIND_CHECKPOINTS 64
+/* Runs of the polling loop recorded and replayed. */
+#define RECORD_RUNS 200
+/* Runs of the chatty loop writing to the serial console. */
+#define SERIAL_RUNS 16
+
+static Memory memory;
+
+static void load(const Kernel *kernel)
+{
+        freeMemory(&memory);
+        initMemory(&memory);
+        if (kernel->setup) {
+                kernel->setup(memory.ram);
+        }
+        memcpy(memory.ram + KERNEL_ADDRESS, kernel->code, kernel->size);
+}
+
+/*
+ * Count the instructions of one run by single stepping, so that the timed
+ * runs do not have to pay for it.
+ */
+static uint64_t countInstructions(void)
+{
+        Registers registers;
+        uint64_t count = 0;
+        uint8_t opcode;
+
+        reset(&registers, KERNEL_ADDRESS);
+        while ((opcode = memory.ram[registers.pc])) {
+                registers.pc++;
+                step(opcode, &memory, &registers);
+                count++;
+        }
+
+        return count;
+}
+
+static double now(void)
+{
+        struct timespec time;
+
+        clock_gettime(CLOCK_MONOTONIC, &time);
+
+        return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static double timeRuns(int repetitions, uint64_t *cycles)
+{
+        Registers registers;
+        double start;
+        int i;
+
+        start = now();
+        for (i = 0; i < repetitions; i++) {
+                reset(&registers, KERNEL_ADDRESS);
+                executeCycles(&registers, &memory, UINT64_MAX);
+        }
+        *cycles = registers.cycles;
+
+        return now() - start;
+}
+
+/*
+ * Run LOCKSTEP_LANES copies of each kernel with runLockstep() and report
+ * their combined rate. Every lane gets the same input, so lanes never
+ * diverge: this is the best case for lockstep execution.
+ */
+static void timeLockstep(void)
+{
+        Machine *machines[LOCKSTEP_LANES];
+        StopReason stops[LOCKSTEP_LANES];
+        uint64_t instructions;
+        double start, seconds, best;
+        const Kernel *kernel;
+        int i, lane, runs, run, trial;
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if (!(machines[lane] = calloc(1, sizeof(Machine)))) {
+                        printf("lockstep: out of memory\n");
+                        while (lane--) {
+                                free(machines[lane]);
+                        }
+                        return;
+                }
+        }
+
+        printf("lockstep, %d lanes:\n", LOCKSTEP_LANES);
+        for (i = 0; i < kernelCount; i++) {
+                kernel = &kernels[i];
+                load(kernel);
+                instructions = countInstructions();
+                for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                        initMemory(&machines[lane]->memory);
+                        memcpy(machines[lane]->memory.ram, memory.ram,
+                               RAM_SIZE);
+                }
+
+                /* About as many instructions as one engine trial. */
+                runs = kernel->repetitions / LOCKSTEP_LANES + 1;
+                best = 0;
+                for (trial = 0; trial < TRIALS; trial++) {
+                        start = now();
+                        for (run = 0; run < runs; run++) {
+                                for (lane = 0; lane < LOCKSTEP_LANES;
+                                     lane++) {
+                                        reset(&machines[lane]->registers,
+                                              KERNEL_ADDRESS);
+                                }
+                                runLockstep(machines, LOCKSTEP_LANES,
+                                            UINT64_MAX, stops);
+                        }
+                        seconds = now() - start;
+                        if (trial == 0 || seconds < best) {
+                                best = seconds;
+                        }
+                }
+
+                instructions *= (uint64_t) runs * LOCKSTEP_LANES;
+                printf("%-14s %12s %12s %9.2f %10s %9.2f\n", kernel->name,
+                       "", "", instructions / best / 1e6, "",
+                       best * 1e9 / instructions);
+                for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                        freeMemory(&machines[lane]->memory);
+                }
+        }
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                free(machines[lane]);
+        }
+}
+
+/*
+ * Run each kernel again while recording it for rewinding, and report how
+ * much slower it runs, the bytes each checkpoint holds on average and the
+ * time taking one takes. The cycle count is carried over from one run to
+ * the next, but as the registers are reset from outside, each run starts
+ * with a checkpoint of its own on top of those every REWIND_PERIOD cycles.
+ */
+static void timeRewind(void)
+{
+        static Machine machine;
+        RewindStats stats;
+        Rewind *rewind;
+        uint64_t cycles, plain;
+        double seconds, best;
+        const Kernel *kernel;
+        int i, run, trial;
+
+        printf("rewind, checkpoint every %d cycles:\n", REWIND_PERIOD);
+        printf("%-14s %9s %11s %12s %9s\n", "kernel", "overhead",
+               "checkpoints", "bytes/chkpt", "us/chkpt");
+        for (i = 0; i < kernelCount; i++) {
+                kernel = &kernels[i];
+                load(kernel);
+                best = 0;
+                for (trial = 0; trial < TRIALS; trial++) {
+                        seconds = timeRuns(kernel->repetitions, &plain);
+                        if (trial == 0 || seconds < best) {
+                                best = seconds;
+                        }
+                }
+                plain = best * 1e9;
+
+                initMemory(&machine.memory);
+                memcpy(machine.memory.ram, memory.ram, RAM_SIZE);
+                reset(&machine.registers, KERNEL_ADDRESS);
+                if (!(rewind = startRewind(&machine, REWIND_PERIOD,
+                                           REWIND_CHECKPOINTS))) {
+                        printf("rewind: out of memory\n");
+                        freeMemory(&machine.memory);
+                        return;
+                }
+                best = 0;
+                for (trial = 0; trial < TRIALS; trial++) {
+                        seconds = now();
+                        for (run = 0; run < kernel->repetitions; run++) {
+                                cycles = machine.registers.cycles;
+                                reset(&machine.registers, KERNEL_ADDRESS);
+                                machine.registers.cycles = cycles;
+                                runRewind(rewind, UINT64_MAX);
+                        }
+                        seconds = now() - seconds;
+                        if (trial == 0 || seconds < best) {
+                                best = seconds;
+                        }
+                }
+
+                getRewindStats(rewind, &stats);
+                printf("%-14s %8.1f%% %11llu %12.0f %9.2f\n", kernel->name,
+                       (best * 1e9 / plain - 1) * 100,
+                       (unsigned long long) stats.taken,
+                       (double) stats.bytes / stats.checkpoints,
+                       stats.seconds * 1e6 / stats.taken);
+                stopRewind(rewind);
+                freeMemory(&machine.memory);
+        }
+}
+
+/*
+ * 256 times 256 reads from a device, 12 cycles apart:
+ *
+ *         ldy #0
+ * outer:  ldx #0
+ * inner:  lda $D000
+ *         sta $10
+ *         dex
+ *         bne inner
+ *         dey
+ *         bne outer
+ *         brk
+ */
+static const uint8_t polling[] = {
+        0xA0, 0x00, 0xA2, 0x00, 0xAD, 0x00, 0xD0, 0x85, 0x10, 0xCA, 0xD0,
+        0xF8, 0x88, 0xD0, 0xF3, 0x00
+};
+
+static uint8_t readCounter(void *context, uint16_t address)
+{
+        uint8_t *counter = context;
+
+        (void) address;
+
+        return (*counter)++;
+}
+
+/*
+ * Run RECORD_RUNS times the polling loop, recording to path or replaying
+ * from it if not NULL, the registers being reset from outside between runs.
+ * Returns the time taken, and the recorder's stats in stats.
+ */
+static double runPolling(const char *path, int replay, RecordStats *stats)
+{
+        static Machine machine;
+        Recorder *recorder = NULL;
+        Device device = { readCounter, NULL, NULL, 0 };
+        uint8_t counter = 0;
+        uint64_t cycles;
+        double start;
+        int run;
+
+        device.context = &counter;
+        initMemory(&machine.memory);
+        mapDevice(&machine.memory, 0xD0, 0xD0, &device);
+        memcpy(machine.memory.ram + KERNEL_ADDRESS, polling, sizeof(polling));
+        reset(&machine.registers, KERNEL_ADDRESS);
+        if (path) {
+                recorder = replay ? startReplay(&machine, path) :
+                        startRecording(&machine, path);
+                if (!recorder) {
+                        freeMemory(&machine.memory);
+                        return -1;
+                }
+        }
+
+        start = now();
+        if (replay) {
+                /* The logged registers restart each run. */
+                while (replayingRecord(recorder)) {
+                        executeCycles(&machine.registers, &machine.memory,
+                                      UINT64_MAX);
+                }
+        } else {
+                for (run = 0; run < RECORD_RUNS; run++) {
+                        cycles = machine.registers.cycles;
+                        reset(&machine.registers, KERNEL_ADDRESS);
+                        machine.registers.cycles = cycles;
+                        if (recorder) {
+                                recordRegisters(recorder, cycles);
+                        }
+                        executeCycles(&machine.registers, &machine.memory,
+                                      UINT64_MAX);
+                }
+        }
+        start = now() - start;
+
+        if (recorder) {
+                getRecordStats(recorder, stats);
+                if (stopRecorder(recorder) < 0) {
+                        start = -1;
+                }
+        }
+        freeMemory(&machine.memory);
+
+        return start;
+}
+
+/*
+ * Time a loop polling a device plainly, while recording it to a log and
+ * while replaying the log, and report the overheads and the bytes each
+ * entry of the log takes, the RAM the log starts with left out.
+ */
+static void timeRecord(void)
+{
+        char path[] = "/tmp/tony6502-bench-XXXXXX";
+        RecordStats recorded, replayed;
+        double plain = 0, record = 0, replay = 0, seconds[3];
+        int descriptor, trial;
+
+        if ((descriptor = mkstemp(path)) < 0) {
+                printf("record: no temporary file\n");
+                return;
+        }
+        close(descriptor);
+
+        /* Interleaved, so that all three see the same noise. */
+        for (trial = 0; trial < TRIALS; trial++) {
+                seconds[0] = runPolling(NULL, 0, NULL);
+                seconds[1] = runPolling(path, 0, &recorded);
+                seconds[2] = seconds[1] < 0 ? -1 :
+                        runPolling(path, 1, &replayed);
+                if (seconds[1] < 0 || seconds[2] < 0) {
+                        unlink(path);
+                        printf("record: could not record and replay\n");
+                        return;
+                }
+                if (trial == 0 || seconds[0] < plain) {
+                        plain = seconds[0];
+                }
+                if (trial == 0 || seconds[1] < record) {
+                        record = seconds[1];
+                }
+                if (trial == 0 || seconds[2] < replay) {
+                        replay = seconds[2];
+                }
+        }
+        unlink(path);
+
+        printf("record, %d x 65536 device reads: overhead %.1f%%, "
+               "replay %.1f%%, %.2f bytes/entry\n", RECORD_RUNS,
+               (record / plain - 1) * 100, (replay / plain - 1) * 100,
+               (double) (recorded.bytes - RAM_SIZE) / recorded.entries);
+}
+
+/*
+ * 256 times 256 bytes written to a serial console:
+ *
+ *         ldy #0
+ * outer:  ldx #0
+ * inner:  txa
+ *         sta $D000
+ *         dex
+ *         bne inner
+ *         dey
+ *         bne outer
+ *         brk
+ */
+static const uint8_t chatty[] = {
+        0xA0, 0x00, 0xA2, 0x00, 0x8A, 0x8D, 0x00, 0xD0, 0xCA, 0xD0, 0xF9,
+        0x88, 0xD0, 0xF4, 0x00
+};
+
+/* A console writing every byte as it comes, to compare with the ACIA. */
+static void writeByte(void *context, uint16_t address, uint8_t value)
+{
+        const int *descriptor = context;
+
+        (void) address;
+
+        if (write(*descriptor, &value, 1) != 1) {
+                perror("write");
+        }
+}
+
+/* Run the chatty loop SERIAL_RUNS times, returns the time taken. */
+static double runChatty(Machine *machine)
+{
+        double start = now();
+        int run;
+
+        for (run = 0; run < SERIAL_RUNS; run++) {
+                reset(&machine->registers, KERNEL_ADDRESS);
+                executeCycles(&machine->registers, &machine->memory,
+                              UINT64_MAX);
+        }
+
+        return now() - start;
+}
+
+/*
+ * Time a guest writing bytes to /dev/null through the ACIA, which batches
+ * them, and through a device making one write() per byte.
+ */
+static void timeSerial(void)
+{
+        static Machine machine;
+        static Acia acia;
+        Device device = { NULL, writeByte, NULL, 0 };
+        double batched = 0, unbuffered = 0, seconds;
+        uint64_t writes = 0;
+        FILE *output;
+        int descriptor, trial;
+
+        if (!(output = fopen("/dev/null", "w"))) {
+                printf("serial: no /dev/null\n");
+                return;
+        }
+        descriptor = fileno(output);
+        device.context = &descriptor;
+        initMemory(&machine.memory);
+        memcpy(machine.memory.ram + KERNEL_ADDRESS, chatty, sizeof(chatty));
+
+        for (trial = 0; trial < TRIALS; trial++) {
+                attachAcia(&acia, &machine, 0xD0, output, -1, 1e6, 9600);
+                seconds = runChatty(&machine);
+                writes = acia.writes;
+                detachAcia(&acia);
+                if (trial == 0 || seconds < batched) {
+                        batched = seconds;
+                }
+
+                mapDevice(&machine.memory, 0xD0, 0xD0, &device);
+                seconds = runChatty(&machine);
+                mapRam(&machine.memory, 0xD0, 0xD0);
+                if (trial == 0 || seconds < unbuffered) {
+                        unbuffered = seconds;
+                }
+        }
+        freeMemory(&machine.memory);
+        fclose(output);
+
+        printf("serial, %d x 65536 bytes: batched %.1f MB/s in %llu "
+               "writes, byte at a time %.1f MB/s\n", SERIAL_RUNS,
+               SERIAL_RUNS * 65536 / batched / 1e6,
+               (unsigned long long) writes,
+               SERIAL_RUNS * 65536 / unbuffered / 1e6);
+}
+
+/* Report the average time to save and to restore a snapshot. */
+static void timeSnapshots(void)
+{
+        static Machine machine;
+        static Snapshot snapshot;
+        double start, save, restore;
+        int i;
+
+        initMemory(&machine.memory);
+        reset(&machine.registers, KERNEL_ADDRESS);
+
+        start = now();
+        for (i = 0; i < SNAPSHOTS; i++) {
+                saveSnapshot(&machine, &snapshot);
+        }
+        save = now() - start;
+
+        start = now();
+        for (i = 0; i < SNAPSHOTS; i++) {
+                restoreSnapshot(&machine, &snapshot);
+        }
+        restore = now() - start;
+
+        freeMemory(&machine.memory);
+        printf("snapshot: save %.2f us, restore %.2f us\n",
+               save * 1e6 / SNAPSHOTS, restore * 1e6 / SNAPSHOTS);
+}
+
+int main(void)
+{
+        uint64_t instructions, cycles, totalInstructions = 0;
+        double seconds, best, totalSeconds = 0;
+        const Kernel *kernel;
+        int i, trial;
+
+        printf("engine: %s\n", ENGINE_NAME);
+        printf("%-14s %12s %12s %9s %10s %9s\n", "kernel", "instructions",
+               "cycles", "MIPS", "Mcycles/s", "ns/instr");
+
+        for (i = 0; i < kernelCount; i++) {
+                kernel = &kernels[i];
+                load(kernel);
+                instructions = countInstructions();
+
+                best = 0;
+                for (trial = 0; trial < TRIALS; trial++) {
+                        seconds = timeRuns(kernel->repetitions, &cycles);
+                        if (trial == 0 || seconds < best) {
+                                best = seconds;
+                        }
+                }
+
+                /* Counts are per run; rates cover all the repetitions. */
+                printf("%-14s %12llu %12llu %9.2f %10.2f %9.2f\n",
+                       kernel->name, (unsigned long long) instructions,
+                       (unsigned long long) cycles,
+                       instructions * kernel->repetitions / best / 1e6,
+                       cycles * kernel->repetitions / best / 1e6,
+                       best * 1e9 / (instructions * kernel->repetitions));
+
+                totalInstructions += instructions * kernel->repetitions;
+                totalSeconds += best;
+        }
+
+        printf("%-14s %12s %12s %9.2f %10s %9.2f\n", "total", "", "",
+               totalInstructions / totalSeconds / 1e6, "",
+               totalSeconds * 1e9 / totalInstructions);
+        timeLockstep();
+        timeRewind();
+        timeRecord();
+        timeSerial();
+        timeSnapshots();
+
+        return 0;
+}
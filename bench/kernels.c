@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include "kernels.h"
+
+/*
+ * Benchmark kernels, hand assembled. Each one is loaded at KERNEL_ADDRESS
+ * and stops at its final BRK.
+ */
+
+/* Copy 8 KiB from $1000 to $4000 a page at a time, through (zp),y pointers. */
+/*
+ * 0200  LDA #$00
+ * 0202  STA $10
+ * 0204  STA $12
+ * 0206  LDA #$10
+ * 0208  STA $11
+ * 020A  LDA #$40
+ * 020C  STA $13
+ * 020E  LDX #$20
+ * 0210  LDY #$00
+ * 0212  LDA ($10),Y
+ * 0214  STA ($12),Y
+ * 0216  INY
+ * 0217  BNE $0212
+ * 0219  INC $11
+ * 021B  INC $13
+ * 021D  DEX
+ * 021E  BNE $0212
+ * 0220  BRK
+ */
+static const uint8_t memcpyCode[] = {
+        0xA9, 0x00, 0x85, 0x10, 0x85, 0x12, 0xA9, 0x10, 0x85, 0x11,
+        0xA9, 0x40, 0x85, 0x13, 0xA2, 0x20, 0xA0, 0x00, 0xB1, 0x10,
+        0x91, 0x12, 0xC8, 0xD0, 0xF9, 0xE6, 0x11, 0xE6, 0x13, 0xCA,
+        0xD0, 0xF2, 0x00,
+};
+
+static void fillSource(uint8_t *ram)
+{
+        int i;
+
+        for (i = 0; i < 0x2000; i++) {
+                ram[0x1000 + i] = i * 7;
+        }
+}
+
+/*
+ * Packed BCD bookkeeping in decimal mode: 65536 times, add $1247 to a three
+ * byte total at $30 and subtract $0329 from a two byte total at $34.
+ */
+/*
+ * 0200  SED
+ * 0201  LDX #$00
+ * 0203  LDY #$00
+ * 0205  CLC
+ * 0206  LDA $30
+ * 0208  ADC #$47
+ * 020A  STA $30
+ * 020C  LDA $31
+ * 020E  ADC #$12
+ * 0210  STA $31
+ * 0212  LDA $32
+ * 0214  ADC #$00
+ * 0216  STA $32
+ * 0218  SEC
+ * 0219  LDA $34
+ * 021B  SBC #$29
+ * 021D  STA $34
+ * 021F  LDA $35
+ * 0221  SBC #$03
+ * 0223  STA $35
+ * 0225  DEY
+ * 0226  BNE $0205
+ * 0228  DEX
+ * 0229  BNE $0203
+ * 022B  CLD
+ * 022C  BRK
+ */
+static const uint8_t bcdCode[] = {
+        0xF8, 0xA2, 0x00, 0xA0, 0x00, 0x18, 0xA5, 0x30, 0x69, 0x47,
+        0x85, 0x30, 0xA5, 0x31, 0x69, 0x12, 0x85, 0x31, 0xA5, 0x32,
+        0x69, 0x00, 0x85, 0x32, 0x38, 0xA5, 0x34, 0xE9, 0x29, 0x85,
+        0x34, 0xA5, 0x35, 0xE9, 0x03, 0x85, 0x35, 0x88, 0xD0, 0xDD,
+        0xCA, 0xD0, 0xD8, 0xD8, 0x00,
+};
+
+/*
+ * Walk a linked list four times, summing node values. Nodes are four bytes
+ * (next pointer, value, padding) scattered over $1000-$8FFF, so the (zp),y
+ * loads often cross pages. A next pointer with a zero high byte ends the
+ * list.
+ */
+/*
+ * 0200  LDA #$00
+ * 0202  STA $22
+ * 0204  LDX #$04
+ * 0206  LDA #$00
+ * 0208  STA $20
+ * 020A  LDA #$10
+ * 020C  STA $21
+ * 020E  LDY #$02
+ * 0210  LDA ($20),Y
+ * 0212  CLC
+ * 0213  ADC $22
+ * 0215  STA $22
+ * 0217  LDY #$01
+ * 0219  LDA ($20),Y
+ * 021B  BEQ $022A
+ * 021D  STA $23
+ * 021F  DEY
+ * 0220  LDA ($20),Y
+ * 0222  STA $20
+ * 0224  LDA $23
+ * 0226  STA $21
+ * 0228  BRA $020E
+ * 022A  DEX
+ * 022B  BNE $0206
+ * 022D  BRK
+ */
+static const uint8_t pointerWalkCode[] = {
+        0xA9, 0x00, 0x85, 0x22, 0xA2, 0x04, 0xA9, 0x00, 0x85, 0x20,
+        0xA9, 0x10, 0x85, 0x21, 0xA0, 0x02, 0xB1, 0x20, 0x18, 0x65,
+        0x22, 0x85, 0x22, 0xA0, 0x01, 0xB1, 0x20, 0xF0, 0x0D, 0x85,
+        0x23, 0x88, 0xB1, 0x20, 0x85, 0x20, 0xA5, 0x23, 0x85, 0x21,
+        0x80, 0xE4, 0xCA, 0xD0, 0xD9, 0x00,
+};
+
+#define NODES 0x2000
+
+static void buildList(uint8_t *ram)
+{
+        static uint16_t order[NODES];
+        uint32_t seed = 1;
+        uint16_t node, next, swap;
+        int i, j;
+
+        /* Shuffle every node but the head with a fixed seed. */
+        for (i = 0; i < NODES; i++) {
+                order[i] = i;
+        }
+        for (i = NODES - 1; i > 1; i--) {
+                seed = seed * 1103515245 + 12345;
+                j = 1 + (seed >> 16) % i;
+                swap = order[i];
+                order[i] = order[j];
+                order[j] = swap;
+        }
+
+        for (i = 0; i < NODES; i++) {
+                node = 0x1000 + order[i] * 4;
+                next = i + 1 < NODES ? 0x1000 + order[i + 1] * 4 : 0x0000;
+                ram[node] = next & 0xFF;
+                ram[node + 1] = next >> 8;
+                ram[node + 2] = order[i];
+                ram[node + 3] = 0;
+        }
+}
+
+/*
+ * Naive recursive Fibonacci, fib(22) with n in X, counting the leaf calls
+ * in $40-$41. Almost nothing but JSR, RTS and short branches.
+ */
+/*
+ * 0200  LDA #$00
+ * 0202  STA $40
+ * 0204  STA $41
+ * 0206  LDX #$16
+ * 0208  JSR $020C
+ * 020B  BRK
+ * 020C  CPX #$02
+ * 020E  BCC $021B
+ * 0210  DEX
+ * 0211  JSR $020C
+ * 0214  DEX
+ * 0215  JSR $020C
+ * 0218  INX
+ * 0219  INX
+ * 021A  RTS
+ * 021B  INC $40
+ * 021D  BNE $0221
+ * 021F  INC $41
+ * 0221  RTS
+ */
+static const uint8_t recursionCode[] = {
+        0xA9, 0x00, 0x85, 0x40, 0x85, 0x41, 0xA2, 0x16, 0x20, 0x0C,
+        0x02, 0x00, 0xE0, 0x02, 0x90, 0x0B, 0xCA, 0x20, 0x0C, 0x02,
+        0xCA, 0x20, 0x0C, 0x02, 0xE8, 0xE8, 0x60, 0xE6, 0x40, 0xD0,
+        0x02, 0xE6, 0x41, 0x60,
+};
+
+/*
+ * Sort 256 pseudo random bytes at $1000 into four buckets, 64 times over,
+ * counting each bucket in $50-$53. Most of the time goes into compares and
+ * hard to predict branches.
+ */
+/*
+ * 0200  LDY #$40
+ * 0202  LDX #$00
+ * 0204  LDA $1000,X
+ * 0207  CMP #$40
+ * 0209  BCC $0217
+ * 020B  CMP #$80
+ * 020D  BCC $021B
+ * 020F  CMP #$C0
+ * 0211  BCC $021F
+ * 0213  INC $53
+ * 0215  BRA $0221
+ * 0217  INC $50
+ * 0219  BRA $0221
+ * 021B  INC $51
+ * 021D  BRA $0221
+ * 021F  INC $52
+ * 0221  INX
+ * 0222  BNE $0204
+ * 0224  DEY
+ * 0225  BNE $0202
+ * 0227  BRK
+ */
+static const uint8_t branchesCode[] = {
+        0xA0, 0x40, 0xA2, 0x00, 0xBD, 0x00, 0x10, 0xC9, 0x40, 0x90,
+        0x0C, 0xC9, 0x80, 0x90, 0x0C, 0xC9, 0xC0, 0x90, 0x0C, 0xE6,
+        0x53, 0x80, 0x0A, 0xE6, 0x50, 0x80, 0x06, 0xE6, 0x51, 0x80,
+        0x02, 0xE6, 0x52, 0xE8, 0xD0, 0xE0, 0x88, 0xD0, 0xDB, 0x00,
+};
+
+static void fillRandom(uint8_t *ram)
+{
+        uint32_t seed = 1;
+        int i;
+
+        for (i = 0; i < 0x100; i++) {
+                seed = seed * 1103515245 + 12345;
+                ram[0x1000 + i] = seed >> 16;
+        }
+}
+
+const Kernel kernels[] = {
+        { "memcpy", memcpyCode, sizeof(memcpyCode), fillSource, 900 },
+        { "bcd", bcdCode, sizeof(bcdCode), NULL, 24 },
+        { "pointer-walk", pointerWalkCode, sizeof(pointerWalkCode),
+          buildList, 60 },
+        { "recursion", recursionCode, sizeof(recursionCode), NULL, 75 },
+        { "branches", branchesCode, sizeof(branchesCode), fillRandom,
+          200 },
+};
+
+const int kernelCount = sizeof(kernels) / sizeof(kernels[0]);
@@ -0,0 +1,23 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Address every kernel is loaded at and starts from. */
+#define KERNEL_ADDRESS 0x0200
+
+typedef struct {
+        const char *name;
+        const uint8_t *code;
+        size_t size;
+        /* Initialise the data the kernel works on, may be NULL. */
+        void (*setup)(uint8_t *ram);
+        /* Runs per timed trial, sized for a fraction of a second. */
+        int repetitions;
+} Kernel;
+
+extern const Kernel kernels[];
+extern const int kernelCount;
+
+#endif  /* KERNELS_H */
@@ -0,0 +1,283 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "acia.h"
+
+/* Registers, by the low two bits of the address. */
+enum {
+        REGISTER_DATA,
+        REGISTER_STATUS,
+        REGISTER_COMMAND,
+        REGISTER_CONTROL
+};
+
+#define STATUS_RECEIVER_FULL 0x08
+#define STATUS_TRANSMITTER_EMPTY 0x10
+#define STATUS_IRQ 0x80
+/* Data terminal ready, and receiver interrupts disabled. */
+#define COMMAND_DTR 0x01
+#define COMMAND_IRQ_DISABLED 0x02
+/* Bits kept by a programmed reset. */
+#define COMMAND_KEPT 0xE0
+/* Bits per character: start, 8 data bits and stop. */
+#define CHARACTER_BITS 10
+/* Cycles' worth of wall clock time output may be held for, in seconds. */
+#define FLUSH_DELAY 0.1
+/* Most character times between reads of input that had none. */
+#define MAX_BACKOFF 64
+
+/* Baud rates selected by the control register, 0 being the default. */
+static const double baudRates[16] = {
+        0, 50, 75, 109.92, 134.58, 150, 300, 600, 1200, 1800, 2400, 3600,
+        4800, 7200, 9600, 19200
+};
+
+static void setBaud(Acia *acia)
+{
+        double baud = baudRates[acia->control & 0x0F];
+
+        if (!baud) {
+                baud = acia->baud;
+        }
+        acia->characterCycles = acia->hz * CHARACTER_BITS / baud;
+        if (!acia->characterCycles) {
+                acia->characterCycles = 1;
+        }
+}
+
+static int receiverInterrupts(const Acia *acia)
+{
+        return (acia->command & (COMMAND_DTR | COMMAND_IRQ_DISABLED)) ==
+                COMMAND_DTR;
+}
+
+static void clearIrq(Acia *acia)
+{
+        if (acia->status & STATUS_IRQ) {
+                acia->status &= ~STATUS_IRQ;
+                lowerIrq(acia->memory, ACIA_IRQ);
+        }
+}
+
+static void receive(void *context, uint64_t cycle);
+
+/*
+ * Schedule the next receive() for cycle. Without a free event,
+ * receivePending stays clear and the next register access or flushAcia()
+ * tries again.
+ */
+static void scheduleReceive(Acia *acia, uint64_t cycle)
+{
+        acia->receivePending = !scheduleEvent(acia->memory, cycle, receive,
+                                              acia);
+}
+
+/* Retry a receive() that found no free event, see scheduleReceive(). */
+static void resumeReceive(Acia *acia)
+{
+        if (!acia->receivePending && !acia->inputDone) {
+                scheduleReceive(acia, currentCycle(acia->memory) +
+                                acia->characterCycles);
+        }
+}
+
+int flushAcia(Acia *acia)
+{
+        if (acia->outputUsed && acia->output) {
+                if (fwrite(acia->outputBuffer, 1, acia->outputUsed,
+                           acia->output) != acia->outputUsed ||
+                    fflush(acia->output)) {
+                        acia->outputFailed = 1;
+                }
+                acia->writes++;
+        }
+        acia->outputUsed = 0;
+        resumeReceive(acia);
+
+        return acia->outputFailed ? -EIO : 0;
+}
+
+static void flushLater(void *context, uint64_t cycle)
+{
+        Acia *acia = context;
+
+        (void) cycle;
+
+        acia->flushPending = 0;
+        flushAcia(acia);
+}
+
+static void transmit(Acia *acia, uint8_t value)
+{
+        uint64_t cycle;
+
+        acia->outputBuffer[acia->outputUsed++] = value;
+        acia->sent++;
+        if (acia->outputUsed == ACIA_OUTPUT_SIZE) {
+                flushAcia(acia);
+        } else if (!acia->flushPending) {
+                /*
+                 * Without a free event, flushPending stays clear and the
+                 * next byte tries again.
+                 */
+                cycle = currentCycle(acia->memory) +
+                        (uint64_t) (acia->hz * FLUSH_DELAY);
+                acia->flushPending = !scheduleEvent(acia->memory, cycle,
+                                                    flushLater, acia);
+        }
+}
+
+/* Read the next chunk of input, if there is any yet. */
+static void readInput(Acia *acia)
+{
+        ssize_t size = read(acia->input, acia->inputBuffer, ACIA_INPUT_SIZE);
+
+        if (size > 0) {
+                acia->inputStart = 0;
+                acia->inputEnd = size;
+        } else if (!size || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                             errno != EINTR)) {
+                acia->inputDone = 1;
+        }
+}
+
+/* Hand the guest the next byte of input, once a character time. */
+static void receive(void *context, uint64_t cycle)
+{
+        Acia *acia = context;
+        uint64_t delay = acia->characterCycles;
+
+        acia->receivePending = 0;
+        if (!(acia->status & STATUS_RECEIVER_FULL)) {
+                if (acia->inputStart == acia->inputEnd) {
+                        readInput(acia);
+                }
+                if (acia->inputStart < acia->inputEnd) {
+                        acia->received = acia->inputBuffer[acia->inputStart++];
+                        acia->receivedBytes++;
+                        acia->status |= STATUS_RECEIVER_FULL;
+                        acia->backoff = 1;
+                        if (receiverInterrupts(acia)) {
+                                acia->status |= STATUS_IRQ;
+                                raiseIrq(acia->memory, ACIA_IRQ);
+                        }
+                } else if (acia->inputDone) {
+                        return;
+                } else {
+                        delay *= acia->backoff;
+                        if (acia->backoff < MAX_BACKOFF) {
+                                acia->backoff *= 2;
+                        }
+                }
+        }
+        scheduleReceive(acia, cycle + delay);
+}
+
+static uint8_t readAcia(void *context, uint16_t address)
+{
+        Acia *acia = context;
+        uint8_t status;
+
+        resumeReceive(acia);
+        switch (address & 3) {
+        case REGISTER_DATA:
+                acia->status &= ~STATUS_RECEIVER_FULL;
+                return acia->received;
+        case REGISTER_STATUS:
+                status = acia->status;
+                clearIrq(acia);
+                return status;
+        case REGISTER_COMMAND:
+                return acia->command;
+        default:
+                return acia->control;
+        }
+}
+
+static void writeAcia(void *context, uint16_t address, uint8_t value)
+{
+        Acia *acia = context;
+
+        resumeReceive(acia);
+        switch (address & 3) {
+        case REGISTER_DATA:
+                transmit(acia, value);
+                break;
+        case REGISTER_STATUS:
+                acia->command &= COMMAND_KEPT;
+                clearIrq(acia);
+                break;
+        case REGISTER_COMMAND:
+                acia->command = value;
+                if (!receiverInterrupts(acia)) {
+                        clearIrq(acia);
+                }
+                break;
+        default:
+                acia->control = value;
+                setBaud(acia);
+                break;
+        }
+}
+
+int attachAcia(Acia *acia, Machine *machine, uint8_t page, FILE *output,
+               int input, double hz, double baud)
+{
+        int error;
+
+        if (!(hz >= 1) || !(baud >= 1)) {
+                return -EINVAL;
+        }
+
+        acia->device = (Device) { readAcia, writeAcia, acia, 0 };
+        acia->memory = &machine->memory;
+        acia->page = page;
+        acia->output = output;
+        acia->input = input;
+        acia->inputFlags = -1;
+        acia->status = STATUS_TRANSMITTER_EMPTY;
+        acia->command = 0;
+        acia->control = 0;
+        acia->received = 0;
+        acia->hz = hz;
+        acia->baud = baud;
+        acia->backoff = 1;
+        acia->inputDone = input < 0;
+        acia->flushPending = acia->receivePending = 0;
+        acia->outputFailed = 0;
+        acia->outputUsed = acia->inputStart = acia->inputEnd = 0;
+        acia->sent = acia->receivedBytes = acia->writes = 0;
+        setBaud(acia);
+
+        if ((error = mapDevice(acia->memory, page, page, &acia->device)) < 0) {
+                return error;
+        }
+        if (input >= 0 && (acia->inputFlags = fcntl(input, F_GETFL)) >= 0) {
+                fcntl(input, F_SETFL, acia->inputFlags | O_NONBLOCK);
+        }
+        if (!acia->inputDone) {
+                scheduleReceive(acia, machine->registers.cycles +
+                                acia->characterCycles);
+        }
+
+        return 0;
+}
+
+int detachAcia(Acia *acia)
+{
+        int error = flushAcia(acia);
+
+        cancelEvents(acia->memory, receive, acia);
+        cancelEvents(acia->memory, flushLater, acia);
+        clearIrq(acia);
+        mapRam(acia->memory, acia->page, acia->page);
+        /* Leave the descriptor as it was found, shared as it may be. */
+        if (acia->inputFlags >= 0) {
+                fcntl(acia->input, F_SETFL, acia->inputFlags);
+        }
+
+        return error;
+}
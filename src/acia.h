@@ -0,0 +1,94 @@
+#ifndef ACIA_H
+#define ACIA_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* IRQ source of the ACIA, see raiseIrq(). */
+#define ACIA_IRQ 0x00000001
+/* Bytes of guest output held before they are written out. */
+#define ACIA_OUTPUT_SIZE 0x10000
+/* Bytes of host input read at once. */
+#define ACIA_INPUT_SIZE 0x1000
+
+/*
+ * A serial console in the manner of the 6551 ACIA, mapped to a page whose
+ * every 4 bytes repeat its registers:
+ *
+ *     0  data: writes transmit, reads the byte received
+ *     1  status (read), programmed reset (write)
+ *     2  command
+ *     3  control: bits 0-3 select the baud rate, 0 for the default
+ *
+ * Transmitting never keeps the guest waiting: bytes written go into a host
+ * side buffer, written out in one fwrite() when it fills up, once 100 ms
+ * worth of cycles have passed since the first byte still held, and when
+ * flushAcia() is called. Input is read from a descriptor without blocking,
+ * in chunks, and handed to the guest one byte per character time (10 bits
+ * at the baud rate), by an event that sets the receiver full status bit
+ * and, while the command register enables receiver interrupts, raises
+ * ACIA_IRQ. A byte the guest has not read yet holds back the next one
+ * rather than being overrun. Reading the status register clears its
+ * interrupt bit and lowers the IRQ; while no input is available, the event
+ * backs off up to 64 character times between reads. Should no event be
+ * free for it, it is scheduled again on the next register access or
+ * flushAcia(), as a held flush is on the next byte transmitted.
+ * Transmitter interrupts are not supported, the transmitter being always
+ * empty.
+ */
+typedef struct {
+        Device device;
+        Memory *memory;
+        uint8_t page;
+        /* Where output goes, NULL to drop it; input descriptor, or -1. */
+        FILE *output;
+        int input;
+        /* File status flags of input before it was made non-blocking. */
+        int inputFlags;
+        uint8_t status;
+        uint8_t command;
+        uint8_t control;
+        uint8_t received;
+        /* Cycles per second, default baud rate and cycles per character. */
+        double hz;
+        double baud;
+        uint64_t characterCycles;
+        /* Character times until the next read of input, when it had none. */
+        uint64_t backoff;
+        uint8_t inputDone;
+        /* Set while a receive() or flush event is scheduled. */
+        uint8_t receivePending;
+        uint8_t flushPending;
+        /* Set once writing output failed. */
+        uint8_t outputFailed;
+        /* Output bytes held, input bytes read and not yet received. */
+        size_t outputUsed;
+        size_t inputStart;
+        size_t inputEnd;
+        /* Bytes sent and received, and output writes made. */
+        uint64_t sent;
+        uint64_t receivedBytes;
+        uint64_t writes;
+        uint8_t outputBuffer[ACIA_OUTPUT_SIZE];
+        uint8_t inputBuffer[ACIA_INPUT_SIZE];
+} Acia;
+
+/*
+ * Map the ACIA to a page of the machine, output going to output and input
+ * coming from the input descriptor (either may be NULL or -1), at hz
+ * cycles per second and baud bits per second by default. Returns 0, or
+ * -EINVAL for a page that cannot hold a device or rates below 1.
+ */
+int attachAcia(Acia *acia, Machine *machine, uint8_t page, FILE *output,
+               int input, double hz, double baud);
+/*
+ * Write out the output held, returns 0 or -EIO if writing output has
+ * failed since the ACIA was attached.
+ */
+int flushAcia(Acia *acia);
+/* Flush, then map the page back to RAM; returns as flushAcia(). */
+int detachAcia(Acia *acia);
+
+#endif  /* ACIA_H */
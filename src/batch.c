@@ -0,0 +1,422 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "loader.h"
+#include "batch.h"
+
+/* An image as loaded once, for all the instances running it. */
+typedef struct {
+        /* RAM with the image loaded, NULL if it failed to load. */
+        uint8_t *ram;
+        Image image;
+        /* Negative errno value if the image could not be loaded. */
+        long error;
+} Program;
+
+/* One line of the manifest, and what became of it. */
+typedef struct {
+        char *path;
+        uint16_t load;
+        /* The image at path loaded at load, shared with other instances. */
+        const Program *program;
+        /* Initial registers, then final ones. */
+        Registers registers;
+        /* Whether the pc was given, rather than the image's entry point. */
+        uint8_t pcSet;
+        uint64_t budget;
+        /* Negative errno value if the program could not be loaded. */
+        long error;
+        StopReason stop;
+} Instance;
+
+/* How the stop reasons are printed, indexed by StopReason. */
+static const char *const stopNames[] = {
+        [STOP_BRK] = "brk",
+        [STOP_BUDGET] = "budget",
+        [STOP_STP] = "stp",
+        [STOP_BREAKPOINT] = "breakpoint",
+        [STOP_WATCHPOINT] = "watchpoint",
+        [STOP_DIVERGED] = "diverged"
+};
+
+/*
+ * Instances still to be run by one worker, as a range of indices. The
+ * owner takes them from the front while idle workers steal from the back,
+ * so that both ends are only contended once the range is nearly empty.
+ */
+typedef struct {
+        pthread_mutex_t lock;
+        size_t next;
+        size_t end;
+} Queue;
+
+typedef struct {
+        Instance *instances;
+        Queue *queues;
+        int threads;
+} Pool;
+
+typedef struct {
+        Pool *pool;
+        int id;
+} Worker;
+
+/* Run an instance on its own machine, allocated for the occasion. */
+static void runInstance(Instance *instance)
+{
+        const Program *program = instance->program;
+        Machine *machine;
+
+        if (program->error) {
+                instance->error = program->error;
+                return;
+        }
+        if (!(machine = malloc(sizeof(*machine)))) {
+                instance->error = -ENOMEM;
+                return;
+        }
+
+        initMemory(&machine->memory);
+        memcpy(machine->memory.ram, program->ram, RAM_SIZE);
+        if (!instance->pcSet) {
+                instance->registers.pc = program->image.entry;
+        }
+        machine->registers = instance->registers;
+        instance->stop = executeCycles(&machine->registers, &machine->memory,
+                                       instance->budget);
+        instance->registers = machine->registers;
+
+        freeMemory(&machine->memory);
+        free(machine);
+}
+
+/* Order instances by image and load address, to find those sharing one. */
+static int compareImages(const void *first, const void *second)
+{
+        const Instance *a = *(Instance *const *) first;
+        const Instance *b = *(Instance *const *) second;
+        int order = strcmp(a->path, b->path);
+
+        return order ? order : (int) a->load - (int) b->load;
+}
+
+/*
+ * Load every distinct image of the instances once, into a freshly
+ * allocated array of programs they point to, so that workers only copy
+ * memory instead of reading and parsing files. Returns the number of
+ * programs, or -ENOMEM.
+ */
+static long loadPrograms(Instance *instances, size_t count,
+                         Program **programs)
+{
+        Instance **sorted = malloc(count * sizeof(*sorted));
+        Program *program = NULL;
+        size_t i, loaded = 0;
+        long size;
+
+        *programs = NULL;
+        if (!count) {
+                free(sorted);
+                return 0;
+        }
+        *programs = calloc(count, sizeof(**programs));
+        if (!sorted || !*programs) {
+                free(sorted);
+                free(*programs);
+                *programs = NULL;
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < count; i++) {
+                sorted[i] = &instances[i];
+        }
+        qsort(sorted, count, sizeof(*sorted), compareImages);
+
+        for (i = 0; i < count; i++) {
+                if (!i || compareImages(&sorted[i - 1], &sorted[i])) {
+                        program = &(*programs)[loaded++];
+                        if (!(program->ram = calloc(1, RAM_SIZE))) {
+                                program->error = -ENOMEM;
+                        } else if ((size = loadImage(sorted[i]->path,
+                                                     FORMAT_AUTO,
+                                                     sorted[i]->load,
+                                                     program->ram,
+                                                     &program->image)) < 0) {
+                                program->error = size;
+                        }
+                }
+                sorted[i]->program = program;
+        }
+        free(sorted);
+
+        return loaded;
+}
+
+/* Take an instance from the front of a queue, or from its back. */
+static int take(Queue *queue, size_t *index, int steal)
+{
+        int found;
+
+        pthread_mutex_lock(&queue->lock);
+        found = queue->next < queue->end;
+        if (found) {
+                *index = steal ? --queue->end : queue->next++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        return found;
+}
+
+static void *work(void *argument)
+{
+        Worker *worker = argument;
+        Pool *pool = worker->pool;
+        size_t index;
+        int victim;
+
+        for (;;) {
+                if (!take(&pool->queues[worker->id], &index, 0)) {
+                        /* Steal from the other workers, in turn. */
+                        for (victim = 1; victim < pool->threads; victim++) {
+                                if (take(&pool->queues[(worker->id + victim) %
+                                                       pool->threads],
+                                         &index, 1)) {
+                                        break;
+                                }
+                        }
+                        /* No instance is ever added, so this is the end. */
+                        if (victim >= pool->threads) {
+                                return NULL;
+                        }
+                }
+                runInstance(&pool->instances[index]);
+        }
+}
+
+/* Run the instances over threads workers, each starting with a slice. */
+static int runInstances(Instance *instances, size_t count, int threads)
+{
+        Pool pool = { instances, NULL, threads };
+        pthread_t *ids = calloc(threads, sizeof(*ids));
+        Worker *workers = calloc(threads, sizeof(*workers));
+        int i, started;
+
+        pool.queues = calloc(threads, sizeof(*pool.queues));
+        if (!ids || !workers || !pool.queues) {
+                free(ids);
+                free(workers);
+                free(pool.queues);
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < threads; i++) {
+                pthread_mutex_init(&pool.queues[i].lock, NULL);
+                pool.queues[i].next = count * i / threads;
+                pool.queues[i].end = count * (i + 1) / threads;
+                workers[i].pool = &pool;
+                workers[i].id = i;
+        }
+
+        /*
+         * The slices of workers that failed to start get stolen, or run
+         * here if none did.
+         */
+        for (started = 0; started < threads; started++) {
+                if (pthread_create(&ids[started], NULL, work,
+                                   &workers[started])) {
+                        break;
+                }
+        }
+        if (!started) {
+                work(&workers[0]);
+        }
+        for (i = 0; i < started; i++) {
+                pthread_join(ids[i], NULL);
+        }
+
+        for (i = 0; i < threads; i++) {
+                pthread_mutex_destroy(&pool.queues[i].lock);
+        }
+        free(ids);
+        free(workers);
+        free(pool.queues);
+
+        return 0;
+}
+
+/* Parse the fields of a manifest line, defaults already set. */
+static int parseInstance(char *line, Instance *instance)
+{
+        char *field, *value, *end, *state;
+        unsigned long long number, limit;
+
+        field = strtok_r(line, " \t\n", &state);
+        if (!(instance->path = strdup(field))) {
+                return -ENOMEM;
+        }
+
+        while ((field = strtok_r(NULL, " \t\n", &state))) {
+                if (!(value = strchr(field, '='))) {
+                        return -EINVAL;
+                }
+                *value++ = '\0';
+                errno = 0;
+                number = strtoull(value, &end, 0);
+                if (*value == '\0' || *end != '\0' || errno) {
+                        return -EINVAL;
+                }
+
+                if (!strcmp(field, "cycles")) {
+                        instance->budget = number;
+                        continue;
+                }
+                limit = !strcmp(field, "load") || !strcmp(field, "pc") ?
+                        0xFFFF : 0xFF;
+                if (number > limit) {
+                        return -EINVAL;
+                }
+                if (!strcmp(field, "load")) {
+                        instance->load = number;
+                } else if (!strcmp(field, "pc")) {
+                        instance->registers.pc = number;
+                        instance->pcSet = 1;
+                } else if (!strcmp(field, "a")) {
+                        instance->registers.a = number;
+                } else if (!strcmp(field, "x")) {
+                        instance->registers.x = number;
+                } else if (!strcmp(field, "y")) {
+                        instance->registers.y = number;
+                } else if (!strcmp(field, "sp")) {
+                        instance->registers.sp = number;
+                } else if (!strcmp(field, "p")) {
+                        instance->registers.p = number;
+                } else {
+                        return -EINVAL;
+                }
+        }
+
+        return 0;
+}
+
+/* Read the manifest into a freshly allocated array of instances. */
+static long readManifest(const char *path, Instance **instances)
+{
+        FILE *manifest = fopen(path, "r");
+        Instance *grown;
+        char *line = NULL, *start;
+        size_t size = 0, count = 0, room = 0;
+        long number = 0, error = 0;
+
+        *instances = NULL;
+        if (!manifest) {
+                return -errno;
+        }
+
+        while (getline(&line, &size, manifest) != -1) {
+                number++;
+                start = line + strspn(line, " \t\n");
+                if (*start == '\0' || *start == '#') {
+                        continue;
+                }
+
+                if (count == room) {
+                        room = room ? room * 2 : 64;
+                        grown = realloc(*instances,
+                                        room * sizeof(**instances));
+                        if (!grown) {
+                                error = -ENOMEM;
+                                break;
+                        }
+                        *instances = grown;
+                }
+
+                memset(&(*instances)[count], 0, sizeof(**instances));
+                reset(&(*instances)[count].registers, 0);
+                (*instances)[count].budget = UINT64_MAX;
+                error = parseInstance(start, &(*instances)[count]);
+                count++;
+                if (error) {
+                        fprintf(stderr, "%s:%ld: invalid instance\n", path,
+                                number);
+                        break;
+                }
+        }
+
+        if (!error && ferror(manifest)) {
+                error = -EIO;
+        }
+        free(line);
+        fclose(manifest);
+
+        if (error) {
+                while (count) {
+                        free((*instances)[--count].path);
+                }
+                free(*instances);
+                *instances = NULL;
+                return error;
+        }
+
+        return count;
+}
+
+int runBatch(const char *manifest, int threads, FILE *out)
+{
+        Instance *instances, *instance;
+        Program *programs = NULL;
+        long count, programCount = 0, i;
+        int error;
+
+        if ((count = readManifest(manifest, &instances)) < 0) {
+                return count;
+        }
+
+        if (threads <= 0) {
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (threads > count) {
+                threads = count;
+        }
+        if (threads < 1) {
+                threads = 1;
+        }
+
+        if ((programCount = loadPrograms(instances, count, &programs)) < 0) {
+                error = programCount;
+        } else {
+                error = runInstances(instances, count, threads);
+        }
+
+        for (i = 0; !error && i < count; i++) {
+                instance = &instances[i];
+                if (instance->error) {
+                        fprintf(out, "%ld %s error: %s\n", i, instance->path,
+                                strerror(-instance->error));
+                        continue;
+                }
+                fprintf(out, "%ld %s stop=%s a=%02X x=%02X y=%02X sp=%02X "
+                        "p=%02X pc=%04X cycles=%llu\n", i, instance->path,
+                        stopNames[instance->stop],
+                        instance->registers.a, instance->registers.x,
+                        instance->registers.y, instance->registers.sp,
+                        instance->registers.p, instance->registers.pc,
+                        (unsigned long long) instance->registers.cycles);
+        }
+
+        for (i = 0; i < programCount; i++) {
+                free(programs[i].ram);
+        }
+        free(programs);
+        for (i = 0; i < count; i++) {
+                free(instances[i].path);
+        }
+        free(instances);
+
+        return error;
+}
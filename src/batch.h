@@ -0,0 +1,21 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+/*
+ * Run every instance listed in a manifest over a pool of worker threads
+ * (one per online CPU if threads is 0), then print a summary line for
+ * each of them to out, in manifest order.
+ *
+ * Each manifest line is the path of a raw binary image followed by
+ * optional key=value fields, in any C integer notation: load (address of
+ * the image, 0 by default), pc (load address by default), a, x, y, sp, p
+ * (power on values by default) and cycles (the cycle budget, unlimited by
+ * default). Blank lines and lines starting with '#' are ignored.
+ *
+ * Returns 0, or a negative errno value if the manifest is unusable.
+ */
+int runBatch(const char *manifest, int threads, FILE *out);
+
+#endif  /* BATCH_H */
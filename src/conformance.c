@@ -0,0 +1,758 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cpu.h"
+#include "conformance.h"
+
+/* Bytes of vectors each worker takes at a time, give or take a line. */
+#define CHUNK_SIZE (256 * 1024)
+/* Most ram cells a state may list. */
+#define MAX_CELLS 64
+/* Most nesting of the values in a vector. */
+#define MAX_DEPTH 8
+#define REPORT_SIZE 160
+
+/* Registers and ram cells before or after a vector. */
+typedef struct {
+        Registers registers;
+        uint16_t addresses[MAX_CELLS];
+        uint8_t values[MAX_CELLS];
+        int cells;
+} State;
+
+typedef struct {
+        const char *name;
+        int nameLength;
+        State initial;
+        State final;
+        /* Bus cycles listed, as many as the instruction should take. */
+        int cycles;
+} Vector;
+
+/* What differed in a failed vector. */
+enum {
+        FAIL_REGISTERS = 1,
+        FAIL_MEMORY = 2,
+        FAIL_CYCLES = 4
+};
+
+/* A file of vectors, mapped in memory. */
+typedef struct {
+        const char *path;
+        char *data;
+        size_t size;
+} File;
+
+/* A run of whole vectors in a file, taken by one worker at a time. */
+typedef struct {
+        const File *file;
+        const char *start;
+        const char *end;
+} Chunk;
+
+/* Results of the vectors of one opcode. */
+typedef struct {
+        unsigned long vectors;
+        unsigned long failed;
+        /* Failures by what differed; one vector may count in several. */
+        unsigned long registers;
+        unsigned long memory;
+        unsigned long cycles;
+        /* Where the first failure is in the input, and what it was. */
+        uint64_t first;
+        char report[REPORT_SIZE];
+} Tally;
+
+typedef struct {
+        Chunk *chunks;
+        size_t count;
+        pthread_mutex_t lock;
+        size_t next;
+        /* Where the first unreadable vector is, or UINT64_MAX. */
+        uint64_t invalid;
+        /* Negative errno value if a worker could not run. */
+        int error;
+} Pool;
+
+typedef struct {
+        Pool *pool;
+        Tally tallies[256];
+} Worker;
+
+/*
+ * Positions in the input, as the index of a chunk and an offset in it, so
+ * that the first failure found by any worker is the first one in the files.
+ */
+static uint64_t position(size_t chunk, size_t offset)
+{
+        return (uint64_t) chunk << 32 | offset;
+}
+
+/* Reads vectors from a run of JSON text, without allocating. */
+typedef struct {
+        const char *at;
+        const char *end;
+} Parser;
+
+static void skipSpace(Parser *parser)
+{
+        while (parser->at < parser->end &&
+               (*parser->at == ' ' || *parser->at == '\t' ||
+                *parser->at == '\n' || *parser->at == '\r')) {
+                parser->at++;
+        }
+}
+
+/* Skip c and the white space before it, or fail if c is not next. */
+static int expect(Parser *parser, char c)
+{
+        skipSpace(parser);
+        if (parser->at == parser->end || *parser->at != c) {
+                return -1;
+        }
+        parser->at++;
+
+        return 0;
+}
+
+/* A string, escape sequences left as they are. */
+static int parseString(Parser *parser, const char **string, int *length)
+{
+        const char *start;
+
+        if (expect(parser, '"')) {
+                return -1;
+        }
+        start = parser->at;
+        while (parser->at < parser->end && *parser->at != '"') {
+                if (*parser->at == '\\') {
+                        parser->at++;
+                }
+                parser->at++;
+        }
+        if (parser->at >= parser->end) {
+                return -1;
+        }
+        *string = start;
+        *length = parser->at++ - start;
+
+        return 0;
+}
+
+/* A decimal number from 0 to limit. */
+static int parseNumber(Parser *parser, unsigned long limit,
+                       unsigned long *number)
+{
+        const char *start;
+
+        skipSpace(parser);
+        start = parser->at;
+        *number = 0;
+        while (parser->at < parser->end && *parser->at >= '0' &&
+               *parser->at <= '9') {
+                *number = *number * 10 + (*parser->at++ - '0');
+                if (*number > limit) {
+                        return -1;
+                }
+        }
+
+        return parser->at == start ? -1 : 0;
+}
+
+static int isKey(const char *key, int length, const char *name)
+{
+        return length == (int) strlen(name) && !memcmp(key, name, length);
+}
+
+/* Skip a value of any type, nested less than depth deep. */
+static int skipValue(Parser *parser, int depth)
+{
+        const char *string;
+        int length;
+        char close;
+
+        skipSpace(parser);
+        if (parser->at == parser->end || !depth) {
+                return -1;
+        }
+        switch (*parser->at) {
+        case '"':
+                return parseString(parser, &string, &length);
+        case '[':
+        case '{':
+                close = *parser->at++ == '[' ? ']' : '}';
+                if (!expect(parser, close)) {
+                        return 0;
+                }
+                do {
+                        if (close == '}' &&
+                            (parseString(parser, &string, &length) ||
+                             expect(parser, ':'))) {
+                                return -1;
+                        }
+                        if (skipValue(parser, depth - 1)) {
+                                return -1;
+                        }
+                } while (!expect(parser, ','));
+                return expect(parser, close);
+        default:
+                /* Numbers, true, false and null. */
+                string = parser->at;
+                while (parser->at < parser->end && *parser->at &&
+                       strchr("+-.0123456789Eaeflnrstu", *parser->at)) {
+                        parser->at++;
+                }
+                return parser->at == string ? -1 : 0;
+        }
+}
+
+/* The ram array of a state: [address, value] pairs. */
+static int parseCells(Parser *parser, State *state)
+{
+        unsigned long address, value;
+
+        if (expect(parser, '[')) {
+                return -1;
+        }
+        if (!expect(parser, ']')) {
+                return 0;
+        }
+        do {
+                if (state->cells == MAX_CELLS || expect(parser, '[') ||
+                    parseNumber(parser, 0xFFFF, &address) ||
+                    expect(parser, ',') ||
+                    parseNumber(parser, 0xFF, &value) ||
+                    expect(parser, ']')) {
+                        return -1;
+                }
+                state->addresses[state->cells] = address;
+                state->values[state->cells++] = value;
+        } while (!expect(parser, ','));
+
+        return expect(parser, ']');
+}
+
+static int parseState(Parser *parser, State *state)
+{
+        Registers *registers = &state->registers;
+        const char *key;
+        unsigned long number;
+        int length;
+
+        memset(state, 0, sizeof(*state));
+        if (expect(parser, '{')) {
+                return -1;
+        }
+        if (!expect(parser, '}')) {
+                return 0;
+        }
+        do {
+                if (parseString(parser, &key, &length) ||
+                    expect(parser, ':')) {
+                        return -1;
+                }
+                if (isKey(key, length, "ram")) {
+                        if (parseCells(parser, state)) {
+                                return -1;
+                        }
+                        continue;
+                }
+                if (!isKey(key, length, "pc") && !isKey(key, length, "s") &&
+                    !isKey(key, length, "a") && !isKey(key, length, "x") &&
+                    !isKey(key, length, "y") && !isKey(key, length, "p")) {
+                        if (skipValue(parser, MAX_DEPTH)) {
+                                return -1;
+                        }
+                        continue;
+                }
+                if (parseNumber(parser, *key == 'p' && length == 2 ?
+                                0xFFFF : 0xFF, &number)) {
+                        return -1;
+                }
+                switch (*key) {
+                case 'p':
+                        if (length == 2) {
+                                registers->pc = number;
+                        } else {
+                                registers->p = number;
+                        }
+                        break;
+                case 's':
+                        registers->sp = number;
+                        break;
+                case 'a':
+                        registers->a = number;
+                        break;
+                case 'x':
+                        registers->x = number;
+                        break;
+                case 'y':
+                        registers->y = number;
+                        break;
+                }
+        } while (!expect(parser, ','));
+
+        return expect(parser, '}');
+}
+
+/* The bus cycles, of which only the count matters. */
+static int parseCycles(Parser *parser, int *cycles)
+{
+        *cycles = 0;
+        if (expect(parser, '[')) {
+                return -1;
+        }
+        if (!expect(parser, ']')) {
+                return 0;
+        }
+        do {
+                if (skipValue(parser, MAX_DEPTH)) {
+                        return -1;
+                }
+                ++*cycles;
+        } while (!expect(parser, ','));
+
+        return expect(parser, ']');
+}
+
+static int parseVector(Parser *parser, Vector *vector)
+{
+        const char *key;
+        int length, error, found = 0;
+
+        vector->name = "";
+        vector->nameLength = 0;
+        if (expect(parser, '{')) {
+                return -1;
+        }
+        do {
+                if (parseString(parser, &key, &length) ||
+                    expect(parser, ':')) {
+                        return -1;
+                }
+                if (isKey(key, length, "name")) {
+                        error = parseString(parser, &vector->name,
+                                            &vector->nameLength);
+                } else if (isKey(key, length, "initial")) {
+                        error = parseState(parser, &vector->initial);
+                        found |= 1;
+                } else if (isKey(key, length, "final")) {
+                        error = parseState(parser, &vector->final);
+                        found |= 2;
+                } else if (isKey(key, length, "cycles")) {
+                        error = parseCycles(parser, &vector->cycles);
+                        found |= 4;
+                } else {
+                        error = skipValue(parser, MAX_DEPTH);
+                }
+                if (error) {
+                        return -1;
+                }
+        } while (!expect(parser, ','));
+
+        return found == 7 ? expect(parser, '}') : -1;
+}
+
+/* Append to a failure report, as long as there is room left. */
+static void describe(char *report, const char *format, ...)
+{
+        size_t used = strlen(report);
+        va_list arguments;
+
+        va_start(arguments, format);
+        vsnprintf(report + used, REPORT_SIZE - used, format, arguments);
+        va_end(arguments);
+}
+
+/* The opcode a vector runs, from its initial ram cells. */
+static uint8_t opcodeOf(const Vector *vector)
+{
+        int i;
+
+        for (i = 0; i < vector->initial.cells; i++) {
+                if (vector->initial.addresses[i] ==
+                    vector->initial.registers.pc) {
+                        return vector->initial.values[i];
+                }
+        }
+
+        return 0x00;
+}
+
+/*
+ * Run a vector on a machine whose memory is all zeros, and leave it so.
+ * Returns what differed, described in report, with the expected values
+ * first.
+ */
+static int runVector(Machine *machine, const Vector *vector, char *report)
+{
+        Registers *registers = &machine->registers;
+        const Registers *expected = &vector->final.registers;
+        const State *final = &vector->final;
+        uint8_t *ram = machine->memory.ram;
+        uint8_t opcode;
+        int i, failure = 0;
+
+        for (i = 0; i < vector->initial.cells; i++) {
+                ram[vector->initial.addresses[i]] = vector->initial.values[i];
+        }
+        *registers = vector->initial.registers;
+        opcode = ram[registers->pc];
+        registers->pc++;
+        step(opcode, &machine->memory, registers);
+
+        snprintf(report, REPORT_SIZE, "%.*s:",
+                 vector->nameLength > 40 ? 40 : vector->nameLength,
+                 vector->name);
+        if (registers->a != expected->a) {
+                failure |= FAIL_REGISTERS;
+                describe(report, " a %02X/%02X", expected->a, registers->a);
+        }
+        if (registers->x != expected->x) {
+                failure |= FAIL_REGISTERS;
+                describe(report, " x %02X/%02X", expected->x, registers->x);
+        }
+        if (registers->y != expected->y) {
+                failure |= FAIL_REGISTERS;
+                describe(report, " y %02X/%02X", expected->y, registers->y);
+        }
+        if (registers->sp != expected->sp) {
+                failure |= FAIL_REGISTERS;
+                describe(report, " s %02X/%02X", expected->sp,
+                         registers->sp);
+        }
+        if (registers->p != expected->p) {
+                failure |= FAIL_REGISTERS;
+                describe(report, " p %02X/%02X", expected->p, registers->p);
+        }
+        if (registers->pc != expected->pc) {
+                failure |= FAIL_REGISTERS;
+                describe(report, " pc %04X/%04X", expected->pc,
+                         registers->pc);
+        }
+        for (i = 0; i < final->cells; i++) {
+                if (ram[final->addresses[i]] != final->values[i]) {
+                        /* The first cell that differs tells enough. */
+                        if (!(failure & FAIL_MEMORY)) {
+                                describe(report, " [%04X] %02X/%02X",
+                                         final->addresses[i],
+                                         final->values[i],
+                                         ram[final->addresses[i]]);
+                        }
+                        failure |= FAIL_MEMORY;
+                }
+        }
+        if (registers->cycles != (uint64_t) vector->cycles) {
+                failure |= FAIL_CYCLES;
+                describe(report, " cycles %d/%llu", vector->cycles,
+                         (unsigned long long) registers->cycles);
+        }
+
+        for (i = 0; i < vector->initial.cells; i++) {
+                ram[vector->initial.addresses[i]] = 0;
+        }
+        for (i = 0; i < final->cells; i++) {
+                ram[final->addresses[i]] = 0;
+        }
+
+        return failure;
+}
+
+/* Run the vectors of a chunk, or fail at the first one unreadable. */
+static int runChunk(Worker *worker, Machine *machine, size_t index)
+{
+        const Chunk *chunk = &worker->pool->chunks[index];
+        Parser parser = { chunk->start, chunk->end };
+        char report[REPORT_SIZE];
+        const char *start;
+        Vector vector;
+        Tally *tally;
+        int failure;
+
+        for (;;) {
+                /* Vectors are on lines of their own or in an array. */
+                while (parser.at < parser.end &&
+                       strchr(" \t\r\n,[]", *parser.at) && *parser.at) {
+                        parser.at++;
+                }
+                if (parser.at == parser.end) {
+                        return 0;
+                }
+                start = parser.at;
+                if (parseVector(&parser, &vector)) {
+                        pthread_mutex_lock(&worker->pool->lock);
+                        if (position(index, start - chunk->start) <
+                            worker->pool->invalid) {
+                                worker->pool->invalid =
+                                        position(index,
+                                                 start - chunk->start);
+                        }
+                        pthread_mutex_unlock(&worker->pool->lock);
+                        return -1;
+                }
+
+                tally = &worker->tallies[opcodeOf(&vector)];
+                tally->vectors++;
+                if (!(failure = runVector(machine, &vector, report))) {
+                        continue;
+                }
+                tally->failed++;
+                tally->registers += !!(failure & FAIL_REGISTERS);
+                tally->memory += !!(failure & FAIL_MEMORY);
+                tally->cycles += !!(failure & FAIL_CYCLES);
+                if (position(index, start - chunk->start) < tally->first) {
+                        tally->first = position(index, start - chunk->start);
+                        memcpy(tally->report, report, REPORT_SIZE);
+                }
+        }
+}
+
+static void *work(void *argument)
+{
+        Worker *worker = argument;
+        Pool *pool = worker->pool;
+        Machine *machine = malloc(sizeof(*machine));
+        size_t index;
+
+        if (!machine) {
+                pthread_mutex_lock(&pool->lock);
+                pool->error = -ENOMEM;
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+        }
+        initMemory(&machine->memory);
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                index = pool->invalid == UINT64_MAX && !pool->error ?
+                        pool->next++ : pool->count;
+                pthread_mutex_unlock(&pool->lock);
+                if (index >= pool->count ||
+                    runChunk(worker, machine, index)) {
+                        break;
+                }
+        }
+
+        freeMemory(&machine->memory);
+        free(machine);
+
+        return NULL;
+}
+
+/*
+ * Map a file and cut it into chunks at lines starting a vector, which
+ * arrays printed on a single line have none of.
+ */
+static int mapFile(File *file, Chunk **chunks, size_t *count, size_t *room)
+{
+        const char *at, *end, *cut;
+        struct stat status;
+        Chunk *grown;
+        int fd = open(file->path, O_RDONLY);
+
+        if (fd < 0) {
+                return -errno;
+        }
+        if (fstat(fd, &status)) {
+                close(fd);
+                return -errno;
+        }
+        file->size = status.st_size;
+        file->data = NULL;
+        if (file->size) {
+                file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0);
+        }
+        close(fd);
+        if (file->data == MAP_FAILED) {
+                file->data = NULL;
+                return -errno;
+        }
+
+        at = file->data;
+        end = file->data + file->size;
+        while (at < end) {
+                cut = at + CHUNK_SIZE < end ? at + CHUNK_SIZE : end;
+                while (cut < end && !(cut[-1] == '\n' && *cut == '{')) {
+                        cut = memchr(cut, '\n', end - cut);
+                        cut = cut ? cut + 1 : end;
+                }
+                if (*count == *room) {
+                        *room = *room ? *room * 2 : 64;
+                        grown = realloc(*chunks, *room * sizeof(**chunks));
+                        if (!grown) {
+                                return -ENOMEM;
+                        }
+                        *chunks = grown;
+                }
+                (*chunks)[(*count)++] = (Chunk) { file, at, cut };
+                at = cut;
+        }
+
+        return 0;
+}
+
+/* Run the chunks over threads workers, then add up their tallies. */
+static int runChunks(Pool *pool, int threads, Tally *tallies)
+{
+        pthread_t *ids = calloc(threads, sizeof(*ids));
+        Worker *workers = calloc(threads, sizeof(*workers));
+        int i, opcode, started;
+        Tally *tally, *total;
+
+        if (!ids || !workers) {
+                free(ids);
+                free(workers);
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < threads; i++) {
+                workers[i].pool = pool;
+                for (opcode = 0; opcode < 256; opcode++) {
+                        workers[i].tallies[opcode].first = UINT64_MAX;
+                }
+        }
+        /* Chunks left by workers that failed to start run here. */
+        for (started = 0; started < threads; started++) {
+                if (pthread_create(&ids[started], NULL, work,
+                                   &workers[started])) {
+                        break;
+                }
+        }
+        if (!started) {
+                work(&workers[0]);
+        }
+        for (i = 0; i < started; i++) {
+                pthread_join(ids[i], NULL);
+        }
+
+        for (opcode = 0; opcode < 256; opcode++) {
+                total = &tallies[opcode];
+                total->first = UINT64_MAX;
+                for (i = 0; i < threads; i++) {
+                        tally = &workers[i].tallies[opcode];
+                        total->vectors += tally->vectors;
+                        total->failed += tally->failed;
+                        total->registers += tally->registers;
+                        total->memory += tally->memory;
+                        total->cycles += tally->cycles;
+                        if (tally->first < total->first) {
+                                total->first = tally->first;
+                                memcpy(total->report, tally->report,
+                                       REPORT_SIZE);
+                        }
+                }
+        }
+
+        free(ids);
+        free(workers);
+
+        return 0;
+}
+
+static double now(void)
+{
+        struct timespec time;
+
+        clock_gettime(CLOCK_MONOTONIC, &time);
+
+        return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+long runConformance(char *const *paths, int count, int threads, FILE *out)
+{
+        File *files = calloc(count, sizeof(*files));
+        Tally *tallies = calloc(256, sizeof(*tallies));
+        Pool pool = { NULL, 0 };
+        const Chunk *chunk;
+        unsigned long vectors = 0, failed = 0;
+        size_t room = 0;
+        double start;
+        long error = 0;
+        int i, opcode;
+
+        if (!files || !tallies) {
+                free(files);
+                free(tallies);
+                return -ENOMEM;
+        }
+        pthread_mutex_init(&pool.lock, NULL);
+        pool.invalid = UINT64_MAX;
+
+        for (i = 0; !error && i < count; i++) {
+                files[i].path = paths[i];
+                if ((error = mapFile(&files[i], &pool.chunks, &pool.count,
+                                     &room)) < 0) {
+                        fprintf(stderr, "%s: %s\n", paths[i],
+                                strerror(-error));
+                }
+        }
+
+        if (threads <= 0) {
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (threads > (long) pool.count) {
+                threads = pool.count;
+        }
+        if (threads < 1) {
+                threads = 1;
+        }
+
+        start = now();
+        if (!error && !(error = runChunks(&pool, threads, tallies))) {
+                error = pool.error;
+        }
+        if (!error && pool.invalid != UINT64_MAX) {
+                chunk = &pool.chunks[pool.invalid >> 32];
+                fprintf(stderr, "%s: invalid vector at byte %zu\n",
+                        chunk->file->path,
+                        (size_t) (chunk->start - chunk->file->data) +
+                        (size_t) (pool.invalid & 0xFFFFFFFF));
+                error = -EINVAL;
+        }
+
+        for (opcode = 0; !error && opcode < 256; opcode++) {
+                vectors += tallies[opcode].vectors;
+                failed += tallies[opcode].failed;
+                if (!tallies[opcode].failed) {
+                        continue;
+                }
+                if (failed == tallies[opcode].failed) {
+                        fprintf(out, "op   vectors   failed  registers  "
+                                "memory  cycles  first failure "
+                                "(expected/got)\n");
+                }
+                fprintf(out, "%02X %9lu %8lu %10lu %7lu %7lu  %s\n", opcode,
+                        tallies[opcode].vectors, tallies[opcode].failed,
+                        tallies[opcode].registers, tallies[opcode].memory,
+                        tallies[opcode].cycles, tallies[opcode].report);
+        }
+        if (!error) {
+                fprintf(out, "%lu vectors, %lu failed, in %.2f s on %d "
+                        "threads\n", vectors, failed, now() - start,
+                        threads);
+                error = failed;
+        }
+
+        for (i = 0; i < count; i++) {
+                if (files[i].data) {
+                        munmap(files[i].data, files[i].size);
+                }
+        }
+        pthread_mutex_destroy(&pool.lock);
+        free(pool.chunks);
+        free(files);
+        free(tallies);
+
+        return error;
+}
@@ -0,0 +1,26 @@
+#ifndef CONFORMANCE_H
+#define CONFORMANCE_H
+
+#include <stdio.h>
+
+/*
+ * Run the single instruction test vectors in the count files at paths
+ * over a pool of worker threads (one per online CPU if threads is 0), then
+ * print to out, for each opcode with failing vectors, how many failed and
+ * what was wrong with the first of them, and a summary line.
+ *
+ * The vectors are JSON objects in the format of the per-opcode test
+ * suites for the 6502 family: a name, the initial and final states (pc, s,
+ * a, x, y, p and a ram array of [address, value] pairs) and the bus cycles
+ * in between, one per line; a file holding a single JSON array of them is
+ * read too, in one piece. Each vector is run with step() on a machine whose
+ * memory only holds its initial ram cells. It fails if a register or a
+ * final ram cell differs, or if the instruction does not take as many
+ * cycles as are listed; what is on the bus in each cycle is not modeled.
+ *
+ * Returns the number of failed vectors, or a negative errno value if a
+ * file could not be read or holds something else than vectors.
+ */
+long runConformance(char *const *paths, int count, int threads, FILE *out);
+
+#endif  /* CONFORMANCE_H */
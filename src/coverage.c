@@ -0,0 +1,61 @@
+#define _XOPEN_SOURCE 700
+
+#include "coverage.h"
+
+#if defined(COVERAGE)
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/shm.h>
+
+int startCoverage(Coverage *coverage)
+{
+        const char *id = getenv("__AFL_SHM_ID");
+        struct shmid_ds segment;
+        size_t size;
+        void *map;
+        int shmId;
+
+        if (!id) {
+                if (!(coverage->map = calloc(1, COVERAGE_MAP_SIZE))) {
+                        return -ENOMEM;
+                }
+                coverage->mask = COVERAGE_MAP_SIZE - 1;
+                coverage->shared = 0;
+                resetCoverage(coverage);
+                return 0;
+        }
+
+        shmId = atoi(id);
+        if (shmctl(shmId, IPC_STAT, &segment) < 0) {
+                return -errno;
+        }
+        /* AFL_MAP_SIZE may have made it any size: use a power of two. */
+        for (size = 1; size * 2 <= segment.shm_segsz; size *= 2) {
+        }
+        if (segment.shm_segsz < 256) {
+                return -EINVAL;
+        }
+        if ((map = shmat(shmId, NULL, 0)) == (void *) -1) {
+                return -errno;
+        }
+
+        coverage->map = map;
+        coverage->mask = size - 1;
+        coverage->shared = 1;
+        resetCoverage(coverage);
+
+        return 0;
+}
+
+void stopCoverage(Coverage *coverage)
+{
+        if (coverage->shared) {
+                shmdt(coverage->map);
+        } else {
+                free(coverage->map);
+        }
+        coverage->map = NULL;
+}
+
+#endif
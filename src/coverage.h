@@ -0,0 +1,56 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+#if defined(COVERAGE)
+
+/* Bytes of the map when not given one by AFL++, as its MAP_SIZE. */
+#define COVERAGE_MAP_SIZE 65536
+
+/*
+ * Edge coverage of guest code in the layout of AFL++, compiled in with
+ * COVERAGE and enabled by pointing memory->coverage at a started Coverage.
+ *
+ * Every control transfer (taken or not taken branches, jumps, JSR, RTS,
+ * RTI and interrupts) enters a block at the new program counter, hashed
+ * into a location: the map byte at that location xor'ed with the previous
+ * one, shifted right by one so that A to B and B to A differ, counts the
+ * edge, wrapping at 256 as in AFL. Translated code is not covered, so the
+ * JIT engine interprets everything meanwhile.
+ */
+struct Coverage {
+        uint8_t *map;
+        /* Size of the map minus one, a power of two. */
+        uint32_t mask;
+        uint16_t previous;
+        /* Whether the map is the shared memory of AFL++. */
+        uint8_t shared;
+};
+
+/*
+ * Start covering into the shared memory segment named by __AFL_SHM_ID if
+ * it is set, or into a zeroed map of COVERAGE_MAP_SIZE bytes. Returns 0,
+ * or a negative errno value.
+ */
+int startCoverage(Coverage *coverage);
+void stopCoverage(Coverage *coverage);
+
+/* Forget the previous location, before each input. */
+static inline void resetCoverage(Coverage *coverage)
+{
+        coverage->previous = 0;
+}
+
+static inline void coverEdge(Coverage *coverage, uint16_t pc)
+{
+        /* Fibonacci hashing spreads neighbouring addresses apart. */
+        uint16_t location = (uint32_t) pc * 0x9E3779B1 >> 16;
+
+        coverage->map[(location ^ coverage->previous) & coverage->mask]++;
+        coverage->previous = location >> 1;
+}
+#endif
+
+#endif  /* COVERAGE_H */
@@ -1,1395 +1,1598 @@
+#include <string.h>
+#include <errno.h>
 #include "cpu.h"
+#include "jit.h"
+#include "trace.h"
+#include "rewind.h"
+#include "record.h"
+#include "debug.h"
+#include "coverage.h"
+
+/* Length in bytes of each instruction, opcode included. */
+const uint8_t lengths[256] = {
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+        3, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+        1, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+        1, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3,
+        2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3,
+};
+
+/*
+ * Base cycle count of each instruction on the 65C02. Page crossing and
+ * taken branch penalties, as well as the extra cycle of decimal mode
+ * arithmetic, are added by the instructions themselves. BRA is counted as a
+ * taken branch, and the a,x shifts as 6 cycles plus the page crossing
+ * penalty (INC and DEC a,x always take 7).
+ */
+const uint8_t baseCycles[256] = {
+        7, 6, 2, 1, 5, 3, 5, 5, 3, 2, 2, 1, 6, 4, 6, 5,
+        2, 5, 5, 1, 5, 4, 6, 5, 2, 4, 2, 1, 6, 4, 6, 5,
+        6, 6, 2, 1, 3, 3, 5, 5, 4, 2, 2, 1, 4, 4, 6, 5,
+        2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 2, 1, 4, 4, 6, 5,
+        6, 6, 2, 1, 3, 3, 5, 5, 3, 2, 2, 1, 3, 4, 6, 5,
+        2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 3, 1, 8, 4, 6, 5,
+        6, 6, 2, 1, 3, 3, 5, 5, 4, 2, 2, 1, 6, 4, 6, 5,
+        2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 4, 1, 6, 4, 6, 5,
+        2, 6, 2, 1, 3, 3, 3, 5, 2, 2, 2, 1, 4, 4, 4, 5,
+        2, 6, 5, 1, 4, 4, 4, 5, 2, 5, 2, 1, 4, 5, 5, 5,
+        2, 6, 2, 1, 3, 3, 3, 5, 2, 2, 2, 1, 4, 4, 4, 5,
+        2, 5, 5, 1, 4, 4, 4, 5, 2, 4, 2, 1, 4, 4, 4, 5,
+        2, 6, 2, 1, 3, 3, 5, 5, 2, 2, 2, 3, 4, 4, 6, 5,
+        2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 3, 3, 4, 4, 7, 5,
+        2, 6, 2, 1, 3, 3, 5, 5, 2, 2, 2, 1, 4, 4, 6, 5,
+        2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 4, 1, 4, 4, 7, 5,
+};
+
+/*
+ * Read the operand bytes of the instruction whose opcode was just fetched,
+ * move the program counter to the next instruction and account for its base
+ * cycles. Reading two bytes regardless of the addressing mode keeps this
+ * branch free.
+ */
+static inline uint16_t fetchOperand(uint8_t opcode, Registers *registers,
+                                    Memory *memory)
+{
+        uint16_t operand;
+
+        operand = memory->ram[(uint16_t) (registers->pc + 1)] << 8 |
+                memory->ram[registers->pc];
+        registers->pc += lengths[opcode] - 1;
+        registers->cycles += baseCycles[opcode];
+
+        return operand;
+}
 
-int execute(FILE *program, uint8_t *ram)
+/*
+ * Trace the instruction at the program counter, about to run, if tracing
+ * is compiled in and enabled; otherwise this is a single, well predicted
+ * branch per instruction.
+ */
+#if defined(TRACE)
+#define TRACE_INSTRUCTION(registers, memory) \
+        do { \
+                if (memory->tracer) { \
+                        traceInstruction(memory->tracer, registers, \
+                                         memory->ram); \
+                } \
+        } while (0)
+#define TRACING(memory) (memory->tracer != NULL)
+#else
+#define TRACE_INSTRUCTION(registers, memory)
+#define TRACING(memory) 0
+#endif
+
+/*
+ * Count the instruction at the program counter, about to run, if profiling
+ * is compiled in and enabled. Its cycles are only known once the next one
+ * starts (or the engine returns), so they are added to the previous
+ * opcode then.
+ */
+#if defined(PROFILE)
+#define PROFILE_INSTRUCTION(registers, memory, opcode) \
+        do { \
+                if (memory->profile) { \
+                        profileInstruction(memory->profile, registers, \
+                                           opcode); \
+                } \
+        } while (0)
+#define PROFILING(memory) (memory->profile != NULL)
+
+/* Add the cycles elapsed since the last instruction started to its opcode. */
+static inline void settleProfile(Profile *profile, const Registers *registers)
 {
-        Registers registers;
-        uint8_t opcode;
+        profile->opcodeCycles[profile->opcode] +=
+                registers->cycles - profile->cycles;
+        profile->cycles = registers->cycles;
+}
 
-        /*
-         * Set initial state of registers. In a real 6502, all but
-         * the bits 1 to 5 of the p register are software defined, but
-         * we have to give them some value here.
-         */
-        registers.a = 0x00;
-        registers.x = 0x00;
-        registers.y = 0x00;
-        registers.sp = 0xFF;
-        registers.pc = 0x0000;
-        registers.p = 0b00110100;
-
-        while ((opcode = fetchImmediate(program, &registers))) {
-                step(opcode, program, ram, &registers);
+static inline void profileInstruction(Profile *profile,
+                                      const Registers *registers,
+                                      uint8_t opcode)
+{
+        settleProfile(profile, registers);
+        profile->opcode = opcode;
+        profile->opcodeCounts[opcode]++;
+        profile->pcCounts[registers->pc]++;
+}
+#else
+#define PROFILE_INSTRUCTION(registers, memory, opcode)
+#define PROFILING(memory) 0
+#endif
+
+/*
+ * Count the edge into the block starting at the program counter, after a
+ * control transfer, if coverage is compiled in and enabled. Idle loop
+ * replays are not covered.
+ */
+#if defined(COVERAGE)
+#define COVER_EDGE(registers, memory) \
+        do { \
+                if (memory->coverage && !memory->scheduler.idling) { \
+                        coverEdge(memory->coverage, registers->pc); \
+                } \
+        } while (0)
+#define COVERING(memory) (memory->coverage != NULL)
+#else
+#define COVER_EDGE(registers, memory)
+#define COVERING(memory) 0
+#endif
+
+/*
+ * Whether reads or writes are watched, and whether one hit a watchpoint
+ * since the run started, see debug.h.
+ */
+#define WATCHING(memory) \
+        (memory->debugger && (memory->debugger->totals[READ_INDEX] || \
+                              memory->debugger->totals[WRITE_INDEX]))
+#define WATCH_HIT(memory) (memory->debugger && memory->debugger->pending)
+
+/* Whether device reads and interrupts come from a log, see record.h. */
+#define REPLAYING(memory) \
+        (memory->recorder && replayingRecord(memory->recorder))
+#define DIVERGED(memory) \
+        (memory->recorder && replayDiverged(memory->recorder))
+
+/*
+ * Have the engine return to executeCycles() if an IRQ is waiting for the I
+ * flag, which the instruction calling this may just have cleared.
+ */
+static inline void checkIrq(Memory *memory)
+{
+        if (memory->scheduler.irq) {
+                memory->scheduler.limit = 0;
         }
+}
 
-        return 0;
+/* Backward jumps over at most this many bytes may close an idle loop. */
+#define IDLE_SPAN 32
+/* Most instructions replayed to prove a loop idle. */
+#define IDLE_LENGTH 16
+/* Matches no packed registers, see packRegisters(). */
+#define IDLE_NONE UINT64_MAX
+
+static void checkIdle(Registers *registers, Memory *memory);
+
+/* Jump to target, looking for an idle loop on short backward jumps. */
+static inline void jump(Registers *registers, Memory *memory,
+                        uint16_t target)
+{
+        uint16_t from = registers->pc;
+
+        registers->pc = target;
+        COVER_EDGE(registers, memory);
+        if ((uint16_t) (from - target) <= IDLE_SPAN) {
+                checkIdle(registers, memory);
+        }
 }
 
-void step(uint8_t opcode, FILE *program, uint8_t *ram, Registers *registers)
+#if defined(ENGINE_TABLE) || defined(ENGINE_PREDECODE)
+
+/* One handler function per opcode, called through a 256 entry table. */
+typedef void (*Handler)(Registers *registers, Memory *memory,
+                        uint16_t operand);
+
+#define OP(code, ...) \
+        static void op_##code(Registers *registers, Memory *memory, \
+                              uint16_t operand) \
+        { __VA_ARGS__ }
+#include "opcodes.def"
+#undef OP
+
+static const Handler handlers[256] = {
+#define OP(code, ...) [code] = op_##code,
+#include "opcodes.def"
+#undef OP
+};
+
+#if defined(ENGINE_TABLE)
+
+static StopReason run(Registers *registers, Memory *memory)
 {
-        uint8_t operand, res, highbyte, lowbyte;
-        uint16_t address;
+        uint8_t opcode;
+        uint16_t operand;
 
-        switch (opcode) {
-        case 0x00: /* BRK */
-                /* Skip the signature byte after the BRK opcode. */
-                registers->pc++;
-                /* Push the high byte of the return address to the stack. */
-                ram[registers->sp] = registers->pc & 0xFF;
-                registers->sp--;
-                /* Push the low byte of the return address to the stack. */
-                ram[registers->sp] = registers->pc << 8;
-                registers->sp--;
-                /* Push the P register with B flag set to the stack. */
-                ram[registers->sp] = registers->p | 0b00010000;
-                registers->sp--;
-                /* Set I and clear D (the latter is 65C02 specific). */
-                SET_I(registers);
-                CLEAR_D(registers);
-                /* Set PC to the address at the reset vector. */
-                lowbyte = ram[0xFFFE];
-                highbyte = ram[0xFFFF];
-                registers->pc = highbyte << 8 | lowbyte;
-                break;
-        case 0x01: /* ORA (zp,x) */
-                operand = fetchIndirectX(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x04: /* TSB zp */
-                operand = fetchZeroPage(program, registers, ram);
-                res = TSB(operand, registers);
-                registers->pc--;
-                storeZeroPage(program, registers, ram, res);
-                break;
-        case 0x05: /* ORA zp */
-                operand = fetchZeroPage(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x06: /* ASL zp */
-                operand = fetchZeroPage(program, registers, ram);
-                res = ASL(operand, registers);
-                registers->pc--;
-                storeZeroPage(program, registers, ram, res);
-                break;
-        case 0x08: /* PHP */
-                ram[0x0100 | registers->sp] = registers->p;
-                registers->sp--;
-                break;
-        case 0x09: /* ORA # */
-                operand = fetchImmediate(program, registers);
-                ORA(operand, registers);
-                break;
-        case 0x0A: /* ASL A */
-                registers->a = ASL(registers->a, registers);
-                break;
-        case 0x0C: /* TSB a */
-                operand = fetchAbsolute(program, registers, ram);
-                res = TSB(operand, registers);
-                registers->pc -= 2;
-                storeAbsolute(program, registers, ram, res);
-                break;
-        case 0x0D: /* ORA a */
-                operand = fetchAbsolute(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x0E: /* ASL a */
-                operand = fetchAbsolute(program, registers, ram);
-                res = ASL(operand, registers);
-                registers->pc -= 2;
-                storeAbsolute(program, registers, ram, res);
-                break;
-        case 0x10: /* BPL */
-                operand = fetchImmediate(program, registers);
-                /* Branch if negative flag is clear. */
-                if (!N(registers)) {
-                        registers->pc += SIGNED(operand);
+        while (registers->cycles < memory->scheduler.limit) {
+                if (!(opcode = memory->ram[registers->pc])) {
+                        return STOP_BRK;
                 }
-                break;
-        case 0x11: /* ORA (zp),y */
-                operand = fetchIndirectY(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x12: /* ORA (zp) */
-                operand = fetchIndirect(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x14: /* TRB zp */
-                operand = fetchZeroPage(program, registers, ram);
-                res = TRB(operand, registers);
-                registers->pc--;
-                storeZeroPage(program, registers, ram, res);
-                break;
-        case 0x15: /* ORA zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x16: /* ASL zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                res = ASL(operand, registers);
-                registers->pc--;
-                storeZeroPageX(program, registers, ram, res);
-                break;
-        case 0x18: /* CLC */
-                CLEAR_C(registers);
-                break;
-        case 0x19: /* ORA a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x1A: /* INC A */
-                registers->a++;
-                updateNegFlag(registers->a, registers);
-                updateZeroFlag(registers->a, registers);
-                break;
-        case 0x1C: /* TRB a */
-                operand = fetchAbsolute(program, registers, ram);
-                res = TRB(operand, registers);
-                registers->pc -= 2;
-                storeAbsolute(program, registers, ram, res);
-                break;
-        case 0x1D: /* ORA a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                ORA(operand, registers);
-                break;
-        case 0x1E: /* ASL a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                res = ASL(operand, registers);
-                registers->pc -= 2;
-                storeAbsoluteX(program, registers, ram, res);
-                break;
-        case 0x20: /* JSR */
-                fpread(&lowbyte, 1, 1, registers->pc, program);
+                TRACE_INSTRUCTION(registers, memory);
+                PROFILE_INSTRUCTION(registers, memory, opcode);
                 registers->pc++;
-                fpread(&highbyte, 1, 1, registers->pc, program);
+                operand = fetchOperand(opcode, registers, memory);
+                handlers[opcode](registers, memory, operand);
+        }
+
+        return STOP_BUDGET;
+}
+
+#else  /* ENGINE_PREDECODE */
+
+/*
+ * Decode the instruction at address once and cache its handler, operand,
+ * length and base cycles, marking the pages it spans as holding code so
+ * that writes to them invalidate it.
+ */
+static Decoded *decode(Memory *memory, uint16_t address)
+{
+        Decoded *decoded = &memory->decoded[address];
+        uint8_t opcode = memory->ram[address];
+
+        decoded->handler = handlers[opcode];
+        decoded->operand = memory->ram[(uint16_t) (address + 2)] << 8 |
+                memory->ram[(uint16_t) (address + 1)];
+        decoded->length = lengths[opcode];
+        decoded->cycles = baseCycles[opcode];
+        markCode(memory, address >> 8);
+        markCode(memory, (uint16_t) (address + decoded->length - 1) >> 8);
+
+        return decoded;
+}
+
+/*
+ * Forget the instructions decoded in a page, as well as those starting in
+ * the last two bytes of the previous page, which may extend into it.
+ */
+static void invalidatePage(Memory *memory, uint8_t page)
+{
+        uint16_t start = page << 8;
+
+        memset(&memory->decoded[start], 0, 0x100 * sizeof(Decoded));
+        memset(&memory->decoded[(uint16_t) (start - 2)], 0,
+               2 * sizeof(Decoded));
+}
+
+static StopReason run(Registers *registers, Memory *memory)
+{
+        Decoded *decoded;
+
+        while (registers->cycles < memory->scheduler.limit) {
+                decoded = &memory->decoded[registers->pc];
+                if (!decoded->handler) {
+                        /* BRK is never cached, so it is only checked here. */
+                        if (!memory->ram[registers->pc]) {
+                                return STOP_BRK;
+                        }
+                        decoded = decode(memory, registers->pc);
+                }
+                TRACE_INSTRUCTION(registers, memory);
+                PROFILE_INSTRUCTION(registers, memory,
+                                    memory->ram[registers->pc]);
+                registers->pc += decoded->length;
+                registers->cycles += decoded->cycles;
+                decoded->handler(registers, memory, decoded->operand);
+        }
+
+        return STOP_BUDGET;
+}
+
+#endif
+
+#elif defined(ENGINE_THREADED)
+
+/*
+ * Direct threading with labels as values (a GCC/clang extension): every
+ * opcode body ends with its own copy of the dispatch code, which gives the
+ * branch predictor one indirect jump per opcode to learn from instead of a
+ * single shared one.
+ */
+static StopReason run(Registers *registers, Memory *memory)
+{
+        static void *const labels[256] = {
+#define OP(code, ...) [code] = &&op_##code,
+#include "opcodes.def"
+#undef OP
+        };
+        uint8_t opcode;
+        uint16_t operand;
+
+#define DISPATCH() \
+        do { \
+                if (registers->cycles >= memory->scheduler.limit) { \
+                        return STOP_BUDGET; \
+                } \
+                if (!(opcode = memory->ram[registers->pc])) { \
+                        return STOP_BRK; \
+                } \
+                TRACE_INSTRUCTION(registers, memory); \
+                PROFILE_INSTRUCTION(registers, memory, opcode); \
+                registers->pc++; \
+                operand = fetchOperand(opcode, registers, memory); \
+                goto *labels[opcode]; \
+        } while (0)
+
+        DISPATCH();
+#define OP(code, ...) op_##code: { __VA_ARGS__ } DISPATCH();
+#include "opcodes.def"
+#undef OP
+#undef DISPATCH
+}
+
+#elif defined(ENGINE_JIT)
+
+/*
+ * Interpret until jit.c has translated the code at the program counter,
+ * then let the translations run, chaining into each other, for as long as
+ * they can.
+ */
+static StopReason run(Registers *registers, Memory *memory)
+{
+        uint8_t opcode;
+
+        while (registers->cycles < memory->scheduler.limit) {
                 /*
-                 * Push the address of the last byte before the next
-                 * instruction into the stack; this is our return
-                 * address.
+                 * Translated code is neither traced, profiled nor
+                 * covered, reads the zero page and the stack behind
+                 * the back of watchpoints, and does not stop for the
+                 * interrupts a replayed device read may be followed by.
                  */
-                ram[registers->sp] = registers->pc << 8;
-                registers->sp--;
-                ram[registers->sp] = registers->pc & 0xFF;
-                registers->sp--;
-                address = highbyte << 8 | lowbyte;
-                registers->pc = address;
-                break;
-        case 0x21: /* AND (zp,x) */
-                operand = fetchIndirectX(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x24: /* BIT zp */
-                operand = fetchZeroPage(program, registers, ram);
-                BIT(operand, registers);
-                break;
-        case 0x25: /* AND zp */
-                operand = fetchZeroPage(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x26: /* ROL zp */
-                operand = fetchZeroPage(program, registers, ram);
-                res = ROL(operand, registers);
-                registers->pc--;
-                storeZeroPage(program, registers, ram, res);
-                break;
-        case 0x28: /* PLP */
-                registers->sp++;
-                registers->p = ram[0x0100 | registers->sp];
-                break;
-        case 0x29: /* AND # */
-                operand = fetchImmediate(program, registers);
-                AND(operand, registers);
-                break;
-        case 0x2A: /* ROL A */
-                registers->a = ROL(registers->a, registers);
-                break;
-        case 0x2C: /* BIT a */
-                operand = fetchAbsolute(program, registers, ram);
-                BIT(operand, registers);
-                break;
-        case 0x2D: /* AND a */
-                operand = fetchAbsolute(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x2E: /* ROL a */
-                operand = fetchAbsolute(program, registers, ram);
-                res = ROL(operand, registers);
-                registers->pc -= 2;
-                storeAbsolute(program, registers, ram, res);
-                break;
-        case 0x30: /* BMI */
-                operand = fetchImmediate(program, registers);
-                /* Branch if negative flag is set. */
-                if (N(registers)) {
-                        registers->pc += SIGNED(operand);
+                if (!TRACING(memory) && !PROFILING(memory) &&
+                    !COVERING(memory) && !WATCHING(memory) &&
+                    !REPLAYING(memory) && runJit(registers, memory)) {
+                        continue;
                 }
-                break;
-        case 0x31: /* AND (zp),y */
-                operand = fetchIndirectY(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x32: /* AND (zp) */
-                operand = fetchIndirect(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x34: /* BIT zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                BIT(operand, registers);
-                break;
-        case 0x35: /* AND zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x36: /* ROL zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                res = ROL(operand, registers);
-                registers->pc--;
-                storeZeroPageX(program, registers, ram, res);
-                break;
-        case 0x38: /* SEC */
-                SET_C(registers);
-                break;
-        case 0x39: /* AND a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x3A: /* DEC A */
-                registers->a--;
-                updateNegFlag(registers->a, registers);
-                updateZeroFlag(registers->a, registers);
-                break;
-        case 0x3C: /* BIT a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                BIT(operand, registers);
-                break;
-        case 0x3D: /* AND a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                AND(operand, registers);
-                break;
-        case 0x3E: /* ROL a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                res = ROL(operand, registers);
-                registers->pc -= 2;
-                storeAbsoluteX(program, registers, ram, res);
-                break;
-        case 0x40: /* RTI */
-                registers->sp--;
-                registers->p = ram[0x0100 | registers->sp];
-                registers->sp--;
-                lowbyte = ram[0x0100 | registers->sp];
-                registers->sp--;
-                highbyte = ram[0x0100 | registers->sp];
-                registers->pc = highbyte << 8 | lowbyte;
-                break;
-        case 0x41: /* EOR (zp,x) */
-                operand = fetchIndirectX(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x45: /* EOR zp */
-                operand = fetchZeroPage(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x46: /* LSR zp */
-                operand = fetchZeroPage(program, registers, ram);
-                res = LSR(operand, registers);
-                registers->pc--;
-                storeZeroPage(program, registers, ram, res);
-                break;
-        case 0x48: /* PHA */
-                ram[0x0100 | registers->sp] = registers->a;
-                registers->sp--;
-                break;
-        case 0x49: /* EOR # */
-                operand = fetchImmediate(program, registers);
-                EOR(operand, registers);
-                break;
-        case 0x4A: /* LSR A */
-                registers->a = LSR(registers->a, registers);
-                break;
-        case 0x4C: /* JMP a */
-                fpread(&lowbyte, 1, 1, registers->pc, program);
-                registers->pc++;
-                fpread(&highbyte, 1, 1, registers->pc, program);
-                registers->pc++;
-                address = highbyte << 8 | lowbyte;
-                registers->pc = address;
-                break;
-        case 0x4D: /* EOR a */
-                operand = fetchAbsolute(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x4E: /* LSR a */
-                operand = fetchAbsolute(program, registers, ram);
-                res = LSR(operand, registers);
-                registers->pc -= 2;
-                storeAbsolute(program, registers, ram, res);
-                break;
-        case 0x50: /* BVC */
-                operand = fetchImmediate(program, registers);
-                /* Branch if overflow flag is clear. */
-                if (!V(registers)) {
-                        registers->pc += SIGNED(operand);
+                if (!(opcode = memory->ram[registers->pc])) {
+                        return STOP_BRK;
                 }
-                break;
-        case 0x51: /* EOR (zp),y */
-                operand = fetchIndirectY(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x52: /* EOR (zp) */
-                operand = fetchIndirect(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x55: /* EOR zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x56: /* LSR zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                res = LSR(operand, registers);
-                registers->pc--;
-                storeZeroPageX(program, registers, ram, res);
-                break;
-        case 0x58: /* CLI */
-                CLEAR_I(registers);
-                break;
-        case 0x59: /* EOR a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x5A: /* PHY */
-                ram[0x0100 | registers->sp] = registers->y;
-                registers->sp--;
-                break;
-        case 0x5D: /* EOR a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                EOR(operand, registers);
-                break;
-        case 0x5E: /* LSR a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                res = LSR(operand, registers);
-                registers->pc -= 2;
-                storeAbsoluteX(program, registers, ram, res);
-                break;
-        case 0x60: /* RTS */
-                registers->sp++;
-                lowbyte = ram[0x0100 | registers->sp];
-                registers->sp++;
-                highbyte = ram[0x0100 | registers->sp];
-                registers->pc = (highbyte << 8 | lowbyte) + 1;
-                break;
-        case 0x61: /* ADC (zp,x) */
-                operand = fetchIndirectX(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x64: /* STZ zp */
-                storeZeroPage(program, registers, ram, 0);
-                break;
-        case 0x65: /* ADC zp */
-                operand = fetchZeroPage(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x66: /* ROR zp */
-                operand = fetchZeroPage(program, registers, ram);
-                res = ROR(operand, registers);
-                registers->pc--;
-                storeZeroPage(program, registers, ram, res);
-                break;
-        case 0x68: /* PLA */
-                registers->sp++;
-                registers->a = ram[0x0100 | registers->sp];
-                updateNegFlag(registers->a, registers);
-                updateZeroFlag(registers->a, registers);
-                break;
-        case 0x69: /* ADC # */
-                operand = fetchImmediate(program, registers);
-                ADC(operand, registers);
-                break;
-        case 0x6A: /* ROR A */
-                registers->a = ROR(registers->a, registers);
-                break;
-        case 0x6C: /* JMP (a) */
-                fpread(&lowbyte, 1, 1, registers->pc, program);
+                TRACE_INSTRUCTION(registers, memory);
+                PROFILE_INSTRUCTION(registers, memory, opcode);
                 registers->pc++;
-                fpread(&highbyte, 1, 1, registers->pc, program);
-                registers->pc++;
-                address = highbyte << 8 | lowbyte;
-                /*
-                 * Get a 16 bit value from the low byte located in the
-                 * ram at the address specified, and the high byte
-                 * which is the next byte in memory.
-                 */
-                registers->pc = (ram[address] << 8) | ram[address + 1];
-                break;
-        case 0x6D: /* ADC a */
-                operand = fetchAbsolute(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x6E: /* ROR a */
-                operand = fetchAbsolute(program, registers, ram);
-                res = ROR(operand, registers);
-                registers->pc -= 2;
-                storeAbsolute(program, registers, ram, res);
-                break;
-        case 0x70: /* BVS */
-                operand = fetchImmediate(program, registers);
-                /* Branch if overflow flag is set */
-                if (V(registers)) {
-                        registers->pc += SIGNED(operand);
+                step(opcode, memory, registers);
+        }
+
+        return STOP_BUDGET;
+}
+
+#else  /* ENGINE_SWITCH */
+
+static StopReason run(Registers *registers, Memory *memory)
+{
+        uint8_t opcode;
+
+        while (registers->cycles < memory->scheduler.limit) {
+                if (!(opcode = memory->ram[registers->pc])) {
+                        return STOP_BRK;
                 }
-                break;
-        case 0x71: /* ADX (zp),y */
-                operand = fetchIndirectY(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x72: /* ADC (zp) */
-                operand = fetchIndirect(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x74: /* STZ zp, x */
-                storeZeroPageX(program, registers, ram, 0);
-                break;
-        case 0x75: /* ADC zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x76: /* ROR dp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                res = ROR(operand, registers);
-                registers->pc --;
-                storeZeroPageX(program, registers, ram, res);
-                break;
-        case 0x78: /* SEI */
-                SET_I(registers);
-                break;
-        case 0x79: /* ADC a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x7A: /* PLY */
-                registers->sp++;
-                registers->y = ram[0x0100 | registers->sp];
-                updateNegFlag(registers->y, registers);
-                updateZeroFlag(registers->y, registers);
-                break;
-        case 0x7C: /* JMP (a,x) */
-                fpread(&lowbyte, 1, 1, registers->pc, program);
+                TRACE_INSTRUCTION(registers, memory);
+                PROFILE_INSTRUCTION(registers, memory, opcode);
                 registers->pc++;
-                fpread(&highbyte, 1, 1, registers->pc, program);
+                step(opcode, memory, registers);
+        }
+
+        return STOP_BUDGET;
+}
+
+#endif
+
+/*
+ * run() with breakpoints set: one instruction at a time through step(),
+ * looking them up first on pages that have any.
+ */
+static StopReason runDebug(Registers *registers, Memory *memory)
+{
+        const Debugger *debugger = memory->debugger;
+        uint8_t opcode;
+
+        while (registers->cycles < memory->scheduler.limit) {
+                if (debugger->counts[EXECUTE_INDEX][registers->pc >> 8] &&
+                    checkBreakpoint(memory, registers)) {
+                        return STOP_BREAKPOINT;
+                }
+                if (!(opcode = memory->ram[registers->pc])) {
+                        return STOP_BRK;
+                }
+                TRACE_INSTRUCTION(registers, memory);
+                PROFILE_INSTRUCTION(registers, memory, opcode);
                 registers->pc++;
-                address = highbyte << 8 | lowbyte;
-                address += registers->x;
+                step(opcode, memory, registers);
+        }
+
+        return STOP_BUDGET;
+}
+
+/* Point the page table entries of a page at what it is mapped to. */
+static void updatePage(Memory *memory, uint8_t page)
+{
+        uint8_t *ram = &memory->ram[page << 8];
+        PageType type = memory->pageTypes[page];
+
+        memory->readPages[page] = type == PAGE_DEVICE ? NULL : ram;
+        memory->writePages[page] = type == PAGE_RAM ? ram : NULL;
+        if (memory->trackingDirty && !memory->dirtyPages[page]) {
+                memory->writePages[page] = NULL;
+        }
+        if (memory->debugger) {
+                if (memory->debugger->counts[READ_INDEX][page]) {
+                        memory->readPages[page] = NULL;
+                }
+                if (memory->debugger->counts[WRITE_INDEX][page]) {
+                        memory->writePages[page] = NULL;
+                }
+        }
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+        if (memory->codePages[page]) {
+                memory->writePages[page] = NULL;
+        }
+#endif
+}
+
+void initMemory(Memory *memory)
+{
+        int page;
+
+        memset(memory, 0, sizeof(*memory));
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                updatePage(memory, page);
+        }
+#if defined(ENGINE_JIT)
+        initJit(memory);
+#endif
+}
+
+void freeMemory(Memory *memory)
+{
+#if defined(ENGINE_JIT)
+        freeJit(memory);
+#endif
+}
+
+static int mapPages(Memory *memory, uint8_t first, uint8_t last,
+                    PageType type, const Device *device)
+{
+        int page;
+
+        if (first < 0x02 || first > last) {
+                return -EINVAL;
+        }
+
+        for (page = first; page <= last; page++) {
+                memory->pageTypes[page] = type;
+                memory->devices[page] = device;
+                updatePage(memory, page);
+        }
+
+        return 0;
+}
+
+int mapRam(Memory *memory, uint8_t first, uint8_t last)
+{
+        return mapPages(memory, first, last, PAGE_RAM, NULL);
+}
+
+int mapRom(Memory *memory, uint8_t first, uint8_t last)
+{
+        return mapPages(memory, first, last, PAGE_ROM, NULL);
+}
+
+int mapDevice(Memory *memory, uint8_t first, uint8_t last,
+              const Device *device)
+{
+        return mapPages(memory, first, last, PAGE_DEVICE, device);
+}
+
+uint8_t readSlow(Memory *memory, uint16_t address)
+{
+        const Device *device = memory->devices[address >> 8];
+        uint8_t value;
+
+        /* Pages with read watches. */
+        if (memory->pageTypes[address >> 8] != PAGE_DEVICE) {
+                value = memory->ram[address];
+                checkWatch(memory, READ_INDEX, address, value);
+                return value;
+        }
+
+#if defined(ENGINE_JIT) && defined(JIT_VERIFY)
+        /* Shadows read what the translation they check read, see jit.c. */
+        if (memory->jit.replayed) {
+                return replayDeviceRead(memory);
+        }
+#endif
+        /*
+         * A replayed loop must not disturb devices, see checkIdle(), nor
+         * reads go missing from the input logs.
+         */
+        if (memory->scheduler.idling &&
+            (!device->steady || memory->rewind || memory->recorder)) {
+                memory->scheduler.idleFailed = 1;
+                return 0xFF;
+        }
+        if (memory->rewind && memory->scheduler.cycles) {
+                value = readInput(memory->rewind, device, address);
+        } else if (memory->recorder && memory->scheduler.cycles) {
+                value = recordRead(memory->recorder, device, address);
+        } else {
+                value = device->read ?
+                        device->read(device->context, address) : 0xFF;
+        }
+#if defined(ENGINE_JIT) && defined(JIT_VERIFY)
+        logDeviceRead(memory, value);
+#endif
+        if (memory->debugger) {
+                checkWatch(memory, READ_INDEX, address, value);
+        }
+        return value;
+}
+
+void writeSlow(Memory *memory, uint16_t address, uint8_t value)
+{
+        const Device *device = memory->devices[address >> 8];
+
+        if (memory->debugger) {
+                checkWatch(memory, WRITE_INDEX, address, value);
+        }
+        switch (memory->pageTypes[address >> 8]) {
+        case PAGE_RAM:
                 /*
-                 * Get a 16 bit value from the low byte located in the
-                 * ram at the address specified, and the high byte
-                 * which is the next byte in memory.
+                 * Pages holding decoded code, not written to yet, or with
+                 * write watches.
                  */
-                registers->pc = (ram[address] << 8) | ram[address + 1];
-                break;
-        case 0x7D: /* ADC a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                ADC(operand, registers);
-                break;
-        case 0x7E: /* ROR a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                res = ROR(operand, registers);
-                registers->pc -= 2;
-                storeAbsoluteX(program, registers, ram, res);
-                break;
-        case 0x80: /* BRA */
-                operand = fetchImmediate(program, registers);
-                registers->pc += SIGNED(operand);
-                break;
-        case 0x81: /* STA (zp,x) */
-                storeIndirectX(program, registers, ram, registers->a);;
-                break;
-        case 0x84: /* STY zp */
-                storeZeroPage(program, registers, ram, registers->y);
-                break;
-        case 0x85: /* STA zp */
-                storeZeroPage(program, registers, ram, registers->a);
-                break;
-        case 0x86: /* STX zp */
-                storeZeroPage(program, registers, ram, registers->x);
-                break;
-        case 0x88: /* DEY */
-                registers->y--;
-                updateNegFlag(registers->y, registers);
-                updateZeroFlag(registers->y, registers);
-                break;
-        case 0x89: /* BIT # */
-                operand = fetchImmediate(program, registers);
-                updateZeroFlag((registers->a & operand), registers);
-                break;
-        case 0x8A: /* TXA */
-                registers->a = registers->x;
-                updateNegFlag(registers->a, registers);
-                updateZeroFlag(registers->a, registers);
-                break;
-        case 0x8C: /* STY a */
-                storeAbsolute(program, registers, ram, registers->y);
-                break;
-        case 0x8D: /* STA a */
-                storeAbsolute(program, registers, ram, registers->a);
-                break;
-        case 0x8E: /* STX a */
-                storeAbsolute(program, registers, ram, registers->x);
-                break;
-        case 0x90: /* BCC */
-                operand = fetchImmediate(program, registers);
-                if (!C(registers)) {
-                        registers->pc += SIGNED(operand);
+                memory->ram[address] = value;
+                if (memory->trackingDirty &&
+                    !memory->dirtyPages[address >> 8]) {
+                        memory->dirtyPages[address >> 8] = 1;
+                        updatePage(memory, address >> 8);
                 }
-                break;
-        case 0x91: /* STA (zp),y */
-                storeIndirectY(program, registers, ram, registers->a);
-                break;
-        case 0x92: /* STA (zp) */
-                storeIndirect(program, registers, ram, registers->a);
-                break;
-        case 0x94: /* STY zp,x */
-                storeZeroPageX(program, registers, ram, registers->y);
-                break;
-        case 0x95: /* STA zp,x */
-                storeZeroPageX(program, registers, ram, registers->a);
-                break;
-        case 0x96: /* STX zp,y */
-                storeZeroPageY(program, registers, ram, registers->x);
-                break;
-        case 0x98: /* TYA */
-                registers->a = registers->y;
-                updateNegFlag(registers->a, registers);
-                updateZeroFlag(registers->a, registers);
-                break;
-        case 0x99: /* STA a,y */
-                storeAbsoluteY(program, registers, ram, registers->a);
-                break;
-        case 0x9A: /* TXS */
-                registers->sp = registers->x;
-                break;
-        case 0x9C: /* STZ a */
-                storeAbsolute(program, registers, ram, 0);
-                break;
-        case 0x9D: /* STA a,x */
-                storeAbsoluteX(program, registers, ram, registers->a);
-                break;
-        case 0x9E: /* STZ a,x */
-                storeAbsoluteX(program, registers, ram, 0);
-                break;
-        case 0xA0: /* LDY # */
-                operand = fetchImmediate(program, registers);
-                LDY(operand, registers);
-                break;
-        case 0xA1: /* LDA (zp,x) */
-                operand = fetchIndirectX(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xA2: /* LDX # */
-                operand = fetchImmediate(program, registers);
-                LDX(operand, registers);
-                break;
-        case 0xA4: /* LDY zp */
-                operand = fetchZeroPage(program, registers, ram);
-                LDY(operand, registers);
-                break;
-        case 0xA5: /* LDA zp */
-                operand = fetchZeroPage(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xA6: /* LDX zp */
-                operand = fetchZeroPage(program, registers, ram);
-                LDX(operand, registers);
-                break;
-        case 0xA8: /* TAY */
-                registers->y = registers->a;
-                updateNegFlag(registers->y, registers);
-                updateZeroFlag(registers->y, registers);
-                break;
-        case 0xA9: /* LDA # */
-                operand = fetchImmediate(program, registers);
-                LDA(operand, registers);
-                break;
-        case 0xAA: /* TAX */
-                registers->x = registers->a;
-                updateNegFlag(registers->x, registers);
-                updateZeroFlag(registers->x, registers);
-                break;
-        case 0xAC: /* LDY a */
-                operand = fetchAbsolute(program, registers, ram);
-                LDY(operand, registers);
-                break;
-        case 0xAD: /* LDA a */
-                operand = fetchAbsolute(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xAE: /* LDX a */
-                operand = fetchAbsolute(program, registers, ram);
-                LDX(operand, registers);
-                break;
-        case 0xB0: /* BCS */
-                operand = fetchImmediate(program, registers);
-                if (C(registers)) {
-                        registers->pc += SIGNED(operand);
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+                if (memory->codePages[address >> 8]) {
+                        invalidateCode(memory, address >> 8);
                 }
+#endif
                 break;
-        case 0xB1: /* LDA (zp),y */
-                operand = fetchIndirectY(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xB2: /* LDA (zp) */
-                operand = fetchIndirect(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xB4: /* LDY zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                LDY(operand, registers);
-                break;
-        case 0xB5: /* LDA zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xB6: /* LDX zp,y */
-                operand = fetchZeroPageY(program, registers, ram);
-                LDX(operand, registers);
-                break;
-        case 0xB8: /* CLV */
-                CLEAR_V(registers);
-                break;
-        case 0xB9: /* LDA a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xBA: /* TSX */
-                registers->x = registers->sp;
-                updateNegFlag(registers->x, registers);
-                updateZeroFlag(registers->x, registers);
-                break;
-        case 0xBC: /* LDY a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                LDY(operand, registers);
-                break;
-        case 0xBD: /* LDA a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                LDA(operand, registers);
-                break;
-        case 0xBE: /* LDX a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                LDX(operand, registers);
-                break;
-        case 0xC0: /* CPY # */
-                operand = fetchImmediate(program, registers);
-                CPY(operand, registers);
-                break;
-        case 0xC1: /* CMP (zp,x) */
-                operand = fetchIndirectX(program, registers, ram);
-                CMP(operand, registers);
-                break;
-        case 0xC4: /* CPY zp */
-                operand = fetchZeroPage(program, registers, ram);
-                CPY(operand, registers);
-                break;
-        case 0xC5: /* CMP zp */
-                operand = fetchZeroPage(program, registers, ram);
-                CMP(operand, registers);
+        case PAGE_ROM:
                 break;
-        case 0xC6: /* DEC zp */
-                operand = fetchZeroPage(program, registers, ram);
-                operand--;
-                registers->pc--;
-                storeZeroPage(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        case 0xC8: /* INY */
-                registers->y++;
-                updateNegFlag(registers->y, registers);
-                updateZeroFlag(registers->y, registers);
-                break;
-        case 0xC9: /* CMP # */
-                operand = fetchImmediate(program, registers);
-                CMP(operand, registers);
-                break;
-        case 0xCA: /* DEX */
-                registers->x--;
-                updateNegFlag(registers->x, registers);
-                updateZeroFlag(registers->x, registers);
-                break;
-        case 0xCC: /* CPY a */
-                operand = fetchAbsolute(program, registers, ram);
-                CPY(operand, registers);
-                break;
-        case 0xCD: /* CMP a */
-                operand = fetchAbsolute(program, registers, ram);
-                CMP(operand, registers);
-                break;
-        case 0xCE: /* DEC a */
-                operand = fetchAbsolute(program, registers, ram);
-                operand--;
-                registers->pc -= 2;
-                storeAbsolute(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        case 0xD0: /* BNE */
-                operand = fetchImmediate(program, registers);
-                /* Branch if zero flag is clear. */
-                if (!Z(registers)) {
-                        registers->pc += SIGNED(operand);
+        case PAGE_DEVICE:
+                /* Replayed writes already happened, see rewind.h. */
+                if ((memory->rewind && replayingInputs(memory->rewind)) ||
+                    REPLAYING(memory)) {
+                        break;
                 }
-                break;
-        case 0xD1: /* CMP (zp),y */
-                operand = fetchIndirectY(program, registers, ram);
-                CMP(operand, registers);
-                break;
-        case 0xD2: /* CMP (zp) */
-                operand = fetchIndirect(program, registers, ram);
-                CMP(operand, registers);
-                break;
-        case 0xD5: /* CMP zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                CMP(operand, registers);
-                break;
-        case 0xD6: /* DEC zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                operand--;
-                registers->pc--;
-                storeZeroPageX(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        case 0xD8: /* CLD */
-                CLEAR_D(registers);
-                break;
-        case 0xD9: /* CMP a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                CMP(operand, registers);
-                break;
-        case 0xDA: /* PHX */
-                ram[0x0100 | registers->sp] = registers->x;
-                registers->sp--;
-                break;
-        case 0xDD: /* CMP a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                CMP(operand, registers);
-                break;
-        case 0xDE: /* DEC a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                operand--;
-                registers->pc -= 2;
-                storeAbsoluteX(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        case 0xE0: /* CPX # */
-                operand = fetchImmediate(program, registers);
-                CPX(operand, registers);
-                break;
-        case 0xE1: /* SBC (zp,x) */
-                operand = fetchIndirectX(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xE4: /* CPX zp */
-                operand = fetchZeroPage(program, registers, ram);
-                CPX(operand, registers);
-                break;
-        case 0xE5: /* SBC zp */
-                operand = fetchZeroPage(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xE6: /* INC zp */
-                operand = fetchZeroPage(program, registers, ram);
-                operand++;
-                registers --;
-                storeZeroPage(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        case 0xE8: /* INX */
-                registers->x++;
-                updateNegFlag(registers->x, registers);
-                updateZeroFlag(registers->x, registers);
-                break;
-        case 0xE9: /* SBC # */
-                operand = fetchImmediate(program, registers);
-                SBC(operand, registers);
-                break;
-        case 0xEA: /* NOP */
-                break;
-        case 0xEC: /* CPX a */
-                operand = fetchAbsolute(program, registers, ram);
-                CPX(operand, registers);
-                break;
-        case 0xED: /* SBC a */
-                operand = fetchAbsolute(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xEE: /* INC a */
-                operand = fetchAbsolute(program, registers, ram);
-                operand++;
-                registers -= 2;
-                storeAbsolute(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        case 0xF0: /* BEQ */
-                operand = fetchImmediate(program, registers);
-                if (Z(registers)) {
-                        registers->pc += SIGNED(operand);
+#if defined(ENGINE_JIT) && defined(JIT_VERIFY)
+                /* So did those of the translation a shadow checks. */
+                if (memory->jit.replayed) {
+                        break;
+                }
+#endif
+                if (device->write) {
+                        device->write(device->context, address, value);
                 }
-                break;
-        case 0xF1: /* SBC (zp),y */
-                operand = fetchIndirectY(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xF2: /* SBC (zp) */
-                operand = fetchIndirect(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xF5: /* SBC zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xF6: /* INC zp,x */
-                operand = fetchZeroPageX(program, registers, ram);
-                operand++;
-                registers --;
-                storeZeroPageX(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        case 0xF8: /* SED */
-                SET_D(registers);
-                break;
-        case 0xF9: /* SBC a,y */
-                operand = fetchAbsoluteY(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xFA: /* PLX */
-                registers->sp++;
-                registers->x = ram[0x0100 | registers->sp];
-                updateNegFlag(registers->x, registers);
-                updateZeroFlag(registers->x, registers);
-                break;
-        case 0xFD: /* SBC a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                SBC(operand, registers);
-                break;
-        case 0xFE: /* INC a,x */
-                operand = fetchAbsoluteX(program, registers, ram);
-                operand++;
-                registers -= 2;
-                storeAbsoluteX(program, registers, ram, operand);
-                updateNegFlag(operand, registers);
-                updateZeroFlag(operand, registers);
-                break;
-        default:
-                illegalOpcode(opcode);
                 break;
         }
 }
 
-size_t fpread(void *ptr, size_t size, size_t nmemb, size_t offset,
-              FILE *stream)
+void remapPages(Memory *memory, uint8_t first, uint8_t last)
 {
-        if (fseek(stream, offset, SEEK_SET) != 0) {
-                return 0;
+        int page;
+
+        for (page = first; page <= last; page++) {
+                updatePage(memory, page);
         }
+}
+
+void trackDirtyPages(Memory *memory, int enable)
+{
+        int page;
 
-        return fread(ptr, size, nmemb, stream);
+        memory->trackingDirty = enable;
+        memset(memory->dirtyPages, 0, sizeof(memory->dirtyPages));
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                updatePage(memory, page);
+        }
 }
 
-/* Immediate addressing | # */
-uint8_t fetchImmediate(FILE *program, Registers *registers)
+void clearDirtyPages(Memory *memory)
 {
-        uint8_t byte;
+        int page;
+
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                if (memory->dirtyPages[page]) {
+                        memory->dirtyPages[page] = 0;
+                        updatePage(memory, page);
+                }
+        }
+}
 
-        fpread(&byte, 1, 1, registers->pc, program);
-        registers->pc++;
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+void markCode(Memory *memory, uint8_t page)
+{
+        memory->codePages[page] = 1;
+        memory->writePages[page] = NULL;
+}
 
-        return byte;
+/* Drop whatever was decoded from a page that changed. */
+void invalidateCode(Memory *memory, uint8_t page)
+{
+#if defined(ENGINE_PREDECODE)
+        invalidatePage(memory, page);
+#else
+        invalidateJitPage(memory, page);
+#endif
+        memory->codePages[page] = 0;
+        updatePage(memory, page);
 }
+#endif
 
-/* Absolute addressing | a */
-uint8_t fetchAbsolute(FILE *program, Registers *registers, uint8_t *ram)
+/* Move the event at index down the heap to where it belongs. */
+static void siftDown(Scheduler *scheduler, int index)
+{
+        Event event = scheduler->events[index];
+        int child;
+
+        while ((child = 2 * index + 1) < scheduler->count) {
+                if (child + 1 < scheduler->count &&
+                    scheduler->events[child + 1].cycle <
+                    scheduler->events[child].cycle) {
+                        child++;
+                }
+                if (event.cycle <= scheduler->events[child].cycle) {
+                        break;
+                }
+                scheduler->events[index] = scheduler->events[child];
+                index = child;
+        }
+        scheduler->events[index] = event;
+}
+
+int scheduleEvent(Memory *memory, uint64_t cycle, EventHandler handler,
+                  void *context)
 {
-        uint8_t lowbyte, highbyte;
-        uint16_t address;
+        Scheduler *scheduler = &memory->scheduler;
+        int index, parent;
 
-        fpread(&lowbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        fpread(&highbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        address = highbyte << 8 | lowbyte;
+        if (scheduler->count == MAX_EVENTS) {
+                return -ENOSPC;
+        }
+
+        for (index = scheduler->count++; index; index = parent) {
+                parent = (index - 1) / 2;
+                if (scheduler->events[parent].cycle <= cycle) {
+                        break;
+                }
+                scheduler->events[index] = scheduler->events[parent];
+        }
+        scheduler->events[index] = (Event) { cycle, handler, context };
+        /* Have a running engine stop in time for it. */
+        if (cycle < scheduler->limit) {
+                scheduler->limit = cycle;
+        }
 
-        return ram[address];
+        return 0;
 }
 
-/* Absolute indexed, x addressing | a,x */
-uint8_t fetchAbsoluteX(FILE *program, Registers *registers, uint8_t *ram)
+void cancelEvents(Memory *memory, EventHandler handler, void *context)
 {
-        uint8_t lowbyte, highbyte;
-        uint16_t address;
+        Scheduler *scheduler = &memory->scheduler;
+        int index, count = 0;
+
+        for (index = 0; index < scheduler->count; index++) {
+                if (scheduler->events[index].handler != handler ||
+                    scheduler->events[index].context != context) {
+                        scheduler->events[count++] = scheduler->events[index];
+                }
+        }
+        scheduler->count = count;
+        for (index = count / 2 - 1; index >= 0; index--) {
+                siftDown(scheduler, index);
+        }
+}
 
-        fpread(&lowbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        fpread(&highbyte, 1, 1, registers->pc, program);
-        registers->pc++;
+uint64_t currentCycle(const Memory *memory)
+{
+        const Scheduler *scheduler = &memory->scheduler;
 
-        address = highbyte << 8 | lowbyte;
-        address += registers->x;
+        return scheduler->cycles ? *scheduler->cycles : scheduler->stopped;
+}
 
-        return ram[address];
+void raiseIrq(Memory *memory, uint32_t sources)
+{
+        memory->scheduler.irq |= sources;
+        memory->scheduler.limit = 0;
 }
 
-/* Absolute indexed, y addressing | a,y */
-uint8_t fetchAbsoluteY(FILE *program, Registers *registers, uint8_t *ram)
+void lowerIrq(Memory *memory, uint32_t sources)
 {
-        uint8_t lowbyte, highbyte;
-        uint16_t address;
+        memory->scheduler.irq &= ~sources;
+}
 
-        fpread(&lowbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        fpread(&highbyte, 1, 1, registers->pc, program);
-        registers->pc++;
+void triggerNmi(Memory *memory)
+{
+        memory->scheduler.nmi = 1;
+        memory->scheduler.limit = 0;
+}
 
-        address = highbyte << 8 | lowbyte;
-        address += registers->y;
+/* Run the events due by cycle, including those they schedule. */
+static void runEvents(Scheduler *scheduler, uint64_t cycle)
+{
+        Event event;
 
-        return ram[address];
+        while (scheduler->count && scheduler->events[0].cycle <= cycle) {
+                event = scheduler->events[0];
+                scheduler->events[0] = scheduler->events[--scheduler->count];
+                siftDown(scheduler, 0);
+                event.handler(event.context, event.cycle);
+        }
 }
 
-/* Zero page addressing (aka Direct page addressing) | zp */
-uint8_t fetchZeroPage(FILE *program, Registers *registers, uint8_t *ram)
+/*
+ * The interrupt to look at before the next instruction: INPUT_NMI,
+ * INPUT_IRQ if one is taken or ends a WAI, or INPUT_NONE. They come from
+ * the scheduler, and are logged to the rewind buffer and the recorder, or
+ * while either replays, from its log instead.
+ */
+static int pendingInput(Registers *registers, Memory *memory)
 {
-        uint8_t address;
+        Scheduler *scheduler = &memory->scheduler;
+        int input = INPUT_NONE;
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+        if (memory->rewind && replayingInputs(memory->rewind)) {
+                return replayInterrupt(memory->rewind, registers->cycles);
+        }
+        if (REPLAYING(memory)) {
+                return replayRecorded(memory->recorder, registers->cycles);
+        }
+        if (scheduler->nmi) {
+                scheduler->nmi = 0;
+                input = INPUT_NMI;
+        } else if (scheduler->irq &&
+                   (registers->state == CPU_WAITING || !I(registers))) {
+                input = INPUT_IRQ;
+        }
+        if (input != INPUT_NONE && memory->rewind) {
+                logInterrupt(memory->rewind, registers->cycles, input);
+        }
+        if (input != INPUT_NONE && memory->recorder) {
+                recordInterrupt(memory->recorder, registers->cycles, input);
+        }
 
-        return ram[address];
+        return input;
 }
 
-/* Zero page indexed, x addressing | zp,x */
-uint8_t fetchZeroPageX(FILE *program, Registers *registers, uint8_t *ram)
+/*
+ * Take an IRQ or NMI through the vector at the given address: like BRK,
+ * but the return address is the current program counter and the P register
+ * is pushed with B clear.
+ */
+static void interrupt(Registers *registers, Memory *memory, uint16_t vector)
 {
-        /* Note that the address wraps around if greater than 0xFF */
-        uint8_t address;
+        push(registers, memory, registers->pc >> 8);
+        push(registers, memory, registers->pc & 0xFF);
+        push(registers, memory, (registers->p & ~FLAG_B) | 0b00100000);
+        SET_I(registers);
+        CLEAR_D(registers);
+        registers->pc = readMemory(memory, vector + 1) << 8 |
+                readMemory(memory, vector);
+        registers->cycles += 7;
+        COVER_EDGE(registers, memory);
+}
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+void saveSnapshot(const Machine *machine, Snapshot *snapshot)
+{
+        snapshot->registers = machine->registers;
+        memcpy(snapshot->ram, machine->memory.ram, RAM_SIZE);
+}
 
-        address += registers->x;
+void restoreSnapshot(Machine *machine, const Snapshot *snapshot)
+{
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+        int page;
+
+        /* Code decoded from pages the snapshot leaves alone stays valid. */
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                if (machine->memory.codePages[page] &&
+                    memcmp(&machine->memory.ram[page << 8],
+                           &snapshot->ram[page << 8], 0x100)) {
+                        invalidateCode(&machine->memory, page);
+                }
+        }
+#endif
+        machine->registers = snapshot->registers;
+        memcpy(machine->memory.ram, snapshot->ram, RAM_SIZE);
+}
 
-        return ram[address];
+void reset(Registers *registers, uint16_t pc)
+{
+        /*
+         * Set initial state of registers. In a real 6502, all but
+         * the bits 1 to 5 of the p register are software defined, but
+         * we have to give them some value here.
+         */
+        registers->a = 0x00;
+        registers->x = 0x00;
+        registers->y = 0x00;
+        registers->sp = 0xFF;
+        registers->pc = pc;
+        registers->p = 0b00110100;
+        registers->cycles = 0;
+        registers->state = CPU_RUNNING;
 }
 
-/* Zero page indexed, y addressing | zp,y */
-uint8_t fetchZeroPageY(FILE *program, Registers *registers, uint8_t *ram)
+int execute(Memory *memory, uint16_t pc)
 {
-        /* Note that the address wraps around if greater than 0xFF */
-        uint8_t address;
+        Registers registers;
+
+        reset(&registers, pc);
+        executeCycles(&registers, memory, UINT64_MAX);
+
+        return 0;
+}
+
+StopReason executeCycles(Registers *registers, Memory *memory,
+                         uint64_t budget)
+{
+        Scheduler *scheduler = &memory->scheduler;
+        uint64_t end = registers->cycles + budget, cycles;
+        StopReason reason = STOP_BUDGET;
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+        /* Saturate so that huge budgets mean "run until BRK". */
+        if (end < registers->cycles) {
+                end = UINT64_MAX;
+        }
 
-        address += registers->y;
+        scheduler->cycles = &registers->cycles;
+        for (;;) {
+                runEvents(scheduler, registers->cycles);
+                if (WATCH_HIT(memory)) {
+                        reason = STOP_WATCHPOINT;
+                        break;
+                }
+                if (registers->state == CPU_STOPPED) {
+                        reason = STOP_STP;
+                        break;
+                }
+                if (DIVERGED(memory)) {
+                        reason = STOP_DIVERGED;
+                        break;
+                }
+                if (registers->cycles >= end) {
+                        break;
+                }
+                cycles = registers->cycles;
+                switch (pendingInput(registers, memory)) {
+                case INPUT_NMI:
+                        registers->state = CPU_RUNNING;
+                        interrupt(registers, memory, 0xFFFA);
+                        break;
+                case INPUT_IRQ:
+                        /* WAI resumes on a masked IRQ, without taking it. */
+                        registers->state = CPU_RUNNING;
+                        if (!I(registers)) {
+                                interrupt(registers, memory, 0xFFFE);
+                        }
+                        break;
+                }
+                scheduler->interruptCycles += registers->cycles - cycles;
+                if (WATCH_HIT(memory)) {
+                        reason = STOP_WATCHPOINT;
+                        break;
+                }
+                if (DIVERGED(memory)) {
+                        reason = STOP_DIVERGED;
+                        break;
+                }
+                scheduler->limit = end;
+                if (scheduler->count && scheduler->events[0].cycle < end) {
+                        scheduler->limit = scheduler->events[0].cycle;
+                }
+                if (memory->rewind) {
+                        scheduler->limit = replayLimit(memory->rewind,
+                                                       scheduler->limit);
+                }
+                if (memory->recorder) {
+                        scheduler->limit = recordLimit(memory->recorder,
+                                                       scheduler->limit);
+                }
+                scheduler->idleRejected = IDLE_NONE;
+                /* Nothing but an event can end a WAI: skip to the next. */
+                if (registers->state == CPU_WAITING) {
+                        scheduler->interruptCycles += scheduler->limit -
+                                registers->cycles;
+                        registers->cycles = scheduler->limit;
+                        continue;
+                }
+#if defined(PROFILE)
+                /* Interrupts are not charged to any instruction. */
+                if (memory->profile) {
+                        memory->profile->cycles = registers->cycles;
+                }
+#endif
+                if (memory->debugger &&
+                    memory->debugger->totals[EXECUTE_INDEX]) {
+                        reason = runDebug(registers, memory);
+                } else {
+                        reason = run(registers, memory);
+                }
+#if defined(PROFILE)
+                if (memory->profile) {
+                        settleProfile(memory->profile, registers);
+                }
+#endif
+                if (reason == STOP_BRK || reason == STOP_BREAKPOINT) {
+                        break;
+                }
+        }
+        if (reason == STOP_BREAKPOINT || reason == STOP_WATCHPOINT) {
+                memory->debugger->pending = 0;
+                memory->debugger->hit.registers = *registers;
+        }
+        scheduler->cycles = NULL;
+        scheduler->stopped = registers->cycles;
 
-        return ram[address];
+        return reason;
 }
 
-/* Zero page indirect addressing | (zp) */
-uint8_t fetchIndirect(FILE *program, Registers *registers, uint8_t *ram)
+/*
+ * Execute a single instruction whose opcode has already been fetched, with
+ * the program counter pointing right after it. This is the switch engine,
+ * also used by every engine for single stepping.
+ */
+void step(uint8_t opcode, Memory *memory, Registers *registers)
 {
-        uint8_t address;
-        uint16_t effectiveAddress;
+        uint16_t operand = fetchOperand(opcode, registers, memory);
+
+        switch (opcode) {
+#define OP(code, ...) case code: { __VA_ARGS__ } break;
+#include "opcodes.def"
+#undef OP
+        }
+}
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+/*
+ * Effective address computation, one function per addressing mode. The
+ * fetch and store functions below, as well as the read-modify-write
+ * instructions, decode their operand through these exactly once.
+ */
 
-        effectiveAddress = ram[address + 1] << 8 | ram[address];
+/* Absolute addressing | a */
+uint16_t addressAbsolute(Registers *registers, Memory *memory,
+                         uint16_t operand)
+{
+        return operand;
+}
 
-        return ram[effectiveAddress];
+/* Absolute indexed, x addressing | a,x */
+uint16_t addressAbsoluteX(Registers *registers, Memory *memory,
+                          uint16_t operand)
+{
+        return operand + registers->x;
 }
 
-/* Zero page indexed indirect, x addressing | (zp,x) */
-uint8_t fetchIndirectX(FILE *program, Registers *registers, uint8_t *ram)
+/* Absolute indexed, y addressing | a,y */
+uint16_t addressAbsoluteY(Registers *registers, Memory *memory,
+                          uint16_t operand)
 {
-        /* Note that the address wraps around if greater than 0xFF. */
-        uint8_t address;
-        uint16_t effectiveAddress;
+        return operand + registers->y;
+}
+
+/* Zero page addressing (aka Direct page addressing) | zp */
+uint16_t addressZeroPage(Registers *registers, Memory *memory,
+                         uint16_t operand)
+{
+        return operand & 0xFF;
+}
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+/* Zero page indexed, x addressing | zp,x */
+uint16_t addressZeroPageX(Registers *registers, Memory *memory,
+                          uint16_t operand)
+{
+        /* Note that the address wraps around if greater than 0xFF */
+        return (operand + registers->x) & 0xFF;
+}
+
+/* Zero page indexed, y addressing | zp,y */
+uint16_t addressZeroPageY(Registers *registers, Memory *memory,
+                          uint16_t operand)
+{
+        /* Note that the address wraps around if greater than 0xFF */
+        return (operand + registers->y) & 0xFF;
+}
 
-        address += registers->x;
+/* Zero page indirect addressing | (zp) */
+uint16_t addressIndirect(Registers *registers, Memory *memory,
+                         uint16_t operand)
+{
+        uint8_t address = operand;
 
-        /* Dereference and get address stored at address in ram. */
-        effectiveAddress = ram[address + 1] << 8 | ram[address];
+        /* The pointer itself wraps around within the zero page. */
+        return readMemory(memory, (uint8_t) (address + 1)) << 8 |
+                readMemory(memory, address);
+}
+
+/* Zero page indexed indirect, x addressing | (zp,x) */
+uint16_t addressIndirectX(Registers *registers, Memory *memory,
+                          uint16_t operand)
+{
+        /* Note that the address wraps around if greater than 0xFF. */
+        uint8_t address = operand + registers->x;
 
-        return ram[effectiveAddress];
+        /* Dereference and get address stored at address in ram. */
+        return readMemory(memory, (uint8_t) (address + 1)) << 8 |
+                readMemory(memory, address);
 }
 
 /* Zero page indirected indexed, y addressing | (zp),y */
-uint8_t fetchIndirectY(FILE *program, Registers *registers, uint8_t *ram)
+uint16_t addressIndirectY(Registers *registers, Memory *memory,
+                          uint16_t operand)
 {
-        uint8_t address;
+        uint8_t address = operand;
         uint16_t effectiveAddress;
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
-
         /* Dereference and get address stored at address in ram. */
-        effectiveAddress = ram[address + 1] << 8 | ram[address];
-        effectiveAddress += registers->y;
+        effectiveAddress = readMemory(memory, (uint8_t) (address + 1)) << 8 |
+                readMemory(memory, address);
 
-        return ram[effectiveAddress];
+        return effectiveAddress + registers->y;
 }
 
-void storeAbsolute(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value)
+uint8_t fetchAbsolute(Registers *registers, Memory *memory, uint16_t operand)
 {
-        uint8_t lowbyte, highbyte;
-        uint16_t address;
+        return readMemory(memory, addressAbsolute(registers, memory, operand));
+}
+
+uint8_t fetchAbsoluteX(Registers *registers, Memory *memory, uint16_t operand)
+{
+        uint16_t address = addressAbsoluteX(registers, memory, operand);
 
-        fpread(&lowbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        fpread(&highbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        address = highbyte << 8 | lowbyte;
+        /* Reads take an extra cycle when indexing crosses a page. */
+        registers->cycles += PAGE_CROSSED(operand, address);
 
-        ram[address] = value;
+        return readMemory(memory, address);
 }
 
-void storeAbsoluteX(FILE *program, Registers *registers, uint8_t *ram,
-                    uint8_t value)
+uint8_t fetchAbsoluteY(Registers *registers, Memory *memory, uint16_t operand)
 {
-        uint8_t lowbyte, highbyte;
-        uint16_t address;
+        uint16_t address = addressAbsoluteY(registers, memory, operand);
 
-        fpread(&lowbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        fpread(&highbyte, 1, 1, registers->pc, program);
-        registers->pc++;
+        registers->cycles += PAGE_CROSSED(operand, address);
 
-        address = highbyte << 8 | lowbyte;
-        address += registers->x;
+        return readMemory(memory, address);
+}
 
-        ram[address] = value;
+uint8_t fetchZeroPage(Registers *registers, Memory *memory, uint16_t operand)
+{
+        return readMemory(memory, addressZeroPage(registers, memory, operand));
 }
 
-void storeAbsoluteY(FILE *program, Registers *registers, uint8_t *ram,
-                    uint8_t value)
+uint8_t fetchZeroPageX(Registers *registers, Memory *memory, uint16_t operand)
 {
-        uint8_t lowbyte, highbyte;
-        uint16_t address;
+        return readMemory(memory,
+                          addressZeroPageX(registers, memory, operand));
+}
 
-        fpread(&lowbyte, 1, 1, registers->pc, program);
-        registers->pc++;
-        fpread(&highbyte, 1, 1, registers->pc, program);
-        registers->pc++;
+uint8_t fetchZeroPageY(Registers *registers, Memory *memory, uint16_t operand)
+{
+        return readMemory(memory,
+                          addressZeroPageY(registers, memory, operand));
+}
 
-        address = highbyte << 8 | lowbyte;
-        address += registers->y;
+uint8_t fetchIndirect(Registers *registers, Memory *memory, uint16_t operand)
+{
+        return readMemory(memory, addressIndirect(registers, memory, operand));
+}
 
-        ram[address] = value;
+uint8_t fetchIndirectX(Registers *registers, Memory *memory, uint16_t operand)
+{
+        return readMemory(memory,
+                          addressIndirectX(registers, memory, operand));
 }
 
-void storeZeroPage(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value)
+uint8_t fetchIndirectY(Registers *registers, Memory *memory, uint16_t operand)
 {
-        uint8_t address;
+        uint16_t base = addressIndirect(registers, memory, operand);
+        uint16_t address = base + registers->y;
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+        registers->cycles += PAGE_CROSSED(base, address);
+
+        return readMemory(memory, address);
+}
 
-        ram[address] = value;
+void storeAbsolute(Registers *registers, Memory *memory, uint16_t operand,
+                   uint8_t value)
+{
+        writeMemory(memory, addressAbsolute(registers, memory, operand),
+                    value);
 }
 
-void storeZeroPageX(FILE *program, Registers *registers, uint8_t *ram,
+void storeAbsoluteX(Registers *registers, Memory *memory, uint16_t operand,
                     uint8_t value)
 {
-        uint8_t address;
+        writeMemory(memory, addressAbsoluteX(registers, memory, operand),
+                    value);
+}
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+void storeAbsoluteY(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value)
+{
+        writeMemory(memory, addressAbsoluteY(registers, memory, operand),
+                    value);
+}
 
-        address += registers->x;
+void storeZeroPage(Registers *registers, Memory *memory, uint16_t operand,
+                   uint8_t value)
+{
+        writeMemory(memory, addressZeroPage(registers, memory, operand),
+                    value);
+}
 
-        ram[address] = value;
+void storeZeroPageX(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value)
+{
+        writeMemory(memory, addressZeroPageX(registers, memory, operand),
+                    value);
 }
 
-void storeZeroPageY(FILE *program, Registers *registers, uint8_t *ram,
+void storeZeroPageY(Registers *registers, Memory *memory, uint16_t operand,
                     uint8_t value)
 {
-        uint8_t address;
+        writeMemory(memory, addressZeroPageY(registers, memory, operand),
+                    value);
+}
+
+void storeIndirect(Registers *registers, Memory *memory, uint16_t operand,
+                   uint8_t value)
+{
+        writeMemory(memory, addressIndirect(registers, memory, operand),
+                    value);
+}
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+void storeIndirectX(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value)
+{
+        writeMemory(memory, addressIndirectX(registers, memory, operand),
+                    value);
+}
 
-        address += registers->y;
+void storeIndirectY(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value)
+{
+        writeMemory(memory, addressIndirectY(registers, memory, operand),
+                    value);
+}
 
-        ram[address] = value;
+void push(Registers *registers, Memory *memory, uint8_t value)
+{
+        writeMemory(memory, 0x0100 | registers->sp, value);
+        registers->sp--;
 }
 
-void storeIndirect(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value)
+uint8_t pull(Registers *registers, Memory *memory)
 {
-        uint8_t address;
-        uint16_t effectiveAddress;
+        registers->sp++;
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+        return readMemory(memory, 0x0100 | registers->sp);
+}
 
-        effectiveAddress = ram[address + 1] << 8 | ram[address];
+void branch(Registers *registers, Memory *memory, uint8_t offset)
+{
+        uint16_t target = registers->pc + SIGNED(offset);
 
-        ram[effectiveAddress] = value;
+        /* One extra cycle when taken, and another one to cross a page. */
+        registers->cycles += 1 + PAGE_CROSSED(registers->pc, target);
+        jump(registers, memory, target);
 }
 
-void storeIndirectX(FILE *program, Registers *registers, uint8_t *ram,
-                    uint8_t value)
+/*
+ * Opcodes an idle loop can be made of: they may read memory but neither
+ * write it nor touch the stack or the I flag, so replaying them changes
+ * nothing but a copy of the registers.
+ */
+static const uint8_t idleOpcodes[256] = {
+        /* LDA, LDX, LDY */
+        [0xA9] = 1, [0xA5] = 1, [0xB5] = 1, [0xAD] = 1, [0xBD] = 1,
+        [0xB9] = 1, [0xA1] = 1, [0xB1] = 1, [0xB2] = 1,
+        [0xA2] = 1, [0xA6] = 1, [0xB6] = 1, [0xAE] = 1, [0xBE] = 1,
+        [0xA0] = 1, [0xA4] = 1, [0xB4] = 1, [0xAC] = 1, [0xBC] = 1,
+        /* BIT, CMP, CPX, CPY */
+        [0x89] = 1, [0x24] = 1, [0x34] = 1, [0x2C] = 1, [0x3C] = 1,
+        [0xC9] = 1, [0xC5] = 1, [0xD5] = 1, [0xCD] = 1, [0xDD] = 1,
+        [0xD9] = 1, [0xC1] = 1, [0xD1] = 1, [0xD2] = 1,
+        [0xE0] = 1, [0xE4] = 1, [0xEC] = 1,
+        [0xC0] = 1, [0xC4] = 1, [0xCC] = 1,
+        /* AND, ORA, EOR */
+        [0x29] = 1, [0x25] = 1, [0x35] = 1, [0x2D] = 1, [0x3D] = 1,
+        [0x39] = 1, [0x21] = 1, [0x31] = 1, [0x32] = 1,
+        [0x09] = 1, [0x05] = 1, [0x15] = 1, [0x0D] = 1, [0x1D] = 1,
+        [0x19] = 1, [0x01] = 1, [0x11] = 1, [0x12] = 1,
+        [0x49] = 1, [0x45] = 1, [0x55] = 1, [0x4D] = 1, [0x5D] = 1,
+        [0x59] = 1, [0x41] = 1, [0x51] = 1, [0x52] = 1,
+        /* ASL A, LSR A, ROL A, ROR A */
+        [0x0A] = 1, [0x4A] = 1, [0x2A] = 1, [0x6A] = 1,
+        /* Transfers, TXS included: it does not touch the stack itself. */
+        [0xAA] = 1, [0x8A] = 1, [0xA8] = 1, [0x98] = 1, [0xBA] = 1,
+        [0x9A] = 1,
+        /* CLC, SEC, CLV, CLD, SED, NOP */
+        [0x18] = 1, [0x38] = 1, [0xB8] = 1, [0xD8] = 1, [0xF8] = 1,
+        [0xEA] = 1,
+        /* Branches, BRA and JMP a */
+        [0x10] = 1, [0x30] = 1, [0x50] = 1, [0x70] = 1, [0x90] = 1,
+        [0xB0] = 1, [0xD0] = 1, [0xF0] = 1, [0x80] = 1, [0x4C] = 1
+};
+
+/* The registers that decide what a loop does next, packed for compares. */
+static uint64_t packRegisters(const Registers *registers)
 {
-        /* Note that the address wraps around if greater than 0xFF. */
-        uint8_t address;
-        uint16_t effectiveAddress;
+        return (uint64_t) registers->pc << 40 |
+                (uint64_t) registers->p << 32 |
+                (uint64_t) registers->sp << 24 |
+                (uint64_t) registers->y << 16 |
+                (uint64_t) registers->x << 8 | registers->a;
+}
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+/*
+ * Called right after a short backward jump. A loop that gets back to its
+ * head with the same registers twice in a row may be waiting for an event:
+ * replay one iteration on a copy of the registers. If it only reads memory
+ * that nothing but an event can change and gets back to the head with the
+ * same registers again, every iteration until the next event would do the
+ * same, so skip them all at once.
+ */
+static void checkIdle(Registers *registers, Memory *memory)
+{
+        Scheduler *scheduler = &memory->scheduler;
+        Registers replay = *registers;
+        uint64_t head = packRegisters(registers), period;
+        uint8_t opcode;
+        int length, back = 0;
 
-        address += registers->x;
+        /* The replay jumps back to the head too. */
+        if (scheduler->idling || head == scheduler->idleRejected) {
+                return;
+        }
+        if (head != scheduler->idleHead) {
+                scheduler->idleHead = head;
+                return;
+        }
 
-        /* Dereference and get address stored at address in ram. */
-        effectiveAddress = ram[address + 1] << 8 | ram[address];
+        scheduler->idling = 1;
+        scheduler->idleFailed = 0;
+        for (length = 0; length < IDLE_LENGTH; length++) {
+                opcode = memory->ram[replay.pc];
+                if (!idleOpcodes[opcode]) {
+                        break;
+                }
+                replay.pc++;
+                step(opcode, memory, &replay);
+                if (replay.pc == registers->pc) {
+                        back = 1;
+                        break;
+                }
+        }
+        scheduler->idling = 0;
 
-        ram[effectiveAddress] = value;
+        if (!back || scheduler->idleFailed ||
+            packRegisters(&replay) != head) {
+                /* Until an event changes something, it would fail again. */
+                scheduler->idleRejected = head;
+                return;
+        }
+        if (scheduler->limit <= registers->cycles) {
+                return;
+        }
+        period = replay.cycles - registers->cycles;
+        registers->cycles += (scheduler->limit - registers->cycles) /
+                period * period;
 }
 
-void storeIndirectY(FILE *program, Registers *registers, uint8_t *ram,
-                    uint8_t value)
+int idleLoop(const Memory *memory, uint16_t pc)
 {
-        uint8_t address;
-        uint16_t effectiveAddress;
+        uint16_t head = 0, end;
+        uint8_t opcode;
+        int length;
 
-        fpread(&address, 1, 1, registers->pc, program);
-        registers->pc++;
+        /* Follow the code to the backward jump closing the loop. */
+        for (length = 0; length < IDLE_LENGTH; length++) {
+                opcode = memory->ram[pc];
+                if (!idleOpcodes[opcode]) {
+                        return 0;
+                }
+                if (opcode == 0x4C) {
+                        head = memory->ram[(uint16_t) (pc + 1)] |
+                                memory->ram[(uint16_t) (pc + 2)] << 8;
+                        pc += 3;
+                        if ((uint16_t) (pc - head) <= IDLE_SPAN) {
+                                break;
+                        }
+                        return 0;
+                }
+                if ((opcode & 0x1F) == 0x10 || opcode == 0x80) {
+                        head = pc + 2 +
+                                SIGNED(memory->ram[(uint16_t) (pc + 1)]);
+                        pc += 2;
+                        if ((uint16_t) (pc - head) <= IDLE_SPAN) {
+                                break;
+                        }
+                        continue;
+                }
+                pc += lengths[opcode];
+        }
+        if (length == IDLE_LENGTH) {
+                return 0;
+        }
 
-        /* Dereference and get address stored at address in ram. */
-        effectiveAddress = ram[address + 1] << 8 | ram[address];
-        effectiveAddress += registers->y;
+        /* The rest of the loop, from its head, must be idle too. */
+        end = pc;
+        for (pc = head, length = 0; pc != end && length < IDLE_LENGTH;
+             pc += lengths[memory->ram[pc]], length++) {
+                if (!idleOpcodes[memory->ram[pc]]) {
+                        return 0;
+                }
+        }
 
-        ram[effectiveAddress] = value;
+        return pc == end;
 }
 
-void updateNegFlag(uint8_t result, Registers *registers)
+/* N and Z flags of every possible result, in their p register positions. */
+const uint8_t nzFlags[256] = {
+        0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+void updateNZFlags(uint8_t result, Registers *registers)
 {
-        /* if bit 7 is set, value is negative. */
-        result & 0b1000000 ? SET_N(registers) : CLEAR_N(registers);
+        registers->p = (registers->p & ~(FLAG_N | FLAG_Z)) | nzFlags[result];
 }
 
 void updateZeroFlag(uint8_t result, Registers *registers)
 {
-        result == 0 ? SET_Z(registers) : CLEAR_Z(registers);
+        registers->p = (registers->p & ~FLAG_Z) | (nzFlags[result] & FLAG_Z);
 }
 
-void ADC(uint8_t operand, Registers *registers)
+/*
+ * Binary addition with carry, shared by ADC and SBC (which adds the one's
+ * complement of its operand). The sum is 9 bits wide: bit 8 is the carry
+ * out, and there is a signed overflow when both inputs have the same sign
+ * but the result has another one.
+ */
+static void addBinary(uint8_t operand, Registers *registers)
+{
+        unsigned int sum = registers->a + operand + C(registers);
+        unsigned int overflow = ~(registers->a ^ operand) &
+                (registers->a ^ sum) & 0x80;
+
+        registers->p = (registers->p &
+                        ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C)) |
+                nzFlags[sum & 0xFF] | overflow >> 1 | sum >> 8;
+        registers->a = sum;
+}
+
+/*
+ * Decimal adjustment of a low digit sum, carry in included: sums above 9
+ * wrap around into a 0x10 carry to the high digit. Indexed by the sum
+ * itself, which is at most 0x0F + 0x0F + 1; invalid BCD digits are
+ * adjusted the way the 65C02 does it.
+ */
+static const uint8_t decimalLow[32] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15,
+        0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D,
+        0x1E, 0x1F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15,
+};
+
+/*
+ * Decimal mode ADC, one digit at a time. As on the 65C02, N and Z reflect
+ * the decimal result, while V comes from the signed sum of the high digits
+ * before they are adjusted.
+ */
+static void addDecimal(uint8_t operand, Registers *registers)
+{
+        unsigned int low, sum, overflow;
+        int signedSum;
+
+        low = decimalLow[(registers->a & 0x0F) + (operand & 0x0F) +
+                         C(registers)];
+        sum = (registers->a & 0xF0) + (operand & 0xF0) + low;
+        signedSum = SIGNED(registers->a & 0xF0) + SIGNED(operand & 0xF0) +
+                (int) low;
+        overflow = (unsigned int) (signedSum + 128) > 0xFF;
+        sum += (sum >= 0xA0) * 0x60;
+
+        registers->p = (registers->p &
+                        ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C)) |
+                nzFlags[sum & 0xFF] | overflow << 6 | (sum > 0xFF);
+        registers->a = sum;
+}
+
+/*
+ * Decimal mode SBC. C and V are the same as in binary mode; the binary
+ * difference is then corrected by 0x60 on a borrow out of the high digit
+ * and by 0x06 on a borrow out of the low digit.
+ */
+static void subtractDecimal(uint8_t operand, Registers *registers)
+{
+        unsigned int binary, overflow;
+        int low, difference;
+
+        binary = registers->a + (operand ^ 0xFF) + C(registers);
+        overflow = (registers->a ^ operand) & (registers->a ^ binary) & 0x80;
+        low = (registers->a & 0x0F) - (operand & 0x0F) + C(registers) - 1;
+        difference = registers->a - operand + C(registers) - 1;
+        difference -= (difference < 0) * 0x60;
+        difference -= (low < 0) * 0x06;
+
+        registers->p = (registers->p &
+                        ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C)) |
+                nzFlags[difference & 0xFF] | overflow >> 1 | binary >> 8;
+        registers->a = difference;
+}
+
+/* Compare a register with an operand, setting C if it is not smaller. */
+static void compare(uint8_t value, uint8_t operand, Registers *registers)
+{
+        unsigned int difference = value + (operand ^ 0xFF) + 1;
+
+        registers->p = (registers->p & ~(FLAG_N | FLAG_Z | FLAG_C)) |
+                nzFlags[difference & 0xFF] | difference >> 8;
+}
+
+/* Update N, Z and C after a shift or rotation. */
+static uint8_t shifted(uint8_t result, uint8_t carry, Registers *registers)
 {
-        uint8_t res = registers->a + operand + C(registers);
+        registers->p = (registers->p & ~(FLAG_N | FLAG_Z | FLAG_C)) |
+                nzFlags[result] | carry;
 
-        /* Set (signed) overflow flag if MSB of A and res differ. */
-        ((registers->a & 0b10000000) != (res & 0b10000000)) ?
-                SET_V(registers) : CLEAR_V(registers);
-        updateNegFlag(registers->a, registers);
-        updateZeroFlag(res, registers);
+        return result;
+}
 
-        /* Handle decimal mode. */
+void ADC(uint8_t operand, Registers *registers)
+{
+        /* Decimal mode takes an extra cycle on the 65C02. */
         if (D(registers)) {
-                res = BCDToBin(registers->a) + BCDToBin(operand) +
-                        C(registers);
-                /*
-                 * Set carry if res is greater than 99, the largest
-                 * acceptable decimal value.
-                 */
-                res > 99 ? SET_C(registers) : CLEAR_C(registers);
-                /* Wrap around if overflowing. */
-                res %= 100;
-                res = binToBCD(res);
+                registers->cycles++;
+                addDecimal(operand, registers);
         } else {
-                /*
-                 * If res is smaller than operand, there was an
-                 * unsigned overflow, so set C.
-                 */
-                (res < operand) ?
-                        SET_C(registers) : CLEAR_C(registers);
+                addBinary(operand, registers);
         }
-
-        registers->a = res;
 }
 
 void AND(uint8_t operand, Registers *registers)
 {
         registers->a &= operand;
-        updateNegFlag(registers->a, registers);
-        updateZeroFlag(registers->a, registers);
+        updateNZFlags(registers->a, registers);
 }
 
 uint8_t ASL(uint8_t operand, Registers *registers)
 {
-        operand & 0b10000000 ?
-                SET_C(registers): CLEAR_C(registers);
-        operand <<= 1;
-        updateNegFlag(operand, registers);
-        updateZeroFlag(operand, registers);
-
-        return operand;
+        return shifted(operand << 1, operand >> 7, registers);
 }
 
 void BIT(uint8_t operand, Registers *registers)
 {
-        operand | 0b10000000 ?
-                SET_N(registers): CLEAR_N(registers);
-        operand | 0b01000000 ?
-                SET_V(registers): CLEAR_V(registers);
-        updateZeroFlag((registers->a & operand), registers);
+        /* N and V are copied from bits 7 and 6 of the operand. */
+        registers->p = (registers->p & ~(FLAG_N | FLAG_V | FLAG_Z)) |
+                (operand & (FLAG_N | FLAG_V)) |
+                (nzFlags[registers->a & operand] & FLAG_Z);
 }
 
 void CMP(uint8_t operand, Registers *registers)
 {
-        uint8_t res = registers->a - operand;
-        registers->a >= operand ?
-                SET_C(registers) : CLEAR_C(registers);
-        updateNegFlag(res, registers);
-        updateZeroFlag(res, registers);
+        compare(registers->a, operand, registers);
 }
 
 void CPX(uint8_t operand, Registers *registers)
 {
-        uint8_t res = registers->x - operand;
-        registers->x >= operand ?
-                SET_C(registers) : CLEAR_C(registers);
-        updateNegFlag(res, registers);
-        updateZeroFlag(res, registers);
+        compare(registers->x, operand, registers);
 }
 
 void CPY(uint8_t operand, Registers *registers)
 {
-        uint8_t res = registers->x - operand;
-        registers->y >= operand ?
-                SET_C(registers) : CLEAR_C(registers);
-        updateNegFlag(res, registers);
-        updateZeroFlag(res, registers);
+        compare(registers->y, operand, registers);
 }
 
 void EOR(uint8_t operand, Registers *registers)
 {
         registers->a ^= operand;
-        updateNegFlag(registers->a, registers);
-        updateZeroFlag(registers->a, registers);
+        updateNZFlags(registers->a, registers);
 }
 
 void LDA(uint8_t operand, Registers *registers)
 {
         registers->a = operand;
-        updateNegFlag(operand, registers);
-        updateZeroFlag(operand, registers);
+        updateNZFlags(operand, registers);
 }
 
 void LDX(uint8_t operand, Registers *registers)
 {
         registers->x = operand;
-        updateNegFlag(operand, registers);
-        updateZeroFlag(operand, registers);
+        updateNZFlags(operand, registers);
 }
 
 void LDY(uint8_t operand, Registers *registers)
 {
         registers->y = operand;
-        updateNegFlag(operand, registers);
-        updateZeroFlag(operand, registers);
+        updateNZFlags(operand, registers);
 }
 
 uint8_t LSR(uint8_t operand, Registers *registers)
 {
-        operand & 0b00000001 ?
-                SET_C(registers): CLEAR_C(registers);
-        operand >>= 1;
-        CLEAR_N(registers);
-        updateZeroFlag(operand, registers);
-
-        return operand;
+        return shifted(operand >> 1, operand & 0b00000001, registers);
 }
 
 void ORA(uint8_t operand, Registers *registers)
 {
         registers->a |= operand;
-        updateNegFlag(registers->a, registers);
-        updateZeroFlag(registers->a, registers);
+        updateNZFlags(registers->a, registers);
 }
 
 uint8_t ROL(uint8_t operand, Registers *registers)
 {
-        uint8_t res;
-
-        res = C(registers) ? 1 : 0;
-        operand & 0b10000000 ?
-                SET_C(registers): CLEAR_C(registers);
-        operand <<= 1;
-        if (res) {
-                operand |= 0b00000001;
-        }
-        updateNegFlag(operand, registers);
-        updateZeroFlag(operand, registers);
-
-        return operand;
+        return shifted(operand << 1 | C(registers), operand >> 7,
+                       registers);
 }
 
 uint8_t ROR(uint8_t operand, Registers *registers)
 {
-        uint8_t res;
-
-        res = C(registers) ? 1 : 0;
-        operand & 0b00000001 ?
-                SET_C(registers): CLEAR_C(registers);
-        operand >>= 1;
-        if (res) {
-                operand |= 0b10000000;
-        }
-        updateNegFlag(operand, registers);
-        updateZeroFlag(operand, registers);
-
-        return operand;
+        return shifted(operand >> 1 | C(registers) << 7,
+                       operand & 0b00000001, registers);
 }
 
 void SBC(uint8_t operand, Registers *registers)
 {
-        uint8_t res;
-
-        /* Handle decimal mode.*/
         if (D(registers)) {
-                res = BCDToBin(registers->a) - BCDToBin(operand) -
-                        !C(registers);
-                /* FIXME: handle underflow? */
-                res > 99 ? SET_V(registers) : CLEAR_V(registers);
-                /* Wrap around if overflowing. */
-                res %= 100;
-                res = binToBCD(res);
+                registers->cycles++;
+                subtractDecimal(operand, registers);
         } else {
-                res = registers->a - operand - !C(registers);
-                /* If the register and operand signs differ. */
-                if (!(0x80 & registers->a) & (0x80 & operand)) {
-                        /*
-                         * And if the result has the same sign as the
-                         * operand, then there is overflow.
-                         */
-                        if (!((0x80 & operand) & (0x80 & res))) {
-                                SET_V(registers);
-                        } else {
-                                CLEAR_V(registers);
-                        }
-                } else {
-                        CLEAR_V(registers);
-                }
+                /* A - M - !C is A + ~M + C in two's complement. */
+                addBinary(operand ^ 0xFF, registers);
         }
-
-        SIGNED(res) >= 0 ? SET_C(registers) : CLEAR_C(registers);
-        updateNegFlag(res, registers);
-        updateZeroFlag(res, registers);
-        registers->a = res;
 }
 
 uint8_t TRB(uint8_t operand, Registers *registers)
@@ -1408,38 +1611,18 @@ uint8_t TSB(uint8_t operand, Registers *registers)
         return operand;
 }
 
-uint8_t binToBCD(uint8_t value)
+void notImplemented(Memory *memory, uint8_t opcode)
 {
-        uint8_t result = 0, i = 1;
-
-        while (value != 0) {
-                result |= (value % 10) * i;
-                value /= 10;
-                i *= 16;
+        if (!memory->reported[opcode]) {
+                memory->reported[opcode] = 1;
+                printf("opcode %02x not yet implemented\n", opcode);
         }
-
-        return result;
 }
 
-uint8_t BCDToBin(uint8_t value)
+void illegalOpcode(Memory *memory, uint8_t opcode)
 {
-        uint8_t result = 0, i = 1;
-
-        while (value != 0) {
-                result |= (value % 2) * i;
-                value >>= 4;
-                i *= 10;
+        if (!memory->reported[opcode]) {
+                memory->reported[opcode] = 1;
+                printf("illegal opcode: %02x\n", opcode);
         }
-
-        return result;
-}
-
-void notImplemented(uint8_t opcode)
-{
-        printf("opcode %02x not yet implemented\n", opcode);
-}
-
-void illegalOpcode(uint8_t opcode)
-{
-        printf("illegal opcode: %02x\n", opcode);
 }
@@ -4,6 +4,14 @@
 #include <stdio.h>
 #include <stdint.h>
 
+/* Masks of each flag in the p register */
+#define FLAG_N 0b10000000
+#define FLAG_V 0b01000000
+#define FLAG_B 0b00010000
+#define FLAG_D 0b00001000
+#define FLAG_I 0b00000100
+#define FLAG_Z 0b00000010
+#define FLAG_C 0b00000001
 /* Macros to easily test for value of specific flag */
 #define N(registers) (registers->p & 0b10000000)
 #define V(registers) (registers->p & 0b01000000)
@@ -28,8 +36,12 @@
 #define CLEAR_I(registers) (registers->p &= 0b11111011)
 #define CLEAR_Z(registers) (registers->p &= 0b11111101)
 #define CLEAR_C(registers) (registers->p &= 0b11111110)
+/* Size of the 65C02 address space. */
+#define RAM_SIZE 0x10000
+/* Whether two addresses are in different pages, as a 0 or 1 penalty. */
+#define PAGE_CROSSED(a, b) (((a) ^ (b)) > 0xFF)
 /* Convert from unsigned to signed, used in relative adressing. */
-#define SIGNED(byte) ((int8_t) byte)
+#define SIGNED(byte) ((int8_t) (byte))
 
 typedef struct {
         /* Accumulator */
@@ -57,50 +69,437 @@ typedef struct {
          * C: carry
         */
         uint8_t p;
+        /* Cycles elapsed since reset */
+        uint64_t cycles;
+        /* Not a register: CPU_RUNNING, or halted by WAI or STP. */
+        uint8_t state;
 } Registers;
 
+enum {
+        CPU_RUNNING,
+        /* Halted by WAI until an interrupt comes, even a masked IRQ. */
+        CPU_WAITING,
+        /* Halted by STP until the next reset. */
+        CPU_STOPPED
+};
+
+typedef struct Memory Memory;
+/* Instruction tracer, see trace.h. */
+typedef struct Tracer Tracer;
+/* Rewind buffer, see rewind.h. */
+typedef struct Rewind Rewind;
+/* Input recorder, see record.h. */
+typedef struct Recorder Recorder;
+/* Breakpoints and watchpoints, see debug.h. */
+typedef struct Debugger Debugger;
+/* Edge coverage map, see coverage.h. */
+typedef struct Coverage Coverage;
+
+/*
+ * A memory mapped device, see mapDevice(). Its handlers get the full
+ * address of each access; a NULL read handler reads 0xFF, a NULL write
+ * handler ignores writes. A steady device promises that its reads have no
+ * side effects and that what they return only changes on writes or in
+ * events, which lets loops polling it be skipped until the next event.
+ */
+typedef struct {
+        uint8_t (*read)(void *context, uint16_t address);
+        void (*write)(void *context, uint16_t address, uint8_t value);
+        void *context;
+        uint8_t steady;
+} Device;
+
+/* What a 256 byte page of the address space is mapped to. */
+typedef enum {
+        PAGE_RAM,
+        /* Read from ram, writes are ignored. */
+        PAGE_ROM,
+        PAGE_DEVICE
+} PageType;
+
+/* Called at the cycle count an event was scheduled for. */
+typedef void (*EventHandler)(void *context, uint64_t cycle);
+
+typedef struct {
+        uint64_t cycle;
+        EventHandler handler;
+        void *context;
+} Event;
+
+/* Most events that can be pending at once. */
+#define MAX_EVENTS 64
+
+/*
+ * Timed events and interrupt inputs, see scheduleEvent() and raiseIrq().
+ * Between instructions, the engines only compare the cycle count with
+ * limit, which executeCycles() sets to the next event or the end of its
+ * budget, and which drops to 0 when an interrupt needs looking at.
+ */
+typedef struct {
+        /* Binary min-heap on the cycle of the events. */
+        Event events[MAX_EVENTS];
+        int count;
+        uint64_t limit;
+        /* Cycle count of the running CPU, NULL outside executeCycles(). */
+        const uint64_t *cycles;
+        /* Cycle count when executeCycles() last returned. */
+        uint64_t stopped;
+        /*
+         * Cycles spent outside instructions since initMemory(): taking
+         * interrupts, and waiting for them in WAI.
+         */
+        uint64_t interruptCycles;
+        /* IRQ sources holding the line, one bit each. */
+        uint32_t irq;
+        /* Set by an NMI edge until it is taken. */
+        uint8_t nmi;
+        /* Registers at the head of the last backward jump, packed. */
+        uint64_t idleHead;
+        /* Loop head that failed to replay since the last event. */
+        uint64_t idleRejected;
+        /* Set while replaying a loop to see whether it is idle. */
+        uint8_t idling;
+        /* Set when the replay read from a device that is not steady. */
+        uint8_t idleFailed;
+} Scheduler;
+
+#if defined(PROFILE)
+/*
+ * Execution profile, see profile.h: flat arrays of counters, indexed by
+ * opcode, address or page and bumped in place as the program runs. Reads
+ * and writes are data accesses, instruction fetches are not counted.
+ */
+typedef struct {
+        uint64_t opcodeCounts[256];
+        uint64_t opcodeCycles[256];
+        uint64_t pageReads[RAM_SIZE >> 8];
+        uint64_t pageWrites[RAM_SIZE >> 8];
+        uint64_t pcCounts[RAM_SIZE];
+        /* Opcode of the instruction running, and cycle count before it. */
+        uint8_t opcode;
+        uint64_t cycles;
+} Profile;
+#endif
+
+#if defined(ENGINE_PREDECODE)
+/* An instruction decoded once and cached by address, see cpu.c. */
+typedef struct {
+        void (*handler)(Registers *registers, Memory *memory,
+                        uint16_t operand);
+        uint16_t operand;
+        uint8_t length;
+        uint8_t cycles;
+} Decoded;
+#endif
+
+#if defined(ENGINE_JIT)
+/* Translation cache of the JIT engine, see jit.c. */
+typedef struct {
+        /* Executable buffer holding the translations, NULL without one. */
+        uint8_t *code;
+        /* Bytes of it in use, and the code leaving translated code. */
+        size_t used;
+        uint8_t *exit;
+        /* Translation of the block starting at each address, or NULL. */
+        void *blocks[RAM_SIZE];
+        /* Times each address was interpreted, to find hot blocks. */
+        uint8_t heat[RAM_SIZE];
+        /* Set when a write has invalidated translations. */
+        uint8_t invalidated;
+        /* Copy of nzFlags, addressable from translated code. */
+        uint8_t nzFlags[256];
+#if defined(JIT_VERIFY)
+        /* Memory to replay translated blocks on, allocated when needed. */
+        Memory *shadow;
+        /*
+         * Bytes read from devices by the translated code running, if
+         * logging, for the shadow to read them again instead of asking
+         * the devices a second time; in the shadow, the memory whose
+         * bytes it reads, and how many it has read.
+         */
+        uint8_t *deviceReads;
+        size_t deviceReadCount;
+        size_t deviceReadSize;
+        uint8_t loggingReads;
+        Memory *replayed;
+        size_t deviceReadsReplayed;
+#endif
+} Jit;
+#endif
+
+/*
+ * The 65C02 address space. Use initMemory() before anything else, and
+ * freeMemory() once done with it; it points into itself, so it cannot be
+ * copied around.
+ *
+ * Accesses go through a page table: readPages and writePages point to the
+ * pages of ram that can be accessed directly, and are NULL for the others
+ * (device pages, ROM pages for writes, and pages holding decoded code for
+ * writes too, so that they get invalidated), which take the slow path.
+ * Instruction fetches always read ram directly.
+ *
+ * While dirty pages are tracked, RAM pages not written to since the last
+ * clearDirtyPages() are missing from writePages too, so that the first
+ * write to each of them goes through writeSlow(), which notes it. Pages
+ * with read or write watches are missing from readPages or writePages.
+ */
+struct Memory {
+        uint8_t ram[RAM_SIZE];
+        uint8_t *readPages[RAM_SIZE >> 8];
+        uint8_t *writePages[RAM_SIZE >> 8];
+        uint8_t pageTypes[RAM_SIZE >> 8];
+        const Device *devices[RAM_SIZE >> 8];
+        Scheduler scheduler;
+#if defined(TRACE)
+        /* Where executed instructions are traced to, if not NULL. */
+        Tracer *tracer;
+#endif
+#if defined(PROFILE)
+        /* Where execution is profiled, if not NULL. */
+        Profile *profile;
+#endif
+#if defined(COVERAGE)
+        /* Where the edges taken are counted, if not NULL. */
+        Coverage *coverage;
+#endif
+        /* Where inputs are logged and replayed from, if not NULL. */
+        Rewind *rewind;
+        /* Where inputs are recorded to or replayed from, if not NULL. */
+        Recorder *recorder;
+        /* Whether each page was written to, if trackingDirty is set. */
+        uint8_t dirtyPages[RAM_SIZE >> 8];
+        uint8_t trackingDirty;
+        /* Breakpoints and watchpoints, if not NULL. */
+        Debugger *debugger;
+        /* Opcodes notImplemented() or illegalOpcode() reported already. */
+        uint8_t reported[256];
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+        /* Whether each page holds (part of) a decoded instruction. */
+        uint8_t codePages[RAM_SIZE >> 8];
+#endif
+#if defined(ENGINE_PREDECODE)
+        /* Instructions decoded so far, NULL handlers for the others. */
+        Decoded decoded[RAM_SIZE];
+#elif defined(ENGINE_JIT)
+        Jit jit;
+#endif
+};
+
+/* A whole 65C02 system, for callers running several of them. */
+typedef struct {
+        Registers registers;
+        Memory memory;
+} Machine;
+
+/*
+ * Copy of the state of a Machine, to boot a program once and then restart
+ * any number of machines from that point.
+ */
+typedef struct {
+        Registers registers;
+        uint8_t ram[RAM_SIZE];
+} Snapshot;
+
+/* Why executeCycles() returned. */
+typedef enum {
+        /* A BRK opcode was fetched; the PC still points to it. */
+        STOP_BRK,
+        /* The cycle budget was spent. */
+        STOP_BUDGET,
+        /* A STP opcode halted the CPU until the next reset. */
+        STOP_STP,
+        /* The PC reached a breakpoint; the PC still points to it. */
+        STOP_BREAKPOINT,
+        /* The last instruction accessed a watched address. */
+        STOP_WATCHPOINT,
+        /* A replay no longer matches its log, see replayDiverged(). */
+        STOP_DIVERGED
+} StopReason;
+
+/* Memory access */
+void initMemory(Memory *memory);
+void freeMemory(Memory *memory);
+/*
+ * Map pages first to last (inclusive) as RAM, ROM or to a device, which
+ * must outlive the mapping. The zero page and the stack page always stay
+ * RAM. Returns 0, or -EINVAL for an invalid range.
+ */
+int mapRam(Memory *memory, uint8_t first, uint8_t last);
+int mapRom(Memory *memory, uint8_t first, uint8_t last);
+int mapDevice(Memory *memory, uint8_t first, uint8_t last,
+              const Device *device);
+/* Out of line paths of readMemory() and writeMemory(). */
+uint8_t readSlow(Memory *memory, uint16_t address);
+void writeSlow(Memory *memory, uint16_t address, uint8_t value);
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+/*
+ * Record that code was decoded from a page, so that writes to it take the
+ * slow path, and forget it again.
+ */
+void markCode(Memory *memory, uint8_t page);
+void invalidateCode(Memory *memory, uint8_t page);
+#endif
+/*
+ * Start or stop tracking which pages get written to, with none written to
+ * so far, and forget those written to since.
+ */
+void trackDirtyPages(Memory *memory, int enable);
+void clearDirtyPages(Memory *memory);
+/* Update the page table entries of pages first to last (inclusive). */
+void remapPages(Memory *memory, uint8_t first, uint8_t last);
+
+/*
+ * Events and interrupts. Events run once the cycle count reaches their
+ * cycle, between instructions, and may schedule more; scheduleEvent()
+ * returns 0, or -ENOSPC with MAX_EVENTS already pending. cancelEvents()
+ * drops the pending events with the given handler and context.
+ */
+int scheduleEvent(Memory *memory, uint64_t cycle, EventHandler handler,
+                  void *context);
+void cancelEvents(Memory *memory, EventHandler handler, void *context);
+/* Cycle count as of the instruction running, for devices to schedule from. */
+uint64_t currentCycle(const Memory *memory);
+/*
+ * The IRQ line is held by any of the sources raised and not lowered since,
+ * and taken between instructions while the I flag is clear. An NMI is
+ * taken once per triggerNmi(), regardless of the I flag.
+ */
+void raiseIrq(Memory *memory, uint32_t sources);
+void lowerIrq(Memory *memory, uint32_t sources);
+void triggerNmi(Memory *memory);
+
+static inline uint8_t readMemory(Memory *memory, uint16_t address)
+{
+        const uint8_t *page = memory->readPages[address >> 8];
+
+#if defined(PROFILE)
+        if (memory->profile) {
+                memory->profile->pageReads[address >> 8]++;
+        }
+#endif
+        if (page) {
+                return page[address & 0xFF];
+        }
+
+        return readSlow(memory, address);
+}
+
+static inline void writeMemory(Memory *memory, uint16_t address,
+                               uint8_t value)
+{
+        uint8_t *page = memory->writePages[address >> 8];
+
+#if defined(PROFILE)
+        if (memory->profile) {
+                memory->profile->pageWrites[address >> 8]++;
+        }
+#endif
+        if (page) {
+                page[address & 0xFF] = value;
+        } else {
+                writeSlow(memory, address, value);
+        }
+}
+
+/*
+ * Snapshots, taking a few microseconds each way. Restoring keeps whatever
+ * the engine decoded from the pages that do not change, so restarting
+ * machines from the same snapshot stays fast.
+ */
+void saveSnapshot(const Machine *machine, Snapshot *snapshot);
+void restoreSnapshot(Machine *machine, const Snapshot *snapshot);
+
+/* Instruction lengths and base cycles, indexed by opcode. */
+extern const uint8_t lengths[256];
+extern const uint8_t baseCycles[256];
+
 /* Main loop functions */
-int execute(FILE *program, uint8_t *ram);
-void step(uint8_t opcode, FILE *program, uint8_t *ram, Registers *registers);
+/* Put the registers in their power on state, with the given pc. */
+void reset(Registers *registers, uint16_t pc);
+/* Run the program already loaded in memory, starting at pc. */
+int execute(Memory *memory, uint16_t pc);
+/*
+ * Run until at least budget more cycles have elapsed, until a BRK is
+ * fetched or until a STP halts the CPU, running events and taking
+ * interrupts on the way. The last
+ * instruction may overshoot the budget by a few cycles; since
+ * registers->cycles is absolute, successive calls do not drift.
+ */
+StopReason executeCycles(Registers *registers, Memory *memory,
+                         uint64_t budget);
+void step(uint8_t opcode, Memory *memory, Registers *registers);
+
+/*
+ * Adressing modes and memory access. The operand argument holds the raw
+ * operand bytes of the current instruction (little endian).
+ */
+/* Effective address functions */
+uint16_t addressAbsolute(Registers *registers, Memory *memory,
+                         uint16_t operand);
+uint16_t addressAbsoluteX(Registers *registers, Memory *memory,
+                          uint16_t operand);
+uint16_t addressAbsoluteY(Registers *registers, Memory *memory,
+                          uint16_t operand);
+uint16_t addressZeroPage(Registers *registers, Memory *memory,
+                         uint16_t operand);
+uint16_t addressZeroPageX(Registers *registers, Memory *memory,
+                          uint16_t operand);
+uint16_t addressZeroPageY(Registers *registers, Memory *memory,
+                          uint16_t operand);
+uint16_t addressIndirect(Registers *registers, Memory *memory,
+                         uint16_t operand);
+uint16_t addressIndirectX(Registers *registers, Memory *memory,
+                          uint16_t operand);
+uint16_t addressIndirectY(Registers *registers, Memory *memory,
+                          uint16_t operand);
 
-/* Adressing modes and memory access */
-/* Read from file stream at given offset. */
-size_t fpread(void *ptr, size_t size, size_t nmemb, size_t offset,
-              FILE *stream);
 /* Fetch functions */
-uint8_t fetchImmediate(FILE *program, Registers *registers);
-uint8_t fetchAbsolute(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchAbsoluteX(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchAbsoluteY(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchZeroPage(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchZeroPageX(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchZeroPageY(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchIndirect(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchIndirectX(FILE *program, Registers *registers, uint8_t *ram);
-uint8_t fetchIndirectY(FILE *program, Registers *registers, uint8_t *ram);
+uint8_t fetchAbsolute(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchAbsoluteX(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchAbsoluteY(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchZeroPage(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchZeroPageX(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchZeroPageY(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchIndirect(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchIndirectX(Registers *registers, Memory *memory, uint16_t operand);
+uint8_t fetchIndirectY(Registers *registers, Memory *memory, uint16_t operand);
 
 /* Store functions */
-void storeAbsolute(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value);
-void storeAbsoluteX(FILE *program, Registers *registers, uint8_t *ram,
+void storeAbsolute(Registers *registers, Memory *memory, uint16_t operand,
                    uint8_t value);
-void storeAbsoluteY(FILE *program, Registers *registers, uint8_t *ram,
+void storeAbsoluteX(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value);
+void storeAbsoluteY(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value);
+void storeZeroPage(Registers *registers, Memory *memory, uint16_t operand,
                    uint8_t value);
-void storeZeroPage(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value);
-void storeZeroPageX(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value);
-void storeZeroPageY(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value);
-void storeIndirect(FILE *program, Registers *registers, uint8_t *ram,
-                  uint8_t value);
-void storeIndirectX(FILE *program, Registers *registers, uint8_t *ram,
-                   uint8_t value);
-void storeIndirectY(FILE *program, Registers *registers, uint8_t *ram,
+void storeZeroPageX(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value);
+void storeZeroPageY(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value);
+void storeIndirect(Registers *registers, Memory *memory, uint16_t operand,
                    uint8_t value);
+void storeIndirectX(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value);
+void storeIndirectY(Registers *registers, Memory *memory, uint16_t operand,
+                    uint8_t value);
+
+/* Stack operations */
+void push(Registers *registers, Memory *memory, uint8_t value);
+uint8_t pull(Registers *registers, Memory *memory);
+/* Take a relative branch, with its extra cycles. */
+void branch(Registers *registers, Memory *memory, uint8_t offset);
+/*
+ * Whether the code at pc is part of a short loop made only of instructions
+ * that idle loop detection can replay, which the JIT leaves to the
+ * interpreter.
+ */
+int idleLoop(const Memory *memory, uint16_t pc);
 
 /* Flag manipulation functions */
-void updateNegFlag(uint8_t result, Registers *registers);
+extern const uint8_t nzFlags[256];
+/* Set N and Z from a result in one write of the p register. */
+void updateNZFlags(uint8_t result, Registers *registers);
 void updateZeroFlag(uint8_t result, Registers *registers);
 
 /* Opcode implementations and helpers */
@@ -122,9 +521,12 @@ uint8_t ROR(uint8_t operand, Registers *registers);
 void SBC(uint8_t operand, Registers *registers);
 uint8_t TRB(uint8_t operand, Registers *registers);
 uint8_t TSB(uint8_t operand, Registers *registers);
-void notImplemented(uint8_t opcode);
-void illegalOpcode(uint8_t opcode);
-uint8_t binToBCD(uint8_t value);
-uint8_t BCDToBin(uint8_t value);
+/*
+ * Report an opcode the emulator does not implement, or an illegal one,
+ * once per machine, so that programs and test vectors running them over
+ * and over do not flood the output.
+ */
+void notImplemented(Memory *memory, uint8_t opcode);
+void illegalOpcode(Memory *memory, uint8_t opcode);
 
 #endif  /* CPU_H */
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "cpu.h"
+#include "rewind.h"
+#include "debug.h"
+
+/* Names of the kinds of watches, indexed by their index. */
+static const char *const watchNames[] = {
+        [EXECUTE_INDEX] = "breakpoint",
+        [READ_INDEX] = "read watchpoint",
+        [WRITE_INDEX] = "write watchpoint"
+};
+
+int setWatches(Memory *memory, uint16_t first, uint16_t last, int types)
+{
+        Debugger *debugger = memory->debugger;
+        uint32_t address;
+        uint8_t mask;
+        int index, set;
+
+        if (!debugger) {
+                if (!types) {
+                        return 0;
+                }
+                if (!(debugger = calloc(1, sizeof(*debugger)))) {
+                        return -ENOMEM;
+                }
+                memory->debugger = debugger;
+        }
+
+        for (address = first; address <= last; address++) {
+                mask = 1 << (address & 7);
+                for (index = EXECUTE_INDEX; index <= WRITE_INDEX; index++) {
+                        set = types & 1 << index;
+                        if (!set == !(debugger->bits[index][address >> 3] &
+                                      mask)) {
+                                continue;
+                        }
+                        debugger->bits[index][address >> 3] ^= mask;
+                        debugger->counts[index][address >> 8] +=
+                                set ? 1 : -1;
+                        debugger->totals[index] += set ? 1 : -1;
+                }
+        }
+        remapPages(memory, first >> 8, last >> 8);
+
+        return 0;
+}
+
+void detachDebugger(Memory *memory)
+{
+        free(memory->debugger);
+        memory->debugger = NULL;
+        remapPages(memory, 0x00, 0xFF);
+}
+
+/* Whether a rewind buffer is replaying, which hits leave alone. */
+static int replaying(const Memory *memory)
+{
+        return memory->rewind && replayingInputs(memory->rewind);
+}
+
+void checkWatch(Memory *memory, int index, uint16_t address, uint8_t value)
+{
+        Debugger *debugger = memory->debugger;
+        Scheduler *scheduler = &memory->scheduler;
+
+        if (!watched(debugger, index, address) || !scheduler->cycles ||
+            replaying(memory)) {
+                return;
+        }
+        /* An idle loop replay must not count, nor skip past the access. */
+        if (scheduler->idling) {
+                scheduler->idleFailed = 1;
+                return;
+        }
+        if (debugger->pending) {
+                return;
+        }
+
+        debugger->pending = 1;
+        debugger->hit.type = 1 << index;
+        debugger->hit.address = address;
+        debugger->hit.value = value;
+        scheduler->limit = 0;
+}
+
+int checkBreakpoint(Memory *memory, const Registers *registers)
+{
+        Debugger *debugger = memory->debugger;
+
+        Hit *hit = &debugger->hit;
+
+        if (!watched(debugger, EXECUTE_INDEX, registers->pc) ||
+            replaying(memory)) {
+                return 0;
+        }
+        /* Running again from the breakpoint it stopped at. */
+        if (hit->type == WATCH_EXECUTE && hit->address == registers->pc &&
+            hit->registers.cycles == registers->cycles) {
+                return 0;
+        }
+
+        hit->type = WATCH_EXECUTE;
+        hit->address = registers->pc;
+        hit->value = 0;
+
+        return 1;
+}
+
+int printHit(const Hit *hit, FILE *out)
+{
+        const Registers *registers = &hit->registers;
+
+        if (hit->type == WATCH_EXECUTE) {
+                fprintf(out, "breakpoint at %04X\n", hit->address);
+        } else {
+                fprintf(out, "%s at %04X: %s %02X\n",
+                        watchNames[hit->type == WATCH_READ ? READ_INDEX :
+                                   WRITE_INDEX], hit->address,
+                        hit->type == WATCH_READ ? "read" : "wrote",
+                        hit->value);
+        }
+        fprintf(out, "a=%02X x=%02X y=%02X sp=%02X p=%02X pc=%04X "
+                "cycles=%llu\n", registers->a, registers->x, registers->y,
+                registers->sp, registers->p, registers->pc,
+                (unsigned long long) registers->cycles);
+
+        return ferror(out) ? -EIO : 0;
+}
@@ -0,0 +1,90 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Breakpoints and watchpoints. Each kind is a bitmap of the address
+ * space, with a count of the bits set in each page: runs only look at the
+ * bitmaps on pages where the count is not 0, and cost nothing elsewhere.
+ *
+ * Pages with read or write watches are missing from readPages or
+ * writePages, so that their accesses take readSlow() or writeSlow(), which
+ * check the bitmap. While breakpoints are set, executeCycles() runs the
+ * instructions with step() one at a time, checking the bitmap before those
+ * on pages with breakpoints; the JIT only interprets while reads or writes
+ * are watched, as its translations read the zero page and the stack
+ * directly.
+ *
+ * A breakpoint stops the run with STOP_BREAKPOINT before the instruction
+ * at its address, and is passed over when running again from there. A
+ * watchpoint stops it with STOP_WATCHPOINT after the instruction that read
+ * or wrote its address, or after the interrupt or event that did. Accesses
+ * from outside executeCycles() and replays of a rewind buffer do not count.
+ */
+
+/* Kinds of watches, to be or'ed together. */
+enum {
+        WATCH_EXECUTE = 1,
+        WATCH_READ = 2,
+        WATCH_WRITE = 4
+};
+
+/* Index of each kind of watch in the arrays of Debugger. */
+enum {
+        EXECUTE_INDEX,
+        READ_INDEX,
+        WRITE_INDEX
+};
+
+/* What stopped the last run. */
+typedef struct {
+        /* WATCH_EXECUTE, WATCH_READ or WATCH_WRITE, 0 if nothing yet. */
+        uint8_t type;
+        uint16_t address;
+        /* Byte read or written, 0 for breakpoints. */
+        uint8_t value;
+        /* Registers once the run stopped, set by executeCycles(). */
+        Registers registers;
+} Hit;
+
+struct Debugger {
+        uint8_t bits[3][RAM_SIZE / 8];
+        uint16_t counts[3][RAM_SIZE >> 8];
+        /* Bits set in all. */
+        uint32_t totals[3];
+        /* Set by a watch hit until the run stops on it. */
+        uint8_t pending;
+        Hit hit;
+};
+
+/*
+ * Set the watches of addresses first to last (inclusive) to types, 0 for
+ * none, attaching a debugger to the memory if it has none yet. Returns 0,
+ * or -ENOMEM.
+ */
+int setWatches(Memory *memory, uint16_t first, uint16_t last, int types);
+/* Drop all the watches and the last hit, and the debugger with them. */
+void detachDebugger(Memory *memory);
+
+static inline int watched(const Debugger *debugger, int index,
+                          uint16_t address)
+{
+        return debugger->counts[index][address >> 8] &&
+                debugger->bits[index][address >> 3] & 1 << (address & 7);
+}
+
+/*
+ * Hooks for cpu.c: note an access to a watched page, which stops the run
+ * once the instruction is over if the address is watched, and whether a
+ * breakpoint stops the run before the instruction at the program counter.
+ */
+void checkWatch(Memory *memory, int index, uint16_t address, uint8_t value);
+int checkBreakpoint(Memory *memory, const Registers *registers);
+
+/* Print what a hit was and the registers, returns 0 or -EIO. */
+int printHit(const Hit *hit, FILE *out);
+
+#endif  /* DEBUG_H */
@@ -0,0 +1,291 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fuzz.h"
+
+#if defined(COVERAGE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "coverage.h"
+#include "debug.h"
+
+/* File descriptors afl-fuzz talks to its fork server through. */
+#define CONTROL_FD 198
+#define STATUS_FD 199
+/* Test cases a child runs before exiting, as with __AFL_LOOP(10000). */
+#define PERSISTENT_RUNS 10000
+
+/* Found in the binary by afl-fuzz, which then expects persistent mode. */
+__attribute__((used))
+static const char persistentSignature[] = "##SIG_AFL_PERSISTENT##";
+
+/* How the stop reasons are printed, indexed by StopReason. */
+static const char *const stopNames[] = {
+        [STOP_BRK] = "brk",
+        [STOP_BUDGET] = "budget",
+        [STOP_STP] = "stp",
+        [STOP_BREAKPOINT] = "breakpoint",
+        [STOP_WATCHPOINT] = "watchpoint",
+        [STOP_DIVERGED] = "diverged"
+};
+
+typedef struct {
+        Machine *machine;
+        uint16_t input;
+        uint64_t budget;
+        /* What every test case starts from. */
+        Snapshot boot;
+        Scheduler scheduler;
+        /* The test case being run. */
+        uint8_t data[RAM_SIZE];
+        size_t size;
+} Fuzzer;
+
+/* Read the test case from stdin, from its start if it is a file. */
+static int readTestCase(Fuzzer *fuzzer)
+{
+        ssize_t done;
+
+        lseek(STDIN_FILENO, 0, SEEK_SET);
+        fuzzer->size = 0;
+        while (fuzzer->size < sizeof(fuzzer->data)) {
+                done = read(STDIN_FILENO, &fuzzer->data[fuzzer->size],
+                            sizeof(fuzzer->data) - fuzzer->size);
+                if (done < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (done < 0) {
+                        return -errno;
+                }
+                if (!done) {
+                        break;
+                }
+                fuzzer->size += done;
+        }
+
+        return 0;
+}
+
+/* Forget what the engine decoded from a page that is being overwritten. */
+static void overwrite(Memory *memory, int page)
+{
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+        if (memory->codePages[page]) {
+                invalidateCode(memory, page);
+        }
+#endif
+}
+
+/*
+ * Copy back the pages written to since the boot snapshot, copy the test
+ * case in and set the registers up for it.
+ */
+static void restart(Fuzzer *fuzzer)
+{
+        Registers *registers = &fuzzer->machine->registers;
+        Memory *memory = &fuzzer->machine->memory;
+        size_t size = fuzzer->size;
+        int page, first, last;
+
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                if (memory->dirtyPages[page]) {
+                        overwrite(memory, page);
+                        memcpy(&memory->ram[page << 8],
+                               &fuzzer->boot.ram[page << 8], 0x100);
+                }
+        }
+        clearDirtyPages(memory);
+
+        /* The length has to fit in A and X. */
+        if (size > RAM_SIZE - fuzzer->input) {
+                size = RAM_SIZE - fuzzer->input;
+        }
+        if (size > 0xFFFF) {
+                size = 0xFFFF;
+        }
+        if (size) {
+                first = fuzzer->input >> 8;
+                last = (fuzzer->input + size - 1) >> 8;
+                for (page = first; page <= last; page++) {
+                        overwrite(memory, page);
+                        memory->dirtyPages[page] = 1;
+                }
+                memcpy(&memory->ram[fuzzer->input], fuzzer->data, size);
+                remapPages(memory, first, last);
+        }
+
+        *registers = fuzzer->boot.registers;
+        registers->a = size & 0xFF;
+        registers->x = size >> 8;
+        memory->scheduler = fuzzer->scheduler;
+        resetCoverage(memory->coverage);
+}
+
+/* Run the test case read, returns whether it crashed. */
+static int runTestCase(Fuzzer *fuzzer, StopReason *reason)
+{
+        Machine *machine = fuzzer->machine;
+
+        restart(fuzzer);
+        *reason = executeCycles(&machine->registers, &machine->memory,
+                                fuzzer->budget);
+
+        return *reason == STOP_STP || *reason == STOP_BREAKPOINT ||
+                *reason == STOP_WATCHPOINT;
+}
+
+/* A forked child: run test cases, stopping after each for the next one. */
+static void runChild(Fuzzer *fuzzer)
+{
+        StopReason reason;
+        int runs;
+
+        close(CONTROL_FD);
+        close(STATUS_FD);
+        for (runs = 0; runs < PERSISTENT_RUNS; runs++) {
+                if (readTestCase(fuzzer) < 0) {
+                        _exit(1);
+                }
+                if (runTestCase(fuzzer, &reason)) {
+                        abort();
+                }
+                raise(SIGSTOP);
+        }
+        _exit(0);
+}
+
+/*
+ * The fork server: a child is forked for the first test case and after
+ * each one that exited or was killed, and woken up for the others. Returns
+ * 1 when not run by afl-fuzz, else 0 once it is done.
+ */
+static int serve(Fuzzer *fuzzer)
+{
+        uint32_t message = 0;
+        pid_t child = -1;
+        int status;
+
+        /* Hello, without options. */
+        if (write(STATUS_FD, &message, 4) != 4) {
+                return 1;
+        }
+
+        while (read(CONTROL_FD, &message, 4) == 4) {
+                /* afl-fuzz killed the stopped child on a time out. */
+                if (message && child > 0) {
+                        waitpid(child, &status, 0);
+                        child = -1;
+                }
+                if (child < 0) {
+                        fflush(NULL);
+                        if ((child = fork()) < 0) {
+                                return -errno;
+                        }
+                        if (!child) {
+                                runChild(fuzzer);
+                        }
+                } else {
+                        kill(child, SIGCONT);
+                }
+
+                message = child;
+                if (write(STATUS_FD, &message, 4) != 4) {
+                        return -EIO;
+                }
+                if (waitpid(child, &status, WUNTRACED) < 0) {
+                        return -errno;
+                }
+                if (!WIFSTOPPED(status)) {
+                        child = -1;
+                }
+                message = status;
+                if (write(STATUS_FD, &message, 4) != 4) {
+                        return -EIO;
+                }
+        }
+
+        return 0;
+}
+
+/* Run the test case once and print how it went, aborting if it crashed. */
+static int runOnce(Fuzzer *fuzzer)
+{
+        Machine *machine = fuzzer->machine;
+        const Registers *registers = &machine->registers;
+        const Coverage *coverage = machine->memory.coverage;
+        StopReason reason;
+        uint32_t index, edges = 0;
+        int crashed, error;
+
+        if ((error = readTestCase(fuzzer)) < 0) {
+                return error;
+        }
+        crashed = runTestCase(fuzzer, &reason);
+
+        for (index = 0; index <= coverage->mask; index++) {
+                edges += coverage->map[index] != 0;
+        }
+        printf("%zu bytes in, stopped on %s after %llu cycles, %u edges\n",
+               fuzzer->size, stopNames[reason],
+               (unsigned long long) (registers->cycles -
+                                     fuzzer->boot.registers.cycles), edges);
+        if (reason == STOP_BREAKPOINT || reason == STOP_WATCHPOINT) {
+                printHit(&machine->memory.debugger->hit, stdout);
+        } else {
+                printf("a=%02X x=%02X y=%02X sp=%02X p=%02X pc=%04X\n",
+                       registers->a, registers->x, registers->y,
+                       registers->sp, registers->p, registers->pc);
+        }
+        if (crashed) {
+                fflush(stdout);
+                abort();
+        }
+
+        return 0;
+}
+
+int runFuzz(Machine *machine, uint16_t input, uint64_t budget)
+{
+        Memory *memory = &machine->memory;
+        Coverage coverage;
+        Fuzzer *fuzzer;
+        int error;
+
+        if (memory->rewind || memory->recorder || memory->coverage) {
+                return -EBUSY;
+        }
+        if (!(fuzzer = malloc(sizeof(*fuzzer)))) {
+                return -ENOMEM;
+        }
+        if ((error = startCoverage(&coverage)) < 0) {
+                free(fuzzer);
+                return error;
+        }
+
+        fuzzer->machine = machine;
+        fuzzer->input = input;
+        fuzzer->budget = budget;
+        saveSnapshot(machine, &fuzzer->boot);
+        fuzzer->scheduler = memory->scheduler;
+        memory->coverage = &coverage;
+        trackDirtyPages(memory, 1);
+
+        if ((error = serve(fuzzer)) == 1) {
+                error = runOnce(fuzzer);
+        }
+
+        trackDirtyPages(memory, 0);
+        memory->coverage = NULL;
+        stopCoverage(&coverage);
+        free(fuzzer);
+
+        return error;
+}
+
+#endif
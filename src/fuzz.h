@@ -0,0 +1,32 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+#if defined(COVERAGE)
+/*
+ * Persistent mode harness for AFL++, compiled in with COVERAGE.
+ *
+ * The machine, with its program loaded and its watches set, is the state
+ * every test case starts from. Each test case is read from stdin, copied
+ * into RAM at input (as much of it as fits), its length put in A (low
+ * byte) and X (high byte), and run for budget cycles while its edges are
+ * covered into the AFL++ map. Reaching a breakpoint or a watchpoint, or a
+ * STP, is a crash: the process aborts, for AFL++ to keep the test case.
+ *
+ * Under afl-fuzz, which passes its fork server file descriptors, this
+ * acts as the fork server: each child forked from it runs test case after
+ * test case, stopping itself between them, and only a few thousand of
+ * them get forked per million test cases. Between test cases, only the
+ * pages written to are copied back from a snapshot of the RAM, the
+ * registers and the scheduler; devices are left as they are.
+ *
+ * Without afl-fuzz, the test case is run once and the outcome printed to
+ * stdout, to reproduce crashes. Returns 0, -EBUSY if the machine records
+ * for rewinding or to a log, or another negative errno value.
+ */
+int runFuzz(Machine *machine, uint16_t input, uint64_t budget);
+#endif
+
+#endif  /* FUZZ_H */
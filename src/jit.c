@@ -0,0 +1,1291 @@
+#include "jit.h"
+
+#if defined(ENGINE_JIT)
+
+#if !defined(__x86_64__)
+#error "ENGINE=JIT needs an x86-64 host"
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Size of the executable buffer holding every translation. */
+#define CODE_SIZE (4 << 20)
+/* Room left in the buffer before translating a block, for the worst case. */
+#define MAX_BLOCK_SIZE 0x4000
+/* Instructions per block at most. */
+#define MAX_BLOCK_LENGTH 32
+/* Interpretations of an address after which its block is translated. */
+#define HOT 16
+
+/* x86-64 general purpose registers, in their encoding order. */
+enum {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+        NO_INDEX = -1
+};
+
+/*
+ * Registers of translated code. They are all callee saved, so the guest
+ * registers survive calls back into the emulator. RCX, RDX and RAX are
+ * scratch registers, addresses being computed into EDX and values into
+ * EAX.
+ */
+#define REG_A R13
+#define REG_X R14
+#define REG_Y R15
+#define REG_P RBP
+#define REG_REGISTERS RBX
+#define REG_MEMORY R12
+
+/* ALU operations, as their /digit in the immediate forms. */
+enum {
+        ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6,
+        ALU_CMP = 7
+};
+/* Shifts, as their /digit. */
+enum { SHIFT_LEFT = 4, SHIFT_RIGHT = 5 };
+/* Condition codes of jcc and setcc. */
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7 };
+
+/* Displacements of the fields reached through REG_REGISTERS/REG_MEMORY. */
+#define REGISTER(field) ((int32_t) offsetof(Registers, field))
+#define MEMORY(field) ((int32_t) offsetof(Memory, field))
+#define JIT(field) MEMORY(jit.field)
+#define LIMIT MEMORY(scheduler.limit)
+
+/* What the translator does with each opcode. */
+enum {
+        /* Call step(), for rare opcodes. */
+        I_STEP,
+        I_LDA, I_LDX, I_LDY, I_STA, I_STX, I_STY, I_STZ,
+        I_ADC, I_SBC, I_AND, I_ORA, I_EOR, I_CMP, I_CPX, I_CPY, I_BIT,
+        I_INC, I_DEC, I_INA, I_DEA, I_INX, I_INY, I_DEX, I_DEY,
+        I_TAX, I_TAY, I_TXA, I_TYA, I_TSX, I_TXS,
+        I_ASL, I_LSR, I_ROL, I_ROR,
+        I_PHA, I_PHX, I_PHY, I_PHP, I_PLA, I_PLX, I_PLY,
+        I_CLEAR, I_SET, I_NOP,
+        I_BRANCH, I_BRA, I_JMP, I_JSR, I_RTS,
+        /* Call step(), then leave the block: the opcode jumps. */
+        I_STEP_JUMP
+};
+
+/* Addressing modes. */
+enum { IMP, IMM, ZP, ZPX, ZPY, ABS, ABSX, ABSY, INDX, INDY, IND };
+
+typedef struct {
+        uint8_t instruction;
+        uint8_t mode;
+} Translation;
+
+/* Opcodes missing here are left to step(). */
+static const Translation translations[256] = {
+        [0x01] = { I_ORA, INDX }, [0x05] = { I_ORA, ZP },
+        [0x08] = { I_PHP, IMP }, [0x09] = { I_ORA, IMM },
+        [0x0A] = { I_ASL, IMP }, [0x0D] = { I_ORA, ABS },
+        [0x10] = { I_BRANCH, IMP }, [0x11] = { I_ORA, INDY },
+        [0x12] = { I_ORA, IND }, [0x15] = { I_ORA, ZPX },
+        [0x18] = { I_CLEAR, FLAG_C }, [0x19] = { I_ORA, ABSY },
+        [0x1A] = { I_INA, IMP }, [0x1D] = { I_ORA, ABSX },
+        [0x20] = { I_JSR, ABS }, [0x21] = { I_AND, INDX },
+        [0x24] = { I_BIT, ZP }, [0x25] = { I_AND, ZP },
+        [0x28] = { I_STEP_JUMP, IMP }, [0x29] = { I_AND, IMM },
+        [0x2A] = { I_ROL, IMP }, [0x2C] = { I_BIT, ABS },
+        [0x2D] = { I_AND, ABS }, [0x30] = { I_BRANCH, IMP },
+        [0x31] = { I_AND, INDY }, [0x32] = { I_AND, IND },
+        [0x34] = { I_BIT, ZPX }, [0x35] = { I_AND, ZPX },
+        [0x38] = { I_SET, FLAG_C }, [0x39] = { I_AND, ABSY },
+        [0x3A] = { I_DEA, IMP }, [0x3C] = { I_BIT, ABSX },
+        [0x3D] = { I_AND, ABSX }, [0x40] = { I_STEP_JUMP, IMP },
+        [0x41] = { I_EOR, INDX }, [0x45] = { I_EOR, ZP },
+        [0x48] = { I_PHA, IMP }, [0x49] = { I_EOR, IMM },
+        [0x4A] = { I_LSR, IMP }, [0x4C] = { I_JMP, ABS },
+        [0x4D] = { I_EOR, ABS }, [0x50] = { I_BRANCH, IMP },
+        [0x51] = { I_EOR, INDY }, [0x52] = { I_EOR, IND },
+        [0x55] = { I_EOR, ZPX }, [0x58] = { I_STEP_JUMP, IMP },
+        [0x59] = { I_EOR, ABSY }, [0x5A] = { I_PHY, IMP },
+        [0x5D] = { I_EOR, ABSX }, [0x60] = { I_RTS, IMP },
+        [0x61] = { I_ADC, INDX }, [0x64] = { I_STZ, ZP },
+        [0x65] = { I_ADC, ZP }, [0x68] = { I_PLA, IMP },
+        [0x69] = { I_ADC, IMM }, [0x6A] = { I_ROR, IMP },
+        [0x6C] = { I_STEP_JUMP, IMP }, [0x6D] = { I_ADC, ABS },
+        [0x70] = { I_BRANCH, IMP }, [0x71] = { I_ADC, INDY },
+        [0x72] = { I_ADC, IND }, [0x74] = { I_STZ, ZPX },
+        [0x75] = { I_ADC, ZPX }, [0x78] = { I_SET, FLAG_I },
+        [0x79] = { I_ADC, ABSY }, [0x7A] = { I_PLY, IMP },
+        [0x7C] = { I_STEP_JUMP, IMP }, [0x7D] = { I_ADC, ABSX },
+        [0x80] = { I_BRA, IMP }, [0x81] = { I_STA, INDX },
+        [0x84] = { I_STY, ZP }, [0x85] = { I_STA, ZP },
+        [0x86] = { I_STX, ZP }, [0x88] = { I_DEY, IMP },
+        [0x89] = { I_BIT, IMM }, [0x8A] = { I_TXA, IMP },
+        [0x8C] = { I_STY, ABS }, [0x8D] = { I_STA, ABS },
+        [0x8E] = { I_STX, ABS }, [0x90] = { I_BRANCH, IMP },
+        [0x91] = { I_STA, INDY }, [0x92] = { I_STA, IND },
+        [0x94] = { I_STY, ZPX }, [0x95] = { I_STA, ZPX },
+        [0x96] = { I_STX, ZPY }, [0x98] = { I_TYA, IMP },
+        [0x99] = { I_STA, ABSY }, [0x9A] = { I_TXS, IMP },
+        [0x9C] = { I_STZ, ABS }, [0x9D] = { I_STA, ABSX },
+        [0x9E] = { I_STZ, ABSX }, [0xA0] = { I_LDY, IMM },
+        [0xA1] = { I_LDA, INDX }, [0xA2] = { I_LDX, IMM },
+        [0xA4] = { I_LDY, ZP }, [0xA5] = { I_LDA, ZP },
+        [0xA6] = { I_LDX, ZP }, [0xA8] = { I_TAY, IMP },
+        [0xA9] = { I_LDA, IMM }, [0xAA] = { I_TAX, IMP },
+        [0xAC] = { I_LDY, ABS }, [0xAD] = { I_LDA, ABS },
+        [0xAE] = { I_LDX, ABS }, [0xB0] = { I_BRANCH, IMP },
+        [0xB1] = { I_LDA, INDY }, [0xB2] = { I_LDA, IND },
+        [0xB4] = { I_LDY, ZPX }, [0xB5] = { I_LDA, ZPX },
+        [0xB6] = { I_LDX, ZPY }, [0xB8] = { I_CLEAR, FLAG_V },
+        [0xB9] = { I_LDA, ABSY }, [0xBA] = { I_TSX, IMP },
+        [0xBC] = { I_LDY, ABSX }, [0xBD] = { I_LDA, ABSX },
+        [0xBE] = { I_LDX, ABSY }, [0xC0] = { I_CPY, IMM },
+        [0xC1] = { I_CMP, INDX }, [0xC4] = { I_CPY, ZP },
+        [0xC5] = { I_CMP, ZP }, [0xC6] = { I_DEC, ZP },
+        [0xC8] = { I_INY, IMP }, [0xC9] = { I_CMP, IMM },
+        [0xCA] = { I_DEX, IMP }, [0xCC] = { I_CPY, ABS },
+        [0xCD] = { I_CMP, ABS }, [0xCE] = { I_DEC, ABS },
+        [0xD0] = { I_BRANCH, IMP }, [0xD1] = { I_CMP, INDY },
+        [0xD2] = { I_CMP, IND }, [0xD5] = { I_CMP, ZPX },
+        [0xD6] = { I_DEC, ZPX }, [0xD8] = { I_CLEAR, FLAG_D },
+        [0xD9] = { I_CMP, ABSY }, [0xDA] = { I_PHX, IMP },
+        [0xDD] = { I_CMP, ABSX }, [0xDE] = { I_DEC, ABSX },
+        [0xE0] = { I_CPX, IMM }, [0xE1] = { I_SBC, INDX },
+        [0xE4] = { I_CPX, ZP }, [0xE5] = { I_SBC, ZP },
+        [0xE6] = { I_INC, ZP }, [0xE8] = { I_INX, IMP },
+        [0xE9] = { I_SBC, IMM }, [0xEA] = { I_NOP, IMP },
+        [0xEC] = { I_CPX, ABS }, [0xED] = { I_SBC, ABS },
+        [0xEE] = { I_INC, ABS }, [0xF0] = { I_BRANCH, IMP },
+        [0xF1] = { I_SBC, INDY }, [0xF2] = { I_SBC, IND },
+        [0xF5] = { I_SBC, ZPX }, [0xF6] = { I_INC, ZPX },
+        [0xF8] = { I_SET, FLAG_D }, [0xF9] = { I_SBC, ABSY },
+        [0xFA] = { I_PLX, IMP }, [0xFD] = { I_SBC, ABSX },
+        [0xFE] = { I_INC, ABSX },
+};
+
+typedef void (*Entry)(Registers *registers, Memory *memory, void *block);
+
+typedef struct {
+        /* Where the next byte of code goes. */
+        uint8_t *code;
+        /* Code returning from translated code to runJit(). */
+        uint8_t *exit;
+        /* Base cycles of the instructions not yet added to the count. */
+        uint32_t pending;
+} Emitter;
+
+/*
+ * Instruction encoding. Only the forms used below are supported; memory
+ * operands are always encoded with a SIB byte and a 32 bit displacement,
+ * which works for every base register.
+ */
+
+static void emit8(Emitter *e, uint8_t byte)
+{
+        *e->code++ = byte;
+}
+
+static void emit16(Emitter *e, uint16_t value)
+{
+        memcpy(e->code, &value, sizeof(value));
+        e->code += sizeof(value);
+}
+
+static void emit32(Emitter *e, uint32_t value)
+{
+        memcpy(e->code, &value, sizeof(value));
+        e->code += sizeof(value);
+}
+
+static void emit64(Emitter *e, uint64_t value)
+{
+        memcpy(e->code, &value, sizeof(value));
+        e->code += sizeof(value);
+}
+
+/*
+ * REX prefix for 64 bit operands or registers above RDI. It is also forced
+ * for byte operands, where it selects SPL to DIL instead of AH to BH.
+ */
+static void rex(Emitter *e, int wide, int reg, int index, int base,
+                int byteOperand)
+{
+        uint8_t prefix = 0x40 | wide << 3 | (reg & 8) >> 1 |
+                (index & 8) >> 2 | (base & 8) >> 3;
+
+        if (prefix != 0x40 || byteOperand) {
+                emit8(e, prefix);
+        }
+}
+
+/* One byte opcode, or a two byte one as 0x0Fxx. */
+static void opcode(Emitter *e, int op)
+{
+        if (op > 0xFF) {
+                emit8(e, op >> 8);
+        }
+        emit8(e, op);
+}
+
+/* op reg, rm with two register operands. */
+static void emitRR(Emitter *e, int wide, int op, int reg, int rm,
+                   int byteOperand)
+{
+        rex(e, wide, reg, 0, rm, byteOperand);
+        opcode(e, op);
+        emit8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op reg, [base + index * 2^scale + disp], reg being a /digit for some. */
+static void emitRM(Emitter *e, int wide, int op, int reg, int base,
+                   int index, int scale, int32_t disp, int byteOperand)
+{
+        rex(e, wide, reg, index == NO_INDEX ? 0 : index, base, byteOperand);
+        opcode(e, op);
+        emit8(e, 0x80 | (reg & 7) << 3 | 4);
+        emit8(e, scale << 6 | (index == NO_INDEX ? 4 : index & 7) << 3 |
+              (base & 7));
+        emit32(e, disp);
+}
+
+/* op rm, imm32 with a /digit opcode. */
+static void emitRI(Emitter *e, int wide, int op, int digit, int rm,
+                   uint32_t imm)
+{
+        rex(e, wide, 0, 0, rm, 0);
+        emit8(e, op);
+        emit8(e, 0xC0 | digit << 3 | (rm & 7));
+        emit32(e, imm);
+}
+
+static void mov(Emitter *e, int dst, int src)
+{
+        emitRR(e, 0, 0x89, src, dst, 0);
+}
+
+static void mov64(Emitter *e, int dst, int src)
+{
+        emitRR(e, 1, 0x89, src, dst, 0);
+}
+
+static void movImm(Emitter *e, int dst, uint32_t imm)
+{
+        rex(e, 0, 0, 0, dst, 0);
+        emit8(e, 0xB8 + (dst & 7));
+        emit32(e, imm);
+}
+
+static void alu(Emitter *e, int op, int dst, int src)
+{
+        emitRR(e, 0, op << 3 | 1, src, dst, 0);
+}
+
+static void aluImm(Emitter *e, int op, int dst, uint32_t imm)
+{
+        emitRI(e, 0, 0x81, op, dst, imm);
+}
+
+static void shift(Emitter *e, int op, int reg, uint8_t count)
+{
+        rex(e, 0, 0, 0, reg, 0);
+        emit8(e, 0xC1);
+        emit8(e, 0xC0 | op << 3 | (reg & 7));
+        emit8(e, count);
+}
+
+static void testImm(Emitter *e, int reg, uint32_t imm)
+{
+        emitRI(e, 0, 0xF7, 0, reg, imm);
+}
+
+/* Zero extend the low byte or word of src into dst. */
+static void movzx8(Emitter *e, int dst, int src)
+{
+        emitRR(e, 0, 0x0FB6, dst, src, 1);
+}
+
+static void movzx16(Emitter *e, int dst, int src)
+{
+        emitRR(e, 0, 0x0FB7, dst, src, 0);
+}
+
+/* dst = byte at [base + index + disp], zero extended. */
+static void load8(Emitter *e, int dst, int base, int index, int32_t disp)
+{
+        emitRM(e, 0, 0x0FB6, dst, base, index, 0, disp, 0);
+}
+
+static void store8(Emitter *e, int base, int32_t disp, int src)
+{
+        emitRM(e, 0, 0x88, src, base, NO_INDEX, 0, disp, 1);
+}
+
+/* dst = base + index + disp, truncated to 32 bits. */
+static void lea(Emitter *e, int dst, int base, int index, int32_t disp)
+{
+        emitRM(e, 0, 0x8D, dst, base, index, 0, disp, 0);
+}
+
+static void setcc(Emitter *e, int condition, int reg)
+{
+        rex(e, 0, 0, 0, reg, 1);
+        emit8(e, 0x0F);
+        emit8(e, 0x90 + condition);
+        emit8(e, 0xC0 | (reg & 7));
+}
+
+static void jccTo(Emitter *e, int condition, uint8_t *target)
+{
+        emit8(e, 0x0F);
+        emit8(e, 0x80 + condition);
+        emit32(e, target - (e->code + 4));
+}
+
+static void jmpTo(Emitter *e, uint8_t *target)
+{
+        emit8(e, 0xE9);
+        emit32(e, target - (e->code + 4));
+}
+
+/* Forward jumps return their displacement, for patch() to fill in. */
+static uint8_t *jcc(Emitter *e, int condition)
+{
+        emit8(e, 0x0F);
+        emit8(e, 0x80 + condition);
+        e->code += 4;
+
+        return e->code - 4;
+}
+
+static uint8_t *jmp(Emitter *e)
+{
+        emit8(e, 0xE9);
+        e->code += 4;
+
+        return e->code - 4;
+}
+
+static void patch(Emitter *e, uint8_t *displacement)
+{
+        uint32_t value = e->code - (displacement + 4);
+
+        memcpy(displacement, &value, sizeof(value));
+}
+
+static void call(Emitter *e, void *function)
+{
+        /* mov rax, function; call rax */
+        emit8(e, 0x48);
+        emit8(e, 0xB8);
+        emit64(e, (uint64_t) (uintptr_t) function);
+        emit8(e, 0xFF);
+        emit8(e, 0xD0);
+}
+
+/*
+ * Guest state helpers.
+ */
+
+static void addCycles(Emitter *e, uint32_t cycles)
+{
+        if (cycles) {
+                /* add qword [registers->cycles], cycles */
+                emitRM(e, 1, 0x81, 0, REG_REGISTERS, NO_INDEX, 0,
+                       REGISTER(cycles), 0);
+                emit32(e, cycles);
+        }
+}
+
+/* Add the value of a register, 0 or 1, to the cycle count. */
+static void addCyclesFrom(Emitter *e, int reg)
+{
+        emitRM(e, 1, 0x01, reg, REG_REGISTERS, NO_INDEX, 0,
+               REGISTER(cycles), 0);
+}
+
+static void flushCycles(Emitter *e)
+{
+        addCycles(e, e->pending);
+        e->pending = 0;
+}
+
+static void setPC(Emitter *e, uint16_t pc)
+{
+        emit8(e, 0x66);
+        emitRM(e, 0, 0xC7, 0, REG_REGISTERS, NO_INDEX, 0, REGISTER(pc), 0);
+        emit16(e, pc);
+}
+
+static void saveRegisters(Emitter *e)
+{
+        store8(e, REG_REGISTERS, REGISTER(a), REG_A);
+        store8(e, REG_REGISTERS, REGISTER(x), REG_X);
+        store8(e, REG_REGISTERS, REGISTER(y), REG_Y);
+        store8(e, REG_REGISTERS, REGISTER(p), REG_P);
+}
+
+static void loadRegisters(Emitter *e)
+{
+        load8(e, REG_A, REG_REGISTERS, NO_INDEX, REGISTER(a));
+        load8(e, REG_X, REG_REGISTERS, NO_INDEX, REGISTER(x));
+        load8(e, REG_Y, REG_REGISTERS, NO_INDEX, REGISTER(y));
+        load8(e, REG_P, REG_REGISTERS, NO_INDEX, REGISTER(p));
+}
+
+/* Set N and Z from a register holding a byte, using RCX. */
+static void setNZ(Emitter *e, int reg)
+{
+        aluImm(e, ALU_AND, REG_P, (uint8_t) ~(FLAG_N | FLAG_Z));
+        load8(e, RCX, REG_MEMORY, reg, JIT(nzFlags));
+        alu(e, ALU_OR, REG_P, RCX);
+}
+
+/* Add one cycle if EDX is not in the same page as base, using RAX. */
+static void pageCrossed(Emitter *e, int base)
+{
+        mov(e, RAX, RDX);
+        alu(e, ALU_XOR, RAX, base);
+        aluImm(e, ALU_CMP, RAX, 0xFF);
+        setcc(e, CC_A, RAX);
+        movzx8(e, RAX, RAX);
+        addCyclesFrom(e, RAX);
+}
+
+/*
+ * Continue with the block at pc, read from registers->pc if negative,
+ * going back to runJit() if it has no translation.
+ */
+static void chain(Emitter *e, int pc)
+{
+        if (pc >= 0) {
+                setPC(e, pc);
+                emitRM(e, 1, 0x8B, RAX, REG_MEMORY, NO_INDEX, 0,
+                       JIT(blocks) + pc * (int32_t) sizeof(void *), 0);
+        } else {
+                emitRM(e, 0, 0x0FB7, RAX, REG_REGISTERS, NO_INDEX, 0,
+                       REGISTER(pc), 0);
+                emitRM(e, 1, 0x8B, RAX, REG_MEMORY, RAX, 3, JIT(blocks), 0);
+        }
+        emitRR(e, 1, 0x85, RAX, RAX, 0);
+        jccTo(e, CC_E, e->exit);
+        /* jmp rax */
+        emit8(e, 0xFF);
+        emit8(e, 0xE0);
+}
+
+/*
+ * Return to runJit() with the program counter at pc if a write just
+ * invalidated translations, as this block might be one of them, or if a
+ * device brought the limit down to this instruction.
+ */
+static void exitIfNeeded(Emitter *e, uint16_t pc)
+{
+        uint8_t *invalidated, *valid;
+
+        /* cmp byte [jit.invalidated], 0 */
+        emitRM(e, 0, 0x80, 7, REG_MEMORY, NO_INDEX, 0, JIT(invalidated), 0);
+        emit8(e, 0);
+        invalidated = jcc(e, CC_NE);
+        emitRM(e, 1, 0x8B, RAX, REG_REGISTERS, NO_INDEX, 0,
+               REGISTER(cycles), 0);
+        emitRI(e, 1, 0x81, ALU_ADD, RAX, e->pending);
+        emitRM(e, 1, 0x3B, RAX, REG_MEMORY, NO_INDEX, 0, LIMIT, 0);
+        valid = jcc(e, CC_B);
+        patch(e, invalidated);
+        addCycles(e, e->pending);
+        setPC(e, pc);
+        jmpTo(e, e->exit);
+        patch(e, valid);
+}
+
+/* RCX = the page table entry for the page of EDX, testing it for NULL. */
+static void lookupPage(Emitter *e, int32_t pages)
+{
+        mov(e, RCX, RDX);
+        shift(e, SHIFT_RIGHT, RCX, 8);
+        emitRM(e, 1, 0x8B, RCX, REG_MEMORY, RCX, 3, pages, 0);
+        emitRR(e, 1, 0x85, RCX, RCX, 0);
+}
+
+/* EAX = readMemory(memory, EDX), keeping EDX. */
+static void emitRead(Emitter *e)
+{
+        uint8_t *slow, *done;
+
+        lookupPage(e, MEMORY(readPages));
+        slow = jcc(e, CC_E);
+        movzx8(e, RAX, RDX);
+        load8(e, RAX, RCX, RAX, 0);
+        done = jmp(e);
+        patch(e, slow);
+        /* Push twice to keep the stack aligned. */
+        emit8(e, 0x52);                         /* push rdx */
+        emit8(e, 0x52);
+        mov(e, RSI, RDX);
+        mov64(e, RDI, REG_MEMORY);
+        addCycles(e, e->pending);
+        call(e, readSlow);
+        addCycles(e, -e->pending);
+        movzx8(e, RAX, RAX);
+        emit8(e, 0x5A);                         /* pop rdx */
+        emit8(e, 0x5A);
+        patch(e, done);
+}
+
+/*
+ * writeMemory(memory, EDX, EAX), then exitIfNeeded() at next unless it is
+ * negative. The slow paths of reads and writes count the cycles of the
+ * block so far, for devices to look at.
+ */
+static void emitWrite(Emitter *e, int next)
+{
+        uint8_t *slow, *done;
+
+        lookupPage(e, MEMORY(writePages));
+        slow = jcc(e, CC_E);
+        movzx8(e, RSI, RDX);
+        emitRM(e, 0, 0x88, RAX, RCX, RSI, 0, 0, 1);
+        done = jmp(e);
+        patch(e, slow);
+        mov(e, RSI, RDX);
+        mov(e, RDX, RAX);
+        mov64(e, RDI, REG_MEMORY);
+        addCycles(e, e->pending);
+        call(e, writeSlow);
+        addCycles(e, -e->pending);
+        if (next >= 0) {
+                exitIfNeeded(e, next);
+        }
+        patch(e, done);
+}
+
+/* Push EAX, as emitWrite(). */
+static void emitPush(Emitter *e, int next)
+{
+        load8(e, RDX, REG_REGISTERS, NO_INDEX, REGISTER(sp));
+        aluImm(e, ALU_OR, RDX, 0x0100);
+        /* dec byte [registers->sp] */
+        emitRM(e, 0, 0xFE, 1, REG_REGISTERS, NO_INDEX, 0, REGISTER(sp), 0);
+        emitWrite(e, next);
+}
+
+/* Pull into a register. */
+static void emitPull(Emitter *e, int reg)
+{
+        /* inc byte [registers->sp] */
+        emitRM(e, 0, 0xFE, 0, REG_REGISTERS, NO_INDEX, 0, REGISTER(sp), 0);
+        load8(e, reg, REG_REGISTERS, NO_INDEX, REGISTER(sp));
+        load8(e, reg, REG_MEMORY, reg, 0x0100);
+}
+
+/* Interpret the instruction at pc with step(). */
+static void emitStep(Emitter *e, uint16_t pc, uint8_t opcode)
+{
+        flushCycles(e);
+        saveRegisters(e);
+        setPC(e, pc + 1);
+        movImm(e, RDI, opcode);
+        mov64(e, RSI, REG_MEMORY);
+        mov64(e, RDX, REG_REGISTERS);
+        call(e, step);
+        loadRegisters(e);
+}
+
+/* Effective address of an operand into EDX. */
+static void address(Emitter *e, int mode, uint16_t operand, int penalty)
+{
+        uint8_t zp = operand;
+
+        switch (mode) {
+        case ZP:
+                movImm(e, RDX, zp);
+                break;
+        case ZPX:
+        case ZPY:
+                lea(e, RDX, mode == ZPX ? REG_X : REG_Y, NO_INDEX, zp);
+                movzx8(e, RDX, RDX);
+                break;
+        case ABS:
+                movImm(e, RDX, operand);
+                break;
+        case ABSX:
+        case ABSY:
+                lea(e, RDX, mode == ABSX ? REG_X : REG_Y, NO_INDEX, operand);
+                movzx16(e, RDX, RDX);
+                if (penalty) {
+                        movImm(e, RCX, operand);
+                        pageCrossed(e, RCX);
+                }
+                break;
+        case INDX:
+                lea(e, RCX, REG_X, NO_INDEX, zp);
+                movzx8(e, RCX, RCX);
+                load8(e, RAX, REG_MEMORY, RCX, 0);
+                aluImm(e, ALU_ADD, RCX, 1);
+                movzx8(e, RCX, RCX);
+                load8(e, RDX, REG_MEMORY, RCX, 0);
+                shift(e, SHIFT_LEFT, RDX, 8);
+                alu(e, ALU_OR, RDX, RAX);
+                break;
+        case IND:
+        case INDY:
+                load8(e, RDX, REG_MEMORY, NO_INDEX, (uint8_t) (zp + 1));
+                shift(e, SHIFT_LEFT, RDX, 8);
+                load8(e, RAX, REG_MEMORY, NO_INDEX, zp);
+                alu(e, ALU_OR, RDX, RAX);
+                if (mode == INDY) {
+                        mov(e, RCX, RDX);
+                        lea(e, RDX, RDX, REG_Y, 0);
+                        movzx16(e, RDX, RDX);
+                        if (penalty) {
+                                pageCrossed(e, RCX);
+                        }
+                }
+                break;
+        }
+}
+
+/* Operand value into EAX, with the page crossing penalty of reads. */
+static void fetch(Emitter *e, int mode, uint16_t operand)
+{
+        if (mode == IMM) {
+                movImm(e, RAX, operand & 0xFF);
+        } else {
+                address(e, mode, operand, 1);
+                emitRead(e);
+        }
+}
+
+/* A + EAX + C, as addBinary() in cpu.c. */
+static void addBinary(Emitter *e)
+{
+        /* ECX = sum */
+        mov(e, RCX, REG_P);
+        aluImm(e, ALU_AND, RCX, FLAG_C);
+        alu(e, ALU_ADD, RCX, REG_A);
+        alu(e, ALU_ADD, RCX, RAX);
+        /* EDX = ~(A ^ operand) & (A ^ sum) & 0x80 */
+        mov(e, RDX, REG_A);
+        alu(e, ALU_XOR, RDX, RAX);
+        emitRR(e, 0, 0xF7, 2, RDX, 0);
+        mov(e, RSI, REG_A);
+        alu(e, ALU_XOR, RSI, RCX);
+        alu(e, ALU_AND, RDX, RSI);
+        aluImm(e, ALU_AND, RDX, 0x80);
+        shift(e, SHIFT_RIGHT, RDX, 1);
+        aluImm(e, ALU_AND, REG_P,
+               (uint8_t) ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C));
+        alu(e, ALU_OR, REG_P, RDX);
+        mov(e, RDX, RCX);
+        shift(e, SHIFT_RIGHT, RDX, 8);
+        alu(e, ALU_OR, REG_P, RDX);
+        movzx8(e, REG_A, RCX);
+        setNZ(e, REG_A);
+}
+
+/* Compare a register with EAX, as compare() in cpu.c. */
+static void compare(Emitter *e, int reg)
+{
+        aluImm(e, ALU_AND, REG_P, (uint8_t) ~(FLAG_N | FLAG_Z | FLAG_C));
+        mov(e, RCX, reg);
+        alu(e, ALU_SUB, RCX, RAX);
+        alu(e, ALU_CMP, reg, RAX);
+        setcc(e, CC_AE, RDX);
+        movzx8(e, RDX, RDX);
+        alu(e, ALU_OR, REG_P, RDX);
+        movzx8(e, RCX, RCX);
+        load8(e, RCX, REG_MEMORY, RCX, JIT(nzFlags));
+        alu(e, ALU_OR, REG_P, RCX);
+}
+
+/* Load a register from EAX, or the other way round, setting N and Z. */
+static void transfer(Emitter *e, int dst, int src)
+{
+        mov(e, dst, src);
+        setNZ(e, dst);
+}
+
+/* Add 1 or -1 to a register holding a byte, setting N and Z. */
+static void increment(Emitter *e, int reg, int op)
+{
+        aluImm(e, op, reg, 1);
+        movzx8(e, reg, reg);
+        setNZ(e, reg);
+}
+
+/*
+ * Translate the instruction at pc, in a block whose pending cycles already
+ * include its base cycles. Returns whether it ends the block.
+ */
+static int translateInstruction(Emitter *e, Memory *memory, uint16_t pc)
+{
+        uint8_t opcode = memory->ram[pc];
+        uint16_t operand = memory->ram[(uint16_t) (pc + 2)] << 8 |
+                memory->ram[(uint16_t) (pc + 1)];
+        uint16_t next = pc + lengths[opcode];
+        uint16_t target = next + SIGNED(operand & 0xFF);
+        Translation translation = translations[opcode];
+        int mode = translation.mode;
+        uint8_t *skip, *done;
+        static const uint8_t conditions[4] = {
+                FLAG_N, FLAG_V, FLAG_C, FLAG_Z
+        };
+
+        switch (translation.instruction) {
+        case I_STEP:
+        case I_STEP_JUMP:
+                e->pending -= baseCycles[opcode];
+                emitStep(e, pc, opcode);
+                if (translation.instruction == I_STEP_JUMP) {
+                        chain(e, -1);
+                        return 1;
+                }
+                exitIfNeeded(e, next);
+                break;
+        case I_LDA:
+                fetch(e, mode, operand);
+                transfer(e, REG_A, RAX);
+                break;
+        case I_LDX:
+                fetch(e, mode, operand);
+                transfer(e, REG_X, RAX);
+                break;
+        case I_LDY:
+                fetch(e, mode, operand);
+                transfer(e, REG_Y, RAX);
+                break;
+        case I_STA:
+        case I_STX:
+        case I_STY:
+        case I_STZ:
+                address(e, mode, operand, 0);
+                if (translation.instruction == I_STZ) {
+                        movImm(e, RAX, 0);
+                } else {
+                        mov(e, RAX, translation.instruction == I_STA ? REG_A :
+                            translation.instruction == I_STX ? REG_X : REG_Y);
+                }
+                emitWrite(e, next);
+                break;
+        case I_ADC:
+        case I_SBC:
+                /* Decimal mode is left to step(). */
+                e->pending -= baseCycles[opcode];
+                flushCycles(e);
+                testImm(e, REG_P, FLAG_D);
+                skip = jcc(e, CC_E);
+                emitStep(e, pc, opcode);
+                done = jmp(e);
+                patch(e, skip);
+                addCycles(e, baseCycles[opcode]);
+                fetch(e, mode, operand);
+                if (translation.instruction == I_SBC) {
+                        aluImm(e, ALU_XOR, RAX, 0xFF);
+                }
+                addBinary(e);
+                patch(e, done);
+                break;
+        case I_AND:
+        case I_ORA:
+        case I_EOR:
+                fetch(e, mode, operand);
+                alu(e, translation.instruction == I_AND ? ALU_AND :
+                    translation.instruction == I_ORA ? ALU_OR : ALU_XOR,
+                    REG_A, RAX);
+                setNZ(e, REG_A);
+                break;
+        case I_CMP:
+                fetch(e, mode, operand);
+                compare(e, REG_A);
+                break;
+        case I_CPX:
+                fetch(e, mode, operand);
+                compare(e, REG_X);
+                break;
+        case I_CPY:
+                fetch(e, mode, operand);
+                compare(e, REG_Y);
+                break;
+        case I_BIT:
+                fetch(e, mode, operand);
+                if (mode == IMM) {
+                        /* BIT # only affects Z. */
+                        aluImm(e, ALU_AND, REG_P, (uint8_t) ~FLAG_Z);
+                } else {
+                        aluImm(e, ALU_AND, REG_P,
+                               (uint8_t) ~(FLAG_N | FLAG_V | FLAG_Z));
+                        mov(e, RCX, RAX);
+                        aluImm(e, ALU_AND, RCX, FLAG_N | FLAG_V);
+                        alu(e, ALU_OR, REG_P, RCX);
+                }
+                alu(e, ALU_AND, RAX, REG_A);
+                load8(e, RCX, REG_MEMORY, RAX, JIT(nzFlags));
+                aluImm(e, ALU_AND, RCX, FLAG_Z);
+                alu(e, ALU_OR, REG_P, RCX);
+                break;
+        case I_INC:
+        case I_DEC:
+                address(e, mode, operand, 0);
+                emitRead(e);
+                increment(e, RAX, translation.instruction == I_INC ?
+                          ALU_ADD : ALU_SUB);
+                emitWrite(e, next);
+                break;
+        case I_INA:
+                increment(e, REG_A, ALU_ADD);
+                break;
+        case I_DEA:
+                increment(e, REG_A, ALU_SUB);
+                break;
+        case I_INX:
+                increment(e, REG_X, ALU_ADD);
+                break;
+        case I_INY:
+                increment(e, REG_Y, ALU_ADD);
+                break;
+        case I_DEX:
+                increment(e, REG_X, ALU_SUB);
+                break;
+        case I_DEY:
+                increment(e, REG_Y, ALU_SUB);
+                break;
+        case I_TAX:
+                transfer(e, REG_X, REG_A);
+                break;
+        case I_TAY:
+                transfer(e, REG_Y, REG_A);
+                break;
+        case I_TXA:
+                transfer(e, REG_A, REG_X);
+                break;
+        case I_TYA:
+                transfer(e, REG_A, REG_Y);
+                break;
+        case I_TSX:
+                load8(e, REG_X, REG_REGISTERS, NO_INDEX, REGISTER(sp));
+                setNZ(e, REG_X);
+                break;
+        case I_TXS:
+                store8(e, REG_REGISTERS, REGISTER(sp), REG_X);
+                break;
+        case I_ASL:
+        case I_ROL:
+                /* EAX = carry out, ECX = carry in */
+                mov(e, RAX, REG_A);
+                shift(e, SHIFT_RIGHT, RAX, 7);
+                shift(e, SHIFT_LEFT, REG_A, 1);
+                if (translation.instruction == I_ROL) {
+                        mov(e, RCX, REG_P);
+                        aluImm(e, ALU_AND, RCX, FLAG_C);
+                        alu(e, ALU_OR, REG_A, RCX);
+                }
+                movzx8(e, REG_A, REG_A);
+                aluImm(e, ALU_AND, REG_P, (uint8_t) ~FLAG_C);
+                alu(e, ALU_OR, REG_P, RAX);
+                setNZ(e, REG_A);
+                break;
+        case I_LSR:
+        case I_ROR:
+                mov(e, RAX, REG_A);
+                aluImm(e, ALU_AND, RAX, FLAG_C);
+                shift(e, SHIFT_RIGHT, REG_A, 1);
+                if (translation.instruction == I_ROR) {
+                        mov(e, RCX, REG_P);
+                        aluImm(e, ALU_AND, RCX, FLAG_C);
+                        shift(e, SHIFT_LEFT, RCX, 7);
+                        alu(e, ALU_OR, REG_A, RCX);
+                }
+                aluImm(e, ALU_AND, REG_P, (uint8_t) ~FLAG_C);
+                alu(e, ALU_OR, REG_P, RAX);
+                setNZ(e, REG_A);
+                break;
+        case I_PHA:
+        case I_PHX:
+        case I_PHY:
+                mov(e, RAX, translation.instruction == I_PHA ? REG_A :
+                    translation.instruction == I_PHX ? REG_X : REG_Y);
+                emitPush(e, next);
+                break;
+        case I_PHP:
+                /* The B and unused bits always read as set when pushed. */
+                mov(e, RAX, REG_P);
+                aluImm(e, ALU_OR, RAX, 0b00110000);
+                emitPush(e, next);
+                break;
+        case I_PLA:
+                emitPull(e, REG_A);
+                setNZ(e, REG_A);
+                break;
+        case I_PLX:
+                emitPull(e, REG_X);
+                setNZ(e, REG_X);
+                break;
+        case I_PLY:
+                emitPull(e, REG_Y);
+                setNZ(e, REG_Y);
+                break;
+        case I_CLEAR:
+                aluImm(e, ALU_AND, REG_P, (uint8_t) ~mode);
+                break;
+        case I_SET:
+                aluImm(e, ALU_OR, REG_P, mode);
+                break;
+        case I_NOP:
+                break;
+        case I_BRANCH:
+                /* Bits 6 and 7 select the flag, bit 5 its value. */
+                flushCycles(e);
+                testImm(e, REG_P, conditions[opcode >> 6]);
+                skip = jcc(e, opcode & 0x20 ? CC_E : CC_NE);
+                addCycles(e, 1 + PAGE_CROSSED(next, target));
+                chain(e, target);
+                patch(e, skip);
+                chain(e, next);
+                return 1;
+        case I_BRA:
+                e->pending += 1 + PAGE_CROSSED(next, target);
+                flushCycles(e);
+                chain(e, target);
+                return 1;
+        case I_JMP:
+                flushCycles(e);
+                chain(e, operand);
+                return 1;
+        case I_JSR:
+                /* Push the address of the last byte of the JSR. */
+                movImm(e, RAX, (uint16_t) (next - 1) >> 8);
+                emitPush(e, -1);
+                movImm(e, RAX, (next - 1) & 0xFF);
+                emitPush(e, -1);
+                flushCycles(e);
+                chain(e, operand);
+                return 1;
+        case I_RTS:
+                emitPull(e, RAX);
+                emitPull(e, RCX);
+                shift(e, SHIFT_LEFT, RCX, 8);
+                alu(e, ALU_OR, RAX, RCX);
+                aluImm(e, ALU_ADD, RAX, 1);
+                /* mov word [registers->pc], ax */
+                emit8(e, 0x66);
+                emitRM(e, 0, 0x89, RAX, REG_REGISTERS, NO_INDEX, 0,
+                       REGISTER(pc), 0);
+                flushCycles(e);
+                chain(e, -1);
+                return 1;
+        }
+
+        return 0;
+}
+
+/*
+ * Emit the code shared by every block at the start of the buffer. Entry
+ * saves the callee saved registers (keeping the stack 16 byte aligned for
+ * calls), loads the guest registers and jumps to the block given as third
+ * argument; exit does the opposite.
+ */
+static void emitStubs(Jit *jit)
+{
+        Emitter e;
+
+        e.code = jit->code;
+        emit8(&e, 0x53);                        /* push rbx */
+        emit8(&e, 0x55);                        /* push rbp */
+        emit8(&e, 0x41);                        /* push r12 */
+        emit8(&e, 0x54);
+        emit8(&e, 0x41);                        /* push r13 */
+        emit8(&e, 0x55);
+        emit8(&e, 0x41);                        /* push r14 */
+        emit8(&e, 0x56);
+        emit8(&e, 0x41);                        /* push r15 */
+        emit8(&e, 0x57);
+        emitRI(&e, 1, 0x81, ALU_SUB, RSP, 8);
+        mov64(&e, REG_REGISTERS, RDI);
+        mov64(&e, REG_MEMORY, RSI);
+        loadRegisters(&e);
+        emit8(&e, 0xFF);                        /* jmp rdx */
+        emit8(&e, 0xE2);
+
+        jit->exit = e.code;
+        saveRegisters(&e);
+        emitRI(&e, 1, 0x81, ALU_ADD, RSP, 8);
+        emit8(&e, 0x41);                        /* pop r15 */
+        emit8(&e, 0x5F);
+        emit8(&e, 0x41);                        /* pop r14 */
+        emit8(&e, 0x5E);
+        emit8(&e, 0x41);                        /* pop r13 */
+        emit8(&e, 0x5D);
+        emit8(&e, 0x41);                        /* pop r12 */
+        emit8(&e, 0x5C);
+        emit8(&e, 0x5D);                        /* pop rbp */
+        emit8(&e, 0x5B);                        /* pop rbx */
+        emit8(&e, 0xC3);                        /* ret */
+        jit->used = e.code - jit->code;
+}
+
+/* Forget every translation, to make room in the code buffer. */
+static void flushJit(Memory *memory)
+{
+        int page;
+
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                if (memory->codePages[page]) {
+                        invalidateCode(memory, page);
+                }
+        }
+        emitStubs(&memory->jit);
+}
+
+/*
+ * Translate the block starting at start: straight-line code up to and
+ * including a jump, within a single page (but for the operand of its last
+ * instruction) so that invalidation only has to look at two pages.
+ */
+static void *translate(Memory *memory, uint16_t start)
+{
+        Jit *jit = &memory->jit;
+        uint8_t *block, *boundPatch;
+        uint8_t opcode;
+        uint32_t bound = 0;
+        uint16_t pc = start;
+        int length = 0;
+        Emitter e;
+
+        /* Loops that may be idle are left to the interpreter to skip. */
+        if (!memory->ram[start] || idleLoop(memory, start)) {
+                return NULL;
+        }
+        if (jit->used + MAX_BLOCK_SIZE > CODE_SIZE) {
+                flushJit(memory);
+        }
+
+        block = jit->code + jit->used;
+        e.code = block;
+        e.exit = jit->exit;
+        e.pending = 0;
+
+        /*
+         * Go back to runJit() unless the budget covers the worst case of the
+         * whole block, so that it stops exactly where the interpreter would.
+         * The bound is patched in once known.
+         */
+        emitRM(&e, 1, 0x8B, RAX, REG_REGISTERS, NO_INDEX, 0,
+               REGISTER(cycles), 0);
+        emitRI(&e, 1, 0x81, ALU_ADD, RAX, 0);
+        boundPatch = e.code - sizeof(bound);
+        emitRM(&e, 1, 0x3B, RAX, REG_MEMORY, NO_INDEX, 0, LIMIT, 0);
+        jccTo(&e, CC_A, e.exit);
+
+        for (;;) {
+                opcode = memory->ram[pc];
+                /* BRK is left to the interpreter, which stops there. */
+                if (!opcode || length == MAX_BLOCK_LENGTH ||
+                    (pc >> 8) != (start >> 8)) {
+                        flushCycles(&e);
+                        chain(&e, pc);
+                        break;
+                }
+                /* Page crossings, branches and decimal mode add 3 at most. */
+                bound += baseCycles[opcode] + 3;
+                e.pending += baseCycles[opcode];
+                length++;
+                if (translateInstruction(&e, memory, pc)) {
+                        pc += lengths[opcode];
+                        break;
+                }
+                pc += lengths[opcode];
+        }
+
+        memcpy(boundPatch, &bound, sizeof(bound));
+        markCode(memory, start >> 8);
+        markCode(memory, (uint16_t) (pc - 1) >> 8);
+        jit->used = e.code - jit->code;
+        jit->blocks[start] = block;
+
+        return block;
+}
+
+void initJit(Memory *memory)
+{
+        Jit *jit = &memory->jit;
+
+        jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit->code == MAP_FAILED) {
+                jit->code = NULL;
+                return;
+        }
+        memcpy(jit->nzFlags, nzFlags, sizeof(jit->nzFlags));
+        emitStubs(jit);
+}
+
+void freeJit(Memory *memory)
+{
+        if (memory->jit.code) {
+                munmap(memory->jit.code, CODE_SIZE);
+                memory->jit.code = NULL;
+        }
+#if defined(JIT_VERIFY)
+        if (memory->jit.shadow) {
+                freeMemory(memory->jit.shadow);
+                free(memory->jit.shadow);
+                memory->jit.shadow = NULL;
+        }
+        free(memory->jit.deviceReads);
+        memory->jit.deviceReads = NULL;
+        memory->jit.deviceReadSize = 0;
+#endif
+}
+
+#if defined(JIT_VERIFY)
+/* Copy memory to its shadow, mapped the same way, before running a block. */
+static Memory *copyShadow(Memory *memory)
+{
+        Memory *shadow = memory->jit.shadow;
+        int page;
+
+        if (!shadow) {
+                if (!(shadow = malloc(sizeof(*shadow)))) {
+                        abort();
+                }
+                initMemory(shadow);
+                memory->jit.shadow = shadow;
+        }
+        for (page = 2; page < RAM_SIZE >> 8; page++) {
+                if (memory->pageTypes[page] == PAGE_RAM) {
+                        mapRam(shadow, page, page);
+                } else if (memory->pageTypes[page] == PAGE_ROM) {
+                        mapRom(shadow, page, page);
+                } else {
+                        mapDevice(shadow, page, page, memory->devices[page]);
+                }
+        }
+        memcpy(shadow->ram, memory->ram, RAM_SIZE);
+        memcpy(shadow->reported, memory->reported, sizeof(shadow->reported));
+        shadow->jit.replayed = memory;
+        shadow->jit.deviceReadsReplayed = 0;
+        memory->jit.deviceReadCount = 0;
+
+        return shadow;
+}
+
+void logDeviceRead(Memory *memory, uint8_t value)
+{
+        Jit *jit = &memory->jit;
+
+        if (!jit->loggingReads) {
+                return;
+        }
+        /* Runs chain blocks up to the next event: grow as needed. */
+        if (jit->deviceReadCount == jit->deviceReadSize) {
+                jit->deviceReadSize = jit->deviceReadSize ?
+                        jit->deviceReadSize * 2 : 0x1000;
+                if (!(jit->deviceReads = realloc(jit->deviceReads,
+                                                 jit->deviceReadSize))) {
+                        abort();
+                }
+        }
+        jit->deviceReads[jit->deviceReadCount++] = value;
+}
+
+uint8_t replayDeviceRead(Memory *shadow)
+{
+        const Jit *logged = &shadow->jit.replayed->jit;
+
+        /* Reading more than the translation did is a difference too. */
+        if (shadow->jit.deviceReadsReplayed == logged->deviceReadCount) {
+                return 0xFF;
+        }
+
+        return logged->deviceReads[shadow->jit.deviceReadsReplayed++];
+}
+
+/*
+ * Differential check of the translations: replay what they just did with
+ * the interpreter, on the shadow copy of memory taken before, and abort on
+ * the first difference. Device pages are mapped as in memory, but the
+ * shadow reads the bytes the translation read from them again and drops
+ * its writes to them, so that devices see each access once.
+ */
+static void verify(const Registers *before, Memory *shadow,
+                   Registers *registers, Memory *memory)
+{
+        Registers expected = *before;
+        uint8_t opcode;
+
+        while (expected.cycles < registers->cycles) {
+                opcode = shadow->ram[expected.pc++];
+                step(opcode, shadow, &expected);
+        }
+
+        if (expected.a != registers->a || expected.x != registers->x ||
+            expected.y != registers->y || expected.sp != registers->sp ||
+            expected.p != registers->p || expected.pc != registers->pc ||
+            expected.cycles != registers->cycles ||
+            memcmp(shadow->ram, memory->ram, RAM_SIZE) ||
+            shadow->jit.deviceReadsReplayed !=
+            memory->jit.deviceReadCount) {
+                fprintf(stderr, "jit: block at %04X differs from the "
+                        "interpreter\n", before->pc);
+                fprintf(stderr, "expected a=%02X x=%02X y=%02X sp=%02X "
+                        "p=%02X pc=%04X cycles=%llu\n", expected.a,
+                        expected.x, expected.y, expected.sp, expected.p,
+                        expected.pc, (unsigned long long) expected.cycles);
+                fprintf(stderr, "got      a=%02X x=%02X y=%02X sp=%02X "
+                        "p=%02X pc=%04X cycles=%llu\n", registers->a,
+                        registers->x, registers->y, registers->sp,
+                        registers->p, registers->pc,
+                        (unsigned long long) registers->cycles);
+                abort();
+        }
+}
+#endif
+
+int runJit(Registers *registers, Memory *memory)
+{
+        Jit *jit = &memory->jit;
+        uint16_t pc = registers->pc;
+        uint64_t cycles = registers->cycles;
+        void *block = jit->blocks[pc];
+#if defined(JIT_VERIFY)
+        Memory *shadow;
+        Registers before = *registers;
+#endif
+
+        if (!block) {
+                if (!jit->code || ++jit->heat[pc] < HOT) {
+                        return 0;
+                }
+                jit->heat[pc] = 0;
+                if (!(block = translate(memory, pc))) {
+                        return 0;
+                }
+        }
+
+#if defined(JIT_VERIFY)
+        shadow = copyShadow(memory);
+#endif
+        jit->invalidated = 0;
+#if defined(JIT_VERIFY)
+        jit->loggingReads = 1;
+#endif
+        ((Entry) (void *) jit->code)(registers, memory, block);
+#if defined(JIT_VERIFY)
+        jit->loggingReads = 0;
+        verify(&before, shadow, registers, memory);
+#endif
+
+        return registers->pc != pc || registers->cycles != cycles;
+}
+
+void invalidateJitPage(Memory *memory, uint8_t page)
+{
+        /* Blocks starting in the previous page may end in this one. */
+        uint8_t previous = page - 1;
+
+        memset(&memory->jit.blocks[page << 8], 0, 0x100 * sizeof(void *));
+        memset(&memory->jit.blocks[previous << 8], 0, 0x100 * sizeof(void *));
+        memory->jit.invalidated = 1;
+}
+
+#endif  /* ENGINE_JIT */
@@ -0,0 +1,32 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "cpu.h"
+
+#if defined(ENGINE_JIT)
+/*
+ * Translation of hot basic blocks to x86-64 code. initJit() maps the code
+ * buffer of a freshly cleared Memory; without one (e.g. when the system
+ * refuses executable mappings), everything is simply interpreted.
+ */
+void initJit(Memory *memory);
+void freeJit(Memory *memory);
+/*
+ * Run translated code from registers->pc, translating it first if it got
+ * hot, until the scheduler limit. Returns whether any instruction was
+ * executed; if not, the caller interprets the next one.
+ */
+int runJit(Registers *registers, Memory *memory);
+/* Drop the translations overlapping a page that was written to. */
+void invalidateJitPage(Memory *memory, uint8_t page);
+#if defined(JIT_VERIFY)
+/*
+ * Hooks for readSlow(): log a byte read from a device while translated
+ * code runs, and read it again from the shadow checking it.
+ */
+void logDeviceRead(Memory *memory, uint8_t value);
+uint8_t replayDeviceRead(Memory *shadow);
+#endif
+#endif
+
+#endif  /* JIT_H */
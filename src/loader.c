@@ -0,0 +1,475 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cpu.h"
+#include "loader.h"
+
+/* Files larger than this are mapped into memory rather than read. */
+#define MAP_SIZE 0x10000
+/* Address of the reset vector. */
+#define RESET_VECTOR 0xFFFC
+
+long loadRaw(const char *path, uint8_t *ram, uint16_t address)
+{
+        FILE *program;
+        size_t size, room = RAM_SIZE - address;
+
+        program = fopen(path, "rb");
+
+        if (!program) {
+                return -errno;
+        }
+
+        /* Read one byte past the room left to detect oversized images. */
+        size = fread(ram + address, 1, room, program);
+
+        if (ferror(program)) {
+                fclose(program);
+                return -EIO;
+        }
+
+        if (size == room && fgetc(program) != EOF) {
+                fclose(program);
+                return -EFBIG;
+        }
+
+        fclose(program);
+
+        return size;
+}
+
+/* Where loading an image is at. */
+typedef struct {
+        uint8_t *ram;
+        Image *image;
+        /* Lowest address loaded, and the entry point if known yet. */
+        uint32_t lowest;
+        uint32_t entry;
+        uint8_t hasEntry;
+        /* Bytes of the reset vector loaded, one bit each. */
+        uint8_t vector;
+} Loader;
+
+/* Copy a segment of the image to its address. */
+static int place(Loader *loader, uint32_t address, const uint8_t *bytes,
+                 size_t size)
+{
+        uint32_t page;
+
+        if (!size) {
+                return 0;
+        }
+        if (address >= RAM_SIZE || size > RAM_SIZE - address) {
+                return -EFBIG;
+        }
+
+        memcpy(&loader->ram[address], bytes, size);
+        for (page = address >> 8; page <= (address + size - 1) >> 8; page++) {
+                loader->image->pages[page] = 1;
+        }
+        loader->image->size += size;
+        if (address < loader->lowest) {
+                loader->lowest = address;
+        }
+        if (address <= RESET_VECTOR && address + size > RESET_VECTOR) {
+                loader->vector |= 1;
+        }
+        if (address + size > RESET_VECTOR + 1) {
+                loader->vector |= 2;
+        }
+
+        return 0;
+}
+
+static int setEntry(Loader *loader, uint32_t entry)
+{
+        if (entry >= RAM_SIZE) {
+                return -EFBIG;
+        }
+        loader->entry = entry;
+        loader->hasEntry = 1;
+
+        return 0;
+}
+
+static int hexDigit(uint8_t digit)
+{
+        if (digit >= '0' && digit <= '9') {
+                return digit - '0';
+        }
+        digit |= 0x20;
+        if (digit >= 'a' && digit <= 'f') {
+                return digit - 'a' + 10;
+        }
+
+        return -1;
+}
+
+/* Decode count bytes of hex digits at text into bytes. */
+static int hexBytes(const uint8_t *text, const uint8_t *end,
+                    uint8_t *bytes, size_t count)
+{
+        int high, low;
+        size_t i;
+
+        if ((size_t) (end - text) < 2 * count) {
+                return -EINVAL;
+        }
+        for (i = 0; i < count; i++) {
+                high = hexDigit(text[2 * i]);
+                low = hexDigit(text[2 * i + 1]);
+                if (high < 0 || low < 0) {
+                        return -EINVAL;
+                }
+                bytes[i] = high << 4 | low;
+        }
+
+        return 0;
+}
+
+/*
+ * Skip the line breaks and blanks before the next record, which must
+ * start with mark: 1 if there is one, 0 at the end of the text, -EINVAL
+ * if anything else is there.
+ */
+static int nextRecord(const uint8_t **text, const uint8_t *end, uint8_t mark)
+{
+        while (*text < end && (**text == '\n' || **text == '\r' ||
+                               **text == ' ' || **text == '\t')) {
+                (*text)++;
+        }
+        if (*text == end) {
+                return 0;
+        }
+
+        return **text == mark ? 1 : -EINVAL;
+}
+
+static uint32_t bigEndian(const uint8_t *bytes, int count)
+{
+        uint32_t value = 0;
+
+        while (count--) {
+                value = value << 8 | *bytes++;
+        }
+
+        return value;
+}
+
+/*
+ * Intel HEX: ":" then, in hex, a byte count, a 16 bit address, a record
+ * type, the data bytes and a checksum making all of them sum to 0. Data
+ * addresses are offset by the last extended address record, if any.
+ */
+static int loadIhex(Loader *loader, const uint8_t *text, const uint8_t *end)
+{
+        /* Count, address, type, data and checksum. */
+        uint8_t record[4 + 0xFF + 1];
+        const uint8_t *data = &record[4];
+        uint32_t base = 0, address;
+        int found, error, count, sum, i;
+
+        while ((found = nextRecord(&text, end, ':')) > 0) {
+                text++;
+                if ((error = hexBytes(text, end, record, 1)) < 0) {
+                        return error;
+                }
+                count = record[0];
+                if ((error = hexBytes(text, end, record, count + 5)) < 0) {
+                        return error;
+                }
+                text += 2 * (count + 5);
+                for (sum = 0, i = 0; i < count + 5; i++) {
+                        sum += record[i];
+                }
+                if (sum & 0xFF) {
+                        return -EINVAL;
+                }
+
+                address = bigEndian(&record[1], 2);
+                switch (record[3]) {
+                case 0x00:
+                        error = place(loader, base + address, data, count);
+                        break;
+                case 0x01:
+                        /* End of file, whatever follows. */
+                        return 0;
+                case 0x02:
+                        /* Extended segment address, in paragraphs. */
+                        if (count != 2) {
+                                return -EINVAL;
+                        }
+                        base = bigEndian(data, 2) << 4;
+                        break;
+                case 0x03:
+                        /* Start segment address, as CS:IP. */
+                        if (count != 4) {
+                                return -EINVAL;
+                        }
+                        error = setEntry(loader, (bigEndian(data, 2) << 4) +
+                                         bigEndian(&data[2], 2));
+                        break;
+                case 0x04:
+                        /* Extended linear address, the upper 16 bits. */
+                        if (count != 2) {
+                                return -EINVAL;
+                        }
+                        base = bigEndian(data, 2) << 16;
+                        break;
+                case 0x05:
+                        /* Start linear address. */
+                        if (count != 4) {
+                                return -EINVAL;
+                        }
+                        error = setEntry(loader, bigEndian(data, 4));
+                        break;
+                default:
+                        return -EINVAL;
+                }
+                if (error < 0) {
+                        return error;
+                }
+        }
+
+        return found;
+}
+
+/*
+ * Motorola S-records: "S" and a type digit then, in hex, a byte count, an
+ * address of 2 to 4 bytes depending on the type, the data bytes and a
+ * checksum, the ones' complement of the sum of all the others.
+ */
+static int loadSrec(Loader *loader, const uint8_t *text, const uint8_t *end)
+{
+        /* Address bytes of each record type, 0 for reserved types. */
+        static const uint8_t widths[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+        /* Count, address, data and checksum. */
+        uint8_t record[1 + 0xFF];
+        int found, error, type, width, count, sum, i;
+        uint32_t address;
+
+        while ((found = nextRecord(&text, end, 'S')) > 0) {
+                if (end - text < 2 || text[1] < '0' || text[1] > '9') {
+                        return -EINVAL;
+                }
+                type = text[1] - '0';
+                text += 2;
+                if ((error = hexBytes(text, end, record, 1)) < 0) {
+                        return error;
+                }
+                count = record[0];
+                if ((error = hexBytes(text, end, record, count + 1)) < 0) {
+                        return error;
+                }
+                text += 2 * (count + 1);
+                for (sum = 0, i = 0; i < count + 1; i++) {
+                        sum += record[i];
+                }
+                width = widths[type];
+                if ((sum & 0xFF) != 0xFF || !width || count < width + 1) {
+                        return -EINVAL;
+                }
+
+                address = bigEndian(&record[1], width);
+                switch (type) {
+                case 1:
+                case 2:
+                case 3:
+                        error = place(loader, address, &record[1 + width],
+                                      count - width - 1);
+                        break;
+                case 7:
+                case 8:
+                case 9:
+                        error = setEntry(loader, address);
+                        break;
+                default:
+                        /* Header and record counts. */
+                        break;
+                }
+                if (error < 0) {
+                        return error;
+                }
+        }
+
+        return found;
+}
+
+/* Whether path ends with one of the extensions, ignoring case. */
+static int hasExtension(const char *path, const char *const *extensions)
+{
+        const char *dot = strrchr(path, '.');
+
+        if (!dot || strchr(dot, '/')) {
+                return 0;
+        }
+        for (; *extensions; extensions++) {
+                if (!strcasecmp(dot + 1, *extensions)) {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+static ImageFormat guessFormat(const char *path, const uint8_t *text,
+                               size_t size)
+{
+        static const char *const ihex[] = {"hex", "ihex", "ihx", NULL};
+        static const char *const srec[] = {"srec", "s19", "s28", "s37",
+                                           "mot", NULL};
+        static const char *const prg[] = {"prg", NULL};
+
+        if (hasExtension(path, ihex)) {
+                return FORMAT_IHEX;
+        }
+        if (hasExtension(path, srec)) {
+                return FORMAT_SREC;
+        }
+        if (hasExtension(path, prg)) {
+                return FORMAT_PRG;
+        }
+        if (size >= 3 && text[0] == ':' && hexDigit(text[1]) >= 0 &&
+            hexDigit(text[2]) >= 0) {
+                return FORMAT_IHEX;
+        }
+        if (size >= 3 && text[0] == 'S' && text[1] >= '0' &&
+            text[1] <= '9' && hexDigit(text[2]) >= 0) {
+                return FORMAT_SREC;
+        }
+
+        return FORMAT_RAW;
+}
+
+/* Read a whole file, or map it if large; NULL for an empty one. */
+static int readFile(const char *path, uint8_t **contents, size_t *size,
+                    int *mapped)
+{
+        struct stat status;
+        ssize_t done;
+        size_t got = 0;
+        int file, error = 0;
+
+        *contents = NULL;
+        *size = 0;
+        *mapped = 0;
+        if ((file = open(path, O_RDONLY)) < 0) {
+                return -errno;
+        }
+        if (fstat(file, &status) < 0) {
+                error = -errno;
+                close(file);
+                return error;
+        }
+
+        *size = status.st_size;
+        *mapped = *size > MAP_SIZE;
+        if (*mapped) {
+                *contents = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, file,
+                                 0);
+                if (*contents == MAP_FAILED) {
+                        error = -errno;
+                } else {
+                        posix_madvise(*contents, *size,
+                                      POSIX_MADV_SEQUENTIAL);
+                }
+        } else if (*size) {
+                if (!(*contents = malloc(*size))) {
+                        error = -ENOMEM;
+                }
+                while (!error && got < *size) {
+                        done = read(file, *contents + got, *size - got);
+                        if (done < 0 && errno != EINTR) {
+                                error = -errno;
+                        } else if (done == 0) {
+                                /* Shrunk since fstat(). */
+                                *size = got;
+                        } else if (done > 0) {
+                                got += done;
+                        }
+                }
+                if (error) {
+                        free(*contents);
+                }
+        }
+        close(file);
+
+        return error;
+}
+
+long loadImage(const char *path, ImageFormat format, uint16_t address,
+               uint8_t *ram, Image *image)
+{
+        Loader loader = {ram, image, RAM_SIZE, 0, 0, 0};
+        const uint8_t *end;
+        uint8_t *contents;
+        size_t size;
+        int mapped, error;
+
+        if ((error = readFile(path, &contents, &size, &mapped)) < 0) {
+                return error;
+        }
+        end = contents + size;
+
+        memset(image, 0, sizeof(*image));
+        if (format == FORMAT_AUTO) {
+                format = guessFormat(path, contents, size);
+        }
+        image->format = format;
+        switch (format) {
+        case FORMAT_IHEX:
+                error = loadIhex(&loader, contents, end);
+                break;
+        case FORMAT_SREC:
+                error = loadSrec(&loader, contents, end);
+                break;
+        case FORMAT_PRG:
+                if (size < 2) {
+                        error = -EINVAL;
+                        break;
+                }
+                address = contents[0] | contents[1] << 8;
+                error = place(&loader, address, contents + 2, size - 2);
+                setEntry(&loader, address);
+                break;
+        default:
+                error = place(&loader, address, contents, size);
+                setEntry(&loader, address);
+                break;
+        }
+
+        if (mapped) {
+                munmap(contents, size);
+        } else {
+                free(contents);
+        }
+        if (error < 0) {
+                return error;
+        }
+
+        if (loader.vector == 3) {
+                if (!loader.hasEntry) {
+                        setEntry(&loader, ram[RESET_VECTOR] |
+                                 ram[RESET_VECTOR + 1] << 8);
+                }
+        } else {
+                if (!loader.hasEntry) {
+                        setEntry(&loader, loader.lowest < RAM_SIZE ?
+                                 loader.lowest : 0);
+                }
+                ram[RESET_VECTOR] = loader.entry & 0xFF;
+                ram[RESET_VECTOR + 1] = loader.entry >> 8;
+                image->pages[RESET_VECTOR >> 8] = 1;
+        }
+        image->entry = loader.entry;
+
+        return image->size;
+}
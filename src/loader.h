@@ -0,0 +1,58 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Copy a raw binary image into ram, starting at the given address.
+ * The image is read once; the emulator never touches the file again.
+ * Returns the number of bytes loaded, or a negative errno value.
+ */
+long loadRaw(const char *path, uint8_t *ram, uint16_t address);
+
+/* Formats of program images, see loadImage(). */
+typedef enum {
+        /* Guessed from the file name, then from its first bytes. */
+        FORMAT_AUTO,
+        /* Bytes to load at a given address. */
+        FORMAT_RAW,
+        /* Intel HEX records. */
+        FORMAT_IHEX,
+        /* Motorola S-records. */
+        FORMAT_SREC,
+        /* Commodore PRG: a little endian load address, then the bytes. */
+        FORMAT_PRG
+} ImageFormat;
+
+/* What loadImage() found in an image. */
+typedef struct {
+        ImageFormat format;
+        /* Where execution starts. */
+        uint16_t entry;
+        /* Bytes loaded, and whether each page got any of them. */
+        size_t size;
+        uint8_t pages[RAM_SIZE >> 8];
+} Image;
+
+/*
+ * Load a program image into ram in a single pass over the file, which is
+ * mapped into memory rather than read if it is large. Raw images go at
+ * address; the other formats say where each of their segments goes.
+ *
+ * The entry point is the load address of raw and PRG images, and the
+ * start address record of HEX and S-record files if they have one (S9,
+ * S8 or S7, and 03 or 05). Unless the image loads the reset vector
+ * itself, it is set to the entry point; otherwise an image without an
+ * entry point starts where its reset vector points, and one without
+ * either starts at the lowest address it loaded.
+ *
+ * Returns the number of bytes loaded, -EINVAL for a malformed record or a
+ * wrong checksum, -EFBIG for bytes past the end of memory, or another
+ * negative errno value. A failed load may have loaded part of the image.
+ */
+long loadImage(const char *path, ImageFormat format, uint16_t address,
+               uint8_t *ram, Image *image);
+
+#endif  /* LOADER_H */
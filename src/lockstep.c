@@ -0,0 +1,1011 @@
+#include <string.h>
+#include <errno.h>
+#include "lockstep.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* What the lanes running an instruction together do with it. */
+enum {
+        /* Step each lane on its own, for rare opcodes. */
+        L_STEP,
+        L_LDA, L_LDX, L_LDY, L_STA, L_STX, L_STY, L_STZ,
+        L_ADC, L_SBC, L_AND, L_ORA, L_EOR, L_CMP, L_CPX, L_CPY,
+        L_ASL, L_LSR, L_ROL, L_ROR,
+        L_TAX, L_TAY, L_TXA, L_TYA, L_INX, L_INY, L_DEX, L_DEY,
+        L_CLC, L_SEC, L_CLV, L_NOP,
+        L_BRANCH, L_BRA, L_JMP, L_JSR, L_RTS,
+        L_INC, L_DEC
+};
+#define STORING(kind) ((kind) >= L_STA && (kind) <= L_STZ)
+#define MODIFYING(kind) ((kind) == L_INC || (kind) == L_DEC)
+
+/* Addressing modes of the operand, as in cpu.c. */
+enum {
+        M_IMP, M_IMM, M_ZP, M_ZPX, M_ZPY, M_ABS, M_ABSX, M_ABSY,
+        M_IND, M_INDX, M_INDY
+};
+
+typedef struct {
+        uint8_t kind;
+        uint8_t mode;
+} Operation;
+
+static const Operation operations[256] = {
+        /* LDA, LDX, LDY */
+        [0xA9] = { L_LDA, M_IMM }, [0xA5] = { L_LDA, M_ZP },
+        [0xB5] = { L_LDA, M_ZPX }, [0xAD] = { L_LDA, M_ABS },
+        [0xBD] = { L_LDA, M_ABSX }, [0xB9] = { L_LDA, M_ABSY },
+        [0xA1] = { L_LDA, M_INDX }, [0xB1] = { L_LDA, M_INDY },
+        [0xB2] = { L_LDA, M_IND },
+        [0xA2] = { L_LDX, M_IMM }, [0xA6] = { L_LDX, M_ZP },
+        [0xB6] = { L_LDX, M_ZPY }, [0xAE] = { L_LDX, M_ABS },
+        [0xBE] = { L_LDX, M_ABSY },
+        [0xA0] = { L_LDY, M_IMM }, [0xA4] = { L_LDY, M_ZP },
+        [0xB4] = { L_LDY, M_ZPX }, [0xAC] = { L_LDY, M_ABS },
+        [0xBC] = { L_LDY, M_ABSX },
+        /* STA, STX, STY, STZ */
+        [0x85] = { L_STA, M_ZP },
+        [0x95] = { L_STA, M_ZPX },
+        [0x8D] = { L_STA, M_ABS },
+        [0x9D] = { L_STA, M_ABSX },
+        [0x99] = { L_STA, M_ABSY },
+        [0x81] = { L_STA, M_INDX },
+        [0x91] = { L_STA, M_INDY },
+        [0x92] = { L_STA, M_IND },
+        [0x86] = { L_STX, M_ZP },
+        [0x96] = { L_STX, M_ZPY },
+        [0x8E] = { L_STX, M_ABS },
+        [0x84] = { L_STY, M_ZP },
+        [0x94] = { L_STY, M_ZPX },
+        [0x8C] = { L_STY, M_ABS },
+        [0x64] = { L_STZ, M_ZP },
+        [0x74] = { L_STZ, M_ZPX },
+        [0x9C] = { L_STZ, M_ABS },
+        [0x9E] = { L_STZ, M_ABSX },
+        /* ADC, SBC */
+        [0x69] = { L_ADC, M_IMM }, [0x65] = { L_ADC, M_ZP },
+        [0x75] = { L_ADC, M_ZPX }, [0x6D] = { L_ADC, M_ABS },
+        [0x7D] = { L_ADC, M_ABSX }, [0x79] = { L_ADC, M_ABSY },
+        [0x61] = { L_ADC, M_INDX }, [0x71] = { L_ADC, M_INDY },
+        [0x72] = { L_ADC, M_IND },
+        [0xE9] = { L_SBC, M_IMM }, [0xE5] = { L_SBC, M_ZP },
+        [0xF5] = { L_SBC, M_ZPX }, [0xED] = { L_SBC, M_ABS },
+        [0xFD] = { L_SBC, M_ABSX }, [0xF9] = { L_SBC, M_ABSY },
+        [0xE1] = { L_SBC, M_INDX }, [0xF1] = { L_SBC, M_INDY },
+        [0xF2] = { L_SBC, M_IND },
+        /* AND, ORA, EOR */
+        [0x29] = { L_AND, M_IMM }, [0x25] = { L_AND, M_ZP },
+        [0x35] = { L_AND, M_ZPX }, [0x2D] = { L_AND, M_ABS },
+        [0x3D] = { L_AND, M_ABSX }, [0x39] = { L_AND, M_ABSY },
+        [0x21] = { L_AND, M_INDX }, [0x31] = { L_AND, M_INDY },
+        [0x32] = { L_AND, M_IND },
+        [0x09] = { L_ORA, M_IMM }, [0x05] = { L_ORA, M_ZP },
+        [0x15] = { L_ORA, M_ZPX }, [0x0D] = { L_ORA, M_ABS },
+        [0x1D] = { L_ORA, M_ABSX }, [0x19] = { L_ORA, M_ABSY },
+        [0x01] = { L_ORA, M_INDX }, [0x11] = { L_ORA, M_INDY },
+        [0x12] = { L_ORA, M_IND },
+        [0x49] = { L_EOR, M_IMM }, [0x45] = { L_EOR, M_ZP },
+        [0x55] = { L_EOR, M_ZPX }, [0x4D] = { L_EOR, M_ABS },
+        [0x5D] = { L_EOR, M_ABSX }, [0x59] = { L_EOR, M_ABSY },
+        [0x41] = { L_EOR, M_INDX }, [0x51] = { L_EOR, M_INDY },
+        [0x52] = { L_EOR, M_IND },
+        /* CMP, CPX, CPY */
+        [0xC9] = { L_CMP, M_IMM }, [0xC5] = { L_CMP, M_ZP },
+        [0xD5] = { L_CMP, M_ZPX }, [0xCD] = { L_CMP, M_ABS },
+        [0xDD] = { L_CMP, M_ABSX }, [0xD9] = { L_CMP, M_ABSY },
+        [0xC1] = { L_CMP, M_INDX }, [0xD1] = { L_CMP, M_INDY },
+        [0xD2] = { L_CMP, M_IND },
+        [0xE0] = { L_CPX, M_IMM }, [0xE4] = { L_CPX, M_ZP },
+        [0xEC] = { L_CPX, M_ABS },
+        [0xC0] = { L_CPY, M_IMM }, [0xC4] = { L_CPY, M_ZP },
+        [0xCC] = { L_CPY, M_ABS },
+        /* Shifts and rotations of A */
+        [0x0A] = { L_ASL }, [0x4A] = { L_LSR },
+        [0x2A] = { L_ROL }, [0x6A] = { L_ROR },
+        /* Transfers, increments and decrements */
+        [0xAA] = { L_TAX }, [0xA8] = { L_TAY },
+        [0x8A] = { L_TXA }, [0x98] = { L_TYA },
+        [0xE8] = { L_INX }, [0xC8] = { L_INY },
+        [0xCA] = { L_DEX }, [0x88] = { L_DEY },
+        /* Flags */
+        [0x18] = { L_CLC }, [0x38] = { L_SEC }, [0xB8] = { L_CLV },
+        [0xEA] = { L_NOP },
+        /* INC and DEC of memory */
+        [0xE6] = { L_INC, M_ZP }, [0xF6] = { L_INC, M_ZPX },
+        [0xEE] = { L_INC, M_ABS }, [0xFE] = { L_INC, M_ABSX },
+        [0xC6] = { L_DEC, M_ZP }, [0xD6] = { L_DEC, M_ZPX },
+        [0xCE] = { L_DEC, M_ABS }, [0xDE] = { L_DEC, M_ABSX },
+        /* Branches, BRA, JMP a, JSR and RTS */
+        [0x10] = { L_BRANCH }, [0x30] = { L_BRANCH },
+        [0x50] = { L_BRANCH }, [0x70] = { L_BRANCH },
+        [0x90] = { L_BRANCH }, [0xB0] = { L_BRANCH },
+        [0xD0] = { L_BRANCH }, [0xF0] = { L_BRANCH },
+        [0x80] = { L_BRA }, [0x4C] = { L_JMP },
+        [0x20] = { L_JSR }, [0x60] = { L_RTS }
+};
+
+/*
+ * Opcodes stepped on their own that write memory: 1 for the stack only, 2
+ * for anywhere else (stores, read-modify-write instructions, TSB, TRB, RMB
+ * and SMB).
+ */
+static const uint8_t writes[256] = {
+        [0x20] = 1, [0x48] = 1, [0x08] = 1, [0xDA] = 1, [0x5A] = 1,
+        [0x85] = 2, [0x95] = 2, [0x8D] = 2, [0x9D] = 2, [0x99] = 2,
+        [0x81] = 2, [0x91] = 2, [0x92] = 2, [0x86] = 2, [0x96] = 2,
+        [0x8E] = 2, [0x84] = 2, [0x94] = 2, [0x8C] = 2, [0x64] = 2,
+        [0x74] = 2, [0x9C] = 2, [0x9E] = 2,
+        [0x06] = 2, [0x16] = 2, [0x0E] = 2, [0x1E] = 2,
+        [0x46] = 2, [0x56] = 2, [0x4E] = 2, [0x5E] = 2,
+        [0x26] = 2, [0x36] = 2, [0x2E] = 2, [0x3E] = 2,
+        [0x66] = 2, [0x76] = 2, [0x6E] = 2, [0x7E] = 2,
+        [0xE6] = 2, [0xF6] = 2, [0xEE] = 2, [0xFE] = 2,
+        [0xC6] = 2, [0xD6] = 2, [0xCE] = 2, [0xDE] = 2,
+        [0x04] = 2, [0x0C] = 2, [0x14] = 2, [0x1C] = 2,
+        [0x07] = 2, [0x17] = 2, [0x27] = 2, [0x37] = 2,
+        [0x47] = 2, [0x57] = 2, [0x67] = 2, [0x77] = 2,
+        [0x87] = 2, [0x97] = 2, [0xA7] = 2, [0xB7] = 2,
+        [0xC7] = 2, [0xD7] = 2, [0xE7] = 2, [0xF7] = 2
+};
+
+/* The registers of every machine, one lane each, and what runs next. */
+typedef struct {
+        uint8_t a[LOCKSTEP_LANES];
+        uint8_t x[LOCKSTEP_LANES];
+        uint8_t y[LOCKSTEP_LANES];
+        uint8_t sp[LOCKSTEP_LANES];
+        uint8_t p[LOCKSTEP_LANES];
+        uint16_t pc[LOCKSTEP_LANES];
+        uint64_t cycles[LOCKSTEP_LANES];
+        /* Cycle count each lane stops at. */
+        uint64_t end[LOCKSTEP_LANES];
+        uint8_t running[LOCKSTEP_LANES];
+        Memory *memory[LOCKSTEP_LANES];
+        /* Operand of the instruction being run, one per lane. */
+        uint8_t m[LOCKSTEP_LANES];
+        uint16_t address[LOCKSTEP_LANES];
+        /* 0xFF in the lanes running it (the group), 0 in the others. */
+        uint8_t mask[LOCKSTEP_LANES];
+        /* Number of lanes in the group. */
+        int size;
+        /*
+         * One bit per address, set once every lane was found to hold the
+         * same instruction there, and cleared when one of them may have
+         * written to it.
+         */
+        uint8_t same[RAM_SIZE / 8];
+        /* Pages with bits set in same, listed to clear them quickly. */
+        uint8_t samePages[RAM_SIZE >> 8];
+        uint8_t pages[RAM_SIZE >> 8];
+        int pageCount;
+        /* Whether the kernels below can use AVX2. */
+        int avx2;
+} Lanes;
+
+static int haveAvx2(void)
+{
+#if defined(__x86_64__)
+        return __builtin_cpu_supports("avx2");
+#else
+        return 0;
+#endif
+}
+
+/* N and Z flags of value, like nzFlags[] but without a table lookup. */
+static uint8_t nzOf(uint8_t value)
+{
+        return (value & FLAG_N) | (value == 0) << 1;
+}
+
+/* Replace a lane of a register with value if the lane is in the group. */
+static uint8_t blend(uint8_t old, uint8_t value, uint8_t mask)
+{
+        return (value & mask) | (old & ~mask);
+}
+
+/*
+ * The kernels below work on all the lanes at once and then keep the results
+ * of the lanes in the group only, so that their loops have no branches and
+ * the compiler can vectorize them. Each one mirrors the scalar code in cpu.c;
+ * the ALU ones have hand-written AVX2 versions for CPUs that have it.
+ */
+#if defined(__x86_64__)
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256i load(const uint8_t *lanes)
+{
+        return _mm256_loadu_si256((const __m256i *) lanes);
+}
+
+/* Store the lanes of value that are in the group. */
+AVX2 static void keep(uint8_t *lanes, __m256i value, __m256i mask)
+{
+        _mm256_storeu_si256((__m256i *) lanes,
+                            _mm256_blendv_epi8(load(lanes), value, mask));
+}
+
+AVX2 static __m256i splat(uint8_t value)
+{
+        return _mm256_set1_epi8((char) value);
+}
+
+/* N and Z flags of each result, like nzFlags[]. */
+AVX2 static __m256i nz(__m256i result)
+{
+        __m256i zero = _mm256_cmpeq_epi8(result, _mm256_setzero_si256());
+
+        return _mm256_or_si256(_mm256_and_si256(result, splat(FLAG_N)),
+                               _mm256_and_si256(zero, splat(FLAG_Z)));
+}
+
+/* Replace the flags of p in clear with those in flags. */
+AVX2 static __m256i setFlags(__m256i p, uint8_t clear, __m256i flags)
+{
+        return _mm256_or_si256(_mm256_and_si256(p, splat(~clear)), flags);
+}
+
+AVX2 static void addAvx2(Lanes *lanes)
+{
+        __m256i mask = load(lanes->mask), a = load(lanes->a);
+        __m256i m = load(lanes->m), p = load(lanes->p);
+        __m256i sum, carry, overflow;
+
+        sum = _mm256_add_epi8(_mm256_add_epi8(a, m),
+                              _mm256_and_si256(p, splat(FLAG_C)));
+        /* Bit 7 carries out if both inputs have it, or one and no sum. */
+        carry = _mm256_or_si256(_mm256_and_si256(a, m),
+                                _mm256_andnot_si256(sum,
+                                                    _mm256_or_si256(a, m)));
+        carry = _mm256_and_si256(_mm256_srli_epi16(carry, 7),
+                                 splat(FLAG_C));
+        overflow = _mm256_and_si256(_mm256_xor_si256(a, sum),
+                                    _mm256_xor_si256(m, sum));
+        overflow = _mm256_and_si256(_mm256_srli_epi16(overflow, 1),
+                                    splat(FLAG_V));
+        p = setFlags(p, FLAG_N | FLAG_V | FLAG_Z | FLAG_C,
+                     _mm256_or_si256(nz(sum),
+                                     _mm256_or_si256(overflow, carry)));
+        keep(lanes->a, sum, mask);
+        keep(lanes->p, p, mask);
+}
+
+AVX2 static void logicAvx2(Lanes *lanes, int kind)
+{
+        __m256i mask = load(lanes->mask), a = load(lanes->a);
+        __m256i m = load(lanes->m);
+
+        if (kind == L_AND) {
+                a = _mm256_and_si256(a, m);
+        } else if (kind == L_ORA) {
+                a = _mm256_or_si256(a, m);
+        } else {
+                a = _mm256_xor_si256(a, m);
+        }
+        keep(lanes->a, a, mask);
+        keep(lanes->p, setFlags(load(lanes->p), FLAG_N | FLAG_Z, nz(a)),
+             mask);
+}
+
+AVX2 static void compareAvx2(Lanes *lanes, const uint8_t *registers)
+{
+        __m256i value = load(registers), m = load(lanes->m);
+        __m256i carry;
+
+        /* No borrow when the register is the larger one. */
+        carry = _mm256_cmpeq_epi8(_mm256_max_epu8(value, m), value);
+        keep(lanes->p, setFlags(load(lanes->p), FLAG_N | FLAG_Z | FLAG_C,
+                                _mm256_or_si256(
+                                        nz(_mm256_sub_epi8(value, m)),
+                                        _mm256_and_si256(carry,
+                                                         splat(FLAG_C)))),
+             load(lanes->mask));
+}
+
+AVX2 static void shiftAvx2(Lanes *lanes, int kind)
+{
+        __m256i mask = load(lanes->mask), a = load(lanes->a);
+        __m256i p = load(lanes->p), result, carry;
+        __m256i carryIn = _mm256_and_si256(p, splat(FLAG_C));
+
+        /* There are no byte shifts: shift words, then mask the bytes. */
+        if (kind == L_ASL || kind == L_ROL) {
+                result = _mm256_add_epi8(a, a);
+                carry = _mm256_and_si256(_mm256_srli_epi16(a, 7),
+                                         splat(FLAG_C));
+                if (kind == L_ROL) {
+                        result = _mm256_or_si256(result, carryIn);
+                }
+        } else {
+                result = _mm256_and_si256(_mm256_srli_epi16(a, 1),
+                                          splat(0x7F));
+                carry = _mm256_and_si256(a, splat(FLAG_C));
+                if (kind == L_ROR) {
+                        result = _mm256_or_si256(result,
+                                                 _mm256_slli_epi16(carryIn,
+                                                                   7));
+                }
+        }
+        keep(lanes->a, result, mask);
+        keep(lanes->p, setFlags(p, FLAG_N | FLAG_Z | FLAG_C,
+                                _mm256_or_si256(nz(result), carry)),
+             mask);
+}
+#endif
+
+/* ADC in binary mode, and SBC once its operands are complemented. */
+static void add(Lanes *lanes)
+{
+        unsigned int sum, overflow;
+        int lane;
+
+#if defined(__x86_64__)
+        if (lanes->avx2) {
+                addAvx2(lanes);
+                return;
+        }
+#endif
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                sum = lanes->a[lane] + lanes->m[lane] +
+                        (lanes->p[lane] & FLAG_C);
+                overflow = ~(lanes->a[lane] ^ lanes->m[lane]) &
+                        (lanes->a[lane] ^ sum) & 0x80;
+                lanes->p[lane] = blend(lanes->p[lane],
+                                       (lanes->p[lane] &
+                                        ~(FLAG_N | FLAG_V | FLAG_Z |
+                                          FLAG_C)) |
+                                       nzOf(sum) | overflow >> 1 | sum >> 8,
+                                       lanes->mask[lane]);
+                lanes->a[lane] = blend(lanes->a[lane], sum,
+                                       lanes->mask[lane]);
+        }
+}
+
+/* AND, ORA or EOR. */
+static void logic(Lanes *lanes, int kind)
+{
+        uint8_t a;
+        int lane;
+
+#if defined(__x86_64__)
+        if (lanes->avx2) {
+                logicAvx2(lanes, kind);
+                return;
+        }
+#endif
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                a = lanes->a[lane];
+                if (kind == L_AND) {
+                        a &= lanes->m[lane];
+                } else if (kind == L_ORA) {
+                        a |= lanes->m[lane];
+                } else {
+                        a ^= lanes->m[lane];
+                }
+                lanes->p[lane] = blend(lanes->p[lane],
+                                       (lanes->p[lane] &
+                                        ~(FLAG_N | FLAG_Z)) | nzOf(a),
+                                       lanes->mask[lane]);
+                lanes->a[lane] = blend(lanes->a[lane], a, lanes->mask[lane]);
+        }
+}
+
+/* CMP, CPX or CPY, comparing registers with the operands. */
+static void compare(Lanes *lanes, const uint8_t *registers)
+{
+        unsigned int difference;
+        int lane;
+
+#if defined(__x86_64__)
+        if (lanes->avx2) {
+                compareAvx2(lanes, registers);
+                return;
+        }
+#endif
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                difference = registers[lane] + (lanes->m[lane] ^ 0xFF) + 1;
+                lanes->p[lane] = blend(lanes->p[lane],
+                                       (lanes->p[lane] &
+                                        ~(FLAG_N | FLAG_Z | FLAG_C)) |
+                                       nzOf(difference) | difference >> 8,
+                                       lanes->mask[lane]);
+        }
+}
+
+/* ASL, LSR, ROL or ROR of A. */
+static void shift(Lanes *lanes, int kind)
+{
+        uint8_t a, result, carry;
+        int lane;
+
+#if defined(__x86_64__)
+        if (lanes->avx2) {
+                shiftAvx2(lanes, kind);
+                return;
+        }
+#endif
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                a = lanes->a[lane];
+                carry = lanes->p[lane] & FLAG_C;
+                if (kind == L_ASL || kind == L_ROL) {
+                        result = a << 1 | (kind == L_ROL ? carry : 0);
+                        carry = a >> 7;
+                } else {
+                        result = a >> 1 | (kind == L_ROR ? carry << 7 : 0);
+                        carry = a & FLAG_C;
+                }
+                lanes->p[lane] = blend(lanes->p[lane],
+                                       (lanes->p[lane] &
+                                        ~(FLAG_N | FLAG_Z | FLAG_C)) |
+                                       nzOf(result) | carry,
+                                       lanes->mask[lane]);
+                lanes->a[lane] = blend(lanes->a[lane], result,
+                                       lanes->mask[lane]);
+        }
+}
+
+/* Set a register of each lane in the group, with N and Z. */
+static void assign(Lanes *lanes, uint8_t *registers, const uint8_t *values,
+                   int delta)
+{
+        uint8_t value;
+        int lane;
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                value = values[lane] + delta;
+                registers[lane] = blend(registers[lane], value,
+                                        lanes->mask[lane]);
+                lanes->p[lane] = blend(lanes->p[lane],
+                                       (lanes->p[lane] &
+                                        ~(FLAG_N | FLAG_Z)) | nzOf(value),
+                                       lanes->mask[lane]);
+        }
+}
+
+/* Registers of a lane, for the addressing modes and step(). */
+static void copyOut(const Lanes *lanes, int lane, Registers *registers)
+{
+        registers->a = lanes->a[lane];
+        registers->x = lanes->x[lane];
+        registers->y = lanes->y[lane];
+        registers->sp = lanes->sp[lane];
+        registers->pc = lanes->pc[lane];
+        registers->p = lanes->p[lane];
+        registers->cycles = lanes->cycles[lane];
+}
+
+static void copyIn(Lanes *lanes, int lane, const Registers *registers)
+{
+        lanes->a[lane] = registers->a;
+        lanes->x[lane] = registers->x;
+        lanes->y[lane] = registers->y;
+        lanes->sp[lane] = registers->sp;
+        lanes->pc[lane] = registers->pc;
+        lanes->p[lane] = registers->p;
+        lanes->cycles[lane] = registers->cycles;
+}
+
+/* Forget that the lanes hold the same instructions anywhere. */
+static void forgetAll(Lanes *lanes)
+{
+        uint8_t page;
+        int i;
+
+        for (i = 0; i < lanes->pageCount; i++) {
+                page = lanes->pages[i];
+                memset(&lanes->same[page << 5], 0, 0x100 >> 3);
+                lanes->samePages[page] = 0;
+        }
+        lanes->pageCount = 0;
+}
+
+/*
+ * Run a lane on its own, with the registers of its machine as scratch
+ * space, until it reaches next or an address above it. With next as the
+ * lowest address of the other lanes, it would be picked again anyway until
+ * then; with next 0, it runs one instruction.
+ */
+static void runAlone(Lanes *lanes, Machine *machine, int lane, uint32_t next,
+                     StopReason *stop)
+{
+        Registers *registers = &machine->registers;
+        Memory *memory = &machine->memory;
+        uint8_t opcode, written = 0;
+
+        copyOut(lanes, lane, registers);
+        do {
+                if (!(opcode = memory->ram[registers->pc])) {
+                        lanes->running[lane] = 0;
+                        *stop = STOP_BRK;
+                        break;
+                }
+                registers->pc++;
+                step(opcode, memory, registers);
+                written |= writes[opcode];
+        } while (registers->state == CPU_RUNNING && registers->pc < next &&
+                 registers->cycles < lanes->end[lane]);
+        if (written & 2) {
+                forgetAll(lanes);
+        } else if (written) {
+                memset(&lanes->same[0x100 >> 3], 0, 0x100 >> 3);
+        }
+        if (registers->state == CPU_STOPPED) {
+                lanes->running[lane] = 0;
+                *stop = STOP_STP;
+        } else if (registers->state == CPU_WAITING) {
+                /* With no interrupt to come, WAI waits for the end. */
+                if (registers->cycles < lanes->end[lane]) {
+                        registers->cycles = lanes->end[lane];
+                }
+        }
+        /* WAI, STP and pending interrupts drop the limit. */
+        memory->scheduler.limit = lanes->end[lane];
+        copyIn(lanes, lane, registers);
+}
+
+/* Lowest address of the running lanes other than lane. */
+static uint32_t nextPc(const Lanes *lanes, int lane)
+{
+        uint32_t pc = RAM_SIZE, key;
+        int other;
+
+        for (other = 0; other < LOCKSTEP_LANES; other++) {
+                key = lanes->running[other] && other != lane ?
+                        lanes->pc[other] : RAM_SIZE;
+                pc = key < pc ? key : pc;
+        }
+
+        return pc;
+}
+
+/*
+ * Effective address of the operand in each lane of the group, as computed
+ * by the addressing mode functions of cpu.c. Reads take an extra cycle when
+ * indexing crosses a page.
+ */
+static void locate(Lanes *lanes, int mode, uint16_t operand, int read)
+{
+        Memory *memory;
+        uint16_t base = operand, address = operand;
+        uint8_t pointer;
+        int lane;
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if (!lanes->mask[lane]) {
+                        continue;
+                }
+                memory = lanes->memory[lane];
+                switch (mode) {
+                case M_ZP:
+                        address = operand & 0xFF;
+                        break;
+                case M_ZPX:
+                        address = (operand + lanes->x[lane]) & 0xFF;
+                        break;
+                case M_ZPY:
+                        address = (operand + lanes->y[lane]) & 0xFF;
+                        break;
+                case M_ABSX:
+                        address = operand + lanes->x[lane];
+                        break;
+                case M_ABSY:
+                        address = operand + lanes->y[lane];
+                        break;
+                case M_IND:
+                case M_INDX:
+                case M_INDY:
+                        pointer = operand;
+                        if (mode == M_INDX) {
+                                pointer += lanes->x[lane];
+                        }
+                        base = readMemory(memory, (uint8_t) (pointer + 1))
+                                << 8 | readMemory(memory, pointer);
+                        address = base;
+                        if (mode == M_INDY) {
+                                address += lanes->y[lane];
+                        }
+                        break;
+                }
+                if (read && (mode == M_ABSX || mode == M_ABSY ||
+                             mode == M_INDY)) {
+                        lanes->cycles[lane] += PAGE_CROSSED(base, address);
+                }
+                lanes->address[lane] = address;
+        }
+}
+
+/* Forget that the lanes hold the same instructions over address. */
+static void forget(Lanes *lanes, uint16_t address)
+{
+        int k;
+
+        for (k = 0; k < 3; k++) {
+                lanes->same[(uint16_t) (address - k) >> 3] &=
+                        ~(1 << ((address - k) & 7));
+        }
+}
+
+/* Read the operands of the group, or write the register stored. */
+static void access(Lanes *lanes, int kind)
+{
+        const uint8_t *values = kind == L_STA ? lanes->a :
+                kind == L_STX ? lanes->x : lanes->y;
+        int lane;
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if (!lanes->mask[lane]) {
+                        continue;
+                }
+                if (!STORING(kind)) {
+                        lanes->m[lane] = readMemory(lanes->memory[lane],
+                                                    lanes->address[lane]);
+                } else {
+                        writeMemory(lanes->memory[lane],
+                                    lanes->address[lane],
+                                    kind == L_STZ ? 0 : values[lane]);
+                        forget(lanes, lanes->address[lane]);
+                }
+        }
+}
+
+/* INC or DEC of the operands, written back. */
+static void modify(Lanes *lanes, int delta)
+{
+        uint8_t value;
+        int lane;
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if (!lanes->mask[lane]) {
+                        continue;
+                }
+                value = lanes->m[lane] + delta;
+                writeMemory(lanes->memory[lane], lanes->address[lane], value);
+                forget(lanes, lanes->address[lane]);
+                lanes->p[lane] = (lanes->p[lane] & ~(FLAG_N | FLAG_Z)) |
+                        nzFlags[value];
+        }
+}
+
+/* Push a byte into the stack of a lane, like push(). */
+static void pushLane(Lanes *lanes, int lane, uint8_t value)
+{
+        uint16_t address = 0x0100 | lanes->sp[lane];
+
+        writeMemory(lanes->memory[lane], address, value);
+        forget(lanes, address);
+        lanes->sp[lane]--;
+}
+
+static uint8_t pullLane(Lanes *lanes, int lane)
+{
+        lanes->sp[lane]++;
+
+        return readMemory(lanes->memory[lane], 0x0100 | lanes->sp[lane]);
+}
+
+/* JSR to target, or RTS, with the stack of each lane. */
+static void call(Lanes *lanes, int kind, uint16_t target)
+{
+        uint16_t pc;
+        int lane;
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if (!lanes->mask[lane]) {
+                        continue;
+                }
+                if (kind == L_JSR) {
+                        pc = lanes->pc[lane] - 1;
+                        pushLane(lanes, lane, pc >> 8);
+                        pushLane(lanes, lane, pc & 0xFF);
+                        lanes->pc[lane] = target;
+                } else {
+                        pc = pullLane(lanes, lane);
+                        pc |= pullLane(lanes, lane) << 8;
+                        lanes->pc[lane] = pc + 1;
+                }
+        }
+}
+
+/* Run the instruction shared by the lanes in the group, decoded once. */
+static void runGroup(Lanes *lanes, uint8_t opcode, uint16_t operand)
+{
+        const Operation *operation = &operations[opcode];
+        uint8_t flag, length = lengths[opcode], base = baseCycles[opcode];
+        uint8_t mask, taken;
+        uint16_t target;
+        int lane;
+        static const uint8_t conditions[4] = {
+                FLAG_N, FLAG_V, FLAG_C, FLAG_Z
+        };
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                lanes->pc[lane] += lanes->mask[lane] & length;
+                lanes->cycles[lane] += lanes->mask[lane] & base;
+        }
+
+        if (operation->mode == M_IMM) {
+                memset(lanes->m, operand, sizeof(lanes->m));
+        } else if (operation->mode != M_IMP) {
+                locate(lanes, operation->mode, operand,
+                       !STORING(operation->kind) &&
+                       !MODIFYING(operation->kind));
+                access(lanes, operation->kind);
+        }
+
+        switch (operation->kind) {
+        case L_LDA:
+                assign(lanes, lanes->a, lanes->m, 0);
+                break;
+        case L_LDX:
+                assign(lanes, lanes->x, lanes->m, 0);
+                break;
+        case L_LDY:
+                assign(lanes, lanes->y, lanes->m, 0);
+                break;
+        case L_SBC:
+                /* A - M - !C is A + ~M + C in two's complement. */
+                for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                        lanes->m[lane] ^= 0xFF;
+                }
+                add(lanes);
+                break;
+        case L_ADC:
+                add(lanes);
+                break;
+        case L_AND:
+        case L_ORA:
+        case L_EOR:
+                logic(lanes, operation->kind);
+                break;
+        case L_CMP:
+                compare(lanes, lanes->a);
+                break;
+        case L_CPX:
+                compare(lanes, lanes->x);
+                break;
+        case L_CPY:
+                compare(lanes, lanes->y);
+                break;
+        case L_ASL:
+        case L_LSR:
+        case L_ROL:
+        case L_ROR:
+                shift(lanes, operation->kind);
+                break;
+        case L_TAX:
+                assign(lanes, lanes->x, lanes->a, 0);
+                break;
+        case L_TAY:
+                assign(lanes, lanes->y, lanes->a, 0);
+                break;
+        case L_TXA:
+                assign(lanes, lanes->a, lanes->x, 0);
+                break;
+        case L_TYA:
+                assign(lanes, lanes->a, lanes->y, 0);
+                break;
+        case L_INX:
+                assign(lanes, lanes->x, lanes->x, 1);
+                break;
+        case L_INY:
+                assign(lanes, lanes->y, lanes->y, 1);
+                break;
+        case L_DEX:
+                assign(lanes, lanes->x, lanes->x, -1);
+                break;
+        case L_DEY:
+                assign(lanes, lanes->y, lanes->y, -1);
+                break;
+        case L_CLC:
+        case L_SEC:
+        case L_CLV:
+                flag = operation->kind == L_CLV ? FLAG_V : FLAG_C;
+                for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                        lanes->p[lane] = blend(lanes->p[lane],
+                                               (lanes->p[lane] & ~flag) |
+                                               (operation->kind == L_SEC ?
+                                                flag : 0),
+                                               lanes->mask[lane]);
+                }
+                break;
+        case L_BRANCH:
+        case L_BRA:
+                /* Bits 7-6 select the flag, bit 5 the value to branch on. */
+                flag = conditions[opcode >> 6];
+                for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                        taken = operation->kind == L_BRA ||
+                                !(lanes->p[lane] & flag) == !(opcode & 0x20);
+                        mask = lanes->mask[lane] & -taken;
+                        target = lanes->pc[lane] + SIGNED(operand & 0xFF);
+                        lanes->cycles[lane] += mask &
+                                (1 + PAGE_CROSSED(lanes->pc[lane], target));
+                        lanes->pc[lane] = mask ? target : lanes->pc[lane];
+                }
+                break;
+        case L_JMP:
+                for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                        lanes->pc[lane] = lanes->mask[lane] ? operand :
+                                lanes->pc[lane];
+                }
+                break;
+        case L_JSR:
+        case L_RTS:
+                call(lanes, operation->kind, operand);
+                break;
+        case L_INC:
+                modify(lanes, 1);
+                break;
+        case L_DEC:
+                modify(lanes, -1);
+                break;
+        }
+}
+
+/* Whether every running lane holds the same instruction at pc. */
+static int sameCode(Lanes *lanes, uint16_t pc)
+{
+        const uint8_t *code = NULL, *ram;
+        int lane, length = 0, k;
+
+        if (lanes->same[pc >> 3] & 1 << (pc & 7)) {
+                return 1;
+        }
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if (!lanes->running[lane]) {
+                        continue;
+                }
+                ram = lanes->memory[lane]->ram;
+                if (!code) {
+                        code = ram;
+                        length = lengths[code[pc]];
+                }
+                for (k = 0; k < length; k++) {
+                        if (ram[(uint16_t) (pc + k)] !=
+                            code[(uint16_t) (pc + k)]) {
+                                return 0;
+                        }
+                }
+        }
+        lanes->same[pc >> 3] |= 1 << (pc & 7);
+        if (!lanes->samePages[pc >> 8]) {
+                lanes->samePages[pc >> 8] = 1;
+                lanes->pages[lanes->pageCount++] = pc >> 8;
+        }
+
+        return 1;
+}
+
+/*
+ * Pick the lanes to run next: the running ones at the lowest address that
+ * hold the same instruction bytes as the first of them. Lanes out of budget
+ * stop on the way, with the STOP_BUDGET they started with. Returns the first
+ * lane picked, or -1 if none is left.
+ */
+static int gather(Lanes *lanes)
+{
+        const uint8_t *code, *ram;
+        uint32_t pc = RAM_SIZE, key;
+        int lane, first, length, k;
+
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                lanes->running[lane] &=
+                        lanes->cycles[lane] < lanes->end[lane];
+                key = lanes->running[lane] ? lanes->pc[lane] : RAM_SIZE;
+                pc = key < pc ? key : pc;
+        }
+        if (pc == RAM_SIZE) {
+                return -1;
+        }
+
+        lanes->size = 0;
+        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                lanes->mask[lane] = -(lanes->running[lane] &
+                                      (lanes->pc[lane] == pc));
+                lanes->size += lanes->mask[lane] & 1;
+        }
+        first = 0;
+        while (!lanes->mask[first]) {
+                first++;
+        }
+        if (sameCode(lanes, pc)) {
+                return first;
+        }
+        code = lanes->memory[first]->ram;
+        length = lengths[code[pc]];
+        for (lane = first; lane < LOCKSTEP_LANES; lane++) {
+                for (k = 0; lanes->mask[lane] && k < length; k++) {
+                        ram = lanes->memory[lane]->ram;
+                        if (ram[(uint16_t) (pc + k)] !=
+                            code[(uint16_t) (pc + k)]) {
+                                lanes->mask[lane] = 0;
+                                lanes->size--;
+                        }
+                }
+        }
+
+        return first;
+}
+
+int runLockstep(Machine **machines, int count, uint64_t budget,
+                StopReason *stops)
+{
+        Lanes lanes;
+        const uint8_t *code;
+        uint8_t opcode;
+        uint16_t pc, operand;
+        int lane, first, decimal;
+
+        if (count < 1 || count > LOCKSTEP_LANES) {
+                return -EINVAL;
+        }
+
+        memset(&lanes, 0, sizeof(lanes));
+        lanes.avx2 = haveAvx2();
+        for (lane = 0; lane < count; lane++) {
+                copyIn(&lanes, lane, &machines[lane]->registers);
+                lanes.memory[lane] = &machines[lane]->memory;
+                lanes.end[lane] = lanes.cycles[lane] + budget;
+                /* Saturate so that huge budgets mean "run until BRK". */
+                if (lanes.end[lane] < lanes.cycles[lane]) {
+                        lanes.end[lane] = UINT64_MAX;
+                }
+                machines[lane]->memory.scheduler.limit = lanes.end[lane];
+                lanes.running[lane] = 1;
+                stops[lane] = STOP_BUDGET;
+                if (machines[lane]->registers.state == CPU_STOPPED) {
+                        lanes.running[lane] = 0;
+                        stops[lane] = STOP_STP;
+                } else if (machines[lane]->registers.state == CPU_WAITING) {
+                        lanes.cycles[lane] = lanes.end[lane];
+                }
+        }
+
+        while ((first = gather(&lanes)) >= 0) {
+                /* A lane on its own runs up to where the others wait. */
+                if (lanes.size == 1) {
+                        runAlone(&lanes, machines[first], first,
+                                 nextPc(&lanes, first), &stops[first]);
+                        continue;
+                }
+                code = lanes.memory[first]->ram;
+                pc = lanes.pc[first];
+                if (!(opcode = code[pc])) {
+                        for (lane = first; lane < count; lane++) {
+                                if (lanes.mask[lane]) {
+                                        lanes.running[lane] = 0;
+                                        stops[lane] = STOP_BRK;
+                                }
+                        }
+                        continue;
+                }
+                operand = code[(uint16_t) (pc + 2)] << 8 |
+                        code[(uint16_t) (pc + 1)];
+
+                /* Decimal mode arithmetic is left to the scalar code. */
+                decimal = 0;
+                if (operations[opcode].kind == L_ADC ||
+                    operations[opcode].kind == L_SBC) {
+                        for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                                decimal |= lanes.p[lane] & lanes.mask[lane];
+                        }
+                        decimal &= FLAG_D;
+                }
+
+                if (operations[opcode].kind != L_STEP && !decimal) {
+                        runGroup(&lanes, opcode, operand);
+                        continue;
+                }
+                for (lane = first; lane < count; lane++) {
+                        if (lanes.mask[lane]) {
+                                runAlone(&lanes, machines[lane], lane, 0,
+                                         &stops[lane]);
+                        }
+                }
+        }
+
+        for (lane = 0; lane < count; lane++) {
+                copyOut(&lanes, lane, &machines[lane]->registers);
+        }
+
+        return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "cpu.h"
+
+/* Most machines run by one runLockstep() call, one per byte of a vector. */
+#define LOCKSTEP_LANES 32
+
+/*
+ * Run count machines, usually holding the same program with different
+ * inputs, until each of them has run budget more cycles, fetched a BRK or
+ * run a STP; stops[i] gets why machines[i] stopped. Results are the same
+ * as running each machine with executeCycles(), but events are not run
+ * and interrupts are not taken, and a WAI spends the rest of the budget.
+ *
+ * The registers of all the machines are kept as arrays, one lane each.
+ * Lanes at the same instruction run it together, decoded once, with vector
+ * kernels for the ALU operations (AVX2 when the CPU has it); each lane
+ * still reads and writes its own memory. Other instructions are stepped
+ * lane by lane, and a lane that diverged from the others runs on its own.
+ * Lanes at the lowest address go first, so that lanes which branched ahead
+ * wait for the others to catch up.
+ *
+ * Returns 0, or -EINVAL if count is not between 1 and LOCKSTEP_LANES.
+ */
+int runLockstep(Machine **machines, int count, uint64_t budget,
+                StopReason *stops);
+
+#endif  /* LOCKSTEP_H */
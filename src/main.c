@@ -1,28 +1,389 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
-#include "cpu.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include "tony6502.h"
+#include "batch.h"
+#include "conformance.h"
 
-#define RAM_SIZE 0xFFFF
+/* Names of the -f formats, indexed by Tony6502Format. */
+static const char *const formatNames[] = {
+        [TONY6502_AUTO] = "auto",
+        [TONY6502_RAW] = "raw",
+        [TONY6502_IHEX] = "ihex",
+        [TONY6502_SREC] = "srec",
+        [TONY6502_PRG] = "prg"
+};
+
+/* Cycle budget of each test case when fuzzing. */
+#define FUZZ_CYCLES 10000000
+
+/* Baud rate of the serial console unless given with -B. */
+#define SERIAL_BAUD 9600
+
+/* Most -w options taken. */
+#define MAX_WATCHES 16
+
+/* A -w option: addresses first to last, watched for types. */
+typedef struct {
+        uint16_t first;
+        uint16_t last;
+        int types;
+} Watch;
+
+/*
+ * Parse address[-address][:rwx] into a watch, breakpoints if no types are
+ * given. Returns 0, or -EINVAL.
+ */
+static int parseWatch(const char *text, Watch *watch)
+{
+        unsigned long first, last;
+        char *end;
+
+        first = last = strtoul(text, &end, 0);
+        if (end != text && *end == '-') {
+                text = end + 1;
+                last = strtoul(text, &end, 0);
+        }
+        if (end == text || first > last || last >= 0x10000) {
+                return -EINVAL;
+        }
+        watch->first = first;
+        watch->last = last;
+        watch->types = *end ? 0 : TONY6502_EXECUTE;
+        if (*end == ':' && !end[1]) {
+                return -EINVAL;
+        }
+        if (*end && *end++ != ':') {
+                return -EINVAL;
+        }
+        for (; *end; end++) {
+                switch (*end) {
+                case 'r':
+                        watch->types |= TONY6502_READ;
+                        break;
+                case 'w':
+                        watch->types |= TONY6502_WRITE;
+                        break;
+                case 'x':
+                        watch->types |= TONY6502_EXECUTE;
+                        break;
+                default:
+                        return -EINVAL;
+                }
+        }
+
+        return 0;
+}
+
+static void usage(void)
+{
+        printf("Usage: tony6502 [-a load address] [-f format] [-t trace] "
+               "[-p profile] [-r clock rate]\n"
+               "                [-w address[-address][:rwx]]... "
+               "[-z input address] [-l log]\n"
+               "                [-s serial address [-o output] [-i input] "
+               "[-B baud]]\n"
+               "                <path/to/program>\n"
+               "       tony6502 -L <log> [-t trace] [-p profile] "
+               "[-w address[-address][:rwx]]...\n"
+               "                [-s serial address [-o output] [-i input] "
+               "[-B baud]]\n"
+               "       tony6502 -b <manifest> [-j threads]\n"
+               "       tony6502 -c [-j threads] <vectors>...\n");
+}
 
 int main(int argc, char **argv)
 {
-        uint8_t ram[RAM_SIZE];
-        FILE *program;
+        Tony6502 *machine;
+        unsigned long address = 0x0000, input = 0;
+        char *manifest = NULL, *trace = NULL, *profile = NULL, *end;
+        char *record = NULL, *replay = NULL;
+        char *serialOutput = NULL, *serialInput = NULL;
+        long size, threads = 0, serial = -1, error = 0;
+        double rate = 0, baud = SERIAL_BAUD;
+        FILE *output = stdout;
+        int inputFd = STDIN_FILENO;
+        Tony6502Format format = TONY6502_AUTO;
+        Watch watches[MAX_WATCHES];
+        int opt, conformance = 0, watchCount = 0, fuzz = 0, i;
+
+        while ((opt = getopt(argc, argv, "a:b:B:cf:i:j:l:L:o:p:r:s:t:w:z:")) != -1) {
+                switch (opt) {
+                case 'a':
+                        address = strtoul(optarg, &end, 0);
+                        if (*end != '\0' || address >= 0x10000) {
+                                printf("Invalid load address: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'b':
+                        manifest = optarg;
+                        break;
+                case 'B':
+                        baud = strtod(optarg, &end);
+                        if (*end != '\0' || !(baud >= 1)) {
+                                printf("Invalid baud rate: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'c':
+                        conformance = 1;
+                        break;
+                case 'f':
+                        for (format = TONY6502_AUTO; format <= TONY6502_PRG;
+                             format++) {
+                                if (!strcmp(optarg, formatNames[format])) {
+                                        break;
+                                }
+                        }
+                        if (format > TONY6502_PRG) {
+                                printf("Invalid format: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'i':
+                        serialInput = optarg;
+                        break;
+                case 'j':
+                        threads = strtol(optarg, &end, 0);
+                        if (*end != '\0' || threads < 1 || threads > 1024) {
+                                printf("Invalid thread count: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'l':
+                        record = optarg;
+                        break;
+                case 'L':
+                        replay = optarg;
+                        break;
+                case 'o':
+                        serialOutput = optarg;
+                        break;
+                case 'p':
+                        profile = optarg;
+                        break;
+                case 'r':
+                        rate = strtod(optarg, &end);
+                        if (*end != '\0' || !(rate >= 1)) {
+                                printf("Invalid clock rate: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 's':
+                        serial = strtol(optarg, &end, 0);
+                        if (*end != '\0' || serial < 0 || serial >= 0x10000) {
+                                printf("Invalid serial address: %s\n",
+                                       optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 't':
+                        trace = optarg;
+                        break;
+                case 'w':
+                        if (watchCount == MAX_WATCHES) {
+                                printf("Too many watches, at most %d\n",
+                                       MAX_WATCHES);
+                                return -EINVAL;
+                        }
+                        if (parseWatch(optarg, &watches[watchCount]) < 0) {
+                                printf("Invalid watch: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        watchCount++;
+                        break;
+                case 'z':
+                        input = strtoul(optarg, &end, 0);
+                        if (*end != '\0' || input >= 0x10000) {
+                                printf("Invalid input address: %s\n",
+                                       optarg);
+                                return -EINVAL;
+                        }
+                        fuzz = 1;
+                        break;
+                default:
+                        usage();
+                        return -1;
+                }
+        }
 
-        if (argc != 2) {
-                printf("Usage: tony6502 <path/to/program>\n");
+        if (manifest) {
+                if (optind != argc) {
+                        usage();
+                        return -1;
+                }
+                size = runBatch(manifest, threads, stdout);
+                if (size < 0) {
+                        printf("Could not run %s: %s\n", manifest,
+                               strerror(-size));
+                }
+                return size;
+        }
+
+        if (conformance) {
+                if (optind == argc) {
+                        usage();
+                        return -1;
+                }
+                size = runConformance(&argv[optind], argc - optind, threads,
+                                      stdout);
+                return size < 0 ? size : size > 0;
+        }
+
+        /* Replays start from the program the log recorded. */
+        if (replay ? optind != argc || record || fuzz :
+            optind != argc - 1) {
+                usage();
                 return -1;
         }
 
-        program = fopen(argv[1], "rb");
+        if (!(machine = tony6502Create())) {
+                printf("Could not create a machine: %s\n", strerror(ENOMEM));
+                return -ENOMEM;
+        }
 
-        if (!program) {
-                printf("No such file\n");
-                return -ENOENT;
+        /*
+         * Pace and map devices first: the serial console counts its baud
+         * rate at the pace, and replays check the devices are as logged.
+         */
+        if (rate && (size = tony6502SetPace(machine, rate)) < 0) {
+                printf("Could not pace: %s\n", strerror(-size));
+                tony6502Destroy(machine);
+                return size;
         }
 
-        execute(program, ram);
+        if (serial >= 0) {
+                if (serialOutput && !(output = fopen(serialOutput, "w"))) {
+                        size = -errno;
+                        printf("Could not open %s: %s\n", serialOutput,
+                               strerror(-size));
+                        tony6502Destroy(machine);
+                        return size;
+                }
+                if (serialInput &&
+                    (inputFd = open(serialInput, O_RDONLY)) < 0) {
+                        size = -errno;
+                        printf("Could not open %s: %s\n", serialInput,
+                               strerror(-size));
+                        tony6502Destroy(machine);
+                        return size;
+                }
+                if ((size = tony6502AttachSerial(machine, serial, output,
+                                                 inputFd, baud)) < 0) {
+                        printf("Could not attach the serial console: %s\n",
+                               strerror(-size));
+                        tony6502Destroy(machine);
+                        return size;
+                }
+        }
 
-        return 0;
+        if (replay) {
+                if ((size = tony6502StartReplay(machine, replay)) < 0) {
+                        printf("Could not replay %s: %s%s\n", replay,
+                               strerror(-size), size == -EINVAL ?
+                               ", or recorded with other -s" : "");
+                        tony6502Destroy(machine);
+                        return size;
+                }
+        } else if ((size = tony6502LoadProgram(machine, argv[optind], format,
+                                               address)) < 0) {
+                printf("Could not load %s: %s\n", argv[optind],
+                       strerror(-size));
+                tony6502Destroy(machine);
+                return size;
+        }
+
+        if (trace && (size = tony6502StartTrace(machine, trace)) < 0) {
+                printf("Could not trace to %s: %s%s\n", trace,
+                       strerror(-size), size == -ENOTSUP ?
+                       ", build with TRACE=1" : "");
+                tony6502Destroy(machine);
+                return size;
+        }
+        if (profile && (size = tony6502StartProfile(machine)) < 0) {
+                printf("Could not profile: %s%s\n", strerror(-size),
+                       size == -ENOTSUP ? ", build with PROFILE=1" : "");
+                tony6502Destroy(machine);
+                return size;
+        }
+
+        for (i = 0; i < watchCount; i++) {
+                if ((size = tony6502Watch(machine, watches[i].first,
+                                          watches[i].last,
+                                          watches[i].types)) < 0) {
+                        printf("Could not watch: %s\n", strerror(-size));
+                        tony6502Destroy(machine);
+                        return size;
+                }
+        }
+
+        if (record && (size = tony6502StartRecording(machine, record)) < 0) {
+                printf("Could not record to %s: %s\n", record,
+                       strerror(-size));
+                tony6502Destroy(machine);
+                return size;
+        }
+
+        if (fuzz) {
+                size = tony6502Fuzz(machine, input, FUZZ_CYCLES);
+                if (size < 0) {
+                        printf("Could not fuzz: %s%s\n", strerror(-size),
+                               size == -ENOTSUP ?
+                               ", build with COVERAGE=1" : "");
+                }
+                tony6502Destroy(machine);
+                return size;
+        }
+
+        switch (tony6502Run(machine, UINT64_MAX)) {
+        case TONY6502_BREAKPOINT:
+        case TONY6502_WATCHPOINT:
+                tony6502WriteHit(machine, stdout);
+                break;
+        default:
+                break;
+        }
+
+        if (serial >= 0 && (size = tony6502DetachSerial(machine)) < 0) {
+                printf("Could not write serial output: %s\n",
+                       strerror(-size));
+                error = size;
+        }
+
+        if (rate) {
+                tony6502WritePace(machine, stdout);
+        }
+
+        if ((record || replay) &&
+            (size = tony6502StopRecording(machine)) < 0) {
+                printf("Could not %s %s: %s\n",
+                       record ? "write" : "replay all of",
+                       record ? record : replay, strerror(-size));
+                error = size;
+        }
+
+        if (trace && (size = tony6502StopTrace(machine)) < 0) {
+                printf("Could not write %s: %s\n", trace, strerror(-size));
+                error = size;
+        }
+        if (profile &&
+            (size = tony6502WriteProfile(machine, stdout, profile)) < 0) {
+                printf("Could not write %s: %s\n", profile, strerror(-size));
+                error = size;
+        }
+        tony6502Destroy(machine);
+        if (output != stdout) {
+                fclose(output);
+        }
+        if (inputFd != STDIN_FILENO) {
+                close(inputFd);
+        }
+
+        /* The last of the errors above, if any. */
+        return error;
 }
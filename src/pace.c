@@ -0,0 +1,173 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <time.h>
+#include "cpu.h"
+#include "rewind.h"
+#include "pace.h"
+
+/* Wall clock time of one slice by default, in nanoseconds. */
+#define SLICE_TIME 100000
+/* Sleeps timed to calibrate, and how long each of them is. */
+#define CALIBRATION_SLEEPS 16
+#define CALIBRATION_TIME 200000
+/* Bounds of the sleep margin. */
+#define MIN_MARGIN 10000
+#define MAX_MARGIN 2000000
+/* How far behind a schedule may fall before it starts over. */
+#define MAX_BEHIND 50000000
+
+static int64_t now(void)
+{
+        struct timespec time;
+
+        clock_gettime(CLOCK_MONOTONIC, &time);
+
+        return (int64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void sleepUntil(int64_t time)
+{
+        struct timespec until = {time / 1000000000, time % 1000000000};
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+                               NULL) == EINTR) {
+        }
+}
+
+int initPacer(Pacer *pacer, double hz, uint64_t slice)
+{
+        int64_t target, late, margin = 0;
+        int i;
+
+        if (!(hz >= 1)) {
+                return -EINVAL;
+        }
+        if (!slice) {
+                slice = hz * SLICE_TIME / 1e9;
+        }
+        if (!slice) {
+                return -EINVAL;
+        }
+
+        /* Twice the latest wake up seen, within bounds. */
+        for (i = 0; i < CALIBRATION_SLEEPS; i++) {
+                target = now() + CALIBRATION_TIME;
+                sleepUntil(target);
+                if ((late = now() - target) > margin) {
+                        margin = late;
+                }
+        }
+        margin *= 2;
+        if (margin < MIN_MARGIN) {
+                margin = MIN_MARGIN;
+        } else if (margin > MAX_MARGIN) {
+                margin = MAX_MARGIN;
+        }
+
+        *pacer = (Pacer) {
+                .hz = hz,
+                .slice = slice,
+                .margin = margin
+        };
+
+        return 0;
+}
+
+/* Start the schedule over at the current time and cycle count. */
+static void restart(Pacer *pacer, uint64_t cycles)
+{
+        pacer->start = now();
+        pacer->cycles = cycles;
+}
+
+/* Sleep until shortly before deadline, then spin; returns when it woke. */
+static int64_t waitUntil(const Pacer *pacer, int64_t deadline)
+{
+        int64_t time = now();
+
+        if (deadline - time > pacer->margin) {
+                sleepUntil(deadline - pacer->margin);
+        }
+        while ((time = now()) < deadline) {
+        }
+
+        return time;
+}
+
+StopReason runPaced(Pacer *pacer, Machine *machine, uint64_t budget)
+{
+        Registers *registers = &machine->registers;
+        Memory *memory = &machine->memory;
+        uint64_t end = registers->cycles + budget, slice;
+        StopReason reason = STOP_BUDGET;
+        int64_t deadline, time;
+
+        /* Saturate so that huge budgets mean "run until BRK". */
+        if (end < registers->cycles) {
+                end = UINT64_MAX;
+        }
+
+        if (!pacer->slices || registers->cycles !=
+            memory->scheduler.stopped) {
+                restart(pacer, registers->cycles);
+        }
+        while (reason == STOP_BUDGET && registers->cycles < end) {
+                slice = end - registers->cycles;
+                if (slice > pacer->slice) {
+                        slice = pacer->slice;
+                }
+                reason = memory->rewind ? runRewind(memory->rewind, slice) :
+                        executeCycles(registers, memory, slice);
+                pacer->slices++;
+
+                deadline = pacer->start +
+                        (int64_t) ((registers->cycles - pacer->cycles) *
+                                   1e9 / pacer->hz);
+                time = now();
+                if (time > deadline) {
+                        pacer->overruns++;
+                } else {
+                        time = waitUntil(pacer, deadline);
+                        pacer->lateness += time - deadline;
+                        if (time - deadline > pacer->maxLateness) {
+                                pacer->maxLateness = time - deadline;
+                        }
+                        if (time - deadline > PACE_JITTER) {
+                                pacer->lateWaits++;
+                        }
+                }
+                pacer->drift = deadline - time;
+                if (pacer->drift < pacer->maxDrift) {
+                        pacer->maxDrift = pacer->drift;
+                }
+                if (pacer->drift < -MAX_BEHIND) {
+                        pacer->resyncs++;
+                        restart(pacer, registers->cycles);
+                }
+        }
+
+        return reason;
+}
+
+int printPacer(const Pacer *pacer, FILE *out)
+{
+        uint64_t waits = pacer->slices - pacer->overruns;
+
+        fprintf(out, "paced at %.0f Hz in %llu cycle slices: %llu slices, "
+                "%llu overruns, %llu resyncs\n", pacer->hz,
+                (unsigned long long) pacer->slice,
+                (unsigned long long) pacer->slices,
+                (unsigned long long) pacer->overruns,
+                (unsigned long long) pacer->resyncs);
+        fprintf(out, "wait lateness: mean %.1f us, worst %.1f us, "
+                "%llu of %llu waits over %d us\n",
+                waits ? pacer->lateness / 1e3 / waits : 0.0,
+                pacer->maxLateness / 1e3,
+                (unsigned long long) pacer->lateWaits,
+                (unsigned long long) waits, PACE_JITTER / 1000);
+        fprintf(out, "drift: %.1f us at the end, worst %.1f us\n",
+                pacer->drift / 1e3, pacer->maxDrift / 1e3);
+
+        return ferror(out) ? -EIO : 0;
+}
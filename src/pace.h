@@ -0,0 +1,67 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* Lateness a wait should stay within, in nanoseconds. */
+#define PACE_JITTER 100000
+
+/*
+ * Paced execution, for programs that have to keep time with the outside
+ * world: runPaced() runs slices of a few cycles each, as fast as it can,
+ * then waits until the CLOCK_MONOTONIC wall clock has caught up with the
+ * cycle count at the clock rate. Deadlines are absolute, counted from
+ * where the schedule started, so that waking up late does not add up.
+ *
+ * Waits sleep until shortly before the deadline then spin for the rest,
+ * the margin being how late sleeps were seen to wake up when calibrating.
+ * A program that runs slower than the clock overruns its deadlines; once
+ * it falls too far behind, the schedule restarts from where it is rather
+ * than have it run flat out to catch up.
+ */
+typedef struct {
+        double hz;
+        uint64_t slice;
+        /* Nanoseconds before a deadline to stop sleeping and spin. */
+        int64_t margin;
+        /* Wall clock and cycle count the schedule counts from. */
+        int64_t start;
+        uint64_t cycles;
+        /* Slices run, deadlines missed and schedule restarts. */
+        uint64_t slices;
+        uint64_t overruns;
+        uint64_t resyncs;
+        /*
+         * Sum and worst of how late the waits ended, in nanoseconds, and
+         * how many ended more than PACE_JITTER late.
+         */
+        int64_t lateness;
+        int64_t maxLateness;
+        uint64_t lateWaits;
+        /*
+         * How far the cycle count was ahead of (positive) or behind the
+         * wall clock after the last slice, and at worst behind.
+         */
+        int64_t drift;
+        int64_t maxDrift;
+} Pacer;
+
+/*
+ * Set up pacing at hz cycles per second, in slices of slice cycles (0 for
+ * 100 microseconds' worth), calibrating the sleep margin, which takes a
+ * few milliseconds. Returns 0, or -EINVAL for a rate or slice below one
+ * cycle.
+ */
+int initPacer(Pacer *pacer, double hz, uint64_t slice);
+/*
+ * executeCycles() on the machine, through its rewind buffer if it has one,
+ * paced. The schedule starts over on the first call, and on calls not
+ * continuing from where the previous one stopped.
+ */
+StopReason runPaced(Pacer *pacer, Machine *machine, uint64_t budget);
+/* Print the statistics so far, returns 0 or -EIO on write errors. */
+int printPacer(const Pacer *pacer, FILE *out);
+
+#endif  /* PACE_H */
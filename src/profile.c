@@ -0,0 +1,166 @@
+#include "profile.h"
+
+#if defined(PROFILE)
+
+#include <stdlib.h>
+#include <errno.h>
+
+/* Rows printed per section of the report. */
+#define REPORT_ROWS 20
+
+/* A counter to sort on, and what it counts. */
+typedef struct {
+        uint64_t key;
+        uint32_t index;
+} Entry;
+
+/* Largest keys first, then lowest indices. */
+static int compareEntries(const void *a, const void *b)
+{
+        const Entry *first = a, *second = b;
+
+        if (first->key != second->key) {
+                return first->key < second->key ? 1 : -1;
+        }
+
+        return first->index < second->index ? -1 : 1;
+}
+
+/* Sort the non-zero keys of a section; returns how many there are. */
+static size_t sortEntries(Entry *entries, size_t count)
+{
+        size_t index, used = 0;
+
+        for (index = 0; index < count; index++) {
+                if (entries[index].key) {
+                        entries[used++] = entries[index];
+                }
+        }
+        qsort(entries, used, sizeof(*entries), compareEntries);
+
+        return used;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+        return total ? 100.0 * part / total : 0.0;
+}
+
+int printProfile(const Profile *profile, FILE *out)
+{
+        Entry *entries = malloc(RAM_SIZE * sizeof(*entries));
+        uint64_t instructions = 0, cycles = 0, accesses = 0;
+        size_t index, count;
+
+        if (!entries) {
+                return -ENOMEM;
+        }
+
+        for (index = 0; index < 256; index++) {
+                instructions += profile->opcodeCounts[index];
+                cycles += profile->opcodeCycles[index];
+                accesses += profile->pageReads[index] +
+                        profile->pageWrites[index];
+        }
+        fprintf(out, "%llu instructions, %llu cycles, %llu data accesses\n",
+                (unsigned long long) instructions,
+                (unsigned long long) cycles, (unsigned long long) accesses);
+
+        for (index = 0; index < 256; index++) {
+                entries[index] = (Entry) { profile->opcodeCycles[index],
+                                           index };
+        }
+        count = sortEntries(entries, 256);
+        fprintf(out, "\nopcode        count       cycles  %%cycles  "
+                "cycles/op\n");
+        for (index = 0; index < count && index < REPORT_ROWS; index++) {
+                fprintf(out, "    %02X %12llu %12llu %7.2f%% %10.2f\n",
+                        entries[index].index,
+                        (unsigned long long)
+                        profile->opcodeCounts[entries[index].index],
+                        (unsigned long long) entries[index].key,
+                        percent(entries[index].key, cycles),
+                        (double) entries[index].key /
+                        profile->opcodeCounts[entries[index].index]);
+        }
+
+        for (index = 0; index < RAM_SIZE; index++) {
+                entries[index] = (Entry) { profile->pcCounts[index], index };
+        }
+        count = sortEntries(entries, RAM_SIZE);
+        fprintf(out, "\naddress       count  %%instructions\n");
+        for (index = 0; index < count && index < REPORT_ROWS; index++) {
+                fprintf(out, "   %04X %12llu %13.2f%%\n",
+                        entries[index].index,
+                        (unsigned long long) entries[index].key,
+                        percent(entries[index].key, instructions));
+        }
+
+        for (index = 0; index < 256; index++) {
+                entries[index] = (Entry) { profile->pageReads[index] +
+                                           profile->pageWrites[index],
+                                           index };
+        }
+        count = sortEntries(entries, 256);
+        fprintf(out, "\npage         reads       writes  %%accesses\n");
+        for (index = 0; index < count && index < REPORT_ROWS; index++) {
+                fprintf(out, "  %02X   %12llu %12llu %9.2f%%\n",
+                        entries[index].index,
+                        (unsigned long long)
+                        profile->pageReads[entries[index].index],
+                        (unsigned long long)
+                        profile->pageWrites[entries[index].index],
+                        percent(entries[index].key, accesses));
+        }
+
+        free(entries);
+
+        return 0;
+}
+
+int dumpProfile(const Profile *profile, const char *path)
+{
+        FILE *file = fopen(path, "w");
+        int index, error = 0;
+
+        if (!file) {
+                return -errno;
+        }
+
+        for (index = 0; index < 256; index++) {
+                if (profile->opcodeCounts[index]) {
+                        fprintf(file, "opcode %02X %llu %llu\n", index,
+                                (unsigned long long)
+                                profile->opcodeCounts[index],
+                                (unsigned long long)
+                                profile->opcodeCycles[index]);
+                }
+        }
+        for (index = 0; index < RAM_SIZE; index++) {
+                if (profile->pcCounts[index]) {
+                        fprintf(file, "pc %04X %llu\n", index,
+                                (unsigned long long)
+                                profile->pcCounts[index]);
+                }
+        }
+        for (index = 0; index < 256; index++) {
+                if (profile->pageReads[index] || profile->pageWrites[index]) {
+                        fprintf(file, "page %02X %llu %llu\n", index,
+                                (unsigned long long)
+                                profile->pageReads[index],
+                                (unsigned long long)
+                                profile->pageWrites[index]);
+                }
+        }
+
+        if (ferror(file)) {
+                error = -EIO;
+        }
+        if (fclose(file) && !error) {
+                error = -errno;
+        }
+
+        return error;
+}
+
+#endif  /* PROFILE */
@@ -0,0 +1,26 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "cpu.h"
+
+#if defined(PROFILE)
+/*
+ * Execution profiling, compiled in with PROFILE and enabled by pointing
+ * memory->profile at a zeroed Profile. Translated code is not profiled,
+ * so the JIT engine interprets everything meanwhile.
+ */
+/*
+ * Human readable report, the busiest opcodes, addresses and pages first.
+ * Returns 0, or -ENOMEM.
+ */
+int printProfile(const Profile *profile, FILE *out);
+/*
+ * Write every non-zero counter to path, one per line, as "opcode XX count
+ * cycles", "pc XXXX count" and "page XX reads writes" (hexadecimal keys,
+ * decimal counts). Returns 0, or a negative errno value.
+ */
+int dumpProfile(const Profile *profile, const char *path);
+#endif
+
+#endif  /* PROFILE_H */
@@ -0,0 +1,623 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cpu.h"
+#include "rewind.h"
+#include "record.h"
+
+#define MAGIC "T65R"
+#define VERSION 2
+/* Bytes of the bitmap of device pages in the header. */
+#define DEVICE_MAP_SIZE ((RAM_SIZE >> 8) / 8)
+/* Bytes of the stdio buffer of the log. */
+#define BUFFER_SIZE 0x100000
+/* Entry kinds, in the low bits of the cycle delta. */
+#define KIND_BITS 3
+#define KIND_MASK ((1 << KIND_BITS) - 1)
+
+enum {
+        ENTRY_READ,
+        ENTRY_IRQ,
+        ENTRY_NMI,
+        ENTRY_WRITE,
+        ENTRY_SET,
+        ENTRY_END
+};
+
+enum {
+        MODE_RECORDING,
+        MODE_REPLAYING,
+        /* A replay that got to the end. */
+        MODE_LIVE
+};
+
+struct Recorder {
+        Machine *machine;
+        FILE *file;
+        /*
+         * The stdio buffer while replaying; while recording, entries are
+         * put here directly and written out once it fills up.
+         */
+        uint8_t *buffer;
+        size_t used;
+        uint8_t mode;
+        /* Cycle count of the previous entry. */
+        uint64_t cycle;
+        /* While replaying, the kind and cycle of the next entry. */
+        uint8_t kind;
+        uint64_t due;
+        RecordStats stats;
+};
+
+/* 64 bit FNV-1a hash of RAM, to check a replay ends as recorded. */
+static uint64_t hashRam(const Memory *memory)
+{
+        uint64_t hash = 0xCBF29CE484222325;
+        int i;
+
+        for (i = 0; i < RAM_SIZE; i++) {
+                hash = (hash ^ memory->ram[i]) * 0x100000001B3;
+        }
+
+        return hash;
+}
+
+/* Write out the entries put so far; errors are left to ferror(). */
+static void flushLog(Recorder *recorder)
+{
+        fwrite(recorder->buffer, 1, recorder->used, recorder->file);
+        recorder->stats.bytes += recorder->used;
+        recorder->used = 0;
+}
+
+static inline void putByte(Recorder *recorder, uint8_t byte)
+{
+        if (recorder->used == BUFFER_SIZE) {
+                flushLog(recorder);
+        }
+        recorder->buffer[recorder->used++] = byte;
+}
+
+static void putVarint(Recorder *recorder, uint64_t value)
+{
+        while (value >= 0x80) {
+                putByte(recorder, value | 0x80);
+                value >>= 7;
+        }
+        putByte(recorder, value);
+}
+
+/*
+ * Entries never go back in time, so that deltas stay positive: the JIT
+ * counts a few cycles ahead in reads, which may land past the next
+ * instruction boundary. Replays key entries the same way.
+ */
+static uint64_t entryCycle(const Recorder *recorder, uint64_t cycle)
+{
+        return cycle > recorder->cycle ? cycle : recorder->cycle;
+}
+
+static void putEntry(Recorder *recorder, int kind, uint64_t cycle)
+{
+        cycle = entryCycle(recorder, cycle);
+        putVarint(recorder, (cycle - recorder->cycle) << KIND_BITS | kind);
+        recorder->cycle = cycle;
+        recorder->stats.entries++;
+}
+
+static void putRegisters(Recorder *recorder, const Registers *registers)
+{
+        putByte(recorder, registers->a);
+        putByte(recorder, registers->x);
+        putByte(recorder, registers->y);
+        putByte(recorder, registers->sp);
+        putByte(recorder, registers->p);
+        putByte(recorder, registers->pc & 0xFF);
+        putByte(recorder, registers->pc >> 8);
+        putByte(recorder, registers->state);
+        putVarint(recorder, registers->cycles);
+}
+
+/* One bit per page mapped to a device, in page order. */
+static void getDeviceMap(const Memory *memory, uint8_t *map)
+{
+        int page;
+
+        memset(map, 0, DEVICE_MAP_SIZE);
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                if (memory->pageTypes[page] == PAGE_DEVICE) {
+                        map[page >> 3] |= 1 << (page & 7);
+                }
+        }
+}
+
+/* A byte of the log, or -1 past its end. */
+static int getByte(Recorder *recorder)
+{
+        int byte = getc_unlocked(recorder->file);
+
+        recorder->stats.bytes += byte != EOF;
+
+        return byte;
+}
+
+static int getVarint(Recorder *recorder, uint64_t *value)
+{
+        int byte, shift = 0;
+
+        *value = 0;
+        do {
+                if ((byte = getByte(recorder)) < 0 || shift > 63) {
+                        return -EINVAL;
+                }
+                *value |= (uint64_t) (byte & 0x7F) << shift;
+                shift += 7;
+        } while (byte & 0x80);
+
+        return 0;
+}
+
+static int getRegisters(Recorder *recorder, Registers *registers)
+{
+        uint8_t bytes[8];
+        int i, byte;
+
+        for (i = 0; i < 8; i++) {
+                if ((byte = getByte(recorder)) < 0) {
+                        return -EINVAL;
+                }
+                bytes[i] = byte;
+        }
+        registers->a = bytes[0];
+        registers->x = bytes[1];
+        registers->y = bytes[2];
+        registers->sp = bytes[3];
+        registers->p = bytes[4];
+        registers->pc = bytes[5] | bytes[6] << 8;
+        registers->state = bytes[7];
+
+        return getVarint(recorder, &registers->cycles);
+}
+
+/*
+ * Read the header of the next entry. A log cut short, by a recording that
+ * was never stopped, is replayed up to where it stops.
+ */
+static void nextEntry(Recorder *recorder)
+{
+        uint64_t header;
+
+        if (getVarint(recorder, &header) < 0) {
+                recorder->mode = MODE_LIVE;
+                return;
+        }
+        recorder->kind = header & KIND_MASK;
+        recorder->due = recorder->cycle + (header >> KIND_BITS);
+}
+
+/*
+ * Open the log, with a large buffer: stdio's when reading, the recorder's
+ * own when writing. NULL with errno set on errors.
+ */
+static Recorder *openLog(Machine *machine, const char *path,
+                         const char *mode)
+{
+        Recorder *recorder;
+
+        if (machine->memory.rewind || machine->memory.recorder) {
+                errno = EBUSY;
+                return NULL;
+        }
+        if (!(recorder = calloc(1, sizeof(*recorder))) ||
+            !(recorder->buffer = malloc(BUFFER_SIZE))) {
+                free(recorder);
+                errno = ENOMEM;
+                return NULL;
+        }
+        if (!(recorder->file = fopen(path, mode))) {
+                free(recorder->buffer);
+                free(recorder);
+                return NULL;
+        }
+        if (*mode == 'r') {
+                setvbuf(recorder->file, (char *) recorder->buffer, _IOFBF,
+                        BUFFER_SIZE);
+        } else {
+                setvbuf(recorder->file, NULL, _IONBF, 0);
+        }
+        recorder->machine = machine;
+
+        return recorder;
+}
+
+static void closeLog(Recorder *recorder)
+{
+        fclose(recorder->file);
+        free(recorder->buffer);
+        free(recorder);
+}
+
+Recorder *startRecording(Machine *machine, const char *path)
+{
+        Recorder *recorder = openLog(machine, path, "wb");
+        uint8_t map[DEVICE_MAP_SIZE];
+        int i;
+
+        if (!recorder) {
+                return NULL;
+        }
+
+        recorder->mode = MODE_RECORDING;
+        for (i = 0; MAGIC[i]; i++) {
+                putByte(recorder, MAGIC[i]);
+        }
+        putByte(recorder, VERSION);
+        putRegisters(recorder, &machine->registers);
+        getDeviceMap(&machine->memory, map);
+        for (i = 0; i < DEVICE_MAP_SIZE; i++) {
+                putByte(recorder, map[i]);
+        }
+        for (i = 0; i < RAM_SIZE; i++) {
+                putByte(recorder, machine->memory.ram[i]);
+        }
+        recorder->cycle = machine->registers.cycles;
+        machine->memory.recorder = recorder;
+
+        return recorder;
+}
+
+/* Forget what the engine decoded from pages about to be overwritten. */
+static void overwrite(Memory *memory, uint16_t address, size_t size)
+{
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+        size_t page;
+
+        for (page = address >> 8; size && page <= (address + size - 1) >> 8;
+             page++) {
+                if (memory->codePages[page]) {
+                        invalidateCode(memory, page);
+                }
+        }
+#endif
+}
+
+Recorder *startReplay(Machine *machine, const char *path)
+{
+        Recorder *recorder = openLog(machine, path, "rb");
+        Memory *memory = &machine->memory;
+        Registers registers;
+        uint8_t map[DEVICE_MAP_SIZE], logged[DEVICE_MAP_SIZE];
+        char magic[sizeof(MAGIC)] = "";
+
+        if (!recorder) {
+                return NULL;
+        }
+
+        if (fread(magic, 1, strlen(MAGIC), recorder->file) != strlen(MAGIC) ||
+            strcmp(magic, MAGIC) || getByte(recorder) != VERSION ||
+            getRegisters(recorder, &registers) < 0 ||
+            fread(logged, 1, DEVICE_MAP_SIZE, recorder->file) !=
+            DEVICE_MAP_SIZE) {
+                closeLog(recorder);
+                errno = EINVAL;
+                return NULL;
+        }
+        /* Reads from pages now RAM, or now devices, would go astray. */
+        getDeviceMap(memory, map);
+        if (memcmp(map, logged, DEVICE_MAP_SIZE)) {
+                closeLog(recorder);
+                errno = EINVAL;
+                return NULL;
+        }
+        overwrite(memory, 0, RAM_SIZE);
+        if (fread(memory->ram, 1, RAM_SIZE, recorder->file) != RAM_SIZE) {
+                closeLog(recorder);
+                errno = EINVAL;
+                return NULL;
+        }
+        recorder->stats.bytes += strlen(MAGIC) + DEVICE_MAP_SIZE + RAM_SIZE;
+        machine->registers = registers;
+
+        recorder->mode = MODE_REPLAYING;
+        recorder->cycle = registers.cycles;
+        nextEntry(recorder);
+        memory->recorder = recorder;
+
+        return recorder;
+}
+
+static int replayUpTo(Recorder *recorder, uint64_t cycle, int interrupts);
+
+int stopRecorder(Recorder *recorder)
+{
+        Machine *machine;
+        uint64_t hash;
+        int i, error = 0;
+
+        if (!recorder) {
+                return 0;
+        }
+
+        machine = recorder->machine;
+        /*
+         * Runs stopping on a BRK end before what was logged after it. An
+         * interrupt due before the stop was not taken when it should have
+         * been; one due right at it is left to a run that never came, so
+         * the replay did not get to the end.
+         */
+        if (recorder->mode == MODE_REPLAYING) {
+                replayUpTo(recorder, machine->registers.cycles, 0);
+                if (recorder->mode == MODE_REPLAYING &&
+                    (recorder->kind == ENTRY_IRQ ||
+                     recorder->kind == ENTRY_NMI) &&
+                    recorder->due < entryCycle(recorder,
+                                               machine->registers.cycles)) {
+                        recorder->stats.diverged = 1;
+                }
+        }
+        switch (recorder->mode) {
+        case MODE_RECORDING:
+                putEntry(recorder, ENTRY_END, machine->registers.cycles);
+                putRegisters(recorder, &machine->registers);
+                hash = hashRam(&machine->memory);
+                for (i = 0; i < 8; i++) {
+                        putByte(recorder, hash >> 8 * i);
+                }
+                flushLog(recorder);
+                if (fflush(recorder->file) || ferror(recorder->file)) {
+                        error = -EIO;
+                }
+                break;
+        case MODE_REPLAYING:
+                error = recorder->stats.diverged ? -EIO : -EINPROGRESS;
+                break;
+        default:
+                error = recorder->stats.diverged ? -EIO :
+                        recorder->stats.replayed ? 0 : -ENODATA;
+                break;
+        }
+        machine->memory.recorder = NULL;
+        closeLog(recorder);
+
+        return error;
+}
+
+void getRecordStats(const Recorder *recorder, RecordStats *stats)
+{
+        *stats = recorder->stats;
+        if (recorder->mode == MODE_RECORDING) {
+                stats->bytes += recorder->used;
+        }
+}
+
+void recordWrite(Recorder *recorder, uint16_t address, size_t size)
+{
+        Machine *machine = recorder->machine;
+        size_t i;
+
+        if (recorder->mode != MODE_RECORDING || !size) {
+                return;
+        }
+
+        putEntry(recorder, ENTRY_WRITE, machine->registers.cycles);
+        putVarint(recorder, address);
+        putVarint(recorder, size);
+        for (i = 0; i < size; i++) {
+                putByte(recorder, machine->memory.ram[address + i]);
+        }
+}
+
+void recordRegisters(Recorder *recorder, uint64_t cycles)
+{
+        Machine *machine = recorder->machine;
+
+        if (recorder->mode != MODE_RECORDING) {
+                return;
+        }
+
+        putEntry(recorder, ENTRY_SET, cycles);
+        putRegisters(recorder, &machine->registers);
+        recorder->cycle = machine->registers.cycles;
+}
+
+uint8_t recordRead(Recorder *recorder, const Device *device,
+                   uint16_t address)
+{
+        Scheduler *scheduler = &recorder->machine->memory.scheduler;
+        uint64_t cycle = *scheduler->cycles;
+        uint8_t value = 0xFF;
+        int byte;
+
+        if (recorder->mode == MODE_REPLAYING) {
+                if (recorder->kind != ENTRY_READ ||
+                    recorder->due != entryCycle(recorder, cycle) ||
+                    (byte = getByte(recorder)) < 0) {
+                        /*
+                         * Nothing later in the log can match either: run
+                         * live, and stop at the end of the instruction.
+                         */
+                        recorder->stats.diverged = 1;
+                        recorder->mode = MODE_LIVE;
+                        scheduler->limit = cycle;
+                        return value;
+                }
+                recorder->cycle = recorder->due;
+                recorder->stats.entries++;
+                recorder->stats.reads++;
+                nextEntry(recorder);
+                /* Stop at the end of the instruction if an interrupt is due. */
+                scheduler->limit = recordLimit(recorder, scheduler->limit);
+                return byte;
+        }
+
+        if (device->read) {
+                value = device->read(device->context, address);
+        }
+        if (recorder->mode != MODE_RECORDING) {
+                return value;
+        }
+        /* Most reads follow the previous entry closely: 2 bytes. */
+        if (cycle >= recorder->cycle && cycle - recorder->cycle < 16 &&
+            recorder->used + 2 <= BUFFER_SIZE) {
+                recorder->buffer[recorder->used++] =
+                        (cycle - recorder->cycle) << KIND_BITS | ENTRY_READ;
+                recorder->buffer[recorder->used++] = value;
+                recorder->cycle = cycle;
+                recorder->stats.entries++;
+        } else {
+                putEntry(recorder, ENTRY_READ, cycle);
+                putByte(recorder, value);
+        }
+        recorder->stats.reads++;
+
+        return value;
+}
+
+int replayingRecord(const Recorder *recorder)
+{
+        return recorder->mode == MODE_REPLAYING;
+}
+
+int replayDiverged(const Recorder *recorder)
+{
+        return recorder->stats.diverged;
+}
+
+void recordInterrupt(Recorder *recorder, uint64_t cycle, int input)
+{
+        if (recorder->mode != MODE_RECORDING) {
+                return;
+        }
+
+        putEntry(recorder, input == INPUT_NMI ? ENTRY_NMI : ENTRY_IRQ, cycle);
+        recorder->stats.interrupts++;
+}
+
+/* Copy a logged write back into memory, returns 0 or -EINVAL. */
+static int replayWrite(Recorder *recorder)
+{
+        Memory *memory = &recorder->machine->memory;
+        uint64_t address, size, i;
+        int byte;
+
+        if (getVarint(recorder, &address) < 0 ||
+            getVarint(recorder, &size) < 0 || address + size > RAM_SIZE) {
+                return -EINVAL;
+        }
+        overwrite(memory, address, size);
+        for (i = 0; i < size; i++) {
+                if ((byte = getByte(recorder)) < 0) {
+                        return -EINVAL;
+                }
+                memory->ram[address + i] = byte;
+        }
+
+        return 0;
+}
+
+/* Check the machine ends up as logged, then let it run live. */
+static int replayEnd(Recorder *recorder)
+{
+        Machine *machine = recorder->machine;
+        const Registers *now = &machine->registers;
+        Registers logged;
+        uint64_t hash = 0;
+        int i, byte;
+
+        if (getRegisters(recorder, &logged) < 0) {
+                return -EINVAL;
+        }
+        for (i = 0; i < 8; i++) {
+                if ((byte = getByte(recorder)) < 0) {
+                        return -EINVAL;
+                }
+                hash |= (uint64_t) byte << 8 * i;
+        }
+        if (logged.a != now->a || logged.x != now->x || logged.y != now->y ||
+            logged.sp != now->sp || logged.p != now->p ||
+            logged.pc != now->pc || logged.state != now->state ||
+            logged.cycles != now->cycles ||
+            hash != hashRam(&machine->memory)) {
+                return -EIO;
+        }
+
+        return 0;
+}
+
+/*
+ * replayRecorded(), taking interrupts only if interrupts is set: otherwise
+ * it stops before one, leaving it to be taken by the next run.
+ */
+static int replayUpTo(Recorder *recorder, uint64_t cycle, int interrupts)
+{
+        Registers *registers = &recorder->machine->registers;
+        int kind, error = 0;
+
+        while (recorder->mode == MODE_REPLAYING &&
+               recorder->kind != ENTRY_READ &&
+               recorder->due <= entryCycle(recorder, cycle)) {
+                if (!interrupts && (recorder->kind == ENTRY_IRQ ||
+                                    recorder->kind == ENTRY_NMI)) {
+                        break;
+                }
+                /* Boundaries come in order: this one was passed. */
+                if (recorder->due < entryCycle(recorder, cycle)) {
+                        recorder->stats.diverged = 1;
+                }
+                kind = recorder->kind;
+                recorder->cycle = recorder->due;
+                recorder->stats.entries++;
+                switch (kind) {
+                case ENTRY_IRQ:
+                case ENTRY_NMI:
+                        recorder->stats.interrupts++;
+                        nextEntry(recorder);
+                        return kind == ENTRY_NMI ? INPUT_NMI : INPUT_IRQ;
+                case ENTRY_WRITE:
+                        error = replayWrite(recorder);
+                        break;
+                case ENTRY_SET:
+                        error = getRegisters(recorder, registers);
+                        recorder->cycle = cycle = registers->cycles;
+                        break;
+                case ENTRY_END:
+                        /* A damaged end cannot be told to match either. */
+                        if (replayEnd(recorder) < 0) {
+                                recorder->stats.diverged = 1;
+                        }
+                        recorder->stats.replayed = 1;
+                        recorder->mode = MODE_LIVE;
+                        return INPUT_NONE;
+                default:
+                        error = -EINVAL;
+                        break;
+                }
+                if (error < 0) {
+                        /* A damaged log: stop replaying it. */
+                        recorder->stats.diverged = 1;
+                        recorder->mode = MODE_LIVE;
+                        return INPUT_NONE;
+                }
+                nextEntry(recorder);
+        }
+
+        return INPUT_NONE;
+}
+
+int replayRecorded(Recorder *recorder, uint64_t cycle)
+{
+        return replayUpTo(recorder, cycle, 1);
+}
+
+uint64_t recordLimit(const Recorder *recorder, uint64_t limit)
+{
+        if (recorder->mode != MODE_REPLAYING ||
+            recorder->kind == ENTRY_READ) {
+                return limit;
+        }
+
+        return recorder->due < limit ? recorder->due : limit;
+}
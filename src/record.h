@@ -0,0 +1,98 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Recording runs to replay them later, bit for bit. A recorder attached to
+ * a machine writes its registers and RAM to a log file, then everything
+ * that comes from outside the CPU as it happens: the bytes read from
+ * devices, the interrupts taken, and the memory and registers changed by
+ * the host between runs (see recordWrite()). Replaying starts over from
+ * the state at the start of the log, reads from devices come from the
+ * log, interrupts are taken at the cycles logged instead of when devices
+ * raise them, and host changes are made again at their cycles; writes to
+ * devices are dropped, and devices otherwise carry on as they are. The
+ * final state logged by stopRecorder() is checked once the replay gets
+ * there, after which the machine runs live again, as it does at the end of
+ * a log cut short.
+ *
+ * Each entry is a varint of its cycle count, as a delta from the previous
+ * entry, shifted left by 3 and or'ed with its kind, then its payload: a
+ * device read or an interrupt taken within 16 cycles of the previous entry
+ * takes 2 bytes or 1 byte, and one within 2048 cycles 3 bytes or 2 bytes.
+ *
+ *     header  "T65R", version 2
+ *     state   a x y sp p pc(2, little endian) state cycles(varint), a
+ *             bitmap of the pages mapped to devices (32, bit 0 of the
+ *             first byte for page 0), then the 65536 bytes of RAM
+ *     READ    value
+ *     IRQ, NMI
+ *     WRITE   address(varint) length(varint), then the bytes now in RAM
+ *     SET     registers as in the state
+ *     END     registers as in the state, FNV-1a hash of RAM(8, little
+ *             endian)
+ *
+ * Recording, like rewinding, makes idle loops reading devices run in full,
+ * so that every read gets logged; the two cannot be used at once.
+ */
+
+typedef struct {
+        /* Entries logged or replayed, and bytes of the log they take. */
+        uint64_t entries;
+        uint64_t bytes;
+        /* Device reads and interrupts among the entries. */
+        uint64_t reads;
+        uint64_t interrupts;
+        /* While replaying: whether the end was reached, and matched. */
+        uint8_t replayed;
+        uint8_t diverged;
+} RecordStats;
+
+/*
+ * Start recording the machine to path, or replaying it from path, which
+ * restores the state the log starts from. The same pages must be mapped to
+ * devices when replaying as when recording. NULL with errno set on errors,
+ * EINVAL for a file that is not a log or one recorded with other device
+ * pages.
+ */
+Recorder *startRecording(Machine *machine, const char *path);
+Recorder *startReplay(Machine *machine, const char *path);
+/*
+ * Detach from the machine and free it, logging the final state first when
+ * recording. Returns 0; when recording, -EIO if the log could not all be
+ * written; when replaying, -EIO if the replay did not match the log,
+ * -EINPROGRESS if it did not get to the end, or -ENODATA if the log was
+ * cut short (the recording was never stopped) and got replayed to its end.
+ */
+int stopRecorder(Recorder *recorder);
+void getRecordStats(const Recorder *recorder, RecordStats *stats);
+
+/*
+ * The host changed size bytes of memory from address on, or the registers
+ * when the cycle count was cycles, bypassing the CPU. Logged when
+ * recording, to be changed again at the same cycle count when replaying.
+ */
+void recordWrite(Recorder *recorder, uint16_t address, size_t size);
+void recordRegisters(Recorder *recorder, uint64_t cycles);
+
+/*
+ * Hooks for cpu.c. recordRead() reads from a device and logs it, or while
+ * replaying, reads from the log. recordInterrupt() logs an interrupt
+ * taken; while replaying, replayRecorded() makes the host changes logged
+ * up to cycle and returns the interrupt logged for it, if any, and
+ * recordLimit() lowers limit to the cycle of the next entry.
+ * replayDiverged() is whether the replay no longer matches the log, which
+ * stops executeCycles() from then on with STOP_DIVERGED.
+ */
+uint8_t recordRead(Recorder *recorder, const Device *device,
+                   uint16_t address);
+int replayingRecord(const Recorder *recorder);
+int replayDiverged(const Recorder *recorder);
+void recordInterrupt(Recorder *recorder, uint64_t cycle, int input);
+int replayRecorded(Recorder *recorder, uint64_t cycle);
+uint64_t recordLimit(const Recorder *recorder, uint64_t limit);
+
+#endif  /* RECORD_H */
@@ -0,0 +1,485 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "cpu.h"
+#include "rewind.h"
+
+/* First capacity of a log, in entries. */
+#define LOG_CAPACITY 1024
+
+/*
+ * Entries of one kind, numbered from the first ever logged. Those logged
+ * before the oldest checkpoint are dropped from the front, a bunch at a
+ * time.
+ */
+typedef struct {
+        uint8_t *entries;
+        size_t size;
+        size_t count;
+        size_t capacity;
+        /* Number of entries[0], and of the first entry still needed. */
+        uint64_t base;
+        uint64_t first;
+} Log;
+
+typedef struct {
+        uint64_t cycle;
+        uint8_t input;
+} Interrupt;
+
+typedef struct {
+        Registers registers;
+        /* Number of the next entry of each log. */
+        uint64_t interrupts;
+        uint64_t reads;
+        /*
+         * Pages that changed since the previous checkpoint: their numbers,
+         * then what each of them held at the previous checkpoint.
+         */
+        int count;
+        uint8_t *pages;
+} Checkpoint;
+
+struct Rewind {
+        Machine *machine;
+        uint64_t period;
+        /* Cycle count to take the next checkpoint at. */
+        uint64_t due;
+        /* Ring of checkpoints, oldest first. */
+        Checkpoint *ring;
+        int capacity;
+        int first;
+        int count;
+        /* The machine as of the newest checkpoint. */
+        Snapshot newest;
+        Log interrupts;
+        Log reads;
+        /* While replaying, number of the next entry of each log. */
+        uint8_t replaying;
+        uint64_t interrupt;
+        uint64_t read;
+        /* Set when the replay did not match the log. */
+        uint8_t diverged;
+        /* Set by touchRewind(). */
+        uint8_t touched;
+        /* Registers when runRewind() last returned. */
+        Registers left;
+        /* -ENOMEM once an input could not be logged. */
+        int error;
+        uint64_t taken;
+        double seconds;
+};
+
+static double now(void)
+{
+        struct timespec time;
+
+        clock_gettime(CLOCK_MONOTONIC, &time);
+
+        return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static uint64_t logEnd(const Log *log)
+{
+        return log->base + log->count;
+}
+
+static void *logEntry(const Log *log, uint64_t number)
+{
+        return log->entries + (number - log->base) * log->size;
+}
+
+static int appendLog(Log *log, const void *entry)
+{
+        uint8_t *entries;
+        size_t capacity;
+
+        if (log->count == log->capacity) {
+                capacity = log->capacity ? 2 * log->capacity : LOG_CAPACITY;
+                if (!(entries = realloc(log->entries, capacity * log->size))) {
+                        return -ENOMEM;
+                }
+                log->entries = entries;
+                log->capacity = capacity;
+        }
+        memcpy(logEntry(log, logEnd(log)), entry, log->size);
+        log->count++;
+
+        return 0;
+}
+
+/* Forget the entries before number, moving the others once half are. */
+static void dropLog(Log *log, uint64_t number)
+{
+        size_t dropped = number - log->base;
+
+        log->first = number;
+        if (dropped > log->count / 2) {
+                memmove(log->entries, logEntry(log, number),
+                        (log->count - dropped) * log->size);
+                log->count -= dropped;
+                log->base = number;
+        }
+}
+
+/* Forget the entries from number on. */
+static void truncateLog(Log *log, uint64_t number)
+{
+        log->count = number - log->base;
+}
+
+static Checkpoint *checkpointAt(const Rewind *rewind, int index)
+{
+        return &rewind->ring[(rewind->first + index) % rewind->capacity];
+}
+
+static Checkpoint *newestCheckpoint(const Rewind *rewind)
+{
+        return checkpointAt(rewind, rewind->count - 1);
+}
+
+static void dropOldest(Rewind *rewind)
+{
+        Checkpoint *oldest = checkpointAt(rewind, 0);
+
+        free(oldest->pages);
+        rewind->first = (rewind->first + 1) % rewind->capacity;
+        rewind->count--;
+
+        /* Nothing goes back past the oldest one now. */
+        oldest = checkpointAt(rewind, 0);
+        free(oldest->pages);
+        oldest->pages = NULL;
+        oldest->count = 0;
+        dropLog(&rewind->interrupts, oldest->interrupts);
+        dropLog(&rewind->reads, oldest->reads);
+}
+
+/*
+ * Checkpoint the machine: save what the pages that changed since the newest
+ * checkpoint held then, and bring it up to date. Only pages written to can
+ * have changed, unless memory was touched from outside.
+ */
+static int takeCheckpoint(Rewind *rewind)
+{
+        Machine *machine = rewind->machine;
+        Memory *memory = &machine->memory;
+        uint8_t *ram = rewind->newest.ram, changed[RAM_SIZE >> 8];
+        uint8_t *pages = NULL;
+        Checkpoint *checkpoint;
+        double start = now();
+        int page, count = 0, i;
+
+        rewind->due = machine->registers.cycles + rewind->period;
+        if (rewind->due < rewind->period) {
+                rewind->due = UINT64_MAX;
+        }
+
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                if ((rewind->touched || memory->dirtyPages[page]) &&
+                    memcmp(&memory->ram[page << 8], &ram[page << 8], 0x100)) {
+                        changed[count++] = page;
+                }
+        }
+        if (count && !(pages = malloc(count * (1 + 0x100)))) {
+                return -ENOMEM;
+        }
+
+        if (rewind->count == rewind->capacity) {
+                dropOldest(rewind);
+        }
+        checkpoint = checkpointAt(rewind, rewind->count++);
+        checkpoint->registers = machine->registers;
+        checkpoint->interrupts = rewind->replaying ? rewind->interrupt :
+                logEnd(&rewind->interrupts);
+        checkpoint->reads = rewind->replaying ? rewind->read :
+                logEnd(&rewind->reads);
+        checkpoint->count = count;
+        checkpoint->pages = pages;
+        for (i = 0; i < count; i++) {
+                page = changed[i];
+                pages[i] = page;
+                memcpy(&pages[count + (i << 8)], &ram[page << 8], 0x100);
+                memcpy(&ram[page << 8], &memory->ram[page << 8], 0x100);
+        }
+        rewind->newest.registers = machine->registers;
+        clearDirtyPages(memory);
+        rewind->touched = 0;
+
+        rewind->taken++;
+        rewind->seconds += now() - start;
+
+        return 0;
+}
+
+/* Drop every checkpoint and the log, and start over with a new one. */
+static void restartRewind(Rewind *rewind)
+{
+        Log *logs[] = {&rewind->interrupts, &rewind->reads};
+        int i;
+
+        while (rewind->count) {
+                free(newestCheckpoint(rewind)->pages);
+                rewind->count--;
+        }
+        for (i = 0; i < 2; i++) {
+                logs[i]->base = logEnd(logs[i]);
+                logs[i]->first = logs[i]->base;
+                logs[i]->count = 0;
+        }
+        saveSnapshot(rewind->machine, &rewind->newest);
+        clearDirtyPages(&rewind->machine->memory);
+        rewind->touched = 0;
+        rewind->error = 0;
+        takeCheckpoint(rewind);
+}
+
+Rewind *startRewind(Machine *machine, uint64_t period, int count)
+{
+        Rewind *rewind;
+
+        if (!period || count <= 0) {
+                return NULL;
+        }
+        if (!(rewind = calloc(1, sizeof(*rewind)))) {
+                return NULL;
+        }
+        if (!(rewind->ring = calloc(count, sizeof(Checkpoint)))) {
+                free(rewind);
+                return NULL;
+        }
+
+        rewind->machine = machine;
+        rewind->period = period;
+        rewind->capacity = count;
+        rewind->interrupts.size = sizeof(Interrupt);
+        rewind->reads.size = 1;
+        machine->memory.rewind = rewind;
+        trackDirtyPages(&machine->memory, 1);
+        restartRewind(rewind);
+        rewind->left = machine->registers;
+
+        return rewind;
+}
+
+void stopRewind(Rewind *rewind)
+{
+        Memory *memory;
+
+        if (!rewind) {
+                return;
+        }
+
+        memory = &rewind->machine->memory;
+        memory->rewind = NULL;
+        trackDirtyPages(memory, 0);
+        while (rewind->count) {
+                free(newestCheckpoint(rewind)->pages);
+                rewind->count--;
+        }
+        free(rewind->ring);
+        free(rewind->interrupts.entries);
+        free(rewind->reads.entries);
+        free(rewind);
+}
+
+static int sameRegisters(const Registers *a, const Registers *b)
+{
+        return a->a == b->a && a->x == b->x && a->y == b->y &&
+                a->sp == b->sp && a->pc == b->pc && a->p == b->p &&
+                a->cycles == b->cycles && a->state == b->state;
+}
+
+/* Run until cycle count end, taking checkpoints when due. */
+static StopReason runTo(Rewind *rewind, uint64_t end)
+{
+        Registers *registers = &rewind->machine->registers;
+        StopReason reason = STOP_BUDGET;
+
+        while (reason == STOP_BUDGET && registers->cycles < end) {
+                if (registers->cycles >= rewind->due) {
+                        takeCheckpoint(rewind);
+                        continue;
+                }
+                reason = executeCycles(registers, &rewind->machine->memory,
+                                       (rewind->due < end ? rewind->due :
+                                        end) - registers->cycles);
+        }
+
+        return reason;
+}
+
+StopReason runRewind(Rewind *rewind, uint64_t budget)
+{
+        Registers *registers = &rewind->machine->registers;
+        uint64_t end = registers->cycles + budget;
+        StopReason reason;
+
+        /* Saturate so that huge budgets mean "run until BRK". */
+        if (end < registers->cycles) {
+                end = UINT64_MAX;
+        }
+
+        /* Replays must not cross changes made from outside. */
+        if (registers->cycles < rewind->newest.registers.cycles) {
+                restartRewind(rewind);
+        } else if (rewind->touched ||
+                   !sameRegisters(registers, &rewind->left)) {
+                takeCheckpoint(rewind);
+        }
+        reason = runTo(rewind, end);
+        rewind->left = *registers;
+
+        return reason;
+}
+
+void touchRewind(Rewind *rewind)
+{
+        rewind->touched = 1;
+}
+
+int rewindTo(Rewind *rewind, uint64_t cycle)
+{
+        Machine *machine = rewind->machine;
+        uint8_t *ram = rewind->newest.ram;
+        const uint8_t *pages;
+        Checkpoint *checkpoint;
+        int index, i;
+
+        if (cycle > machine->registers.cycles) {
+                return -ERANGE;
+        }
+        for (index = rewind->count - 1; index >= 0; index--) {
+                if (checkpointAt(rewind, index)->registers.cycles <= cycle) {
+                        break;
+                }
+        }
+        if (index < 0) {
+                return -ERANGE;
+        }
+
+        /* Undo the newer checkpoints, newest first. */
+        while (rewind->count > index + 1) {
+                checkpoint = newestCheckpoint(rewind);
+                pages = checkpoint->pages;
+                for (i = 0; i < checkpoint->count; i++) {
+                        memcpy(&ram[pages[i] << 8],
+                               &pages[checkpoint->count + (i << 8)], 0x100);
+                }
+                free(checkpoint->pages);
+                rewind->count--;
+        }
+        checkpoint = newestCheckpoint(rewind);
+        rewind->newest.registers = checkpoint->registers;
+        restoreSnapshot(machine, &rewind->newest);
+        clearDirtyPages(&machine->memory);
+        rewind->touched = 0;
+        rewind->due = checkpoint->registers.cycles + rewind->period;
+        if (rewind->due < rewind->period) {
+                rewind->due = UINT64_MAX;
+        }
+
+        rewind->replaying = 1;
+        rewind->diverged = 0;
+        rewind->interrupt = checkpoint->interrupts;
+        rewind->read = checkpoint->reads;
+        runTo(rewind, cycle);
+        rewind->replaying = 0;
+        truncateLog(&rewind->interrupts, rewind->interrupt);
+        truncateLog(&rewind->reads, rewind->read);
+        rewind->left = machine->registers;
+
+        return rewind->diverged ? -EIO : rewind->error;
+}
+
+void getRewindStats(const Rewind *rewind, RewindStats *stats)
+{
+        const Log *logs[] = {&rewind->interrupts, &rewind->reads};
+        int index, i;
+
+        memset(stats, 0, sizeof(*stats));
+        stats->checkpoints = rewind->count;
+        stats->oldest = checkpointAt(rewind, 0)->registers.cycles;
+        for (index = 0; index < rewind->count; index++) {
+                stats->pages += checkpointAt(rewind, index)->count;
+        }
+        stats->bytes = rewind->count * sizeof(Checkpoint) +
+                stats->pages * (1 + 0x100);
+        for (i = 0; i < 2; i++) {
+                stats->inputs += logEnd(logs[i]) - logs[i]->first;
+                stats->logBytes += logs[i]->capacity * logs[i]->size;
+        }
+        stats->taken = rewind->taken;
+        stats->seconds = rewind->seconds;
+}
+
+uint8_t readInput(Rewind *rewind, const Device *device, uint16_t address)
+{
+        uint8_t value = 0xFF;
+
+        if (rewind->replaying) {
+                if (rewind->read == logEnd(&rewind->reads)) {
+                        rewind->diverged = 1;
+                        return value;
+                }
+                return *(uint8_t *) logEntry(&rewind->reads, rewind->read++);
+        }
+
+        if (device->read) {
+                value = device->read(device->context, address);
+        }
+        if (appendLog(&rewind->reads, &value)) {
+                rewind->error = -ENOMEM;
+        }
+
+        return value;
+}
+
+int replayingInputs(const Rewind *rewind)
+{
+        return rewind->replaying;
+}
+
+void logInterrupt(Rewind *rewind, uint64_t cycle, int input)
+{
+        Interrupt interrupt = {cycle, input};
+
+        if (appendLog(&rewind->interrupts, &interrupt)) {
+                rewind->error = -ENOMEM;
+        }
+}
+
+int replayInterrupt(Rewind *rewind, uint64_t cycle)
+{
+        const Interrupt *next;
+
+        if (rewind->interrupt == logEnd(&rewind->interrupts)) {
+                return INPUT_NONE;
+        }
+        next = logEntry(&rewind->interrupts, rewind->interrupt);
+        if (next->cycle > cycle) {
+                return INPUT_NONE;
+        }
+        if (next->cycle < cycle) {
+                rewind->diverged = 1;
+        }
+        rewind->interrupt++;
+
+        return next->input;
+}
+
+uint64_t replayLimit(const Rewind *rewind, uint64_t limit)
+{
+        const Interrupt *next;
+
+        if (!rewind->replaying ||
+            rewind->interrupt == logEnd(&rewind->interrupts)) {
+                return limit;
+        }
+        next = logEntry(&rewind->interrupts, rewind->interrupt);
+
+        return next->cycle < limit ? next->cycle : limit;
+}
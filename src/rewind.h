@@ -0,0 +1,94 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/*
+ * Going back in time. A rewind buffer attached to a machine takes a
+ * checkpoint of its registers and RAM every period cycles of runRewind(),
+ * keeping the newest ones in a ring, and logs what comes from outside the
+ * CPU in between: the interrupts taken and the bytes read from devices.
+ * rewindTo() restores the newest checkpoint at or before a cycle and
+ * replays the log from there, which gives back the state the machine had
+ * at the first instruction boundary from that cycle on.
+ *
+ * RAM as of the newest checkpoint is kept whole. Each checkpoint holds the
+ * registers and, for the 256 byte pages that changed since the previous
+ * one, what they held before: older checkpoints are rebuilt by undoing the
+ * newer ones. Changed pages are found by tracking which ones are written
+ * to (see trackDirtyPages()), which costs running code one slow write per
+ * page between checkpoints.
+ *
+ * Devices are not rewound: while replaying, reads from them come from the
+ * log and writes to them are dropped, and once rewound they carry on from
+ * where they were, as do their pending events and interrupt lines.
+ */
+
+/* What pendingInput() in cpu.c found, as logged. */
+enum {
+        INPUT_NONE,
+        INPUT_NMI,
+        /* An IRQ taken, or ending a WAI while masked. */
+        INPUT_IRQ
+};
+
+typedef struct {
+        /* Checkpoints held, and the cycle count of the oldest. */
+        int checkpoints;
+        uint64_t oldest;
+        /*
+         * Pages they hold, and bytes they take; the whole buffer takes one
+         * more copy of RAM and unused slots of the ring on top of that.
+         */
+        uint64_t pages;
+        size_t bytes;
+        /* Interrupts and device reads logged, and bytes they take. */
+        size_t inputs;
+        size_t logBytes;
+        /* Checkpoints taken since startRewind(), and seconds it took. */
+        uint64_t taken;
+        double seconds;
+} RewindStats;
+
+/*
+ * Attach a rewind buffer to a machine, holding up to count checkpoints
+ * taken every period cycles, with a first one right away. NULL if out of
+ * memory, or if period or count is 0.
+ */
+Rewind *startRewind(Machine *machine, uint64_t period, int count);
+/* Detach it from the machine, and free it. */
+void stopRewind(Rewind *rewind);
+/*
+ * executeCycles() on the machine, taking checkpoints on the way, and one
+ * first if its registers changed since the last call.
+ */
+StopReason runRewind(Rewind *rewind, uint64_t budget);
+/*
+ * Memory was changed from outside the CPU, bypassing writeMemory():
+ * compare it all with the newest checkpoint before running again.
+ */
+void touchRewind(Rewind *rewind);
+/*
+ * Go back to cycle, which the newest checkpoints taken after it are
+ * dropped for, as is the log from there on. Returns 0, -ERANGE if cycle is
+ * before the oldest checkpoint or past the current cycle count, or -EIO if
+ * the replay did not match the log.
+ */
+int rewindTo(Rewind *rewind, uint64_t cycle);
+void getRewindStats(const Rewind *rewind, RewindStats *stats);
+
+/*
+ * Hooks for cpu.c. readInput() reads from a device and logs it, or while
+ * replaying, reads from the log. logInterrupt() logs an interrupt taken;
+ * while replaying, replayInterrupt() is the one logged for cycle, if any,
+ * and replayLimit() lowers limit to the cycle of the next one.
+ */
+uint8_t readInput(Rewind *rewind, const Device *device, uint16_t address);
+int replayingInputs(const Rewind *rewind);
+void logInterrupt(Rewind *rewind, uint64_t cycle, int input);
+int replayInterrupt(Rewind *rewind, uint64_t cycle);
+uint64_t replayLimit(const Rewind *rewind, uint64_t limit);
+
+#endif  /* REWIND_H */
@@ -0,0 +1,573 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cpu.h"
+#include "loader.h"
+#include "trace.h"
+#include "profile.h"
+#include "rewind.h"
+#include "record.h"
+#include "pace.h"
+#include "acia.h"
+#include "debug.h"
+#include "fuzz.h"
+#include "tony6502.h"
+
+struct Tony6502 {
+        Machine machine;
+        /* Pacing of runs, if not NULL. */
+        Pacer *pacer;
+        /* Serial console, if not NULL. */
+        Acia *acia;
+};
+
+/*
+ * Forget what the engine decoded from memory that was just overwritten,
+ * have the rewind buffer look for what changed and log it if recording.
+ */
+static void overwritten(Memory *memory, uint16_t address, size_t size)
+{
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+        size_t page;
+#endif
+
+        if (memory->rewind) {
+                touchRewind(memory->rewind);
+        }
+        if (memory->recorder) {
+                recordWrite(memory->recorder, address, size);
+        }
+#if defined(ENGINE_PREDECODE) || defined(ENGINE_JIT)
+        for (page = address >> 8; size && page <= (address + size - 1) >> 8;
+             page++) {
+                if (memory->codePages[page]) {
+                        invalidateCode(memory, page);
+                }
+        }
+#endif
+}
+
+/* Log registers set by the host, when they were at cycles, if recording. */
+static void registersChanged(Tony6502 *machine, uint64_t cycles)
+{
+        if (machine->machine.memory.recorder) {
+                recordRegisters(machine->machine.memory.recorder, cycles);
+        }
+}
+
+Tony6502 *tony6502Create(void)
+{
+        Tony6502 *machine = malloc(sizeof(*machine));
+
+        if (machine) {
+                initMemory(&machine->machine.memory);
+                reset(&machine->machine.registers, 0x0000);
+                machine->pacer = NULL;
+                machine->acia = NULL;
+        }
+
+        return machine;
+}
+
+void tony6502Destroy(Tony6502 *machine)
+{
+        if (!machine) {
+                return;
+        }
+
+        tony6502StopTrace(machine);
+        tony6502DetachSerial(machine);
+        stopRewind(machine->machine.memory.rewind);
+        stopRecorder(machine->machine.memory.recorder);
+        detachDebugger(&machine->machine.memory);
+        free(machine->pacer);
+#if defined(PROFILE)
+        free(machine->machine.memory.profile);
+#endif
+        freeMemory(&machine->machine.memory);
+        free(machine);
+}
+
+long tony6502Load(Tony6502 *machine, const char *path, uint16_t address)
+{
+        Memory *memory = &machine->machine.memory;
+        long size = loadRaw(path, memory->ram, address);
+
+        /* Failed loads may have overwritten anything past address. */
+        overwritten(memory, address, size < 0 ? RAM_SIZE - address : size);
+
+        return size;
+}
+
+long tony6502LoadImage(Tony6502 *machine, const void *image, size_t size,
+                       uint16_t address)
+{
+        Memory *memory = &machine->machine.memory;
+
+        if (size > RAM_SIZE - address) {
+                return -EFBIG;
+        }
+
+        memcpy(&memory->ram[address], image, size);
+        overwritten(memory, address, size);
+
+        return size;
+}
+
+long tony6502LoadProgram(Tony6502 *machine, const char *path,
+                         Tony6502Format format, uint16_t address)
+{
+        /* Same order as Tony6502Format. */
+        static const ImageFormat formats[] = {
+                FORMAT_AUTO, FORMAT_RAW, FORMAT_IHEX, FORMAT_SREC, FORMAT_PRG
+        };
+        Memory *memory = &machine->machine.memory;
+        uint64_t cycles = machine->machine.registers.cycles;
+        Image image;
+        long size;
+        int page;
+
+        if ((unsigned) format >= sizeof(formats) / sizeof(formats[0])) {
+                return -EINVAL;
+        }
+
+        size = loadImage(path, formats[format], address, memory->ram, &image);
+        if (size < 0) {
+                /* Failed loads may have overwritten anything. */
+                overwritten(memory, 0, RAM_SIZE);
+                return size;
+        }
+
+        for (page = 0; page < RAM_SIZE >> 8; page++) {
+                if (image.pages[page]) {
+                        overwritten(memory, page << 8, 0x100);
+                }
+        }
+        reset(&machine->machine.registers, image.entry);
+        registersChanged(machine, cycles);
+
+        return size;
+}
+
+void tony6502Reset(Tony6502 *machine, uint16_t pc)
+{
+        uint64_t cycles = machine->machine.registers.cycles;
+
+        reset(&machine->machine.registers, pc);
+        registersChanged(machine, cycles);
+}
+
+/* Run the machine, paced and through its rewind buffer if it has them. */
+static StopReason run(Tony6502 *machine, uint64_t cycles)
+{
+        Memory *memory = &machine->machine.memory;
+
+        if (machine->pacer) {
+                return runPaced(machine->pacer, &machine->machine, cycles);
+        }
+        if (memory->rewind) {
+                return runRewind(memory->rewind, cycles);
+        }
+
+        return executeCycles(&machine->machine.registers, memory, cycles);
+}
+
+/* Write out the serial output held once a run returns. */
+static void flushOutput(Tony6502 *machine)
+{
+        if (machine->acia) {
+                flushAcia(machine->acia);
+        }
+}
+
+Tony6502Stop tony6502Run(Tony6502 *machine, uint64_t cycles)
+{
+        StopReason reason = run(machine, cycles);
+
+        flushOutput(machine);
+        switch (reason) {
+        case STOP_BRK:
+                return TONY6502_BRK;
+        case STOP_STP:
+                return TONY6502_STP;
+        case STOP_BREAKPOINT:
+                return TONY6502_BREAKPOINT;
+        case STOP_WATCHPOINT:
+                return TONY6502_WATCHPOINT;
+        case STOP_DIVERGED:
+                return TONY6502_DIVERGED;
+        default:
+                return TONY6502_BUDGET;
+        }
+}
+
+uint64_t tony6502Step(Tony6502 *machine, uint64_t count)
+{
+        Registers *registers = &machine->machine.registers;
+        const Scheduler *scheduler = &machine->machine.memory.scheduler;
+        uint64_t done = 0, budget, cycles, interruptCycles;
+        StopReason reason;
+        int ran;
+
+        while (done < count) {
+                /*
+                 * Every instruction takes at least one cycle, so this runs
+                 * one, unless the slice goes to taking an interrupt. A WAI
+                 * only ends on an interrupt: wait up to the next event, and
+                 * give up if there is none.
+                 */
+                budget = 1;
+                if (registers->state == CPU_WAITING && !scheduler->irq &&
+                    !scheduler->nmi) {
+                        if (!scheduler->count) {
+                                break;
+                        }
+                        if (scheduler->events[0].cycle > registers->cycles) {
+                                budget = scheduler->events[0].cycle -
+                                        registers->cycles;
+                        }
+                }
+                cycles = registers->cycles;
+                interruptCycles = scheduler->interruptCycles;
+                reason = run(machine, budget);
+                /* Whether any of the cycles went to an instruction. */
+                ran = registers->cycles - cycles >
+                        scheduler->interruptCycles - interruptCycles;
+                if (reason != STOP_BUDGET) {
+                        /* Watches stop runs once the instruction is over. */
+                        done += reason == STOP_WATCHPOINT && ran;
+                        break;
+                }
+                done += ran;
+        }
+        flushOutput(machine);
+
+        return done;
+}
+
+/* Copy registers in the layout of the library. */
+static void copyRegisters(const Registers *source,
+                          Tony6502Registers *registers)
+{
+        registers->a = source->a;
+        registers->x = source->x;
+        registers->y = source->y;
+        registers->sp = source->sp;
+        registers->pc = source->pc;
+        registers->p = source->p;
+        registers->cycles = source->cycles;
+}
+
+void tony6502GetRegisters(const Tony6502 *machine,
+                          Tony6502Registers *registers)
+{
+        copyRegisters(&machine->machine.registers, registers);
+}
+
+void tony6502SetRegisters(Tony6502 *machine,
+                          const Tony6502Registers *registers)
+{
+        Registers *target = &machine->machine.registers;
+        uint64_t cycles = target->cycles;
+
+        target->a = registers->a;
+        target->x = registers->x;
+        target->y = registers->y;
+        target->sp = registers->sp;
+        target->pc = registers->pc;
+        target->p = registers->p;
+        target->cycles = registers->cycles;
+        registersChanged(machine, cycles);
+}
+
+uint8_t tony6502Read(Tony6502 *machine, uint16_t address)
+{
+        return readMemory(&machine->machine.memory, address);
+}
+
+void tony6502Write(Tony6502 *machine, uint16_t address, uint8_t value)
+{
+        Memory *memory = &machine->machine.memory;
+
+        writeMemory(memory, address, value);
+        if (memory->recorder) {
+                recordWrite(memory->recorder, address, 1);
+        }
+}
+
+int tony6502StartTrace(Tony6502 *machine, const char *path)
+{
+#if defined(TRACE)
+        Memory *memory = &machine->machine.memory;
+
+        if (memory->tracer) {
+                return -EBUSY;
+        }
+
+        if (!(memory->tracer = startTrace(path))) {
+                return -errno;
+        }
+
+        return 0;
+#else
+        return -ENOTSUP;
+#endif
+}
+
+int tony6502StopTrace(Tony6502 *machine)
+{
+#if defined(TRACE)
+        Memory *memory = &machine->machine.memory;
+        int error = 0;
+
+        if (memory->tracer) {
+                error = stopTrace(memory->tracer);
+                memory->tracer = NULL;
+        }
+
+        return error;
+#else
+        return 0;
+#endif
+}
+
+int tony6502StartProfile(Tony6502 *machine)
+{
+#if defined(PROFILE)
+        Memory *memory = &machine->machine.memory;
+
+        if (memory->profile) {
+                memset(memory->profile, 0, sizeof(*memory->profile));
+        } else if (!(memory->profile = calloc(1, sizeof(Profile)))) {
+                return -ENOMEM;
+        }
+
+        return 0;
+#else
+        return -ENOTSUP;
+#endif
+}
+
+int tony6502WriteProfile(Tony6502 *machine, FILE *report, const char *dump)
+{
+#if defined(PROFILE)
+        Profile *profile = machine->machine.memory.profile;
+        int error = 0;
+
+        if (!profile) {
+                return -EINVAL;
+        }
+
+        if (report) {
+                error = printProfile(profile, report);
+        }
+        if (dump && !error) {
+                error = dumpProfile(profile, dump);
+        }
+
+        return error;
+#else
+        return -ENOTSUP;
+#endif
+}
+
+int tony6502StartRewind(Tony6502 *machine, uint64_t period, int checkpoints)
+{
+        if (!period || checkpoints <= 0) {
+                return -EINVAL;
+        }
+        if (machine->machine.memory.rewind ||
+            machine->machine.memory.recorder) {
+                return -EBUSY;
+        }
+        if (!startRewind(&machine->machine, period, checkpoints)) {
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+void tony6502StopRewind(Tony6502 *machine)
+{
+        stopRewind(machine->machine.memory.rewind);
+}
+
+int tony6502Rewind(Tony6502 *machine, uint64_t cycles)
+{
+        if (!machine->machine.memory.rewind) {
+                return -EINVAL;
+        }
+
+        return rewindTo(machine->machine.memory.rewind, cycles);
+}
+
+int tony6502StartRecording(Tony6502 *machine, const char *path)
+{
+        if (!startRecording(&machine->machine, path)) {
+                return -errno;
+        }
+
+        return 0;
+}
+
+int tony6502StartReplay(Tony6502 *machine, const char *path)
+{
+        if (!startReplay(&machine->machine, path)) {
+                return -errno;
+        }
+
+        return 0;
+}
+
+int tony6502StopRecording(Tony6502 *machine)
+{
+        return stopRecorder(machine->machine.memory.recorder);
+}
+
+int tony6502GetRecordStats(const Tony6502 *machine,
+                           Tony6502RecordStats *stats)
+{
+        const Recorder *recorder = machine->machine.memory.recorder;
+        RecordStats source;
+
+        if (!recorder) {
+                return -EINVAL;
+        }
+
+        getRecordStats(recorder, &source);
+        stats->entries = source.entries;
+        stats->bytes = source.bytes;
+        stats->reads = source.reads;
+        stats->interrupts = source.interrupts;
+
+        return 0;
+}
+
+int tony6502SetPace(Tony6502 *machine, double hz)
+{
+        Pacer *pacer;
+        int error;
+
+        if (!hz) {
+                free(machine->pacer);
+                machine->pacer = NULL;
+                return 0;
+        }
+
+        if (!(pacer = malloc(sizeof(*pacer)))) {
+                return -ENOMEM;
+        }
+        if ((error = initPacer(pacer, hz, 0)) < 0) {
+                free(pacer);
+                return error;
+        }
+        free(machine->pacer);
+        machine->pacer = pacer;
+
+        return 0;
+}
+
+int tony6502WritePace(Tony6502 *machine, FILE *report)
+{
+        if (!machine->pacer) {
+                return -EINVAL;
+        }
+
+        return printPacer(machine->pacer, report);
+}
+
+int tony6502AttachSerial(Tony6502 *machine, uint16_t address, FILE *output,
+                         int input, double baud)
+{
+        /* The baud rate delay is counted at the clock rate runs keep. */
+        double hz = machine->pacer ? machine->pacer->hz : 1e6;
+        Acia *acia;
+        int error;
+
+        if (machine->acia) {
+                return -EBUSY;
+        }
+        if (!(acia = malloc(sizeof(*acia)))) {
+                return -ENOMEM;
+        }
+        if ((error = attachAcia(acia, &machine->machine, address >> 8, output,
+                                input, hz, baud)) < 0) {
+                free(acia);
+                return error;
+        }
+        machine->acia = acia;
+
+        return 0;
+}
+
+int tony6502FlushSerial(Tony6502 *machine)
+{
+        if (!machine->acia) {
+                return -EINVAL;
+        }
+
+        return flushAcia(machine->acia);
+}
+
+int tony6502DetachSerial(Tony6502 *machine)
+{
+        int error;
+
+        if (!machine->acia) {
+                return -EINVAL;
+        }
+
+        error = detachAcia(machine->acia);
+        free(machine->acia);
+        machine->acia = NULL;
+
+        return error;
+}
+
+int tony6502Watch(Tony6502 *machine, uint16_t first, uint16_t last,
+                  int types)
+{
+        if (first > last ||
+            types & ~(TONY6502_EXECUTE | TONY6502_READ | TONY6502_WRITE)) {
+                return -EINVAL;
+        }
+
+        /* The library's kinds of watches are those of debug.h. */
+        return setWatches(&machine->machine.memory, first, last, types);
+}
+
+int tony6502GetHit(const Tony6502 *machine, Tony6502Hit *hit)
+{
+        const Debugger *debugger = machine->machine.memory.debugger;
+
+        if (!debugger || !debugger->hit.type) {
+                return -EINVAL;
+        }
+
+        hit->type = debugger->hit.type;
+        hit->address = debugger->hit.address;
+        hit->value = debugger->hit.value;
+        copyRegisters(&debugger->hit.registers, &hit->registers);
+
+        return 0;
+}
+
+int tony6502WriteHit(const Tony6502 *machine, FILE *report)
+{
+        const Debugger *debugger = machine->machine.memory.debugger;
+
+        if (!debugger || !debugger->hit.type) {
+                return -EINVAL;
+        }
+
+        return printHit(&debugger->hit, report);
+}
+
+int tony6502Fuzz(Tony6502 *machine, uint16_t input, uint64_t cycles)
+{
+#if defined(COVERAGE)
+        return runFuzz(&machine->machine, input, cycles);
+#else
+        return -ENOTSUP;
+#endif
+}
@@ -0,0 +1,261 @@
+#ifndef TONY6502_H
+#define TONY6502_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libtony6502, the emulator as a library.
+ *
+ * Each Tony6502 is a whole machine, registers and 64 KiB address space,
+ * sharing no state with the others: any number of them can run at once,
+ * as long as each is only used by one thread at a time. The dispatch
+ * engine, tracing and profiling are those the library was built with.
+ *
+ * Functions returning int or long return a negative errno value on error.
+ */
+typedef struct Tony6502 Tony6502;
+
+typedef struct {
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t sp;
+        uint16_t pc;
+        /* NV-BDIZC */
+        uint8_t p;
+        /* Cycles elapsed since reset */
+        uint64_t cycles;
+} Tony6502Registers;
+
+/* Why tony6502Run() returned. */
+typedef enum {
+        /* A BRK opcode was fetched; the PC still points to it. */
+        TONY6502_BRK,
+        /* The cycle budget was spent. */
+        TONY6502_BUDGET,
+        /* A STP opcode halted the CPU; only tony6502Reset() resumes it. */
+        TONY6502_STP,
+        /* The PC reached a breakpoint; the PC still points to it. */
+        TONY6502_BREAKPOINT,
+        /* The last instruction read or wrote a watched address. */
+        TONY6502_WATCHPOINT,
+        /*
+         * A replay no longer matches its log; runs stop straight away
+         * until tony6502StopRecording(), which returns -EIO.
+         */
+        TONY6502_DIVERGED
+} Tony6502Stop;
+
+/* A machine with zeroed memory, reset to pc 0; NULL if out of memory. */
+Tony6502 *tony6502Create(void);
+void tony6502Destroy(Tony6502 *machine);
+
+/*
+ * Copy a raw binary image from a file or from memory into the address
+ * space at address, bypassing devices. Returns the number of bytes loaded;
+ * an image running past the end of memory is an error (-EFBIG).
+ */
+long tony6502Load(Tony6502 *machine, const char *path, uint16_t address);
+long tony6502LoadImage(Tony6502 *machine, const void *image, size_t size,
+                       uint16_t address);
+
+/* Formats of program images, for tony6502LoadProgram(). */
+typedef enum {
+        /* Guessed from the file name, then from its first bytes. */
+        TONY6502_AUTO,
+        TONY6502_RAW,
+        /* Intel HEX records. */
+        TONY6502_IHEX,
+        /* Motorola S-records. */
+        TONY6502_SREC,
+        /* Commodore PRG: a little endian load address, then the bytes. */
+        TONY6502_PRG
+} Tony6502Format;
+
+/*
+ * Load a program from a file in one of the formats above, placing each of
+ * its segments where it says (raw images at address), set the reset
+ * vector to its entry point unless it loads the vector itself, and reset
+ * the machine there. The entry point is the load address of raw and PRG
+ * images, or the start address record of HEX and S-record files, or else
+ * the reset vector the image loaded, or else the lowest address loaded.
+ * Returns the number of bytes loaded; -EINVAL for a malformed image,
+ * -EFBIG for one running past the end of memory.
+ */
+long tony6502LoadProgram(Tony6502 *machine, const char *path,
+                         Tony6502Format format, uint16_t address);
+
+/* Power on state of the registers, with the given pc. */
+void tony6502Reset(Tony6502 *machine, uint16_t pc);
+/*
+ * Run for at least cycles more cycles (UINT64_MAX for no limit), or until
+ * a BRK is fetched, a STP halts the CPU, a watch is hit or a replay
+ * diverges. The last instruction may overshoot by a few cycles.
+ */
+Tony6502Stop tony6502Run(Tony6502 *machine, uint64_t cycles);
+/*
+ * Run count instructions, fewer if a BRK is fetched, a STP halts the CPU
+ * or a watch is hit first, or if a WAI waits with no event pending that
+ * could end it. Returns how many were run, the one hitting a watchpoint
+ * included; taking an interrupt and waiting in WAI are not instructions.
+ */
+uint64_t tony6502Step(Tony6502 *machine, uint64_t count);
+
+void tony6502GetRegisters(const Tony6502 *machine,
+                          Tony6502Registers *registers);
+void tony6502SetRegisters(Tony6502 *machine,
+                          const Tony6502Registers *registers);
+
+/* Read or write a byte as the CPU would, through ROM and device pages. */
+uint8_t tony6502Read(Tony6502 *machine, uint16_t address);
+void tony6502Write(Tony6502 *machine, uint16_t address, uint8_t value);
+
+/*
+ * Trace every instruction run to a file (see tools/tracedump.c) until
+ * tony6502StopTrace(), which returns whether all of it could be written.
+ * -ENOTSUP without TRACE, -EBUSY if already tracing.
+ */
+int tony6502StartTrace(Tony6502 *machine, const char *path);
+int tony6502StopTrace(Tony6502 *machine);
+
+/*
+ * Profile execution from now on, -ENOTSUP without PROFILE. The profile so
+ * far can then be printed as a report and written to a dump file (see
+ * profile.h), either being skipped if NULL; -EINVAL if not profiling.
+ */
+int tony6502StartProfile(Tony6502 *machine);
+int tony6502WriteProfile(Tony6502 *machine, FILE *report, const char *dump);
+
+/*
+ * Record execution from now on so that it can be rewound: a checkpoint of
+ * the registers and the RAM pages that changed is taken every period
+ * cycles run, the newest few kept, and the interrupts taken and bytes read
+ * from devices are logged in between. -EBUSY if already recording, for
+ * rewinding or to a log.
+ * tony6502Rewind() then takes the machine back to the first instruction
+ * boundary from cycles on, as long as the oldest checkpoint kept is not
+ * newer; -ERANGE otherwise, or if cycles is in the future. Devices are not
+ * rewound, only what the CPU read from them is replayed.
+ */
+int tony6502StartRewind(Tony6502 *machine, uint64_t period, int checkpoints);
+void tony6502StopRewind(Tony6502 *machine);
+int tony6502Rewind(Tony6502 *machine, uint64_t cycles);
+
+/*
+ * Record everything that comes into the machine from now on to a log file
+ * (see src/record.h): bytes read from devices, interrupts taken, and
+ * memory and registers changed through this library, each at the cycle
+ * it happened, after the registers and RAM to start from. Replaying the
+ * log restores that state, then has runs read and take the same, for the
+ * machine to go through the same states bit for bit whatever the devices
+ * now do; once the end of the recording is reached, it runs live again.
+ * The host should only run the machine while it replays. Both take the
+ * place of recording for rewinding: -EBUSY if either is going on.
+ * Devices are not in the log: replaying needs the same pages mapped to
+ * devices (the serial console attached at the same address) as when
+ * recording, -EINVAL otherwise, as for a file that is not a log.
+ *
+ * tony6502StopRecording() writes the final state to the log, or when
+ * replaying, checks the machine got there: -EIO if it did not (or the log
+ * could not be written), -EINPROGRESS if the replay did not get to the
+ * end, -ENODATA if the log was cut short by a recording that was never
+ * stopped. Entries and bytes logged or replayed so far can be read in the
+ * meantime, -EINVAL if neither recording nor replaying.
+ */
+typedef struct {
+        uint64_t entries;
+        uint64_t bytes;
+        /* Device reads and interrupts among the entries. */
+        uint64_t reads;
+        uint64_t interrupts;
+} Tony6502RecordStats;
+
+int tony6502StartRecording(Tony6502 *machine, const char *path);
+int tony6502StartReplay(Tony6502 *machine, const char *path);
+int tony6502StopRecording(Tony6502 *machine);
+int tony6502GetRecordStats(const Tony6502 *machine,
+                           Tony6502RecordStats *stats);
+
+/*
+ * Pace tony6502Run() and tony6502Step() from now on to hz cycles per
+ * second of wall clock time, holding the machine back in slices of 100
+ * microseconds; 0 runs flat out again. Takes a few milliseconds, to time
+ * how late sleeps wake up. -EINVAL for a rate below 1 Hz. The pacing
+ * statistics so far (deadlines missed, how late waits ended and how far
+ * behind the clock the machine was) can then be printed as a report;
+ * -EINVAL if not pacing.
+ */
+int tony6502SetPace(Tony6502 *machine, double hz);
+int tony6502WritePace(Tony6502 *machine, FILE *report);
+
+/*
+ * Map a 6551 ACIA style serial console (see src/acia.h) to the page of
+ * address, its registers repeating every 4 bytes. Bytes the guest writes
+ * to it are held in a 64 KiB buffer and written to output in batches: when
+ * it fills up, 100 ms worth of cycles after the first byte held, and when
+ * tony6502Run() or tony6502Step() returns. Input is read from the input
+ * descriptor without blocking and received one byte per character time at
+ * baud bits per second, counted at the pace set or else 1 MHz, raising
+ * the IRQ if the guest enabled receiver interrupts. output may be NULL
+ * and input -1 for none. -EINVAL for a page that cannot hold a device or
+ * a baud rate below 1, -EBUSY if a console is already attached.
+ *
+ * tony6502DetachSerial() writes out what is held and maps the page back
+ * to RAM; both it and tony6502FlushSerial() return -EIO if writing output
+ * has failed, -EINVAL without a console.
+ */
+int tony6502AttachSerial(Tony6502 *machine, uint16_t address, FILE *output,
+                         int input, double baud);
+int tony6502FlushSerial(Tony6502 *machine);
+int tony6502DetachSerial(Tony6502 *machine);
+
+/* Kinds of watches, to be or'ed together. */
+enum {
+        /* Breakpoints, before the instruction at the address runs. */
+        TONY6502_EXECUTE = 1,
+        TONY6502_READ = 2,
+        TONY6502_WRITE = 4
+};
+
+/* Where and why a run last stopped on a watch. */
+typedef struct {
+        /* TONY6502_EXECUTE, TONY6502_READ or TONY6502_WRITE. */
+        int type;
+        uint16_t address;
+        /* Byte read or written, 0 for breakpoints. */
+        uint8_t value;
+        Tony6502Registers registers;
+} Tony6502Hit;
+
+/*
+ * Set the watches of addresses first to last (inclusive) to types, 0 to
+ * clear them. Runs stop before the instruction at a breakpoint, and again
+ * running from it passes it; they stop after the instruction (or the
+ * interrupt) reading or writing a watched address, accesses through
+ * tony6502Read() and tony6502Write() aside. Pages without watches run at
+ * full speed; the JIT only interprets while reads or writes are watched.
+ * -EINVAL for an empty range or unknown types.
+ */
+int tony6502Watch(Tony6502 *machine, uint16_t first, uint16_t last,
+                  int types);
+/*
+ * The last hit, which can also be printed as a report with the registers;
+ * -EINVAL if there was none.
+ */
+int tony6502GetHit(const Tony6502 *machine, Tony6502Hit *hit);
+int tony6502WriteHit(const Tony6502 *machine, FILE *report);
+
+/*
+ * Fuzz the loaded program with AFL++ in persistent mode: every test case,
+ * read from stdin, starts from the machine as it is now, copied to input
+ * with its length in A and X, and runs for cycles cycles at most. Hitting
+ * a watch or a STP aborts the process as a crash. Returns when afl-fuzz
+ * is done, or after running stdin once when not run by afl-fuzz, printing
+ * the outcome. -ENOTSUP without COVERAGE, -EBUSY while recording for
+ * rewinding or to a log.
+ */
+int tony6502Fuzz(Tony6502 *machine, uint16_t input, uint64_t cycles);
+
+#endif  /* TONY6502_H */
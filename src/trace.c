@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+
+#if defined(TRACE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* Records in the ring, a power of two. */
+#define RING_SIZE 0x10000
+#define CACHE_LINE 64
+
+/*
+ * The producer only writes head and the consumer only writes tail, each on
+ * its own cache line; both only ever grow, and index the ring modulo its
+ * size.
+ */
+struct Tracer {
+        _Alignas(CACHE_LINE) atomic_size_t head;
+        /* Last tail seen by the producer, to rarely touch the other line. */
+        size_t knownTail;
+        _Alignas(CACHE_LINE) atomic_size_t tail;
+        atomic_int stopping;
+        int error;
+        FILE *file;
+        pthread_t writer;
+        _Alignas(CACHE_LINE) TraceRecord records[RING_SIZE];
+};
+
+void traceInstruction(Tracer *tracer, const Registers *registers,
+                      const uint8_t *ram)
+{
+        size_t head = atomic_load_explicit(&tracer->head,
+                                           memory_order_relaxed);
+        TraceRecord *record;
+
+        while (head - tracer->knownTail == RING_SIZE) {
+                tracer->knownTail = atomic_load_explicit(&tracer->tail,
+                                                         memory_order_acquire);
+                if (head - tracer->knownTail == RING_SIZE) {
+                        sched_yield();
+                }
+        }
+
+        record = &tracer->records[head & (RING_SIZE - 1)];
+        record->cycles = registers->cycles;
+        record->pc = registers->pc;
+        record->opcode = ram[registers->pc];
+        record->operand[0] = ram[(uint16_t) (registers->pc + 1)];
+        record->operand[1] = ram[(uint16_t) (registers->pc + 2)];
+        record->a = registers->a;
+        record->x = registers->x;
+        record->y = registers->y;
+        record->sp = registers->sp;
+        record->p = registers->p;
+        atomic_store_explicit(&tracer->head, head + 1, memory_order_release);
+}
+
+/* Writer thread: hand whatever the ring holds to fwrite(), until stopped. */
+static void *drain(void *argument)
+{
+        static const struct timespec pause = { 0, 1000000 };
+        Tracer *tracer = argument;
+        size_t tail = 0, head, count;
+        int stopping;
+
+        for (;;) {
+                /* Read before head, so that nothing is left behind. */
+                stopping = atomic_load_explicit(&tracer->stopping,
+                                                memory_order_acquire);
+                head = atomic_load_explicit(&tracer->head,
+                                            memory_order_acquire);
+                if (head == tail) {
+                        if (stopping) {
+                                break;
+                        }
+                        nanosleep(&pause, NULL);
+                        continue;
+                }
+
+                /* Up to the end of the ring, the rest on the next round. */
+                count = head - tail;
+                if (count > RING_SIZE - (tail & (RING_SIZE - 1))) {
+                        count = RING_SIZE - (tail & (RING_SIZE - 1));
+                }
+                if (fwrite(&tracer->records[tail & (RING_SIZE - 1)],
+                           sizeof(TraceRecord), count, tracer->file) !=
+                    count && !tracer->error) {
+                        tracer->error = errno ? errno : EIO;
+                }
+                tail += count;
+                atomic_store_explicit(&tracer->tail, tail,
+                                      memory_order_release);
+        }
+
+        return NULL;
+}
+
+Tracer *startTrace(const char *path)
+{
+        Tracer *tracer = aligned_alloc(CACHE_LINE, sizeof(Tracer));
+        int error;
+
+        if (!tracer) {
+                return NULL;
+        }
+
+        atomic_init(&tracer->head, 0);
+        atomic_init(&tracer->tail, 0);
+        atomic_init(&tracer->stopping, 0);
+        tracer->knownTail = 0;
+        tracer->error = 0;
+        if (!(tracer->file = fopen(path, "wb"))) {
+                error = errno;
+                free(tracer);
+                errno = error;
+                return NULL;
+        }
+        /* Large buffered writes, the ring already batches records. */
+        setvbuf(tracer->file, NULL, _IOFBF, 1 << 20);
+        fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), tracer->file);
+
+        if ((error = pthread_create(&tracer->writer, NULL, drain, tracer))) {
+                fclose(tracer->file);
+                free(tracer);
+                errno = error;
+                return NULL;
+        }
+
+        return tracer;
+}
+
+int stopTrace(Tracer *tracer)
+{
+        int error;
+
+        atomic_store_explicit(&tracer->stopping, 1, memory_order_release);
+        pthread_join(tracer->writer, NULL);
+        error = tracer->error;
+        if (fclose(tracer->file) && !error) {
+                error = errno;
+        }
+        free(tracer);
+
+        return -error;
+}
+
+#endif  /* TRACE */
@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+/* Magic number starting every trace file, followed by TraceRecords. */
+#define TRACE_MAGIC "T6502TR1"
+
+/*
+ * State of the CPU right before an instruction, as written to trace files
+ * in host byte order.
+ */
+typedef struct {
+        uint64_t cycles;
+        uint16_t pc;
+        uint8_t opcode;
+        /* The two bytes after the opcode, whatever its length. */
+        uint8_t operand[2];
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t sp;
+        uint8_t p;
+        uint8_t reserved[6];
+} TraceRecord;
+
+#if defined(TRACE)
+/*
+ * Instruction tracing, compiled in with TRACE and enabled by pointing
+ * memory->tracer at a Tracer. The CPU thread fills a single producer,
+ * single consumer ring that a writer thread drains to the trace file in
+ * batches; when the ring is full, the CPU waits for it.
+ *
+ * startTrace() returns NULL with errno set if the file cannot be created.
+ * stopTrace() writes the records left, then returns 0, or a negative errno
+ * value if any write failed.
+ */
+Tracer *startTrace(const char *path);
+void traceInstruction(Tracer *tracer, const Registers *registers,
+                      const uint8_t *ram);
+int stopTrace(Tracer *tracer);
+#endif
+
+#endif  /* TRACE_H */
@@ -0,0 +1,131 @@
+/*
+ * Check decimal mode ADC and SBC against a model that works one digit at a
+ * time, for every carry, accumulator and operand: 2x256x256 combinations
+ * each. The model follows the documented 65C02 sequences, invalid BCD
+ * digits included. Prints each mismatch and exits nonzero on any.
+ */
+#include <stdio.h>
+#include "cpu.h"
+
+/* Mismatches printed before the rest are only counted. */
+#define MAX_PRINTED 20
+
+/* A digit of a byte, as a signed value for the high one. */
+static int signedDigit(int digit)
+{
+        return digit >= 8 ? digit - 16 : digit;
+}
+
+static uint8_t zeroNegative(uint8_t value)
+{
+        return (value & FLAG_N) | (value ? 0 : FLAG_Z);
+}
+
+/* Returns the accumulator and sets *flags to N, V, Z and C. */
+static uint8_t addModel(uint8_t a, uint8_t operand, int carry,
+                        uint8_t *flags)
+{
+        int low = (a & 0x0F) + (operand & 0x0F) + carry;
+        int high, signedHigh, lowCarry = 0, overflow;
+        uint8_t result;
+
+        if (low > 9) {
+                low = (low + 6) & 0x0F;
+                lowCarry = 1;
+        }
+        high = (a >> 4) + (operand >> 4) + lowCarry;
+        /* V comes from the high digits before they are adjusted. */
+        signedHigh = signedDigit(a >> 4) + signedDigit(operand >> 4) +
+                lowCarry;
+        overflow = signedHigh < -8 || signedHigh > 7;
+        if (high > 9) {
+                high += 6;
+        }
+        carry = high > 0x0F;
+        result = (high & 0x0F) << 4 | low;
+        *flags = zeroNegative(result) | overflow * FLAG_V | carry * FLAG_C;
+
+        return result;
+}
+
+static uint8_t subtractModel(uint8_t a, uint8_t operand, int carry,
+                             uint8_t *flags)
+{
+        int low = (a & 0x0F) - (operand & 0x0F) - !carry;
+        int high, lowBorrow = low < 0, highBorrow, overflow, digit;
+        uint8_t result;
+
+        high = (a >> 4) - (operand >> 4) - lowBorrow;
+        highBorrow = high < 0;
+        /* C and V are those of the binary subtraction. */
+        digit = signedDigit(a >> 4) - signedDigit(operand >> 4) - lowBorrow;
+        overflow = digit < -8 || digit > 7;
+        low &= 0x0F;
+        high &= 0x0F;
+        /*
+         * The 65C02 corrects the whole binary difference, so taking 6 off
+         * an invalid low digit can borrow from the high one.
+         */
+        if (lowBorrow) {
+                low -= 6;
+                if (low < 0) {
+                        low += 16;
+                        high--;
+                }
+        }
+        if (highBorrow) {
+                high -= 6;
+        }
+        result = (high & 0x0F) << 4 | low;
+        *flags = zeroNegative(result) | overflow * FLAG_V |
+                !highBorrow * FLAG_C;
+
+        return result;
+}
+
+static unsigned long check(const char *name,
+                           void (*instruction)(uint8_t, Registers *),
+                           uint8_t (*model)(uint8_t, uint8_t, int, uint8_t *),
+                           unsigned long printed)
+{
+        Registers registers = { 0 };
+        unsigned long mismatches = 0;
+        uint8_t expected, flags;
+        int carry, a, operand;
+
+        for (carry = 0; carry < 2; carry++) {
+                for (a = 0; a < 0x100; a++) {
+                        for (operand = 0; operand < 0x100; operand++) {
+                                registers.a = a;
+                                registers.p = FLAG_D | carry;
+                                instruction(operand, &registers);
+                                expected = model(a, operand, carry, &flags);
+                                if (registers.a == expected &&
+                                    registers.p == (FLAG_D | flags)) {
+                                        continue;
+                                }
+                                if (printed + mismatches++ < MAX_PRINTED) {
+                                        printf("%s c=%d a=%02X m=%02X: "
+                                               "a=%02X p=%02X, expected "
+                                               "a=%02X p=%02X\n", name, carry,
+                                               a, operand, registers.a,
+                                               registers.p, expected,
+                                               FLAG_D | flags);
+                                }
+                        }
+                }
+        }
+
+        return mismatches;
+}
+
+int main(void)
+{
+        unsigned long mismatches = check("ADC", ADC, addModel, 0);
+
+        mismatches += check("SBC", SBC, subtractModel, mismatches);
+        printf("%lu mismatches in %d decimal mode ADC and SBC cases\n",
+               mismatches, 2 * 2 * 256 * 256);
+
+        return mismatches != 0;
+}
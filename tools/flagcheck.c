@@ -0,0 +1,233 @@
+/*
+ * Check the binary mode ALU opcodes against a model in plain integer
+ * arithmetic, for every register value, operand and carry, with the other
+ * flags all clear and all set: ADC, SBC, the compares, the loads and
+ * logical operations, the shifts and rotations, BIT, TRB and TSB. Prints
+ * each mismatch and exits nonzero on any.
+ */
+#include <stdio.h>
+#include "cpu.h"
+
+/* Mismatches printed before the rest are only counted. */
+#define MAX_PRINTED 20
+
+enum {
+        OP_ADC, OP_SBC, OP_CMP, OP_CPX, OP_CPY, OP_AND, OP_EOR, OP_ORA,
+        OP_LDA, OP_LDX, OP_LDY, OP_ASL, OP_LSR, OP_ROL, OP_ROR, OP_BIT,
+        OP_TRB, OP_TSB, OPS
+};
+
+static const char *const names[OPS] = {
+        "ADC", "SBC", "CMP", "CPX", "CPY", "AND", "EOR", "ORA", "LDA", "LDX",
+        "LDY", "ASL", "LSR", "ROL", "ROR", "BIT", "TRB", "TSB"
+};
+
+/* The registers, and the memory operand read-modify-write opcodes leave. */
+typedef struct {
+        uint8_t a, x, y, p, memory;
+} State;
+
+static int signedByte(int value)
+{
+        return value >= 0x80 ? value - 0x100 : value;
+}
+
+/* Set N and Z from result, and C and V as given, keeping the rest of p. */
+static uint8_t flags(uint8_t p, uint8_t mask, int result, int carry,
+                     int overflow)
+{
+        uint8_t set = 0;
+
+        if (result & 0x80) {
+                set |= FLAG_N;
+        }
+        if (!(result & 0xFF)) {
+                set |= FLAG_Z;
+        }
+        if (carry) {
+                set |= FLAG_C;
+        }
+        if (overflow) {
+                set |= FLAG_V;
+        }
+
+        return (p & ~mask) | (set & mask);
+}
+
+static State model(int op, State state, uint8_t operand)
+{
+        int carry = state.p & FLAG_C, value, sum;
+        const uint8_t nz = FLAG_N | FLAG_Z, nzc = nz | FLAG_C;
+        const uint8_t all = nzc | FLAG_V;
+
+        switch (op) {
+        case OP_ADC:
+                sum = state.a + operand + carry;
+                value = signedByte(state.a) + signedByte(operand) + carry;
+                state.p = flags(state.p, all, sum, sum > 0xFF,
+                                value < -128 || value > 127);
+                state.a = sum;
+                break;
+        case OP_SBC:
+                sum = state.a - operand - !carry;
+                value = signedByte(state.a) - signedByte(operand) - !carry;
+                state.p = flags(state.p, all, sum, sum >= 0,
+                                value < -128 || value > 127);
+                state.a = sum;
+                break;
+        case OP_CMP:
+        case OP_CPX:
+        case OP_CPY:
+                value = op == OP_CMP ? state.a :
+                        op == OP_CPX ? state.x : state.y;
+                state.p = flags(state.p, nzc, value - operand,
+                                value >= operand, 0);
+                break;
+        case OP_AND:
+        case OP_EOR:
+        case OP_ORA:
+                state.a = op == OP_AND ? state.a & operand :
+                        op == OP_EOR ? state.a ^ operand : state.a | operand;
+                state.p = flags(state.p, nz, state.a, 0, 0);
+                break;
+        case OP_LDA:
+        case OP_LDX:
+        case OP_LDY:
+                if (op == OP_LDA) {
+                        state.a = operand;
+                } else if (op == OP_LDX) {
+                        state.x = operand;
+                } else {
+                        state.y = operand;
+                }
+                state.p = flags(state.p, nz, operand, 0, 0);
+                break;
+        case OP_ASL:
+        case OP_ROL:
+                value = operand * 2 + (op == OP_ROL && carry);
+                state.p = flags(state.p, nzc, value, value > 0xFF, 0);
+                state.memory = value;
+                break;
+        case OP_LSR:
+        case OP_ROR:
+                value = operand / 2 + (op == OP_ROR && carry) * 0x80;
+                state.p = flags(state.p, nzc, value, operand % 2, 0);
+                state.memory = value;
+                break;
+        case OP_BIT:
+                /* N and V come from the operand, Z from A AND it. */
+                state.p = flags(state.p, all & ~FLAG_C, operand, 0,
+                                operand & 0x40);
+                state.p = flags(state.p, FLAG_Z, state.a & operand, 0, 0);
+                break;
+        case OP_TRB:
+        case OP_TSB:
+                state.p = flags(state.p, FLAG_Z, state.a & operand, 0, 0);
+                state.memory = op == OP_TRB ? operand & ~state.a :
+                        operand | state.a;
+                break;
+        }
+
+        return state;
+}
+
+/* The opcodes leaving a result in a register, and those returning one. */
+static void (*const registerOps[OPS])(uint8_t, Registers *) = {
+        [OP_ADC] = ADC, [OP_SBC] = SBC, [OP_CMP] = CMP, [OP_CPX] = CPX,
+        [OP_CPY] = CPY, [OP_AND] = AND, [OP_EOR] = EOR, [OP_ORA] = ORA,
+        [OP_LDA] = LDA, [OP_LDX] = LDX, [OP_LDY] = LDY, [OP_BIT] = BIT
+};
+static uint8_t (*const memoryOps[OPS])(uint8_t, Registers *) = {
+        [OP_ASL] = ASL, [OP_LSR] = LSR, [OP_ROL] = ROL, [OP_ROR] = ROR,
+        [OP_TRB] = TRB, [OP_TSB] = TSB
+};
+
+static State actual(int op, State state, uint8_t operand)
+{
+        Registers registers = { 0 };
+
+        registers.a = state.a;
+        registers.x = state.x;
+        registers.y = state.y;
+        registers.p = state.p;
+        if (memoryOps[op]) {
+                state.memory = memoryOps[op](operand, &registers);
+        } else {
+                registerOps[op](operand, &registers);
+        }
+        state.a = registers.a;
+        state.x = registers.x;
+        state.y = registers.y;
+        state.p = registers.p;
+
+        return state;
+}
+
+static int same(const State *a, const State *b)
+{
+        return a->a == b->a && a->x == b->x && a->y == b->y &&
+                a->p == b->p && a->memory == b->memory;
+}
+
+static void printState(const State *state)
+{
+        printf("a=%02X x=%02X y=%02X p=%02X m=%02X", state->a, state->x,
+               state->y, state->p, state->memory);
+}
+
+/* Check op with every register value and operand, returns mismatches. */
+static unsigned long check(int op, uint8_t p, unsigned long printed)
+{
+        unsigned long mismatches = 0;
+        State state, expected, got;
+        int value, operand;
+
+        for (value = 0; value < 0x100; value++) {
+                for (operand = 0; operand < 0x100; operand++) {
+                        /* Different values, to catch CPY comparing X. */
+                        state.a = value;
+                        state.x = value ^ 0x5A;
+                        state.y = value ^ 0xA5;
+                        state.p = p;
+                        state.memory = operand;
+                        expected = model(op, state, operand);
+                        got = actual(op, state, operand);
+                        if (same(&expected, &got)) {
+                                continue;
+                        }
+                        if (printed + mismatches++ < MAX_PRINTED) {
+                                printf("%s ", names[op]);
+                                printState(&state);
+                                printf(": ");
+                                printState(&got);
+                                printf(", expected ");
+                                printState(&expected);
+                                printf("\n");
+                        }
+                }
+        }
+
+        return mismatches;
+}
+
+int main(void)
+{
+        /* Binary mode: D stays clear, whatever the other flags. */
+        static const uint8_t others[] = { 0, (uint8_t) ~(FLAG_D | FLAG_C) };
+        unsigned long mismatches = 0, cases = 0;
+        int op, i, carry;
+
+        for (op = 0; op < OPS; op++) {
+                for (i = 0; i < 2; i++) {
+                        for (carry = 0; carry < 2; carry++) {
+                                mismatches += check(op, others[i] | carry,
+                                                    mismatches);
+                                cases += 0x100 * 0x100;
+                        }
+                }
+        }
+        printf("%lu mismatches in %lu binary mode ALU cases\n", mismatches,
+               cases);
+
+        return mismatches != 0;
+}
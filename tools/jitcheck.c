@@ -0,0 +1,277 @@
+/*
+ * Differential check of the JIT against the interpreter, built with
+ * JIT_VERIFY so that every translated block is also replayed on a shadow
+ * copy of the machine. Generates random loops of common opcodes that
+ * rewrite the immediate operands of their own instructions and call a
+ * subroutine, and runs each on two machines in the same random budget
+ * slices: one translating hot blocks, one with its code buffer dropped,
+ * which only interprets. Their registers and RAM must match after every
+ * slice. Prints the seed of the first program that differs and exits
+ * nonzero.
+ *
+ *     jitcheck [programs [seed]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "jit.h"
+
+#if !defined(ENGINE_JIT) || !defined(JIT_VERIFY)
+#error "jitcheck needs ENGINE_JIT and JIT_VERIFY"
+#endif
+
+#define CODE 0x0200
+/* Data written by absolute addressing, and pointers for (zp),y. */
+#define DATA 0x0300
+#define POINTERS 0x00
+#define POINTER_COUNT 8
+/* End of what programs can write: compared after every slice. */
+#define WRITABLE 0x0500
+/* Instructions in the loop, at most, and cycles each program runs. */
+#define MAX_INSTRUCTIONS 48
+#define RUN_CYCLES 50000
+#define MAX_SLICE 300
+#define PROGRAMS 400
+
+/* How an instruction's operand is chosen. */
+enum {
+        IMPLIED,
+        IMMEDIATE,
+        ZERO_PAGE,
+        ABSOLUTE,
+        INDIRECT,
+        BRANCH,
+        /* An absolute write to the operand of an immediate instruction. */
+        SELF
+};
+
+typedef struct {
+        uint8_t opcode;
+        uint8_t kind;
+} Template;
+
+static const Template templates[] = {
+        { 0xA9, IMMEDIATE }, { 0xA2, IMMEDIATE }, { 0xA0, IMMEDIATE },
+        { 0x69, IMMEDIATE }, { 0xE9, IMMEDIATE }, { 0x29, IMMEDIATE },
+        { 0x09, IMMEDIATE }, { 0x49, IMMEDIATE }, { 0xC9, IMMEDIATE },
+        { 0xE0, IMMEDIATE }, { 0xC0, IMMEDIATE }, { 0x89, IMMEDIATE },
+        { 0xA5, ZERO_PAGE }, { 0x85, ZERO_PAGE }, { 0x86, ZERO_PAGE },
+        { 0x84, ZERO_PAGE }, { 0x64, ZERO_PAGE }, { 0xE6, ZERO_PAGE },
+        { 0xC6, ZERO_PAGE }, { 0x06, ZERO_PAGE }, { 0x46, ZERO_PAGE },
+        { 0x26, ZERO_PAGE }, { 0x66, ZERO_PAGE }, { 0x65, ZERO_PAGE },
+        { 0xE5, ZERO_PAGE }, { 0x24, ZERO_PAGE }, { 0x04, ZERO_PAGE },
+        { 0x14, ZERO_PAGE }, { 0xB5, ZERO_PAGE }, { 0x95, ZERO_PAGE },
+        { 0xF6, ZERO_PAGE }, { 0x75, ZERO_PAGE },
+        { 0xAD, ABSOLUTE }, { 0x8D, ABSOLUTE }, { 0xEE, ABSOLUTE },
+        { 0xCE, ABSOLUTE }, { 0x6D, ABSOLUTE }, { 0xED, ABSOLUTE },
+        { 0x0E, ABSOLUTE }, { 0x2E, ABSOLUTE }, { 0x9C, ABSOLUTE },
+        { 0xBD, ABSOLUTE }, { 0x9D, ABSOLUTE }, { 0xFE, ABSOLUTE },
+        { 0x7D, ABSOLUTE }, { 0x1E, ABSOLUTE }, { 0xB9, ABSOLUTE },
+        { 0x99, ABSOLUTE }, { 0x79, ABSOLUTE },
+        { 0xB1, INDIRECT }, { 0x71, INDIRECT }, { 0xD1, INDIRECT },
+        { 0xE8, IMPLIED }, { 0xCA, IMPLIED }, { 0xC8, IMPLIED },
+        { 0x88, IMPLIED }, { 0xAA, IMPLIED }, { 0x8A, IMPLIED },
+        { 0xA8, IMPLIED }, { 0x98, IMPLIED }, { 0x18, IMPLIED },
+        { 0x38, IMPLIED }, { 0xF8, IMPLIED }, { 0xD8, IMPLIED },
+        { 0xB8, IMPLIED }, { 0x48, IMPLIED }, { 0x68, IMPLIED },
+        { 0x08, IMPLIED }, { 0x28, IMPLIED }, { 0x0A, IMPLIED },
+        { 0x4A, IMPLIED }, { 0x2A, IMPLIED }, { 0x6A, IMPLIED },
+        { 0x1A, IMPLIED }, { 0x3A, IMPLIED }, { 0xDA, IMPLIED },
+        { 0xFA, IMPLIED }, { 0x5A, IMPLIED }, { 0x7A, IMPLIED },
+        { 0xEA, IMPLIED },
+        { 0xD0, BRANCH }, { 0xF0, BRANCH }, { 0x90, BRANCH },
+        { 0xB0, BRANCH }, { 0x30, BRANCH }, { 0x10, BRANCH },
+        { 0x50, BRANCH }, { 0x70, BRANCH }, { 0x80, BRANCH },
+        { 0x8D, SELF }, { 0x8E, SELF }, { 0x8C, SELF }, { 0xEE, SELF },
+        { 0xCE, SELF }
+};
+
+#define TEMPLATE_COUNT (sizeof(templates) / sizeof(templates[0]))
+
+static uint64_t randomState;
+
+/* xorshift64*, so that a seed gives the same program everywhere. */
+static uint32_t randomNumber(void)
+{
+        randomState ^= randomState >> 12;
+        randomState ^= randomState << 25;
+        randomState ^= randomState >> 27;
+
+        return (randomState * 0x2545F4914F6CDD1D) >> 32;
+}
+
+/* Write a random program to ram, returns its end. */
+static uint16_t generate(uint8_t *ram)
+{
+        uint16_t starts[MAX_INSTRUCTIONS], immediates[MAX_INSTRUCTIONS];
+        uint8_t kinds[MAX_INSTRUCTIONS];
+        int count = 8 + randomNumber() % (MAX_INSTRUCTIONS - 8);
+        int immediateCount = 0, i, target, offset;
+        uint16_t pc = CODE, subroutine;
+        const Template *template;
+
+        for (i = 0; i < 0x100; i++) {
+                ram[i] = randomNumber();
+                ram[DATA + i] = randomNumber();
+        }
+        for (i = 0; i < POINTER_COUNT; i++) {
+                ram[POINTERS + 2 * i] = randomNumber();
+                ram[POINTERS + 2 * i + 1] = DATA >> 8;
+        }
+
+        /* Lay the instructions out, operands that need addresses later. */
+        for (i = 0; i < count; i++) {
+                template = &templates[randomNumber() % TEMPLATE_COUNT];
+                starts[i] = pc;
+                kinds[i] = template->kind;
+                ram[pc++] = template->opcode;
+                switch (template->kind) {
+                case IMMEDIATE:
+                        immediates[immediateCount++] = pc;
+                        ram[pc++] = randomNumber();
+                        break;
+                case ZERO_PAGE:
+                        /* Clear of the pointers, which stay in DATA. */
+                        ram[pc++] = 2 * POINTER_COUNT + randomNumber() %
+                                (0x100 - 2 * POINTER_COUNT);
+                        break;
+                case ABSOLUTE:
+                        ram[pc++] = randomNumber();
+                        ram[pc++] = DATA >> 8;
+                        break;
+                case INDIRECT:
+                        ram[pc++] = POINTERS + 2 * (randomNumber() %
+                                                    POINTER_COUNT);
+                        break;
+                case BRANCH:
+                        pc++;
+                        break;
+                case SELF:
+                        pc += 2;
+                        break;
+                }
+        }
+        /* Call the subroutine, then loop. */
+        ram[pc++] = 0x20;
+        subroutine = pc + 5;
+        ram[pc++] = subroutine & 0xFF;
+        ram[pc++] = subroutine >> 8;
+        ram[pc++] = 0x4C;
+        ram[pc++] = CODE & 0xFF;
+        ram[pc++] = CODE >> 8;
+        /* The subroutine rewrites an operand too, leaving the stack be. */
+        ram[pc++] = 0xE8;
+        ram[pc++] = 0xEE;
+        pc += 2;
+        ram[pc++] = 0x60;
+
+        for (i = 0; i < count; i++) {
+                if (kinds[i] == BRANCH) {
+                        /* Branch to an instruction start in reach. */
+                        target = starts[randomNumber() % count];
+                        offset = target - (starts[i] + 2);
+                        if (offset < -128 || offset > 127) {
+                                offset = 0;
+                        }
+                        ram[starts[i] + 1] = offset;
+                } else if (kinds[i] == SELF) {
+                        target = immediateCount ?
+                                immediates[randomNumber() % immediateCount] :
+                                DATA;
+                        ram[starts[i] + 1] = target & 0xFF;
+                        ram[starts[i] + 2] = target >> 8;
+                }
+        }
+        target = immediateCount ? immediates[0] : DATA;
+        ram[pc - 3] = target & 0xFF;
+        ram[pc - 2] = target >> 8;
+
+        return pc;
+}
+
+static int same(const Registers *a, const Registers *b)
+{
+        return a->a == b->a && a->x == b->x && a->y == b->y &&
+                a->sp == b->sp && a->p == b->p && a->pc == b->pc &&
+                a->state == b->state && a->cycles == b->cycles;
+}
+
+static void printRegisters(const char *name, const Registers *registers)
+{
+        printf("  %s: a=%02X x=%02X y=%02X sp=%02X p=%02X pc=%04X "
+               "cycles=%llu\n", name, registers->a, registers->x,
+               registers->y, registers->sp, registers->p, registers->pc,
+               (unsigned long long) registers->cycles);
+}
+
+static Machine translated, interpreted;
+
+/* Run the program of seed on both machines, returns whether they agree. */
+static int check(uint64_t seed)
+{
+        uint64_t budget;
+        int agree = 1;
+
+        initMemory(&translated.memory);
+        initMemory(&interpreted.memory);
+        /* Without a code buffer, nothing gets translated. */
+        freeJit(&interpreted.memory);
+        /* Spread consecutive seeds apart, never to 0. */
+        randomState = seed * 0x9E3779B97F4A7C15 | 1;
+        generate(translated.memory.ram);
+        memcpy(interpreted.memory.ram, translated.memory.ram, RAM_SIZE);
+        reset(&translated.registers, CODE);
+        reset(&interpreted.registers, CODE);
+
+        while (translated.registers.cycles < RUN_CYCLES) {
+                budget = 1 + randomNumber() % MAX_SLICE;
+                executeCycles(&translated.registers, &translated.memory,
+                              budget);
+                executeCycles(&interpreted.registers, &interpreted.memory,
+                              budget);
+                if (!same(&translated.registers, &interpreted.registers) ||
+                    memcmp(translated.memory.ram, interpreted.memory.ram,
+                           WRITABLE)) {
+                        printf("Seed %llu differs:\n",
+                               (unsigned long long) seed);
+                        printRegisters("jit", &translated.registers);
+                        printRegisters("interpreter",
+                                       &interpreted.registers);
+                        agree = 0;
+                        break;
+                }
+        }
+        if (agree && memcmp(translated.memory.ram, interpreted.memory.ram,
+                            RAM_SIZE)) {
+                printf("Seed %llu wrote past 0x%04X\n",
+                       (unsigned long long) seed, WRITABLE);
+                agree = 0;
+        }
+        freeMemory(&translated.memory);
+        freeMemory(&interpreted.memory);
+
+        return agree;
+}
+
+int main(int argc, char **argv)
+{
+        unsigned long programs = argc > 1 ? strtoul(argv[1], NULL, 0) :
+                PROGRAMS;
+        uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+        unsigned long i;
+
+        if (argc > 3 || !seed) {
+                printf("Usage: jitcheck [programs [seed]]\n");
+                return 1;
+        }
+
+        for (i = 0; i < programs; i++) {
+                if (!check(seed + i)) {
+                        return 1;
+                }
+        }
+        printf("JIT and interpreter agree on %lu programs\n", programs);
+
+        return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Record a program polling a serial console, then replay the log once as
+ * is and once with each byte after its header flipped in turn. The clean
+ * replay must match; every tampered one must stop, diverged or at a BRK,
+ * and tony6502StopRecording() must report an error: mostly -EIO, or
+ * -EINPROGRESS for an entry turned into an interrupt that ends the
+ * program early. Prints the first failures and exits nonzero on any.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "tony6502.h"
+
+#define LOAD_ADDRESS 0x0200
+#define SERIAL_ADDRESS 0xD000
+#define BAUD 9600
+
+/*
+ * 4096 times: if the receiver is full, store the byte received at
+ * 0x0300,x. Then BRK.
+ */
+static const uint8_t program[] = {
+        0xA2, 0x00,             /* LDX #$00 */
+        0xA0, 0x10,             /* LDY #$10 */
+        0xAD, 0x01, 0xD0,       /* LDA $D001 */
+        0x29, 0x08,             /* AND #$08 */
+        0xF0, 0x06,             /* BEQ +6 */
+        0xAD, 0x00, 0xD0,       /* LDA $D000 */
+        0x9D, 0x00, 0x03,       /* STA $0300,X */
+        0xCA,                   /* DEX */
+        0xD0, 0xF0,             /* BNE -16 */
+        0x88,                   /* DEY */
+        0xD0, 0xED,             /* BNE -19 */
+        0x00                    /* BRK */
+};
+
+/* A machine running the program, its console reading input if not -1. */
+static Tony6502 *create(int input)
+{
+        Tony6502 *machine = tony6502Create();
+
+        if (!machine) {
+                return NULL;
+        }
+        tony6502LoadImage(machine, program, sizeof(program), LOAD_ADDRESS);
+        tony6502Reset(machine, LOAD_ADDRESS);
+        if (tony6502AttachSerial(machine, SERIAL_ADDRESS, NULL, input,
+                                 BAUD) < 0) {
+                tony6502Destroy(machine);
+                return NULL;
+        }
+
+        return machine;
+}
+
+/* Record the program to path, returns the bytes of the header or -1. */
+static long record(const char *path)
+{
+        static const char input[] = "The quick brown fox jumps over the "
+                "lazy dog";
+        Tony6502RecordStats stats;
+        Tony6502 *machine;
+        int fds[2];
+        long header = -1;
+
+        if (pipe(fds)) {
+                return -1;
+        }
+        write(fds[1], input, sizeof(input) - 1);
+        close(fds[1]);
+        if ((machine = create(fds[0])) &&
+            !tony6502StartRecording(machine, path) &&
+            !tony6502GetRecordStats(machine, &stats)) {
+                header = stats.bytes;
+                if (tony6502Run(machine, UINT64_MAX) != TONY6502_BRK ||
+                    tony6502StopRecording(machine)) {
+                        header = -1;
+                }
+        }
+        tony6502Destroy(machine);
+        close(fds[0]);
+
+        return header;
+}
+
+/* Replay path, returns what tony6502StopRecording() did, or -ENOMEM. */
+static int replay(const char *path, Tony6502Stop *stop)
+{
+        Tony6502 *machine = create(-1);
+        int error;
+
+        if (!machine) {
+                return -ENOMEM;
+        }
+        if ((error = tony6502StartReplay(machine, path)) >= 0) {
+                *stop = tony6502Run(machine, UINT64_MAX);
+                error = tony6502StopRecording(machine);
+        }
+        tony6502Destroy(machine);
+
+        return error;
+}
+
+static int writeLog(const char *path, const uint8_t *log, size_t size)
+{
+        FILE *file = fopen(path, "wb");
+        int error = !file || fwrite(log, 1, size, file) != size;
+
+        if (file && fclose(file)) {
+                error = 1;
+        }
+
+        return error;
+}
+
+int main(void)
+{
+        char path[] = "/tmp/replaycheckXXXXXX";
+        unsigned long failures = 0, replays = 0;
+        Tony6502Stop stop = TONY6502_BUDGET;
+        uint8_t *log = NULL;
+        long header, size = 0, i;
+        FILE *file = NULL;
+        int fd, error;
+
+        if ((fd = mkstemp(path)) < 0) {
+                printf("Could not create a log: %s\n", strerror(errno));
+                return 1;
+        }
+        close(fd);
+
+        if ((header = record(path)) < 0 || !(file = fopen(path, "rb")) ||
+            fseek(file, 0, SEEK_END) || (size = ftell(file)) <= header ||
+            !(log = malloc(size)) || fseek(file, 0, SEEK_SET) ||
+            fread(log, 1, size, file) != (size_t) size) {
+                printf("Could not record the program\n");
+                failures++;
+                goto out;
+        }
+
+        if ((error = replay(path, &stop)) != 0) {
+                printf("The log replays with: %s\n", strerror(-error));
+                failures++;
+        }
+        for (i = header; i < size; i++) {
+                log[i] ^= 0xFF;
+                if (writeLog(path, log, size)) {
+                        printf("Could not write the log\n");
+                        failures++;
+                        break;
+                }
+                log[i] ^= 0xFF;
+                stop = TONY6502_BUDGET;
+                error = replay(path, &stop);
+                replays++;
+                if ((stop != TONY6502_DIVERGED && stop != TONY6502_BRK) ||
+                    error >= 0) {
+                        if (failures++ < 20) {
+                                printf("Byte %ld flipped: stop %d, %s\n", i,
+                                       stop, strerror(-error));
+                        }
+                }
+        }
+        printf("%lu failures in %lu tampered replays\n", failures, replays);
+
+out:
+        if (file) {
+                fclose(file);
+        }
+        free(log);
+        remove(path);
+
+        return failures != 0;
+}
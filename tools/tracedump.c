@@ -0,0 +1,57 @@
+/*
+ * Decode a trace file written by tony6502 -t into one line of text per
+ * instruction: its cycle count, address and bytes, then the registers
+ * before it ran.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "cpu.h"
+#include "trace.h"
+
+int main(int argc, char **argv)
+{
+        char magic[sizeof(TRACE_MAGIC) - 1];
+        TraceRecord record;
+        FILE *file;
+        int length;
+
+        if (argc != 2) {
+                printf("Usage: tracedump <path/to/trace>\n");
+                return -1;
+        }
+
+        if (!(file = fopen(argv[1], "rb"))) {
+                printf("Could not open %s: %s\n", argv[1], strerror(errno));
+                return -errno;
+        }
+
+        if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+            memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+                printf("%s is not a trace file\n", argv[1]);
+                fclose(file);
+                return -EINVAL;
+        }
+
+        while (fread(&record, sizeof(record), 1, file) == 1) {
+                length = lengths[record.opcode];
+                printf("%12llu %04X  %02X", (unsigned long long) record.cycles,
+                       record.pc, record.opcode);
+                if (length > 1) {
+                        printf(" %02X", record.operand[0]);
+                } else {
+                        printf("   ");
+                }
+                if (length > 2) {
+                        printf(" %02X", record.operand[1]);
+                } else {
+                        printf("   ");
+                }
+                printf("  a=%02X x=%02X y=%02X sp=%02X p=%02X\n", record.a,
+                       record.x, record.y, record.sp, record.p);
+        }
+
+        fclose(file);
+
+        return 0;
+}